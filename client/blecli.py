@@ -352,16 +352,17 @@ class ScannerHost (Host):
 		self.connection_handle = None
 
 	def sh_got_advertising_report (self, event):
-		tag_data = self.parse_advertising_data (event.data)
-		addr = event.address
-		if event.address_type:
-			addr |= 1<<48
+		for event_type, address_type, address, data, rssi in event.reports:
+			tag_data = self.parse_advertising_data (data)
+			addr = address
+			if address_type:
+				addr |= 1<<48
 
-		if addr not in self.found_devices:
-			self.found_devices[addr] = {'address': addr}
+			if addr not in self.found_devices:
+				self.found_devices[addr] = {'address': addr}
 
-		self.found_devices[addr].update (tag_data)
-		self.found_devices[addr].update ({'rssi': event.rssi})
+			self.found_devices[addr].update (tag_data)
+			self.found_devices[addr].update ({'rssi': rssi})
 
 	def sh_disconnect (self):
 		self.send_command (hci.Disconnect_Command (connection_handle = self.connection_handle, reason = hci.EC_REMOTE_USER_TERMINATED_CONNECTION))
@@ -1190,11 +1190,17 @@ class LE_Advertising_Report_Event (LE_Meta_Event):
 	
 	def decode (self, contents):
 		super ().decode (contents)
-		self.num_reports, self.event_type, self.address_type, addrl, addrh = struct.unpack (b'<BBBIH', contents[1:10])
-		self.address = (addrh << 32) | addrl
-		self.len_data = struct.unpack (b'<B', contents[10:11])[0]
-		self.data = contents[11:11+self.len_data]
-		self.rssi = struct.unpack (b'<b', contents[11+self.len_data:12+self.len_data])[0]
+		self.num_reports = struct.unpack (b'<B', contents[1:2])[0]
+		self.reports = []
+		offset = 2
+		for index in range (self.num_reports):
+			event_type, address_type, addrl, addrh, len_data = struct.unpack (b'<BBIHB', contents[offset:offset+9])
+			data = contents[offset+9:offset+9+len_data]
+			rssi = struct.unpack (b'<b', contents[offset+9+len_data:offset+10+len_data])[0]
+			self.reports.append ((event_type, address_type, (addrh << 32) | addrl, data, rssi))
+			offset += 10 + len_data
+		self.event_type, self.address_type, self.address, self.data, self.rssi = self.reports[0]
+		self.len_data = len (self.data)
 
 	def __repr__ (self):
 		return "<LE Advertising Report Event (%d, %d, %d, %012x, %s, %d)>" % (self.num_reports, self.event_type, self.address_type, self.address, self.data, self.rssi)
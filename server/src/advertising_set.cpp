@@ -0,0 +1,585 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include <stdlib.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "controller.h"
+#include "hci.h"
+#include "log.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+const int aux_offset_unit = 30; // microseconds, AuxPtr Offset Units = 0
+const int t_ifs = 150;
+const int t_mafs = 300;
+
+////////////////////////////////////////////////////////////////////////////////
+
+AdvertisingSet::AdvertisingSet ()
+{
+	reset ();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+AdvertisingSet::~AdvertisingSet ()
+{
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void AdvertisingSet::reset (void)
+{
+	in_use = false;
+	enabled = false;
+	handle = 0;
+
+	properties = ADV_PROP_LEGACY | ADV_PROP_SCANNABLE | ADV_PROP_CONNECTABLE;
+	interval = 0x0800;
+	channel_map = 0x07;
+	own_address_type = 0x00;
+	peer_address_type = 0x00;
+	peer_address = 0x000000000000;
+	random_address = 0x000000000000;
+	primary_phy = GFSK_LE;
+	secondary_phy = GFSK_LE;
+	sid = 0;
+	did = 0;
+
+	duration = 0;
+	max_events = 0;
+	number_of_events = 0;
+	end_of_duration = 0;
+
+	data_length = 0;
+
+	schedule_index = 0;
+	schedule_referenced = 0;
+
+	for (int index = 0; index < advertising_pdu_copies; index ++)
+	{
+		number_of_packets[index] = 0;
+	}
+
+	periodic_configured = false;
+	periodic_enabled = false;
+	periodic_interval = 0;
+	periodic_properties = 0;
+	periodic_data_length = 0;
+	periodic_access_address = 0;
+	periodic_crc_init = 0;
+	periodic_channel_identifier = 0;
+	periodic_channel_map = 0;
+	periodic_number_of_used_channels = 0;
+
+	periodic_pdu_index = 0;
+	periodic_pdu_referenced = 0;
+
+	for (int index = 0; index < advertising_pdu_copies; index ++)
+	{
+		periodic_pdu_length[index] = 0;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool AdvertisingSet::set_parameters (int new_properties, int new_interval, int new_channel_map, int new_own_address_type, int new_peer_address_type, uint64 new_peer_address, PhyModulation new_primary_phy, PhyModulation new_secondary_phy, int new_sid)
+{
+	if ((new_channel_map & 0x07) == 0)
+	{
+		return false;
+	}
+
+	if (new_properties & ADV_PROP_LEGACY)
+	{
+		// only the legacy PDU combinations that exist, directed is not supported
+
+		if
+		(
+			(new_properties != (ADV_PROP_LEGACY | ADV_PROP_SCANNABLE | ADV_PROP_CONNECTABLE)) &&
+			(new_properties != (ADV_PROP_LEGACY | ADV_PROP_SCANNABLE)) &&
+			(new_properties != ADV_PROP_LEGACY)
+		)
+		{
+			return false;
+		}
+
+		if (data_length > maximum_advertising_data_length)
+		{
+			return false;
+		}
+	}
+	else if ((new_properties & ADV_PROP_CONNECTABLE) && (new_properties & ADV_PROP_SCANNABLE))
+	{
+		return false;
+	}
+
+	properties = new_properties;
+	interval = new_interval;
+	channel_map = new_channel_map & 0x07;
+	own_address_type = new_own_address_type;
+	peer_address_type = new_peer_address_type;
+	peer_address = new_peer_address;
+	primary_phy = new_primary_phy;
+	secondary_phy = new_secondary_phy;
+	sid = new_sid & 0x0F;
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool AdvertisingSet::set_data (int operation, int len, const uint8 *new_data)
+{
+	int offset;
+
+
+	switch (operation)
+	{
+		case 0x00: // intermediate fragment
+		case 0x02: // last fragment
+			offset = data_length;
+			break;
+
+		case 0x01: // first fragment
+		case 0x03: // complete data
+			offset = 0;
+			break;
+
+		case 0x04: // unchanged data, only the DID changes
+			did = (did + 1) & 0x0FFF;
+			return true;
+
+		default:
+			return false;
+	}
+
+	if (offset + len > maximum_extended_advertising_data_length)
+	{
+		return false;
+	}
+
+	if ((properties & ADV_PROP_LEGACY) && (offset + len > maximum_advertising_data_length))
+	{
+		return false;
+	}
+
+	memcpy (&data[offset], new_data, len);
+	data_length = offset + len;
+
+	if ((operation == 0x02) || (operation == 0x03))
+	{
+		did = (did + 1) & 0x0FFF;
+	}
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool AdvertisingSet::set_periodic_parameters (int new_interval, int new_properties)
+{
+	if (new_interval < 6)
+	{
+		return false;
+	}
+
+	periodic_interval = new_interval;
+	periodic_properties = new_properties;
+	periodic_configured = true;
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool AdvertisingSet::set_periodic_data (int operation, int len, const uint8 *new_data)
+{
+	int offset;
+
+
+	switch (operation)
+	{
+		case 0x00: // intermediate fragment
+		case 0x02: // last fragment
+			offset = periodic_data_length;
+			break;
+
+		case 0x01: // first fragment
+		case 0x03: // complete data
+			offset = 0;
+			break;
+
+		default:
+			return false;
+	}
+
+	if (offset + len > maximum_periodic_advertising_data_length)
+	{
+		return false;
+	}
+
+	memcpy (&periodic_data[offset], new_data, len);
+	periodic_data_length = offset + len;
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the AUX_SYNC_IND has no extended header fields, only the data
+
+void AdvertisingSet::build_periodic (void)
+{
+	int next_index;
+	uint8 *pdu;
+
+
+	next_index = 0;
+	while ((next_index == periodic_pdu_index) || (next_index == periodic_pdu_referenced))
+	{
+		next_index ++;
+	}
+
+	pdu = periodic_pdu[next_index];
+
+	pdu[0] = PDU_ADV_EXT_IND;
+	pdu[1] = 1 + periodic_data_length;
+	pdu[2] = 0x00; // no extended header, AdvMode non-connectable and non-scannable
+	memcpy (&pdu[3], periodic_data, periodic_data_length);
+
+	periodic_pdu_length[next_index] = 3 + periodic_data_length;
+	periodic_pdu_crc[next_index] = PhysicalPacket::calculate_crc (periodic_crc_init, periodic_pdu_length[next_index], pdu);
+	periodic_pdu_index = next_index;
+
+	log (LOG_LINKLAYER, "AdvertisingSet::build_periodic %02X %d octets", handle, periodic_data_length);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int AdvertisingSet::build_extended_pdu (uint8 *pdu, int adv_mode, uint8 flags, uint64 adva, const uint8 *aux_ptr, const uint8 *pdu_data, int pdu_data_len, int *sync_info)
+{
+	int p;
+	int adi;
+
+
+	pdu[0] = PDU_ADV_EXT_IND;
+	p = 3;
+
+	if (flags)
+	{
+		pdu[p++] = flags;
+	}
+
+	if (flags & EXT_HEADER_ADVA)
+	{
+		for (int index = 0; index < 6; index ++)
+		{
+			pdu[p++] = (adva >> (8 * index)) & 0xFF;
+		}
+	}
+
+	if (flags & EXT_HEADER_ADI)
+	{
+		adi = (did & 0x0FFF) | (sid << 12);
+		pdu[p++] = adi & 0xFF;
+		pdu[p++] = (adi >> 8) & 0xFF;
+	}
+
+	if (flags & EXT_HEADER_AUXPTR)
+	{
+		pdu[p++] = aux_ptr[0];
+		pdu[p++] = aux_ptr[1];
+		pdu[p++] = aux_ptr[2];
+	}
+
+	if (flags & EXT_HEADER_SYNCINFO)
+	{
+		// filled in just before each transmission, the offset to the next
+		// AUX_SYNC_IND changes every event
+
+		*sync_info = p;
+		memset (&pdu[p], 0, 18);
+		p += 18;
+	}
+
+	pdu[2] = ((p - 3) & 0x3F) | (adv_mode << 6);
+
+	if (pdu_data_len > 0)
+	{
+		memcpy (&pdu[p], pdu_data, pdu_data_len);
+		p += pdu_data_len;
+	}
+
+	pdu[1] = p - 2;
+
+	return p;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void encode_aux_ptr (uint8 *aux_ptr, int channel, int offset, PhyModulation phy)
+{
+	int units;
+	int aux_phy;
+
+
+	units = offset / aux_offset_unit;
+
+	switch (phy)
+	{
+		case GFSK_LE_2M:       aux_phy = 1; break;
+		case GFSK_LE_CODED_S2: aux_phy = 2; break;
+		case GFSK_LE_CODED_S8: aux_phy = 2; break;
+		default:               aux_phy = 0; break;
+	}
+
+	aux_ptr[0] = channel & 0x3F; // CA = 0, Offset Units = 30us
+	aux_ptr[1] = units & 0xFF;
+	aux_ptr[2] = ((units >> 8) & 0x1F) | (aux_phy << 5);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void AdvertisingSet::build (uint64 adva, bool adva_is_random)
+{
+	AdvertisingEventPacket *packet;
+	int next_index;
+	int count;
+	int primary_count;
+	int aux_count;
+	int aux_first;
+	int offset;
+	int adv_mode;
+	int fragment[maximum_number_of_aux_pdus];
+	int remaining;
+	int capacity;
+	int data_offset;
+	uint8 flags;
+	uint8 aux_ptr[3];
+	uint8 type;
+
+
+	// build into the schedule that is neither the latest nor in use by the
+	// current event, the caller holds the mutex so neither can move meanwhile
+
+	next_index = 0;
+	while ((next_index == schedule_index) || (next_index == schedule_referenced))
+	{
+		next_index ++;
+	}
+	packet = schedule_packet[next_index];
+	count = 0;
+	offset = 0;
+
+	if (properties & ADV_PROP_LEGACY)
+	{
+		if (properties & ADV_PROP_CONNECTABLE)
+		{
+			type = PDU_ADV_IND;
+		}
+		else if (properties & ADV_PROP_SCANNABLE)
+		{
+			type = PDU_ADV_SCAN_IND;
+		}
+		else
+		{
+			type = PDU_ADV_NONCONN_IND;
+		}
+
+		for (int channel = 0; channel < 3; channel ++)
+		{
+			if (channel_map & (1 << channel))
+			{
+				packet[count].pdu[0] = type | (adva_is_random ? PDU_TXADD : 0);
+				packet[count].pdu[1] = 6 + data_length;
+				for (int index = 0; index < 6; index ++)
+				{
+					packet[count].pdu[2 + index] = (adva >> (8 * index)) & 0xFF;
+				}
+				memcpy (&packet[count].pdu[8], data, data_length);
+				packet[count].pdu_length = 8 + data_length;
+				packet[count].offset = offset;
+				packet[count].sync_info = 0;
+				packet[count].channel = 37 + channel;
+				packet[count].modulation = GFSK_LE;
+
+				offset += phy_packet_airtime (GFSK_LE, packet[count].pdu_length) + t_ifs;
+				count ++;
+			}
+		}
+	}
+	else
+	{
+		adv_mode = 0;
+		if (properties & ADV_PROP_CONNECTABLE)
+		{
+			adv_mode = 1;
+		}
+		else if (properties & ADV_PROP_SCANNABLE)
+		{
+			adv_mode = 2;
+		}
+
+		// split the data across AUX_ADV_IND and as many AUX_CHAIN_IND as needed,
+		// every PDU but the last also carries a 3 octet AuxPtr
+
+		remaining = data_length;
+		aux_count = 0;
+
+		do
+		{
+			if (aux_count == 0)
+			{
+				capacity = 255 - 1 - 1 - 2 - ((properties & ADV_PROP_ANONYMOUS) ? 0 : 6) - (periodic_enabled ? 18 : 0);
+			}
+			else
+			{
+				capacity = 255 - 1 - 1 - 2;
+			}
+
+			if ((remaining > capacity) && (aux_count < maximum_number_of_aux_pdus - 1))
+			{
+				fragment[aux_count] = capacity - 3;
+			}
+			else
+			{
+				fragment[aux_count] = (remaining < capacity) ? remaining : capacity;
+			}
+
+			remaining -= fragment[aux_count];
+			aux_count ++;
+		}
+		while (remaining > 0);
+
+		// primary channel ADV_EXT_IND, the length is fixed so the timing is known
+
+		for (int channel = 0; channel < 3; channel ++)
+		{
+			if (channel_map & (1 << channel))
+			{
+				packet[count].offset = offset;
+				packet[count].sync_info = 0;
+				packet[count].channel = 37 + channel;
+				packet[count].modulation = primary_phy;
+
+				offset += phy_packet_airtime (primary_phy, 2 + 1 + 1 + 2 + 3) + t_ifs;
+				count ++;
+			}
+		}
+
+		primary_count = count;
+		aux_first = count;
+
+		// the first aux packet goes at least T_MAFS after the last primary packet
+
+		offset = packet[primary_count - 1].offset + phy_packet_airtime (primary_phy, 2 + 1 + 1 + 2 + 3) + t_mafs + aux_offset_unit;
+
+		for (int index = 0; index < aux_count; index ++)
+		{
+			packet[aux_first + index].offset = offset;
+			packet[aux_first + index].sync_info = 0;
+			packet[aux_first + index].channel = rand () % 37;
+			packet[aux_first + index].modulation = secondary_phy;
+			count ++;
+
+			// fragment lengths are known, so the next offset can be computed before the PDU is built
+
+			capacity = 2 + 1 + 1 + 2 + fragment[index];
+			if ((index == 0) && !(properties & ADV_PROP_ANONYMOUS))
+			{
+				capacity += 6;
+			}
+			if ((index == 0) && periodic_enabled)
+			{
+				capacity += 18;
+			}
+			if (index + 1 < aux_count)
+			{
+				capacity += 3;
+			}
+
+			capacity = phy_packet_airtime (secondary_phy, capacity) + t_mafs;
+			offset += ((capacity + aux_offset_unit - 1) / aux_offset_unit) * aux_offset_unit;
+		}
+
+		for (int index = 0; index < primary_count; index ++)
+		{
+			encode_aux_ptr (aux_ptr, packet[aux_first].channel, packet[aux_first].offset - packet[index].offset, secondary_phy);
+			packet[index].pdu_length = build_extended_pdu (packet[index].pdu, adv_mode, EXT_HEADER_ADI | EXT_HEADER_AUXPTR, 0, aux_ptr, 0, 0, 0);
+		}
+
+		data_offset = 0;
+
+		for (int index = 0; index < aux_count; index ++)
+		{
+			flags = EXT_HEADER_ADI;
+
+			if ((index == 0) && !(properties & ADV_PROP_ANONYMOUS))
+			{
+				flags |= EXT_HEADER_ADVA;
+			}
+
+			if ((index == 0) && periodic_enabled)
+			{
+				flags |= EXT_HEADER_SYNCINFO;
+			}
+
+			if (index + 1 < aux_count)
+			{
+				flags |= EXT_HEADER_AUXPTR;
+				encode_aux_ptr (aux_ptr, packet[aux_first + index + 1].channel, packet[aux_first + index + 1].offset - packet[aux_first + index].offset, secondary_phy);
+			}
+
+			packet[aux_first + index].pdu_length = build_extended_pdu (packet[aux_first + index].pdu, (index == 0) ? adv_mode : 0, flags, adva, aux_ptr, &data[data_offset], fragment[index], &packet[aux_first + index].sync_info);
+
+			if ((flags & EXT_HEADER_ADVA) && adva_is_random)
+			{
+				packet[aux_first + index].pdu[0] |= PDU_TXADD;
+			}
+
+			data_offset += fragment[index];
+		}
+	}
+
+	for (int index = 0; index < count; index ++)
+	{
+		packet[index].crc = PhysicalPacket::calculate_crc (advertising_crc_init, packet[index].pdu_length, packet[index].pdu);
+	}
+
+	number_of_packets[next_index] = count;
+	schedule_index = next_index;
+
+	log (LOG_LINKLAYER, "AdvertisingSet::build %02X %d packets, %d octets", handle, count, data_length);
+}
+
+////////////////////////////////////////////////////////////////////////////////
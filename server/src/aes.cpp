@@ -0,0 +1,604 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+
+#if defined (__x86_64__) || defined (__i386__)
+#include <wmmintrin.h>
+#define AES_NI_SUPPORTED
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "aes.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+static const uint8 sbox[256] =
+{
+	0x63, 0x7C, 0x77, 0x7B, 0xF2, 0x6B, 0x6F, 0xC5, 0x30, 0x01, 0x67, 0x2B, 0xFE, 0xD7, 0xAB, 0x76,
+	0xCA, 0x82, 0xC9, 0x7D, 0xFA, 0x59, 0x47, 0xF0, 0xAD, 0xD4, 0xA2, 0xAF, 0x9C, 0xA4, 0x72, 0xC0,
+	0xB7, 0xFD, 0x93, 0x26, 0x36, 0x3F, 0xF7, 0xCC, 0x34, 0xA5, 0xE5, 0xF1, 0x71, 0xD8, 0x31, 0x15,
+	0x04, 0xC7, 0x23, 0xC3, 0x18, 0x96, 0x05, 0x9A, 0x07, 0x12, 0x80, 0xE2, 0xEB, 0x27, 0xB2, 0x75,
+	0x09, 0x83, 0x2C, 0x1A, 0x1B, 0x6E, 0x5A, 0xA0, 0x52, 0x3B, 0xD6, 0xB3, 0x29, 0xE3, 0x2F, 0x84,
+	0x53, 0xD1, 0x00, 0xED, 0x20, 0xFC, 0xB1, 0x5B, 0x6A, 0xCB, 0xBE, 0x39, 0x4A, 0x4C, 0x58, 0xCF,
+	0xD0, 0xEF, 0xAA, 0xFB, 0x43, 0x4D, 0x33, 0x85, 0x45, 0xF9, 0x02, 0x7F, 0x50, 0x3C, 0x9F, 0xA8,
+	0x51, 0xA3, 0x40, 0x8F, 0x92, 0x9D, 0x38, 0xF5, 0xBC, 0xB6, 0xDA, 0x21, 0x10, 0xFF, 0xF3, 0xD2,
+	0xCD, 0x0C, 0x13, 0xEC, 0x5F, 0x97, 0x44, 0x17, 0xC4, 0xA7, 0x7E, 0x3D, 0x64, 0x5D, 0x19, 0x73,
+	0x60, 0x81, 0x4F, 0xDC, 0x22, 0x2A, 0x90, 0x88, 0x46, 0xEE, 0xB8, 0x14, 0xDE, 0x5E, 0x0B, 0xDB,
+	0xE0, 0x32, 0x3A, 0x0A, 0x49, 0x06, 0x24, 0x5C, 0xC2, 0xD3, 0xAC, 0x62, 0x91, 0x95, 0xE4, 0x79,
+	0xE7, 0xC8, 0x37, 0x6D, 0x8D, 0xD5, 0x4E, 0xA9, 0x6C, 0x56, 0xF4, 0xEA, 0x65, 0x7A, 0xAE, 0x08,
+	0xBA, 0x78, 0x25, 0x2E, 0x1C, 0xA6, 0xB4, 0xC6, 0xE8, 0xDD, 0x74, 0x1F, 0x4B, 0xBD, 0x8B, 0x8A,
+	0x70, 0x3E, 0xB5, 0x66, 0x48, 0x03, 0xF6, 0x0E, 0x61, 0x35, 0x57, 0xB9, 0x86, 0xC1, 0x1D, 0x9E,
+	0xE1, 0xF8, 0x98, 0x11, 0x69, 0xD9, 0x8E, 0x94, 0x9B, 0x1E, 0x87, 0xE9, 0xCE, 0x55, 0x28, 0xDF,
+	0x8C, 0xA1, 0x89, 0x0D, 0xBF, 0xE6, 0x42, 0x68, 0x41, 0x99, 0x2D, 0x0F, 0xB0, 0x54, 0xBB, 0x16,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline uint8 xtime (uint8 x)
+{
+	return (x << 1) ^ ((x & 0x80) ? 0x1B : 0x00);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void aes_expand_key (const uint8 *key, AesKey *expanded)
+{
+	uint8 *w;
+	uint8 t[4];
+	uint8 rcon;
+	uint8 tmp;
+
+
+	w = &expanded->round_key[0][0];
+	memcpy (w, key, 16);
+
+	rcon = 0x01;
+
+	for (int i = 16; i < 176; i += 4)
+	{
+		t[0] = w[i - 4];
+		t[1] = w[i - 3];
+		t[2] = w[i - 2];
+		t[3] = w[i - 1];
+
+		if ((i % 16) == 0)
+		{
+			tmp = t[0];
+			t[0] = sbox[t[1]] ^ rcon;
+			t[1] = sbox[t[2]];
+			t[2] = sbox[t[3]];
+			t[3] = sbox[tmp];
+
+			rcon = xtime (rcon);
+		}
+
+		w[i + 0] = w[i - 16] ^ t[0];
+		w[i + 1] = w[i - 15] ^ t[1];
+		w[i + 2] = w[i - 14] ^ t[2];
+		w[i + 3] = w[i - 13] ^ t[3];
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void aes_encrypt_software (const AesKey *key, const uint8 *in, uint8 *out)
+{
+	uint8 s[16];
+	uint8 t[16];
+	uint8 a, b, c, d, e;
+
+
+	for (int i = 0; i < 16; i ++)
+	{
+		s[i] = in[i] ^ key->round_key[0][i];
+	}
+
+	for (int round = 1; round <= 10; round ++)
+	{
+		// SubBytes and ShiftRows, the state is column major
+
+		for (int column = 0; column < 4; column ++)
+		{
+			for (int row = 0; row < 4; row ++)
+			{
+				t[4 * column + row] = sbox[s[4 * ((column + row) % 4) + row]];
+			}
+		}
+
+		if (round < 10)
+		{
+			for (int column = 0; column < 4; column ++)
+			{
+				a = t[4 * column + 0];
+				b = t[4 * column + 1];
+				c = t[4 * column + 2];
+				d = t[4 * column + 3];
+				e = a ^ b ^ c ^ d;
+
+				t[4 * column + 0] = a ^ e ^ xtime (a ^ b);
+				t[4 * column + 1] = b ^ e ^ xtime (b ^ c);
+				t[4 * column + 2] = c ^ e ^ xtime (c ^ d);
+				t[4 * column + 3] = d ^ e ^ xtime (d ^ a);
+			}
+		}
+
+		for (int i = 0; i < 16; i ++)
+		{
+			s[i] = t[i] ^ key->round_key[round][i];
+		}
+	}
+
+	memcpy (out, s, 16);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef AES_NI_SUPPORTED
+
+__attribute__ ((target ("aes,sse2")))
+static inline __m128i aes_encrypt_block_ni (const AesKey *key, __m128i block)
+{
+	const __m128i *rk = (const __m128i *) key->round_key;
+
+
+	block = _mm_xor_si128 (block, _mm_load_si128 (&rk[0]));
+	for (int round = 1; round < 10; round ++)
+	{
+		block = _mm_aesenc_si128 (block, _mm_load_si128 (&rk[round]));
+	}
+
+	return _mm_aesenclast_si128 (block, _mm_load_si128 (&rk[10]));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+__attribute__ ((target ("aes,sse2")))
+static void aes_encrypt_ni (const AesKey *key, const uint8 *in, uint8 *out)
+{
+	__m128i block;
+
+
+	block = _mm_loadu_si128 ((const __m128i *) in);
+	block = aes_encrypt_block_ni (key, block);
+	_mm_storeu_si128 ((__m128i *) out, block);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// four independent keys at a time so that the AESENC latency is hidden
+
+__attribute__ ((target ("aes,sse2")))
+static void aes_encrypt_many_ni (const AesKey *key, int count, const uint8 *in, uint8 *out)
+{
+	__m128i block;
+	__m128i b0, b1, b2, b3;
+	int index;
+
+
+	block = _mm_loadu_si128 ((const __m128i *) in);
+
+	for (index = 0; index + 4 <= count; index += 4)
+	{
+		const __m128i *k0 = (const __m128i *) key[index + 0].round_key;
+		const __m128i *k1 = (const __m128i *) key[index + 1].round_key;
+		const __m128i *k2 = (const __m128i *) key[index + 2].round_key;
+		const __m128i *k3 = (const __m128i *) key[index + 3].round_key;
+
+		b0 = _mm_xor_si128 (block, _mm_load_si128 (&k0[0]));
+		b1 = _mm_xor_si128 (block, _mm_load_si128 (&k1[0]));
+		b2 = _mm_xor_si128 (block, _mm_load_si128 (&k2[0]));
+		b3 = _mm_xor_si128 (block, _mm_load_si128 (&k3[0]));
+
+		for (int round = 1; round < 10; round ++)
+		{
+			b0 = _mm_aesenc_si128 (b0, _mm_load_si128 (&k0[round]));
+			b1 = _mm_aesenc_si128 (b1, _mm_load_si128 (&k1[round]));
+			b2 = _mm_aesenc_si128 (b2, _mm_load_si128 (&k2[round]));
+			b3 = _mm_aesenc_si128 (b3, _mm_load_si128 (&k3[round]));
+		}
+
+		_mm_storeu_si128 ((__m128i *) &out[16 * (index + 0)], _mm_aesenclast_si128 (b0, _mm_load_si128 (&k0[10])));
+		_mm_storeu_si128 ((__m128i *) &out[16 * (index + 1)], _mm_aesenclast_si128 (b1, _mm_load_si128 (&k1[10])));
+		_mm_storeu_si128 ((__m128i *) &out[16 * (index + 2)], _mm_aesenclast_si128 (b2, _mm_load_si128 (&k2[10])));
+		_mm_storeu_si128 ((__m128i *) &out[16 * (index + 3)], _mm_aesenclast_si128 (b3, _mm_load_si128 (&k3[10])));
+	}
+
+	for (; index < count; index ++)
+	{
+		_mm_storeu_si128 ((__m128i *) &out[16 * index], aes_encrypt_block_ni (&key[index], block));
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// as above but every block has its own key and its own input
+
+__attribute__ ((target ("aes,sse2")))
+static void aes_encrypt_lanes_ni (const AesKey *const *key, int count, const uint8 *in, uint8 *out)
+{
+	__m128i b0, b1, b2, b3;
+	int index;
+
+
+	for (index = 0; index + 4 <= count; index += 4)
+	{
+		const __m128i *k0 = (const __m128i *) key[index + 0]->round_key;
+		const __m128i *k1 = (const __m128i *) key[index + 1]->round_key;
+		const __m128i *k2 = (const __m128i *) key[index + 2]->round_key;
+		const __m128i *k3 = (const __m128i *) key[index + 3]->round_key;
+
+		b0 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) &in[16 * (index + 0)]), _mm_load_si128 (&k0[0]));
+		b1 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) &in[16 * (index + 1)]), _mm_load_si128 (&k1[0]));
+		b2 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) &in[16 * (index + 2)]), _mm_load_si128 (&k2[0]));
+		b3 = _mm_xor_si128 (_mm_loadu_si128 ((const __m128i *) &in[16 * (index + 3)]), _mm_load_si128 (&k3[0]));
+
+		for (int round = 1; round < 10; round ++)
+		{
+			b0 = _mm_aesenc_si128 (b0, _mm_load_si128 (&k0[round]));
+			b1 = _mm_aesenc_si128 (b1, _mm_load_si128 (&k1[round]));
+			b2 = _mm_aesenc_si128 (b2, _mm_load_si128 (&k2[round]));
+			b3 = _mm_aesenc_si128 (b3, _mm_load_si128 (&k3[round]));
+		}
+
+		_mm_storeu_si128 ((__m128i *) &out[16 * (index + 0)], _mm_aesenclast_si128 (b0, _mm_load_si128 (&k0[10])));
+		_mm_storeu_si128 ((__m128i *) &out[16 * (index + 1)], _mm_aesenclast_si128 (b1, _mm_load_si128 (&k1[10])));
+		_mm_storeu_si128 ((__m128i *) &out[16 * (index + 2)], _mm_aesenclast_si128 (b2, _mm_load_si128 (&k2[10])));
+		_mm_storeu_si128 ((__m128i *) &out[16 * (index + 3)], _mm_aesenclast_si128 (b3, _mm_load_si128 (&k3[10])));
+	}
+
+	for (; index < count; index ++)
+	{
+		aes_encrypt_ni (key[index], &in[16 * index], &out[16 * index]);
+	}
+}
+
+#endif
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool aes_hardware_available (void)
+{
+#ifdef AES_NI_SUPPORTED
+	static const bool available = __builtin_cpu_supports ("aes");
+
+	return available;
+#else
+	return false;
+#endif
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void aes_encrypt (const AesKey *key, const uint8 *in, uint8 *out)
+{
+#ifdef AES_NI_SUPPORTED
+	if (aes_hardware_available ())
+	{
+		aes_encrypt_ni (key, in, out);
+		return;
+	}
+#endif
+
+	aes_encrypt_software (key, in, out);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+uint32 bt_ah (const AesKey *irk, uint32 prand)
+{
+	uint32 hash;
+
+
+	bt_ah_many (irk, 1, prand, &hash);
+
+	return hash;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void bt_ah_many (const AesKey *irk, int count, uint32 prand, uint32 *hash)
+{
+	uint8 r[16];
+	uint8 out[16 * 4];
+	int batch;
+
+
+	// r' = padding || r, ah = e (k, r') mod 2^24
+
+	memset (r, 0, 13);
+	r[13] = (prand >> 16) & 0xFF;
+	r[14] = (prand >> 8) & 0xFF;
+	r[15] = prand & 0xFF;
+
+	for (int index = 0; index < count; index += batch)
+	{
+		batch = (count - index < 4) ? count - index : 4;
+
+#ifdef AES_NI_SUPPORTED
+		if (aes_hardware_available ())
+		{
+			aes_encrypt_many_ni (&irk[index], batch, r, out);
+		}
+		else
+#endif
+		{
+			for (int i = 0; i < batch; i ++)
+			{
+				aes_encrypt_software (&irk[index + i], r, &out[16 * i]);
+			}
+		}
+
+		for (int i = 0; i < batch; i ++)
+		{
+			hash[index + i] = (out[16 * i + 13] << 16) | (out[16 * i + 14] << 8) | out[16 * i + 15];
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void aes_encrypt_lanes (const AesKey *const *key, int count, const uint8 *in, uint8 *out)
+{
+#ifdef AES_NI_SUPPORTED
+	if (aes_hardware_available ())
+	{
+		aes_encrypt_lanes_ni (key, count, in, out);
+		return;
+	}
+#endif
+
+	for (int index = 0; index < count; index ++)
+	{
+		aes_encrypt_software (key[index], &in[16 * index], &out[16 * index]);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// a group of packets small enough to keep on the stack, the MAC is a chain
+// per packet so the group is the number of chains in flight at once
+
+const int ccm_group = 4;
+const int ccm_maximum_blocks = 1 + 16; // A0 and a 255 octet payload
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline int ccm_blocks (int length)
+{
+	return (length + 15) / 16;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// CBC-MAC over B0, the additional data block and the plaintext, T is left in
+// the first 16 octets of tag for each packet
+
+static void ccm_mac (CcmPacket *packet, int count, uint8 *tag)
+{
+	const AesKey *key[ccm_group];
+	uint8 in[16 * ccm_group];
+	uint8 out[16 * ccm_group];
+	int lane[ccm_group];
+	int most_blocks;
+	int active;
+	int length;
+	uint8 *b;
+
+
+	most_blocks = 0;
+
+	for (int i = 0; i < count; i ++)
+	{
+		key[i] = packet[i].key;
+
+		b = &in[16 * i];
+		b[0] = 0x49; // Adata, M = 4, L = 2
+		memcpy (&b[1], packet[i].nonce, 13);
+		b[14] = (packet[i].length >> 8) & 0xFF;
+		b[15] = packet[i].length & 0xFF;
+
+		if (ccm_blocks (packet[i].length) > most_blocks)
+		{
+			most_blocks = ccm_blocks (packet[i].length);
+		}
+	}
+
+	aes_encrypt_lanes (key, count, in, tag);
+
+	for (int i = 0; i < count; i ++)
+	{
+		b = &in[16 * i];
+		memcpy (b, &tag[16 * i], 16);
+
+		// l(a) = 1, a = the header with NESN, SN and MD masked out
+
+		b[1] ^= 0x01;
+		b[2] ^= packet[i].header & 0xE3;
+	}
+
+	aes_encrypt_lanes (key, count, in, tag);
+
+	for (int block = 0; block < most_blocks; block ++)
+	{
+		active = 0;
+
+		for (int i = 0; i < count; i ++)
+		{
+			if (block >= ccm_blocks (packet[i].length))
+			{
+				continue;
+			}
+
+			length = packet[i].length - 16 * block;
+			if (length > 16)
+			{
+				length = 16;
+			}
+
+			b = &in[16 * active];
+			memcpy (b, &tag[16 * i], 16);
+			for (int octet = 0; octet < length; octet ++)
+			{
+				b[octet] ^= packet[i].payload[16 * block + octet];
+			}
+
+			key[active] = packet[i].key;
+			lane[active] = i;
+			active ++;
+		}
+
+		aes_encrypt_lanes (key, active, in, out);
+
+		for (int a = 0; a < active; a ++)
+		{
+			memcpy (&tag[16 * lane[a]], &out[16 * a], 16);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// CTR mode key stream, S0 followed by one block per 16 octets of payload.
+// Blocks from all packets go through the cipher in one batch.
+
+static void ccm_key_stream (CcmPacket *packet, int count, uint8 *stream)
+{
+	const AesKey *key[ccm_group * ccm_maximum_blocks];
+	uint8 in[16 * ccm_group * ccm_maximum_blocks];
+	int blocks;
+	uint8 *a;
+
+
+	blocks = 0;
+
+	for (int i = 0; i < count; i ++)
+	{
+		for (int counter = 0; counter <= ccm_blocks (packet[i].length); counter ++)
+		{
+			a = &in[16 * blocks];
+			a[0] = 0x01; // L = 2
+			memcpy (&a[1], packet[i].nonce, 13);
+			a[14] = (counter >> 8) & 0xFF;
+			a[15] = counter & 0xFF;
+
+			key[blocks] = packet[i].key;
+			blocks ++;
+		}
+	}
+
+	aes_encrypt_lanes (key, blocks, in, stream);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void ccm_apply_key_stream (CcmPacket *packet, const uint8 *s)
+{
+	for (int octet = 0; octet < packet->length; octet ++)
+	{
+		packet->payload[octet] ^= s[16 + octet];
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void aes_ccm_encrypt (CcmPacket *packet, int count)
+{
+	uint8 tag[16 * ccm_group];
+	uint8 stream[16 * ccm_group * ccm_maximum_blocks];
+	const uint8 *s;
+	int group;
+
+
+	for (int first = 0; first < count; first += group)
+	{
+		group = (count - first < ccm_group) ? count - first : ccm_group;
+
+		ccm_mac (&packet[first], group, tag);
+		ccm_key_stream (&packet[first], group, stream);
+
+		s = stream;
+
+		for (int i = 0; i < group; i ++)
+		{
+			for (int octet = 0; octet < ccm_mic_length; octet ++)
+			{
+				packet[first + i].mic[octet] = tag[16 * i + octet] ^ s[octet];
+			}
+
+			ccm_apply_key_stream (&packet[first + i], s);
+			packet[first + i].authenticated = true;
+
+			s += 16 * (1 + ccm_blocks (packet[first + i].length));
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void aes_ccm_decrypt (CcmPacket *packet, int count)
+{
+	uint8 tag[16 * ccm_group];
+	uint8 stream[16 * ccm_group * ccm_maximum_blocks];
+	uint8 mic[ccm_group][ccm_mic_length];
+	const uint8 *s;
+	int group;
+
+
+	for (int first = 0; first < count; first += group)
+	{
+		group = (count - first < ccm_group) ? count - first : ccm_group;
+
+		ccm_key_stream (&packet[first], group, stream);
+
+		s = stream;
+
+		for (int i = 0; i < group; i ++)
+		{
+			for (int octet = 0; octet < ccm_mic_length; octet ++)
+			{
+				mic[i][octet] = packet[first + i].mic[octet] ^ s[octet];
+			}
+
+			ccm_apply_key_stream (&packet[first + i], s);
+
+			s += 16 * (1 + ccm_blocks (packet[first + i].length));
+		}
+
+		ccm_mac (&packet[first], group, tag);
+
+		for (int i = 0; i < group; i ++)
+		{
+			packet[first + i].authenticated = (memcmp (mic[i], &tag[16 * i], ccm_mic_length) == 0);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
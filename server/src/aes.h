@@ -0,0 +1,76 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "types.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// AES-128 as used by the Bluetooth security functions. Keys and blocks are in
+// the byte order of the specification (most significant octet first), the
+// reverse of the order used on HCI. The key schedule is expanded once so that
+// resolving against a list of IRKs only costs the rounds themselves.
+
+struct AesKey
+{
+	alignas (16) uint8 round_key[11][16];
+};
+
+void aes_expand_key (const uint8 *key, AesKey *expanded);
+void aes_encrypt (const AesKey *key, const uint8 *in, uint8 *out);
+bool aes_hardware_available (void);
+
+// random address hash function ah, the 24 bit hash of a 24 bit prand
+
+uint32 bt_ah (const AesKey *irk, uint32 prand);
+
+// ah of one prand under count IRKs, used to resolve against a whole list
+
+void bt_ah_many (const AesKey *irk, int count, uint32 prand, uint32 *hash);
+
+// AES-CCM as used on the LE data channel: 13 octet nonce, one octet of
+// additional data (the masked PDU header) and a 4 octet MIC. Payloads are
+// en/decrypted in place. Several packets, each under its own key, are
+// processed together so that their AES blocks share the pipeline.
+
+const int ccm_mic_length = 4;
+
+struct CcmPacket
+{
+	const AesKey *key;
+	const uint8 *nonce;
+	uint8 header;
+	int length;
+	uint8 *payload;
+	uint8 *mic;
+	bool authenticated;
+};
+
+void aes_ccm_encrypt (CcmPacket *packet, int count);
+void aes_ccm_decrypt (CcmPacket *packet, int count);
+
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,61 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include "types.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// The controller as a library, for hosts in the same process. Packets go both
+// ways as H4 frames, the packet indicator first: the host hands commands and
+// ACL data to b1ee_send, and events and ACL data for the host come back
+// through its callback.
+//
+// The callback is called on whichever thread produced the packet, the one in
+// b1ee_send for a command's own responses or the simulation thread for
+// everything else, possibly with the simulation locked. It should copy the
+// packet and return, and must not call back into the library. Each controller
+// takes packets from one host thread at a time, the usual HCI flow control
+// (Num_HCI_Command_Packets, the ACL buffers) applies as it would on a socket.
+
+class EmbeddedController;
+
+typedef void (*B1eeHostCallback) (void *context, const uint8 *packet, int len);
+
+// starts the simulation, once per process before anything else
+void b1ee_initialise (void);
+
+EmbeddedController *b1ee_open (uint64 bd_addr, B1eeHostCallback callback, void *context);
+void b1ee_send (EmbeddedController *controller, const uint8 *packet, int len);
+
+// waits for the simulation to let go of the controller, so no callback comes
+// once this returns; that can take a whole pass of the simulation, closing
+// many together waits for just the one
+void b1ee_close (EmbeddedController *controller);
+void b1ee_close (EmbeddedController **controllers, int count);
+
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,439 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "controller.h"
+#include "log.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+// every capture that exists, open or not, the writer lets go of the list
+// mutex while it writes a file and a capture being written is not destroyed
+// until the writer is done with it
+
+static BtSnoop *all_captures = 0;
+static pthread_mutex_t capture_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t capture_writer_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t capture_flushed_cond = PTHREAD_COND_INITIALIZER;
+
+// set when every new connection is captured from the start
+static const char *capture_directory = 0;
+
+// btsnoop timestamps are microseconds since midnight on 1st January 0 AD
+const uint64 btsnoop_epoch_offset = 0x00DCDDB30F2F8000ULL;
+
+const int btsnoop_version = 1;
+const int btsnoop_datalink_h4 = 1002;
+const int btsnoop_record_header_len = 24;
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void put_be32 (char *p, uint32 value)
+{
+	p[0] = (value >> 24) & 0xFF;
+	p[1] = (value >> 16) & 0xFF;
+	p[2] = (value >> 8) & 0xFF;
+	p[3] = (value) & 0xFF;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+BtSnoop::BtSnoop ()
+{
+	capturing = false;
+
+	pthread_mutex_init (&buffer_mutex, NULL);
+	buffer = 0;
+	buffer_len = 0;
+	buffer_size = 0;
+	dropped_packets = 0;
+
+	pthread_mutex_init (&file_mutex, NULL);
+	fd = -1;
+	spare_buffer = 0;
+	spare_buffer_size = 0;
+
+	flushing = false;
+
+	pthread_mutex_lock (&capture_list_mutex);
+
+	pred = 0;
+	succ = all_captures;
+
+	if (all_captures)
+	{
+		all_captures->pred = this;
+	}
+
+	all_captures = this;
+
+	pthread_mutex_unlock (&capture_list_mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+BtSnoop::~BtSnoop ()
+{
+	close ();
+
+	pthread_mutex_lock (&capture_list_mutex);
+
+	while (flushing)
+	{
+		pthread_cond_wait (&capture_flushed_cond, &capture_list_mutex);
+	}
+
+	if (pred)
+	{
+		pred->succ = succ;
+	}
+	else
+	{
+		all_captures = succ;
+	}
+
+	if (succ)
+	{
+		succ->pred = pred;
+	}
+
+	pthread_mutex_unlock (&capture_list_mutex);
+
+	free (buffer);
+	free (spare_buffer);
+
+	pthread_mutex_destroy (&buffer_mutex);
+	pthread_mutex_destroy (&file_mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void BtSnoop::start_writer (void)
+{
+	pthread_t t3;
+
+
+	pthread_create (&t3, NULL, &BtSnoop::writer_thread, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void BtSnoop::set_capture_directory (const char *directory)
+{
+	capture_directory = directory;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+const char *BtSnoop::get_capture_directory (void)
+{
+	return capture_directory;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// a controller's capture is named after its address, capturing again after
+// a close carries on at the end of the same file
+
+bool BtSnoop::open (uint64 bd_addr)
+{
+	char filename[PATH_MAX];
+	char header[16];
+	int file;
+
+
+	if (is_open ())
+	{
+		return true;
+	}
+
+	snprintf (filename, sizeof (filename), "%s/b1ee_%012llX.btsnoop", capture_directory ? capture_directory : ".", bd_addr);
+
+	file = ::open (filename, O_WRONLY | O_CREAT | O_APPEND, 0644);
+
+	if (file < 0)
+	{
+		log (LOG_ERROR, "btsnoop open %s (%d : %s)", filename, errno, strerror (errno));
+		return false;
+	}
+
+	if (lseek (file, 0, SEEK_END) == 0)
+	{
+		memcpy (header, "btsnoop", 8);
+		put_be32 (&header[8], btsnoop_version);
+		put_be32 (&header[12], btsnoop_datalink_h4);
+
+		if (write (file, header, sizeof (header)) != sizeof (header))
+		{
+			log (LOG_ERROR, "btsnoop write %s (%d : %s)", filename, errno, strerror (errno));
+			::close (file);
+			return false;
+		}
+	}
+
+	log (LOG_INFO, "btsnoop capture to %s", filename);
+
+	pthread_mutex_lock (&file_mutex);
+	fd = file;
+	pthread_mutex_unlock (&file_mutex);
+
+	pthread_mutex_lock (&buffer_mutex);
+	dropped_packets = 0;
+	capturing = true;
+	pthread_mutex_unlock (&buffer_mutex);
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// what is still buffered is written here rather than by the writer, so the
+// file is complete once this returns
+
+void BtSnoop::close (void)
+{
+	if (!is_open ())
+	{
+		return;
+	}
+
+	pthread_mutex_lock (&buffer_mutex);
+	capturing = false;
+	pthread_mutex_unlock (&buffer_mutex);
+
+	flush ();
+
+	pthread_mutex_lock (&file_mutex);
+	::close (fd);
+	fd = -1;
+	pthread_mutex_unlock (&file_mutex);
+
+	log (LOG_INFO, "btsnoop capture closed");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void BtSnoop::capture (bool received, const char *frame, int len)
+{
+	struct timespec now;
+	uint64 timestamp;
+	uint32 flags;
+	char *record;
+	char *larger;
+	int size;
+	bool wakeup;
+
+
+	clock_gettime (CLOCK_REALTIME, &now);
+	timestamp = (uint64) now.tv_sec * 1000000 + now.tv_nsec / 1000 + btsnoop_epoch_offset;
+
+	flags = received ? 0x01 : 0x00;
+
+	if ((frame[0] == HCI_COMMAND) || (frame[0] == HCI_EVENT))
+	{
+		flags |= 0x02;
+	}
+
+	pthread_mutex_lock (&buffer_mutex);
+
+	// checked again now that it can not change, close may have come in
+	// since the caller looked
+
+	if (!capturing)
+	{
+		pthread_mutex_unlock (&buffer_mutex);
+		return;
+	}
+
+	// a writer that can not keep up costs packets rather than memory, the
+	// count goes in every record that follows
+
+	if (buffer_len + btsnoop_record_header_len + len > btsnoop_maximum_buffer)
+	{
+		dropped_packets ++;
+		pthread_mutex_unlock (&buffer_mutex);
+		return;
+	}
+
+	if (buffer_size - buffer_len < btsnoop_record_header_len + len)
+	{
+		size = buffer_size;
+
+		while (size - buffer_len < btsnoop_record_header_len + len)
+		{
+			size = (size == 0) ? btsnoop_flush_threshold : 2 * size;
+		}
+
+		larger = (char *) realloc (buffer, size);
+
+		if (!larger)
+		{
+			dropped_packets ++;
+			pthread_mutex_unlock (&buffer_mutex);
+			return;
+		}
+
+		buffer = larger;
+		buffer_size = size;
+	}
+
+	record = &buffer[buffer_len];
+
+	put_be32 (&record[0], len);
+	put_be32 (&record[4], len);
+	put_be32 (&record[8], flags);
+	put_be32 (&record[12], dropped_packets);
+	put_be32 (&record[16], timestamp >> 32);
+	put_be32 (&record[20], timestamp);
+	memcpy (&record[btsnoop_record_header_len], frame, len);
+
+	wakeup = (buffer_len < btsnoop_flush_threshold);
+	buffer_len += btsnoop_record_header_len + len;
+	wakeup = wakeup && (buffer_len >= btsnoop_flush_threshold);
+
+	pthread_mutex_unlock (&buffer_mutex);
+
+	if (wakeup)
+	{
+		pthread_cond_signal (&capture_writer_cond);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the filled buffer is swapped for the empty spare, so capture carries on
+// into that while the file is written
+
+void BtSnoop::flush (void)
+{
+	char *full;
+	int full_size;
+	int len;
+	int offset;
+	int err;
+
+
+	pthread_mutex_lock (&file_mutex);
+
+	pthread_mutex_lock (&buffer_mutex);
+
+	full = buffer;
+	full_size = buffer_size;
+	len = buffer_len;
+
+	buffer = spare_buffer;
+	buffer_size = spare_buffer_size;
+	buffer_len = 0;
+
+	spare_buffer = full;
+	spare_buffer_size = full_size;
+
+	pthread_mutex_unlock (&buffer_mutex);
+
+	offset = 0;
+
+	while ((fd >= 0) && (offset < len))
+	{
+		err = write (fd, &spare_buffer[offset], len - offset);
+
+		if (err < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			log (LOG_ERROR, "btsnoop write (%d : %s)", errno, strerror (errno));
+			break;
+		}
+
+		offset += err;
+	}
+
+	pthread_mutex_unlock (&file_mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// one thread writes every capture, each pass is a single write per capture of
+// whatever built up since the last, the list is not locked while a file is
+// written so creating and destroying other captures never waits on the disk
+
+void *BtSnoop::writer_thread (void *arg)
+{
+	struct timespec deadline;
+	BtSnoop *snoop;
+
+
+	pthread_mutex_lock (&capture_list_mutex);
+
+	while (true)
+	{
+		clock_gettime (CLOCK_REALTIME, &deadline);
+
+		deadline.tv_nsec += btsnoop_flush_interval * 1000000;
+
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec += deadline.tv_nsec / 1000000000;
+			deadline.tv_nsec %= 1000000000;
+		}
+
+		pthread_cond_timedwait (&capture_writer_cond, &capture_list_mutex, &deadline);
+
+		for (snoop = all_captures; snoop; snoop = snoop->succ)
+		{
+			if (snoop->is_open ())
+			{
+				snoop->flushing = true;
+				pthread_mutex_unlock (&capture_list_mutex);
+
+				snoop->flush ();
+
+				pthread_mutex_lock (&capture_list_mutex);
+				snoop->flushing = false;
+				pthread_cond_broadcast (&capture_flushed_cond);
+			}
+		}
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
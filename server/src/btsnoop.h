@@ -0,0 +1,97 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <atomic>
+#include <pthread.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "types.h"
+
+////////////////////////////////////////////////////////////////////////////////
+// btsnoop capture of the HCI traffic of one controller. Packets are appended to
+// a memory buffer from whichever thread sends or receives them, and a single
+// background thread writes every capture's buffer out in large writes, so
+// sending and receiving packets never waits on the file.
+
+const int btsnoop_flush_threshold = 64 * 1024; // wakes the writer early
+const int btsnoop_maximum_buffer = 4 * 1024 * 1024; // packets are dropped beyond this
+const int btsnoop_flush_interval = 100; // milliseconds
+
+class BtSnoop
+{
+public:
+
+	BtSnoop ();
+	~BtSnoop ();
+
+	static void start_writer (void);
+	static void set_capture_directory (const char *directory);
+	static const char *get_capture_directory (void);
+
+	bool open (uint64 bd_addr);
+	void close (void);
+
+	// the only cost on the packet path while nothing is being captured
+	bool is_open (void) { return capturing.load (std::memory_order_relaxed); };
+
+	// an H4 frame, packet indicator first, received is from the controller
+	// to the host
+	void capture (bool received, const char *frame, int len);
+
+private:
+
+	static void *writer_thread (void *arg);
+	void flush (void);
+
+	std::atomic<bool> capturing;
+
+	// appended to by capture
+	pthread_mutex_t buffer_mutex;
+	char *buffer;
+	int buffer_len;
+	int buffer_size;
+	uint32 dropped_packets;
+
+	// held while the file is written, so close can not pull it from under
+	// the writer
+	pthread_mutex_t file_mutex;
+	int fd;
+	char *spare_buffer;
+	int spare_buffer_size;
+
+	BtSnoop *pred;
+	BtSnoop *succ;
+
+	// set while the writer has the capture out of the list lock
+	bool flushing;
+
+};
+
+////////////////////////////////////////////////////////////////////////////////
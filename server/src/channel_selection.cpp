@@ -0,0 +1,149 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include <stdlib.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "controller.h"
+#include "log.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+// events are worked out in blocks of this many, the permutation and MAM steps
+// are straight line code over the block so that the compiler can vectorise
+// them
+
+const int csa2_block_size = 16;
+
+////////////////////////////////////////////////////////////////////////////////
+
+// reverses the bits within each of the two octets
+
+static inline uint32 csa2_perm (uint32 v)
+{
+	v = ((v & 0x0F0F) << 4) | ((v >> 4) & 0x0F0F);
+	v = ((v & 0x3333) << 2) | ((v >> 2) & 0x3333);
+	v = ((v & 0x5555) << 1) | ((v >> 1) & 0x5555);
+
+	return v;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline uint32 csa2_mam (uint32 a, uint32 b)
+{
+	return (17 * a + b) & 0xFFFF;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline uint32 csa2_prn_e (uint32 counter, uint32 channel_identifier)
+{
+	uint32 v;
+
+
+	v = counter ^ channel_identifier;
+
+	for (int round = 0; round < 3; round ++)
+	{
+		v = csa2_mam (csa2_perm (v), channel_identifier);
+	}
+
+	return v ^ channel_identifier;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+uint16 csa2_channel_identifier (uint32 access_address)
+{
+	return ((access_address >> 16) ^ access_address) & 0xFFFF;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline int csa2_map_channel (uint32 prn_e, uint64 channel_map, const uint8 *used_channel, int number_of_used_channels)
+{
+	int unmapped;
+
+
+	unmapped = prn_e % 37;
+
+	if (channel_map & (1ULL << unmapped))
+	{
+		return unmapped;
+	}
+
+	return used_channel[(number_of_used_channels * prn_e) >> 16];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int csa2_select_channel (uint16 channel_identifier, uint16 event_counter, uint64 channel_map, const uint8 *used_channel, int number_of_used_channels)
+{
+	return csa2_map_channel (csa2_prn_e (event_counter, channel_identifier), channel_map, used_channel, number_of_used_channels);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the channels of count events from first_event_counter, the counter wraps at
+// 16 bits
+
+void csa2_select_channels (uint16 channel_identifier, uint16 first_event_counter, int count, uint64 channel_map, const uint8 *used_channel, int number_of_used_channels, uint8 *channels)
+{
+	uint32 v[csa2_block_size];
+	int block;
+
+
+	for (int done = 0; done < count; done += block)
+	{
+		block = (count - done < csa2_block_size) ? count - done : csa2_block_size;
+
+		for (int index = 0; index < csa2_block_size; index ++)
+		{
+			v[index] = ((first_event_counter + done + index) & 0xFFFF) ^ channel_identifier;
+		}
+
+		for (int round = 0; round < 3; round ++)
+		{
+			for (int index = 0; index < csa2_block_size; index ++)
+			{
+				v[index] = csa2_mam (csa2_perm (v[index]), channel_identifier);
+			}
+		}
+
+		for (int index = 0; index < block; index ++)
+		{
+			channels[done + index] = csa2_map_channel (v[index] ^ channel_identifier, channel_map, used_channel, number_of_used_channels);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
@@ -36,29 +36,40 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "log.h"
 #include "socket.h"
 
-#define BUFFER_SIZE (64*1024)
-
 ////////////////////////////////////////////////////////////////////////////////
 
-ClientSocket::ClientSocket (int new_sockfd, unsigned long new_addr, unsigned int new_port)
+ClientSocket::ClientSocket (int new_sockfd, unsigned long new_addr, unsigned int new_port) :
+	read_ring (read_ring_size),
+	write_ring (write_ring_size)
 {
+	int opt;
+
+
 	sockfd = new_sockfd;
 	addr = new_addr;
 	port = new_port;
 
-	read_buffer_len = 0;
-	read_buffer_size = 0;
-	read_buffer = 0;
+	// every send is already a whole batch, Nagle would only hold the next
+	// one back until the host acknowledges the last; this does nothing for
+	// a unix domain socket
+
+	opt = 1;
+	setsockopt (sockfd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof (opt));
 
-	write_buffer_len = 0;
-	write_buffer_size = 0;
-	write_buffer = 0;
+	pthread_mutex_init (&write_mutex, NULL);
+	write_batch = 0;
+	write_failed = false;
+
+	shm = 0;
+
+	watch ();
 
 	log (LOG_CLIENTSOCKET, "ClientSocket %s", get_name ());
 }
@@ -67,145 +78,366 @@ ClientSocket::ClientSocket (int new_sockfd, unsigned long new_addr, unsigned int
 
 ClientSocket::~ClientSocket ()
 {
-	if (read_buffer)
+	if (shm)
 	{
-		free (read_buffer);
+		unwatch_descriptor (shm->get_doorbell_fd ());
+		delete shm;
 	}
 
-	if (write_buffer)
-	{
-		free (write_buffer);
-	}
+	pthread_mutex_destroy (&write_mutex);
 
 	log (LOG_CLIENTSOCKET, "~ClientSocket %s", get_name ());
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-bool ClientSocket::is_readable (void)
+void ClientSocket::on_readable (void)
 {
-	return true;
+	fill_read_buffer ();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-bool ClientSocket::is_writable (void)
+// reads until there is nothing more or the read ring is full; for a full ring
+// it returns true, and is called again once what is in it has been consumed
+
+bool ClientSocket::fill_read_buffer (void)
 {
-	if ((write_buffer) && (write_buffer_len > 0))
+	int err;
+	int len;
+	char *space;
+	char buffer[16];
+
+
+	if (shm)
 	{
-		log (LOG_CLIENTSOCKET, "ClientSocket is_writable %p %d", write_buffer, write_buffer_len);
-		return true;
+		// the host writes nothing to the socket, it is only watched to
+		// see it close; the doorbell is cleared before the ring is read
+		// so that a ring after the read is not lost
+
+		err = recv (sockfd, buffer, sizeof (buffer), MSG_DONTWAIT);
+
+		if ((err == 0) || ((err < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK)))
+		{
+			this->set_delete_pending ();
+			return false;
+		}
+
+		shm->clear_doorbell ();
+
+		space = read_ring.get_space (&len);
+
+		if (!space)
+		{
+			this->set_delete_pending ();
+			return false;
+		}
+
+		read_ring.commit (shm->receive (space, len));
+
+		return read_ring.is_full ();
 	}
-	else
+
+	// there is no second edge for whatever is left, so everything the
+	// socket has is read now, or as much as there is room for
+
+	while (true)
 	{
-		log (LOG_CLIENTSOCKET, "ClientSocket !is_writable %p %d", write_buffer, write_buffer_len);
-		return false;
+		space = read_ring.get_space (&len);
+
+		if (!space)
+		{
+			this->set_delete_pending ();
+			return false;
+		}
+
+		if (len == 0)
+		{
+			return true;
+		}
+
+		err = recv (sockfd, space, len, 0);
+
+		log (LOG_CLIENTSOCKET, "ClientSocket::on_readable (%d)", err);
+
+		if (err < 0)
+		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				return false;
+			}
+
+			if (errno == EINTR)
+			{
+				continue;
+			}
+
+			log (LOG_ERROR, "recv (%d : %s)", errno, strerror (errno));
+			this->set_delete_pending ();
+			return false;
+		}
+
+		if (err == 0)
+		{
+			this->set_delete_pending ();
+			return false;
+		}
+
+		read_ring.commit (err); // err is actually the length of data read
 	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void ClientSocket::on_readable (void)
+// sends until the socket or ring will take no more, write interest is kept
+// for as long as anything is left over
+
+void ClientSocket::on_writable (void)
 {
 	int err;
+	int len;
+	char *buffer;
+
 
+	pthread_mutex_lock (&write_mutex);
 
-	if (read_buffer_size - read_buffer_len < BUFFER_SIZE)
+	if (write_failed)
 	{
-		read_buffer_size += BUFFER_SIZE;
-		read_buffer = (char *) realloc (read_buffer, read_buffer_size);
+		pthread_mutex_unlock (&write_mutex);
+		this->set_delete_pending ();
+		return;
 	}
 
-	err = recv (sockfd, &read_buffer[read_buffer_len], read_buffer_size - read_buffer_len, 0);
+	buffer = write_ring.peek (&len);
 
-	log (LOG_CLIENTSOCKET, "ClientSocket::on_readable (%d)", err);
+	log (LOG_CLIENTSOCKET, "ClientSocket::on_writable (%d)", len);
 
-	if (err < 0)
+	while (len > 0)
 	{
-		log (LOG_ERROR, "recv (%d : %s)", errno, strerror (errno));
-		return;
+		err = transport_send (buffer, len, MSG_DONTWAIT);
+
+		if (err < 0)
+		{
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+			{
+				log (LOG_ERROR, "ERROR send (%d : %s)", errno, strerror (errno));
+			}
+			break;
+		}
+
+		if (err == 0)
+		{
+			break;
+		}
+
+		write_ring.consume (err);
+		buffer = write_ring.peek (&len);
 	}
 
-	if (err == 0)
+	set_write_interest (len > 0);
+
+	pthread_mutex_unlock (&write_mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+char *ClientSocket::peek_read_buffer (int *len)
+{
+	return read_ring.peek (len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void ClientSocket::consume_read_buffer (int len)
+{
+	log (LOG_CLIENTSOCKET, "ClientSocket::consume_read_buffer (%d)", len);
+
+	if ((len > 0) && (len <= read_ring.get_length ()))
 	{
-		this->set_delete_pending ();
-		return;
+		read_ring.consume (len);
 	}
-
-	read_buffer_len += err; // err is actually the length of data read
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void ClientSocket::on_writable (void)
+void ClientSocket::write_data (char *buffer, int len)
 {
-	int err;
-	int len;
+	write_data (buffer, len, 0, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
 
+// the header and data are appended together, nothing written from another
+// thread can come between them
+
+void ClientSocket::write_data (const char *header, int header_len, const char *data, int len)
+{
+	char *buffer;
 
-	log (LOG_CLIENTSOCKET, "ClientSocket::on_writable (%d)", write_buffer_len);
 
-	len = write_buffer_len;
+	buffer = reserve_write (header_len + len);
 
-	if (len > BUFFER_SIZE)
+	if (!buffer)
 	{
-		len = BUFFER_SIZE;
+		return;
 	}
 
-	err = send (sockfd, write_buffer, len, 0);
-	
-	if (err < 0)
+	memcpy (buffer, header, header_len);
+
+	if (len > 0)
 	{
-		log (LOG_ERROR, "ERROR send (%d : %s)", errno, strerror (errno));
-		return;
+		memcpy (&buffer[header_len], data, len);
 	}
 
-	memcpy (write_buffer, &write_buffer[err], write_buffer_size - err);
-	write_buffer_len -= err;
+	commit_write (header_len + len);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-char *ClientSocket::peek_read_buffer (int *len)
+// space for len bytes at the end of the write buffer, for the caller to fill
+// in place; the write mutex is held until commit_write so that nothing from
+// another thread can land in the middle. If the ring cannot grow it returns 0
+// with the mutex released, and nothing more is written; the socket can only
+// go on the delete list from the poll loop, so asking for write interest
+// wakes it to do that in on_writable
+
+char *ClientSocket::reserve_write (int len)
 {
-	*len = read_buffer_len;
-	return read_buffer;
+	char *buffer;
+
+
+	pthread_mutex_lock (&write_mutex);
+
+	buffer = write_failed ? 0 : write_ring.reserve (len);
+
+	if (!buffer)
+	{
+		write_failed = true;
+		set_write_interest (true);
+		pthread_mutex_unlock (&write_mutex);
+	}
+
+	return buffer;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void ClientSocket::consume_read_buffer (int len)
+void ClientSocket::commit_write (int len)
 {
-	log (LOG_CLIENTSOCKET, "ClientSocket::consume_read_buffer (%d)", len);
+	int pending;
+	char *buffer;
+
+
+	if (is_logging_enabled (LOG_CLIENTSOCKET))
+	{
+		buffer = write_ring.peek (&pending);
+
+		log_start (LOG_CLIENTSOCKET, "ClientSocket::commit_write (%d) ", len);
+		for (int index = 0; index < len; index ++)
+		{
+			log_continuation ("%02X", buffer[pending + index] & 0xFF);
+		}
+		log_end ();
+	}
 
-	if ((len > 0) && (len <= read_buffer_len))
+	write_ring.commit (len);
+
+	// asking for write interest wakes the poll loop, and does nothing if
+	// it is already asked for; a batch is sent when it ends
+
+	if (write_batch == 0)
 	{
-		memmove (read_buffer, &read_buffer[len], read_buffer_size - len);
-		read_buffer_len -= len;
+		set_write_interest (true);
 	}
+
+	pthread_mutex_unlock (&write_mutex);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void ClientSocket::write_data (char *buffer, int len)
+void ClientSocket::begin_write_batch (void)
+{
+	pthread_mutex_lock (&write_mutex);
+	write_batch ++;
+	pthread_mutex_unlock (&write_mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// sends everything queued during the batch with one send, anything the
+// socket will not take now is left for the poll loop to send once the socket
+// has room; when the socket and simulation threads both have a batch open,
+// the last to end it does the send
+
+void ClientSocket::end_write_batch (void)
 {
-	log_start (LOG_CLIENTSOCKET, "ClientSocket::write_data (%d : %p) ", len, buffer);
-	for (int index = 0; index < len; index ++)
+	int err;
+	int len;
+	char *buffer;
+
+
+	pthread_mutex_lock (&write_mutex);
+
+	write_batch --;
+
+	if (write_batch > 0)
 	{
-		log_continuation ("%02X", buffer[index]);
+		pthread_mutex_unlock (&write_mutex);
+		return;
 	}
-	log_end ();
 
-	if (write_buffer_size - write_buffer_len < len)
+	buffer = write_ring.peek (&len);
+
+	if (len > 0)
 	{
-		write_buffer_size = write_buffer_len + len;
-		write_buffer = (char *) realloc (write_buffer, write_buffer_size);
+		err = transport_send (buffer, len, MSG_DONTWAIT);
+
+		log (LOG_CLIENTSOCKET, "ClientSocket::end_write_batch (%d : %d)", len, err);
+
+		if (err > 0)
+		{
+			write_ring.consume (err);
+		}
+		else if ((err < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+		{
+			log (LOG_ERROR, "ERROR send (%d : %s)", errno, strerror (errno));
+		}
 	}
 
-	memcpy (&write_buffer[write_buffer_len], buffer, len);
-	write_buffer_len += len;
+	// a write that failed during the batch still needs on_writable to
+	// delete the socket
+
+	set_write_interest ((write_failed) || (write_ring.get_length () > 0));
+
+	pthread_mutex_unlock (&write_mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the socket stays open alongside the rings, the host closing it is what
+// ends the controller; the host ringing the doorbell reads as the socket
+// being readable
+
+void ClientSocket::use_shared_memory (SharedMemoryTransport *transport)
+{
+	shm = transport;
+
+	watch_descriptor (shm->get_doorbell_fd (), this);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// as much as the socket or ring will take, a full ring takes nothing and is
+// tried again once the host has made room
+
+int ClientSocket::transport_send (const char *buffer, int len, int flags)
+{
+	if (shm)
+	{
+		return shm->send (buffer, len);
+	}
 
-	write (ListenSocket::get_write_pipefd (), " ", 1);
+	return send (sockfd, buffer, len, flags);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -27,6 +27,11 @@
 //
 ////////////////////////////////////////////////////////////////////////////////
 
+#include <string.h>
+#include <unistd.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
 #include "controller.h"
 #include "log.h"
 
@@ -37,7 +42,17 @@ Controller::Controller (int sockfd, unsigned long addr, unsigned int port) :
 {
 	log (LOG_CONTROLLER, "Controller");
 
+	h4_header_len = 0;
+	h4_frame_len = 0;
+
+	reserved_write = 0;
+
 	ll_set_bd_addr ((addr << 16) | port);
+
+	if (BtSnoop::get_capture_directory ())
+	{
+		snoop.open (ll_get_bd_addr ());
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -52,72 +67,165 @@ Controller::~Controller ()
 void Controller::on_readable (void)
 {
 	int len;
-	int packet_type;
+	int offset;
+	int remaining;
 	char *buffer;
+	char *frame;
+	bool read_full;
 
 
 	log (LOG_CONTROLLER, "Controller::on_readable %s", get_name ());
 
-	// do the actual socket read into a buffer
-	ClientSocket::on_readable ();
+	// every complete frame in the buffer is handled where it lies, a host may
+	// have up to num_hci_command_packets commands in flight, what was used is
+	// consumed once at the end and all of the responses go out together; a
+	// frame that is not all in yet is left at the start of the buffer and
+	// its header is not looked at again
 
-	while (true)
+	// a read buffer that filled up is gone through and then read into again,
+	// the socket will not say that there is more
+
+	do
 	{
+		read_full = fill_read_buffer ();
+
+		begin_write_batch ();
+
 		buffer = peek_read_buffer (&len);
+		offset = 0;
 
-		if (len > 1)
+		while ((offset < len) && (!is_delete_pending ()))
 		{
-			packet_type = buffer[0];
+			frame = &buffer[offset];
+			remaining = len - offset;
 
-			if (packet_type == HCI_COMMAND)
+			if (h4_frame_len == 0)
 			{
-				int opcode;
-				int command_len;
+				h4_header_len = h4_header_length (frame[0] & 0xFF);
 
-				if (len > 3)
+				if (h4_header_len < 0)
 				{
-					opcode = (buffer[1]) + (buffer[2] << 8);
-					command_len = buffer[3];
-				
-					if (command_len + 4 >= len)
-					{
-						if (command_len == 0)
-						{
-							process_command (opcode, command_len, 0);
-						}
-						else
-						{
-							process_command (opcode, command_len, &buffer[4]);
-						}
-
-						consume_read_buffer (command_len + 4);
-					}
-					else
-					{
-						break;
-					}
+					log (LOG_ERROR, "Invalid Packet Type %02x", frame[0] & 0xFF);
+
+					// there is no finding the next frame once framing is lost
+
+					set_delete_pending ();
+					break;
 				}
-				else
+
+				if (remaining < h4_header_len)
 				{
 					break;
 				}
+
+				h4_frame_len = h4_header_len + h4_payload_length (frame);
 			}
-			else if (packet_type == HCI_DATA)
+
+			if (remaining < h4_frame_len)
 			{
-				log (LOG_CONTROLLER, "HCI Data");
+				break;
 			}
-			else
-			{
-				log (LOG_ERROR, "Invalid Packet Type %02x", packet_type);
 
-				// TODO : should this be delete this, or should this set the delete pending flag?
-				delete this;
-			}
+			h4_process_frame (frame);
+
+			offset += h4_frame_len;
+			h4_frame_len = 0;
 		}
-		else
-		{
+
+		consume_read_buffer (offset);
+
+		end_write_batch ();
+	}
+	while ((read_full) && (!is_delete_pending ()));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the packet indicator and the header after it, -1 for a packet type the host
+// should never send
+
+int Controller::h4_header_length (int packet_type)
+{
+	switch (packet_type)
+	{
+		case HCI_COMMAND:
+			return 1 + 3;
+
+		case HCI_DATA:
+			return 1 + 4;
+
+		case HCI_ISO_DATA:
+			return 1 + 4;
+	}
+
+	return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int Controller::h4_payload_length (const char *frame)
+{
+	switch (frame[0])
+	{
+		case HCI_COMMAND:
+			return frame[3] & 0xFF;
+
+		case HCI_DATA:
+			return (frame[3] & 0xFF) | ((frame[4] & 0xFF) << 8);
+
+		case HCI_ISO_DATA:
+			return (frame[3] & 0xFF) | ((frame[4] & 0x3F) << 8);
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Controller::h4_process_frame (const char *frame)
+{
+	int opcode;
+	int handle;
+	int packet_boundary;
+	int len;
+
+
+	len = h4_frame_len - h4_header_len;
+
+	if (snoop.is_open ())
+	{
+		snoop.capture (false, frame, h4_frame_len);
+	}
+
+	switch (frame[0])
+	{
+		case HCI_COMMAND:
+
+			opcode = (frame[1] & 0xFF) | ((frame[2] & 0xFF) << 8);
+
+			process_command (opcode, len, (len == 0) ? 0 : (char *) &frame[4]);
+			break;
+
+		case HCI_DATA:
+
+			handle = (frame[1] & 0xFF) | ((frame[2] & 0x0F) << 8);
+			packet_boundary = (frame[2] >> 4) & 0x03;
+
+			// the payload is copied straight from the read buffer into
+			// the link layer buffers
+
+			process_acl_data (handle, packet_boundary, len, &frame[5]);
+			break;
+
+		case HCI_ISO_DATA:
+
+			// no isochronous channels can be set up, so there is nowhere
+			// for the data to go
+
+			handle = (frame[1] & 0xFF) | ((frame[2] & 0x0F) << 8);
+
+			log (LOG_ERROR, "HCI ISO Data dropped %03X (%d)", handle, len);
 			break;
-		}
 	}
 }
 
@@ -125,14 +233,104 @@ void Controller::on_readable (void)
 
 void Controller::write_data (char *buffer, int len)
 {
-	ClientSocket::write_data (buffer, len);
+	write_data (buffer, len, 0, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// goes through reserve_write and commit_write so that it is captured too
+
+void Controller::write_data (const char *header, int header_len, const char *data, int len)
+{
+	char *buffer;
+
+
+	buffer = reserve_write (header_len + len);
+
+	if (!buffer)
+	{
+		return;
+	}
+
+	memcpy (buffer, header, header_len);
+
+	if (len > 0)
+	{
+		memcpy (&buffer[header_len], data, len);
+	}
+
+	commit_write (header_len + len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the write mutex is held from here to commit_write, which is what keeps
+// reserved_write to one thread at a time. The first packet the simulation
+// thread writes in a step opens a write batch, closed by flush_output as the
+// step ends, so that a scanner hearing many advertisers is sent its reports
+// in one go rather than woken for each
+
+char *Controller::reserve_write (int len)
+{
+	if ((PhysicalLayer::is_simulation_thread ()) && (!is_output_deferred ()) && (!is_delete_pending ()))
+	{
+		defer_output ();
+		begin_write_batch ();
+	}
+
+	reserved_write = ClientSocket::reserve_write (len);
+
+	return reserved_write;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void Controller::commit_write (int len)
+{
+	if (snoop.is_open ())
+	{
+		snoop.capture (true, reserved_write, len);
+	}
+
+	ClientSocket::commit_write (len);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
+void Controller::flush_output (void)
+{
+	end_write_batch ();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool Controller::set_btsnoop_capture (bool enable)
+{
+	if (!enable)
+	{
+		snoop.close ();
+		return true;
+	}
+
+	return snoop.open (ll_get_bd_addr ());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// called from the simulation thread once it has let go of the controller, the
+// poll loop is woken so that the socket is deleted now rather than on whatever
+// wakes it next
+
 void Controller::set_delete_ready (void)
 {
-	ClientSocket::set_delete_ready ();
+	if (!is_delete_ready ())
+	{
+		send_deferred_output ();
+
+		ClientSocket::set_delete_ready ();
+
+		write (ListenSocket::get_write_pipefd (), " ", 1);
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -29,17 +29,114 @@
 
 #include "types.h"
 #include "socket.h"
+#include "aes.h"
+#include "btsnoop.h"
+#include "b1ee.h"
 
 ////////////////////////////////////////////////////////////////////////////////
 
-const int maximum_pdu_length = 31 + 6 + 2; // 31 data length + 6 advertising address + header + length
+const int maximum_legacy_pdu_length = 31 + 6 + 2; // 31 data length + 6 advertising address + header + length
+const int advertising_pdu_copies = 3; // latest, referenced by a packet in flight, and one to build into
+const int maximum_pdu_length = 255 + 2; // extended payload + header + length
 const int maximum_radio_channels = 40;
 const int maximum_advertising_data_length = 31;
 const int maximum_scan_response_data_length = 31;
+const int maximum_extended_advertising_data_length = 1650;
+const int maximum_extended_report_data_length = 229;
+const int maximum_number_of_advertising_sets = 4;
+const int maximum_number_of_aux_pdus = 8; // AUX_ADV_IND + AUX_CHAIN_IND for 1650 octets
 const int maximum_features_page_number = 4;
 const int maximum_number_of_white_list_entries = 1;
-const int maximum_number_of_link_layer_state_machines = 2;
+const int maximum_resolving_list_size = 32;
+const int resolved_address_cache_size = 64; // power of two
+const int64 default_rpa_timeout = 900000000; // 15 minutes in microseconds
+const int maximum_number_of_connections = 4;
+const int maximum_number_of_periodic_syncs = 4;
+const int maximum_periodic_advertising_data_length = 252; // one AUX_SYNC_IND, no AUX_CHAIN_IND
+const int maximum_number_of_link_layer_state_machines = 2 + 2 * maximum_number_of_advertising_sets + maximum_number_of_connections + maximum_number_of_periodic_syncs;
+const int maximum_data_pdu_payload_length = 27; // no data length extension
+const int maximum_data_pdu_length = 2 + maximum_data_pdu_payload_length + 4; // header, payload, MIC
+const int le_acl_data_packet_length = 251;
+const int total_num_le_acl_data_packets = 8;
+const int maximum_fragments_per_acl_packet = (le_acl_data_packet_length + maximum_data_pdu_payload_length - 1) / maximum_data_pdu_payload_length;
+const int channel_lookahead_length = 16; // CSA#2 channels worked out in one go
 const uint32 advertising_access_address = 0x8E89BED6;
+const uint32 advertising_crc_init = 0x555555;
+const int maximum_hci_event_parameter_length = 255;
+
+////////////////////////////////////////////////////////////////////////////////
+// Advertising channel PDU types, the extended PDUs all share ADV_EXT_IND
+
+const uint8 PDU_ADV_IND = 0x00;
+const uint8 PDU_ADV_DIRECT_IND = 0x01;
+const uint8 PDU_ADV_NONCONN_IND = 0x02;
+const uint8 PDU_SCAN_REQ = 0x03;
+const uint8 PDU_SCAN_RSP = 0x04;
+const uint8 PDU_CONNECT_IND = 0x05;
+const uint8 PDU_ADV_SCAN_IND = 0x06;
+const uint8 PDU_ADV_EXT_IND = 0x07;
+
+const uint8 PDU_CHSEL = 0x20; // supports Channel Selection Algorithm #2
+const uint8 PDU_TXADD = 0x40;
+const uint8 PDU_RXADD = 0x80;
+
+////////////////////////////////////////////////////////////////////////////////
+// Data Channel PDU
+
+const uint8 LLID_CONTINUATION = 0x01;
+const uint8 LLID_START = 0x02;
+const uint8 LLID_CONTROL = 0x03;
+
+const uint8 DATA_HEADER_LLID = 0x03;
+const uint8 DATA_HEADER_NESN = 0x04;
+const uint8 DATA_HEADER_SN = 0x08;
+const uint8 DATA_HEADER_MD = 0x10;
+
+const uint8 LL_TERMINATE_IND = 0x02;
+const uint8 LL_ENC_REQ = 0x03;
+const uint8 LL_ENC_RSP = 0x04;
+const uint8 LL_START_ENC_REQ = 0x05;
+const uint8 LL_START_ENC_RSP = 0x06;
+const uint8 LL_UNKNOWN_RSP = 0x07;
+const uint8 LL_REJECT_IND = 0x0D;
+
+// Extended header flags
+
+const uint8 EXT_HEADER_ADVA = 0x01;
+const uint8 EXT_HEADER_TARGETA = 0x02;
+const uint8 EXT_HEADER_CTEINFO = 0x04;
+const uint8 EXT_HEADER_ADI = 0x08;
+const uint8 EXT_HEADER_AUXPTR = 0x10;
+const uint8 EXT_HEADER_SYNCINFO = 0x20;
+const uint8 EXT_HEADER_TXPOWER = 0x40;
+
+// Advertising_Event_Properties and extended report Event_Type bits
+
+const int ADV_PROP_CONNECTABLE = 0x0001;
+const int ADV_PROP_SCANNABLE = 0x0002;
+const int ADV_PROP_DIRECTED = 0x0004;
+const int ADV_PROP_HIGH_DUTY_DIRECTED = 0x0008;
+const int ADV_PROP_LEGACY = 0x0010;
+const int ADV_PROP_ANONYMOUS = 0x0020;
+const int ADV_PROP_INCLUDE_TX_POWER = 0x0040;
+
+const int REPORT_DATA_COMPLETE = 0x0000;
+const int REPORT_DATA_INCOMPLETE = 0x0020;
+const int REPORT_DATA_TRUNCATED = 0x0040;
+
+////////////////////////////////////////////////////////////////////////////////
+
+// access addresses for connections and periodic advertising trains
+
+bool is_valid_access_address (uint32 aa);
+
+////////////////////////////////////////////////////////////////////////////////
+// Channel Selection Algorithm #2, the channel of an event depends only on the
+// event counter so a run of events can be worked out in one batch
+
+uint16 csa2_channel_identifier (uint32 access_address);
+int csa2_select_channel (uint16 channel_identifier, uint16 event_counter, uint64 channel_map, const uint8 *used_channel, int number_of_used_channels);
+void csa2_select_channels (uint16 channel_identifier, uint16 first_event_counter, int count, uint64 channel_map, const uint8 *used_channel, int number_of_used_channels, uint8 *channels);
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -57,7 +154,89 @@ enum PhysicalPacketState
 
 enum PhyModulation
 {
-	GFSK_LE
+	GFSK_LE,          // LE 1M
+	GFSK_LE_2M,       // LE 2M
+	GFSK_LE_CODED_S2, // LE Coded, 500 kb/s
+	GFSK_LE_CODED_S8, // LE Coded, 125 kb/s
+};
+
+const int number_of_phy_modulations = 4;
+
+////////////////////////////////////////////////////////////////////////////////
+// Airtime of each part of a packet in microseconds, the coded PHY adds the
+// coding indicator and TERM1 after the access address and TERM2 after the CRC
+
+struct PhyTiming
+{
+	int preamble;
+	int access_address;
+	int coding_overhead;
+	int per_octet;
+	int crc;
+	int term2;
+};
+
+constexpr PhyTiming phy_timing[number_of_phy_modulations] =
+{
+	{  8,  32,  0,  8,  24,  0 }, // GFSK_LE
+	{  8,  16,  0,  4,  12,  0 }, // GFSK_LE_2M
+	{ 80, 256, 40, 16,  48,  6 }, // GFSK_LE_CODED_S2
+	{ 80, 256, 40, 64, 192, 24 }, // GFSK_LE_CODED_S8
+};
+
+// time from the start of the packet until a receiver has synchronised
+
+constexpr int phy_sync_time (PhyModulation mod)
+{
+	return phy_timing[mod].preamble + phy_timing[mod].access_address + phy_timing[mod].coding_overhead;
+}
+
+constexpr int phy_packet_airtime (PhyModulation mod, int pdu_length)
+{
+	return phy_sync_time (mod) + phy_timing[mod].per_octet * pdu_length + phy_timing[mod].crc + phy_timing[mod].term2;
+}
+
+// a coded receiver decodes either coding from the coding indicator
+
+constexpr bool phy_can_receive (PhyModulation rx_mod, PhyModulation tx_mod)
+{
+	return (rx_mod == tx_mod) ||
+		(((rx_mod == GFSK_LE_CODED_S2) || (rx_mod == GFSK_LE_CODED_S8)) &&
+		 ((tx_mod == GFSK_LE_CODED_S2) || (tx_mod == GFSK_LE_CODED_S8)));
+}
+
+static_assert (phy_packet_airtime (GFSK_LE, 39) == 376, "LE 1M airtime");
+static_assert (phy_packet_airtime (GFSK_LE_CODED_S8, 39) == 3088, "LE Coded S=8 airtime");
+
+// PHY bits as used by HCI in the ALL_PHYS, TX_PHYS and RX_PHYS parameters
+
+const int hci_phy_le_1m = 0x01;
+const int hci_phy_le_2m = 0x02;
+const int hci_phy_le_coded = 0x04;
+
+// PHY values as used by HCI in reports and PHY parameters (1 = 1M, 2 = 2M, 3 = Coded)
+
+constexpr int hci_phy_value (PhyModulation mod)
+{
+	return (mod == GFSK_LE) ? 0x01 : (mod == GFSK_LE_2M) ? 0x02 : 0x03;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// The radio model, received power falls off as in free space from the loss at
+// one metre, closer than that counts as one metre
+
+const int default_tx_power = 0; // dBm
+const int minimum_tx_power = -127;
+const int maximum_tx_power = 20;
+const int reference_path_loss = 40; // dB at one metre and 2.4 GHz
+const int receiver_sensitivity = -95; // dBm, anything weaker is not received
+const int maximum_clock_drift = 500; // ppm
+const int maximum_number_of_lossy_links = 8;
+
+struct LossyLink
+{
+	uint64 address; // public device address of the peer controller
+	int percent;    // of the packets between the two that are dropped
 };
 
 class PhysicalLayer;
@@ -74,31 +253,46 @@ public:
 	void set_transmit (uint8 chan, PhyModulation mod, int64 when);
 	void set_receive (uint8 chan, PhyModulation mod, int64 start, int64 end);
 	void set_access_address (uint32 aa);
-	void set_pdu (uint8 len, uint8 *pdu);
+	void set_crc_init (uint32 init);
+	void set_pdu (int len, uint8 *pdu);
+	void set_pdu_reference (int len, const uint8 *pdu, uint32 pdu_crc);
 	void set_llsm (int index);
 
 	bool is_transmit (void) { return is_tx; };
 	bool is_receive (void) { return !is_tx; };
 	uint8 get_channel (void) { return channel; };
+	PhyModulation get_modulation (void) { return modulation; };
 	int get_llsm (void) { return llsm_index; };
+	int64 get_rx_start_time (void) { return rx_start_time; };
+	PhyModulation get_rx_modulation (void) { return rx_modulation; };
+	int get_rx_rssi (void) { return rx_rssi; };
 
 	void log (void);
-	void end_of_packet (int64 when, int rx_len, uint8 *rx_data);
+	void end_of_packet (int64 when, int rx_len, const uint8 *rx_data);
+
+	static uint32 calculate_crc (uint32 init, int len, const uint8 *pdu);
 
 private:
 	bool is_tx; // true = Transmit, false = Receive
 	uint8 channel;
 	PhyModulation modulation;
 	uint64 start_time, end_time;
+	int64 rx_start_time; // start of the last packet received
+	PhyModulation rx_modulation;
+	int rx_rssi; // dBm
 	uint8 preamble;
 	uint32 access_address;
-	uint8 pdu_length;
-	uint8 pdu_data[maximum_pdu_length];
+	uint32 crc_init;
+	int pdu_length;
+	const uint8 *pdu_data; // either pdu_buffer or a buffer owned by the link layer
+	uint8 pdu_buffer[maximum_pdu_length];
 	uint32 crc;
 	int llsm_index;
 
 	PhysicalLayer *physical_layer;
 	PhysicalPacket *succ;
+	PhysicalPacket *channel_succ; // next packet on the same channel
+	PhysicalPacket *rx_transmitter; // the transmission this receiver gets in the current step
 
 };
 
@@ -118,11 +312,32 @@ public:
 	static void *physical_layer_simulation_thread (void *arg);
 
 	virtual PhysicalPacket *get_next_packet (int64 after) = 0;
-	void end_of_packet (PhysicalPacket *packet, int64 when, int rx_len, uint8 *rx_data);
+	void end_of_packet (PhysicalPacket *packet, int64 when, int rx_len, const uint8 *rx_data);
+	void prepare_packet (PhysicalPacket *packet, int rx_len, const uint8 *rx_data);
+
+	void set_timer (int64 when);
+	void clear_timer (void);
+	virtual void on_timer (int64 when) = 0;
 
 	static void enter_mutex (const char *file, int line);
 	static void leave_mutex (const char *file, int line);
 
+	// output for the host that the simulation thread queues during a step is
+	// sent as the step ends, one write for each controller rather than one
+	// for each packet
+	static bool is_simulation_thread (void);
+	void defer_output (void);
+	bool is_output_deferred (void) { return output_deferred; };
+	void send_deferred_output (void);
+	virtual void flush_output (void) {};
+
+	// the radio model, set from the host with the simulation mutex held
+	void set_radio_address (uint64 address);
+	bool set_tx_power (int dbm);
+	void set_position (int x, int y, int z);
+	bool set_clock_drift (int ppm);
+	bool set_link_loss (uint64 address, int percent);
+
 private:
 
 	bool physical_layer_is_active;
@@ -130,16 +345,45 @@ private:
 
 	PhysicalPacket *current_packet;
 
+	bool timer_is_set;
+	int64 timer_instant;
+
 	static PhysicalLayer *all_radios;
 
 	PhysicalLayer *pred;
 	PhysicalLayer *succ;
 
+	static pthread_t simulation_thread;
+	static PhysicalLayer *deferred_output;
+	static void send_all_deferred_output (void);
+
+	bool output_deferred;
+	PhysicalLayer *next_deferred;
+
 	static void insert_into (PhysicalPacket **list, PhysicalPacket *packet);
+	static PhysicalPacket *synchronised_transmitter (PhysicalPacket *receiver);
+
+	static int received_power (const PhysicalLayer *receiver, const PhysicalLayer *transmitter);
+	static int link_loss (const PhysicalLayer *receiver, const PhysicalLayer *transmitter);
+	void apply_clock_drift (PhysicalPacket *packet, int64 now);
+
+	// positions are in millimetres, a radio with a positive drift has a
+	// clock that runs fast
+	uint64 radio_address;
+	int tx_power;
+	int position[3];
+	int clock_drift;
+	int number_of_lossy_links;
+	LossyLink lossy_link[maximum_number_of_lossy_links];
 
 	static PhysicalPacket *ordered_transmitters;
 	static PhysicalPacket *ordered_receivers;
 
+	// the same packets by channel, so a transmission is only matched against
+	// the receivers listening on its channel
+	static PhysicalPacket *transmitters_on_channel[maximum_radio_channels];
+	static PhysicalPacket *receivers_on_channel[maximum_radio_channels];
+
 	static int transmitting[maximum_radio_channels];
 	static bool bad_transmission[maximum_radio_channels];
 
@@ -154,9 +398,13 @@ enum LinkLayerState
 	LLS_Scanning,
 	LLS_Initiator,
 	LLS_Slave,
-	LLS_Master
+	LLS_Master,
+	LLS_Periodic_Advertising,
+	LLS_Synchronized
 };
 
+const int number_of_link_layer_states = LLS_Synchronized + 1;
+
 ////////////////////////////////////////////////////////////////////////////////
 
 enum Advertising_SubStates
@@ -173,6 +421,303 @@ enum Scanning_SubStates
 	SSS_Scan,
 	SSS_Scan_Request,
 	SSS_Scan_Response,
+	SSS_Scan_Aux,
+	SSS_Connect_Request,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+enum Connection_SubStates
+{
+	CSS_Transmit,
+	CSS_Receive,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the encryption start procedure, data is held back from the LL_ENC_REQ until
+// each side has sent its LL_START_ENC_RSP
+
+enum Encryption_SubStates
+{
+	ESS_Idle,
+	ESS_Wait_Enc_Rsp, // master
+	ESS_Wait_Key, // slave, the host has been asked for the LTK
+	ESS_Wait_Start_Enc_Req, // master
+	ESS_Wait_Start_Enc_Rsp,
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// one packet of an advertising event, offset is from the start of the event
+
+struct AdvertisingEventPacket
+{
+	int offset;
+	int sync_info; // where the SyncInfo is in the PDU, 0 when there is none
+	uint8 channel;
+	PhyModulation modulation;
+	int pdu_length;
+	uint32 crc;
+	uint8 pdu[maximum_pdu_length];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+class AdvertisingSet
+{
+	friend class LinkLayer;
+public:
+
+	AdvertisingSet ();
+	~AdvertisingSet ();
+
+	void reset (void);
+
+	bool set_parameters (int properties, int interval, int channel_map, int own_address_type, int peer_address_type, uint64 peer_address, PhyModulation primary_phy, PhyModulation secondary_phy, int sid);
+	bool set_data (int operation, int len, const uint8 *data);
+	bool set_periodic_parameters (int interval, int properties);
+	bool set_periodic_data (int operation, int len, const uint8 *data);
+
+	void build (uint64 adva, bool adva_is_random);
+	void build_periodic (void);
+
+	int get_number_of_packets (void) { return number_of_packets[schedule_index]; };
+	AdvertisingEventPacket *get_packet (int schedule, int index) { return &schedule_packet[schedule][index]; };
+
+private:
+
+	int build_extended_pdu (uint8 *pdu, int adv_mode, uint8 flags, uint64 adva, const uint8 *aux_ptr, const uint8 *data, int data_len, int *sync_info);
+
+	bool in_use;
+	bool enabled;
+	uint8 handle;
+
+	int properties;
+	int interval;
+	int channel_map;
+	int own_address_type;
+	int peer_address_type;
+	uint64 peer_address;
+	uint64 random_address;
+	PhyModulation primary_phy;
+	PhyModulation secondary_phy;
+	int sid;
+	int did;
+
+	int64 duration;
+	int max_events;
+	int number_of_events;
+	int64 end_of_duration;
+
+	int data_length;
+	uint8 data[maximum_extended_advertising_data_length];
+
+	// the whole event (primary + aux chain) is prebuilt, always into a copy
+	// that is neither the latest nor the one the event in progress uses, so
+	// any number of rebuilds never change an event that is in progress
+	int schedule_index;
+	int schedule_referenced;
+	int number_of_packets[advertising_pdu_copies];
+	AdvertisingEventPacket schedule_packet[advertising_pdu_copies][3 + maximum_number_of_aux_pdus];
+
+	// periodic advertising, the train runs on a state machine of its own and
+	// the AUX_ADV_IND carries the SyncInfo that scanners find it by
+	bool periodic_configured;
+	bool periodic_enabled;
+	int periodic_interval; // 1.25 ms units
+	int periodic_properties;
+	int periodic_data_length;
+	uint8 periodic_data[maximum_periodic_advertising_data_length];
+	uint32 periodic_access_address;
+	uint32 periodic_crc_init;
+	uint16 periodic_channel_identifier;
+	uint64 periodic_channel_map;
+	int periodic_number_of_used_channels;
+	uint8 periodic_used_channel[37];
+
+	// the AUX_SYNC_IND, new data goes into a copy that is neither the latest
+	// nor the one referenced by the packet in flight
+	int periodic_pdu_index;
+	int periodic_pdu_referenced;
+	int periodic_pdu_length[advertising_pdu_copies];
+	uint32 periodic_pdu_crc[advertising_pdu_copies];
+	uint8 periodic_pdu[advertising_pdu_copies][maximum_pdu_length];
+
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ResolvingListEntry
+{
+	int peer_identity_address_type;
+	uint64 peer_identity_address;
+	bool has_peer_irk;
+	bool has_local_irk;
+	AesKey local_irk;
+	uint64 local_rpa;
+	uint64 peer_rpa; // last RPA resolved to this peer
+};
+
+// recently seen random addresses and the resolving list entry they resolved
+// to, -1 when none of the IRKs resolves them
+
+struct ResolvedAddress
+{
+	uint64 address;
+	int entry;
+	uint32 generation;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// per connection state of the LE encryption, the packet counters are the
+// 39 bit counters of the CCM nonce, one for each direction. Each direction
+// is turned on at its own point of the encryption start procedure.
+
+struct LinkEncryption
+{
+	bool tx_enabled;
+	bool rx_enabled;
+	bool master;
+	AesKey session_key;
+	uint8 iv[8];
+	uint64 tx_packet_counter;
+	uint64 rx_packet_counter;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// one HCI ACL data packet from the host, stored as the data channel PDUs it is
+// sent in (each with room for its header and MIC) so that the radio transmits
+// straight out of the buffer
+
+struct AclBuffer
+{
+	AclBuffer *next;
+	int number_of_fragments;
+	uint8 pdu[maximum_fragments_per_acl_packet][maximum_data_pdu_length];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct Connection
+{
+	bool in_use;
+	bool master;
+	int machine;
+	int peer_address_type;
+	uint64 peer_address;
+	int interval; // 1.25 ms units
+	int latency;
+	int supervision_timeout; // 10 ms units
+	int master_clock_accuracy;
+
+	uint32 access_address;
+	uint32 crc_init;
+	int hop_increment;
+	int unmapped_channel;
+	int channel;
+	uint64 channel_map;
+	int number_of_used_channels;
+	uint8 used_channel[37];
+	uint16 event_counter;
+
+	// with CSA#2 the channels of the next events are worked out in batches,
+	// lookahead_channel[0] is the channel of event lookahead_counter
+	bool csa2;
+	uint16 channel_identifier;
+	uint16 lookahead_counter;
+	int lookahead_length;
+	uint8 lookahead_channel[channel_lookahead_length];
+
+	Connection_SubStates substate;
+	bool event_in_progress;
+	int event_packets_received;
+	int64 anchor; // start of the current or next connection event
+	int64 next_time; // next transmission or start of the next receive window
+	int64 window_end;
+	int64 last_received;
+	int rssi; // of the last packet received
+	bool established;
+
+	// acknowledgement, tx_pdu is the PDU sent and not yet acknowledged, it is
+	// one of empty_pdu, control_pdu, terminate_pdu or a fragment of the
+	// AclBuffer at the head of the queue
+	uint8 sn;
+	uint8 nesn;
+	bool peer_more_data;
+	bool more_data;
+	uint8 *tx_pdu;
+	AclBuffer *tx_queue_head;
+	AclBuffer *tx_queue_tail;
+	int tx_fragment;
+	uint8 empty_pdu[2];
+	uint8 control_pdu[maximum_data_pdu_length];
+	bool control_pending;
+
+	uint8 terminate_pdu[4 + ccm_mic_length];
+	bool terminate_sent;
+	bool terminate_received;
+	int terminate_reason;
+
+	// received fragments recombined into one HCI ACL data packet
+	int rx_packet_boundary;
+	int rx_length;
+	uint8 rx_data[le_acl_data_packet_length];
+
+	// the encryption start procedure, encryption_pdus_due has bit (1 << opcode)
+	// set for each LL control PDU owed to the peer, built in opcode order as
+	// control_pdu comes free
+	Encryption_SubStates encryption_substate;
+	uint32 encryption_pdus_due;
+	int encryption_reject_reason;
+	uint8 encryption_rand[8];
+	uint8 encryption_ediv[2];
+	uint8 encryption_ltk[16];
+	uint8 encryption_skd[16]; // SKDm || SKDs
+	uint8 encryption_iv[8]; // IVm || IVs
+	LinkEncryption encryption;
+
+	// a new encrypted PDU, decrypted along with the others that complete in
+	// the same step of the simulation before any of them is delivered
+	bool rx_pdu_decrypted;
+	bool rx_pdu_authenticated;
+	uint8 rx_pdu[maximum_data_pdu_length];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// a periodic advertising train that a scanner has synchronised to, the
+// receiver only listens around the AUX_SYNC_IND it expects next
+
+struct PeriodicSync
+{
+	bool in_use;
+	bool established;
+	bool reports_enabled;
+	int machine;
+	int sid;
+	int address_type;
+	uint64 address;
+	PhyModulation modulation;
+	int interval; // 1.25 ms units
+	int skip;
+	int sync_timeout; // 10 ms units
+	int clock_accuracy;
+
+	uint32 access_address;
+	uint32 crc_init;
+	uint16 channel_identifier;
+	uint64 channel_map;
+	int number_of_used_channels;
+	uint8 used_channel[37];
+
+	uint16 event_counter;
+	int64 anchor; // earliest start of the AUX_SYNC_IND of event_counter
+	int window_widening; // uncertainty in the anchor, either side
+	int events_waited; // before the first AUX_SYNC_IND was received
+	int64 last_received;
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -189,7 +734,12 @@ public:
 
 	void mk_idle (void);
 	void mk_advertiser (int64 after);
+	void mk_extended_advertiser (int64 after, int set);
 	void mk_scanner (int64 after);
+	void mk_initiator (int64 after);
+	void mk_connection (int connection, bool master);
+	void mk_periodic_advertiser (int64 after, int set);
+	void mk_synchronized (int sync);
 
 	int64 determine_next_packet_time (void);
 	PhysicalPacket *create_next_packet (void);
@@ -198,6 +748,11 @@ private:
 
 	LinkLayerState state;
 
+	// arbitration, the number of events in a row this machine has lost the
+	// radio for and the end of the last one counted as pre-empted
+	int starvation;
+	int64 preempted_event_end;
+
 	union
 	{
 		struct
@@ -206,6 +761,11 @@ private:
 			int64 ll_next_advertising_instant; // when is the next 0
 			int64 ll_next_advertising_tx; // when is the next transmission
 			int ll_advertising_channel; // 0, 1, 2 ... interval ... 0, 1, 2 ... 
+			int ll_advertising_set; // -1 for legacy advertising
+			int ll_advertising_schedule; // which prebuilt event is in progress
+			int64 ll_advertising_event_start;
+			int64 ll_request_window_end; // listening for a CONNECT_IND after ADV_IND
+			int ll_request_channel;
 		} adv;
 
 		struct
@@ -213,7 +773,32 @@ private:
 			Scanning_SubStates substate;
 			int64 ll_next_scanning_instant;
 			int ll_scanning_channel;
+			int ll_scanning_phy; // index into ll_scan_phy_* for the next window
+			int64 ll_window_end; // a window cut short by a received packet is resumed
+			int ll_window_channel;
+			PhyModulation ll_window_modulation;
+			int64 ll_aux_start; // when the next AUX_ADV_IND / AUX_CHAIN_IND is due
+			int ll_aux_window;
+			int ll_aux_channel;
+			PhyModulation ll_aux_modulation;
 		} scan;
+
+		struct
+		{
+			int ll_connection;
+		} conn;
+
+		struct
+		{
+			int ll_advertising_set;
+			int64 ll_next_event; // start of the next AUX_SYNC_IND
+			uint16 ll_event_counter;
+		} per;
+
+		struct
+		{
+			int ll_sync;
+		} sync;
 	};
 
 };
@@ -238,6 +823,8 @@ public:
 	uint64 ll_get_extended_features (uint8 page_number);
 	uint64 ll_get_le_features (void);
 	void ll_set_host_supports (int le_supported_host, int simultaneous_le_host);
+	void ll_set_host_le_event_mask (uint64 mask);
+	bool ll_host_wants_le_event (int subevent) { return (ll_host_le_event_mask >> (subevent - 1)) & 1; };
 	int ll_get_maximum_number_of_white_list_entries (void);
 	uint64 ll_get_supported_states (void);
 	void ll_set_advertising_parameters (int advertising_interval_min, int advertising_interval_max, int advertising_type, int own_address_type, int direct_address_type, uint64 direct_address, int advertising_channel_map, int advertising_filter_policy);
@@ -246,17 +833,122 @@ public:
 	bool ll_set_advertising_enable (int enable);
 	void ll_set_scan_parameters (int scan_type, int scan_interval, int scan_window, int own_address_type, int scanning_filter_policy);
 	bool ll_set_scan_enable (int enable, int filter_duplicates);
+	int ll_set_default_phy (int all_phys, int tx_phys, int rx_phys);
+
+	int ll_set_extended_advertising_parameters (int handle, int properties, int interval, int channel_map, int own_address_type, int peer_address_type, uint64 peer_address, int primary_phy, int secondary_phy, int sid);
+	int ll_set_extended_advertising_data (int handle, int operation, int len, const uint8 *data);
+	int ll_set_extended_advertising_enable (int enable, int handle, int duration, int max_events);
+	int ll_remove_advertising_set (int handle);
+	int ll_clear_advertising_sets (void);
+	int ll_get_number_of_advertising_sets (void);
+	int ll_set_extended_scan_parameters (int own_address_type, int scanning_filter_policy, int scanning_phys, int number_of_phys, const int *scan_type, const int *scan_interval, const int *scan_window);
+	bool ll_set_extended_scan_enable (int enable, int filter_duplicates);
+
+	int ll_set_periodic_advertising_parameters (int handle, int interval_min, int interval_max, int properties);
+	int ll_set_periodic_advertising_data (int handle, int operation, int len, const uint8 *data);
+	int ll_set_periodic_advertising_enable (int enable, int handle);
+	int ll_periodic_advertising_create_sync (int options, int sid, int address_type, uint64 address, int skip, int sync_timeout);
+	int ll_periodic_advertising_create_sync_cancel (void);
+	int ll_periodic_advertising_terminate_sync (int handle);
+
+	int ll_set_random_address (uint64 address);
+	int ll_set_advertising_set_random_address (int handle, uint64 address);
+	int ll_add_device_to_resolving_list (int peer_identity_address_type, uint64 peer_identity_address, const uint8 *peer_irk, const uint8 *local_irk);
+	int ll_remove_device_from_resolving_list (int peer_identity_address_type, uint64 peer_identity_address);
+	int ll_clear_resolving_list (void);
+	int ll_get_resolving_list_size (void);
+	int ll_read_peer_resolvable_address (int peer_identity_address_type, uint64 peer_identity_address, uint64 *address);
+	int ll_read_local_resolvable_address (int peer_identity_address_type, uint64 peer_identity_address, uint64 *address);
+	int ll_set_address_resolution_enable (int enable);
+	int ll_set_resolvable_private_address_timeout (int seconds);
+
+	void ll_encrypt (const uint8 *key, const uint8 *plaintext, uint8 *encrypted);
+	void ll_rand (uint8 *random);
+	static void ll_start_link_encryption (LinkEncryption *link, bool master, const uint8 *ltk, const uint8 *skd, const uint8 *iv);
+	static void ll_encrypt_data_pdus (LinkEncryption *const *link, uint8 *const *pdu, int count);
+	static int ll_decrypt_data_pdus (LinkEncryption *const *link, uint8 *const *pdu, int count, bool *authenticated);
+
+	int ll_create_connection (int scan_interval, int scan_window, int filter_policy, int peer_address_type, uint64 peer_address, int own_address_type, int interval, int latency, int supervision_timeout);
+	int ll_create_connection_cancel (void);
+	int ll_disconnect (int handle, int reason);
+	int ll_read_rssi (int handle, int *rssi);
+	int ll_start_encryption (int handle, const uint8 *rand, const uint8 *ediv, const uint8 *ltk);
+	int ll_long_term_key_request_reply (int handle, const uint8 *ltk);
+	int ll_long_term_key_request_negative_reply (int handle);
+	bool ll_queue_acl_data (int handle, int packet_boundary, int len, const uint8 *data);
 
 	virtual PhysicalPacket *get_next_packet (int64 after);
-	void end_of_packet (PhysicalPacket *packet, int64 when, int rx_len, uint8 *rx_data);
-
-	virtual void send_le_advertising_report_event (int rx_len, uint8 *rx_data) = 0;
+	void end_of_packet (PhysicalPacket *packet, int64 when, int rx_len, const uint8 *rx_data);
+	void ll_prepare_received_pdu (PhysicalPacket *packet, int rx_len, const uint8 *rx_data);
+	static void ll_decrypt_received_pdus (void);
+
+	static uint64 ll_get_total_missed_events (void);
+	static uint64 ll_get_total_preempted_events (LinkLayerState role);
+
+	virtual void send_le_advertising_report_event (int64 when, int event_type, int address_type, uint64 address, int rssi, int data_len, const uint8 *data) = 0;
+	virtual void send_le_extended_advertising_report_event (int64 when, int event_type, int address_type, uint64 address, int primary_phy, int secondary_phy, int sid, int rssi, int data_len, const uint8 *data) = 0;
+	virtual void send_le_advertising_set_terminated_event (int status, int handle, int number_of_events) = 0;
+	virtual void flush_le_advertising_reports (void) = 0;
+	virtual void send_le_connection_complete_event (int status, int handle, int role, int peer_address_type, uint64 peer_address, int interval, int latency, int supervision_timeout, int master_clock_accuracy) = 0;
+	virtual void send_disconnection_complete_event (int status, int handle, int reason) = 0;
+	virtual void send_encryption_change_event (int status, int handle, int enabled) = 0;
+	virtual void send_le_long_term_key_request_event (int handle, const uint8 *rand, const uint8 *ediv) = 0;
+	virtual void send_number_of_completed_packets_event (int64 when, int handle, int count) = 0;
+	virtual void send_data_buffer_overflow_event (void) = 0;
+	virtual void send_acl_data (int handle, int packet_boundary, int len, const uint8 *data) = 0;
+	virtual void send_le_periodic_advertising_sync_established_event (int status, int handle, int sid, int address_type, uint64 address, int phy, int interval, int clock_accuracy) = 0;
+	virtual void send_le_periodic_advertising_report_event (int handle, int rssi, int data_status, int data_len, const uint8 *data) = 0;
+	virtual void send_le_periodic_advertising_sync_lost_event (int handle) = 0;
 
 	virtual void set_delete_ready (void) = 0;
 	virtual bool is_delete_pending (void) = 0;
 
 private:
 
+	void ll_build_advertising_pdu (void);
+	AdvertisingSet *ll_find_advertising_set (int handle);
+	PhysicalPacket *ll_next_extended_advertising_packet (int index, int64 after);
+	void ll_received_extended_pdu (int index, PhysicalPacket *packet, int64 when, int rx_len, const uint8 *rx_data);
+	void ll_report_legacy_pdu (int64 when, int rssi, int rx_len, const uint8 *rx_data);
+	bool ll_scanning_wanted (void);
+	void ll_restart_scanning (void);
+	void ll_end_of_aux_chain (int index, int64 when, int data_status);
+	void ll_end_of_extended_advertising_event (int index, int64 count);
+	void ll_build_advertising_set (AdvertisingSet *set);
+	uint64 ll_own_address (int own_address_type, int peer_address_type, uint64 peer_address, uint64 random_address, bool *is_random);
+	int ll_find_resolving_list_entry (int peer_identity_address_type, uint64 peer_identity_address);
+	bool ll_resolving_list_in_use (void);
+	int ll_resolve_address (uint64 address);
+	void ll_resolve_peer_address (int *address_type, uint64 *address);
+	void ll_rotate_private_addresses (int64 now);
+	void ll_count_missed_events (int64 count);
+	PhysicalPacket *ll_next_machine_packet (int index, int64 after);
+	bool ll_next_event_window (int index, int64 after, int64 *start, int64 *end);
+	int ll_event_priority (int index, int64 after);
+	int ll_arbitrate (int64 after);
+	PhysicalPacket *ll_next_initiator_packet (int index, int64 after);
+	void ll_initiator_end_of_packet (int index, PhysicalPacket *packet, int64 when, int rx_len, const uint8 *rx_data);
+	void ll_advertiser_end_of_packet (int index, PhysicalPacket *packet, int64 when, int rx_len, const uint8 *rx_data);
+	int ll_open_connection (int index, bool master, int64 when, const uint8 *connect_ind);
+	void ll_close_connection (Connection *connection, int reason);
+	PhysicalPacket *ll_next_connection_packet (int index, int64 after);
+	void ll_connection_end_of_packet (int index, PhysicalPacket *packet, int64 when, int rx_len, const uint8 *rx_data);
+	void ll_connection_received (Connection *connection, int64 when, const uint8 *rx_data);
+	void ll_encryption_received (Connection *connection, int length, const uint8 *payload);
+	void ll_build_encryption_pdu (Connection *connection);
+	static bool ll_check_encryption_sample_data (void);
+	void ll_end_of_connection_event (Connection *connection, int64 when, int64 count);
+	void ll_flush_received_acl_data (Connection *connection);
+	AclBuffer *ll_allocate_acl_buffer (void);
+	void ll_free_acl_buffer (AclBuffer *buffer);
+	PhysicalPacket *ll_next_periodic_advertising_packet (int index, int64 after);
+	void ll_update_sync_info (AdvertisingSet *set, AdvertisingEventPacket *entry, int64 tx);
+	void ll_create_periodic_sync (int64 when, const uint8 *sync_info, int sid, int address_type, uint64 address, PhyModulation modulation);
+	PhysicalPacket *ll_next_synchronized_packet (int index, int64 after);
+	void ll_synchronized_end_of_packet (int index, PhysicalPacket *packet, int64 when, int rx_len, const uint8 *rx_data);
+	void ll_end_of_sync_event (PeriodicSync *sync, int64 when, int64 count);
+	void ll_close_periodic_sync (PeriodicSync *sync);
+
 	int64 last_clock;
 
 	uint64 ll_bd_addr;
@@ -281,6 +973,29 @@ private:
 	int ll_scan_response_data_length;
 	char ll_scan_response_data[maximum_scan_response_data_length];
 
+	// the advertising PDU is only rebuilt when the parameters or data change,
+	// always into a copy that is neither the latest nor the one referenced by
+	// the packet in flight, so that packet is never modified underneath
+	int ll_advertising_pdu_index;
+	int ll_advertising_pdu_referenced;
+	uint8 ll_advertising_pdu_length[advertising_pdu_copies];
+	uint8 ll_advertising_pdu[advertising_pdu_copies][maximum_legacy_pdu_length];
+	uint32 ll_advertising_pdu_crc[advertising_pdu_copies];
+
+	AdvertisingSet ll_advertising_set[maximum_number_of_advertising_sets];
+
+	// privacy, the peer IRKs are kept apart from the entries so that a whole
+	// list can be run through ah in one go
+	uint64 ll_random_address;
+	bool ll_address_resolution_enabled;
+	int64 ll_rpa_timeout;
+	int64 ll_rpa_expiry;
+	int ll_resolving_list_size;
+	ResolvingListEntry ll_resolving_list[maximum_resolving_list_size];
+	AesKey ll_resolving_peer_irk[maximum_resolving_list_size];
+	uint32 ll_resolving_list_generation;
+	ResolvedAddress ll_resolved_address[resolved_address_cache_size];
+
 	int ll_advertising_enabled;
 
 	int ll_scan_type;
@@ -291,6 +1006,78 @@ private:
 	int ll_scanning_enabled;
 	int ll_scan_filter_duplicates;
 
+	// extended scanning, one set of parameters per primary PHY (1M, Coded)
+	bool ll_scan_extended;
+	int ll_scan_number_of_phys;
+	PhyModulation ll_scan_phy_modulation[2];
+	int ll_scan_phy_interval[2];
+	int ll_scan_phy_window[2];
+
+	// reassembly of the extended advertising data received through an aux chain
+	uint16 ll_aux_adi;
+	int ll_aux_event_type;
+	int ll_aux_address_type;
+	int ll_aux_rssi; // of the last packet of the chain
+	uint64 ll_aux_address;
+	PhyModulation ll_aux_primary_phy;
+	bool ll_aux_have_address;
+	int ll_aux_data_length;
+	uint8 ll_aux_data[maximum_extended_advertising_data_length];
+
+	int ll_default_tx_phys;
+	int ll_default_rx_phys;
+
+	// LE Create Connection, the CONNECT_IND is built when the advertiser is heard
+	bool ll_initiating;
+	int ll_initiator_scan_interval;
+	int ll_initiator_scan_window;
+	int ll_initiator_peer_address_type;
+	uint64 ll_initiator_peer_address;
+	int ll_initiator_own_address_type;
+	int ll_initiator_interval;
+	int ll_initiator_latency;
+	int ll_initiator_supervision_timeout;
+	int64 ll_connect_ind_time;
+	int ll_connect_ind_channel;
+	uint8 ll_connect_ind[2 + 34];
+	uint32 ll_connect_ind_crc;
+	bool ll_connect_ind_csa2; // the advertiser set ChSel as well
+
+	Connection ll_connection[maximum_number_of_connections];
+
+	// the LE ACL data buffers, the number free is what the host is allowed
+	// to have outstanding
+	AclBuffer ll_acl_buffer[total_num_le_acl_data_packets];
+	AclBuffer *ll_acl_free_list;
+
+	// LE Periodic Advertising Create Sync waits for an AUX_ADV_IND from the
+	// advertiser with a SyncInfo in it
+	bool ll_sync_pending;
+	int ll_sync_options;
+	int ll_sync_sid;
+	int ll_sync_address_type;
+	uint64 ll_sync_address;
+	int ll_sync_skip;
+	int ll_sync_timeout;
+
+	PeriodicSync ll_periodic_sync[maximum_number_of_periodic_syncs];
+
+	// the LE subevents that get through both of the host's event masks, so
+	// that nothing is received or built only to be filtered by the HCI
+	uint64 ll_host_le_event_mask;
+
+	// LE Encryption is only offered if the cipher gave the sample data of the
+	// specification
+	bool ll_encryption_supported;
+
+	// advertising, scanning and connection events that started too late and
+	// were skipped, over all controllers
+	static uint64 ll_total_missed_events;
+
+	// events that lost the radio to an overlapping event of a higher
+	// priority, by the role of the machine, over all controllers
+	static uint64 ll_total_preempted_events[number_of_link_layer_states];
+
 	int last_machine;
 	LinkLayerStateMachine machine[maximum_number_of_link_layer_state_machines];
 
@@ -316,6 +1103,7 @@ public:
 	void hci_read_local_extended_features_command (int parameter_len, char *parameters);
 	void hci_read_buffer_size_command (int parameter_len, char *parameters);
 	void hci_read_bd_addr_command (int parameter_len, char *parameters);
+	void hci_read_rssi_command (int parameter_len, char *parameters);
 	void hci_le_set_event_mask_command (int parameter_len, char *parameters);
 	void hci_le_read_buffer_size_command (int parameter_len, char *parameters);
 	void hci_le_read_local_supported_features_command (int parameter_len, char *parameters);
@@ -328,27 +1116,113 @@ public:
 	void hci_le_set_scan_enable_command (int parameter_len, char *parameters);
 	void hci_le_read_white_list_size_command (int parameter_len, char *parameters);
 	void hci_le_read_supported_states_command (int parameter_len, char *parameters);
+	void hci_le_set_default_phy_command (int parameter_len, char *parameters);
+	void hci_le_set_extended_advertising_parameters_command (int parameter_len, char *parameters);
+	void hci_le_set_extended_advertising_data_command (int parameter_len, char *parameters);
+	void hci_le_set_extended_scan_response_data_command (int parameter_len, char *parameters);
+	void hci_le_set_extended_advertising_enable_command (int parameter_len, char *parameters);
+	void hci_le_read_maximum_advertising_data_length_command (int parameter_len, char *parameters);
+	void hci_le_read_number_of_supported_advertising_sets_command (int parameter_len, char *parameters);
+	void hci_le_remove_advertising_set_command (int parameter_len, char *parameters);
+	void hci_le_clear_advertising_sets_command (int parameter_len, char *parameters);
+	void hci_le_set_extended_scan_parameters_command (int parameter_len, char *parameters);
+	void hci_le_set_extended_scan_enable_command (int parameter_len, char *parameters);
+	void hci_le_set_periodic_advertising_parameters_command (int parameter_len, char *parameters);
+	void hci_le_set_periodic_advertising_data_command (int parameter_len, char *parameters);
+	void hci_le_set_periodic_advertising_enable_command (int parameter_len, char *parameters);
+	void hci_le_periodic_advertising_create_sync_command (int parameter_len, char *parameters);
+	void hci_le_periodic_advertising_create_sync_cancel_command (int parameter_len, char *parameters);
+	void hci_le_periodic_advertising_terminate_sync_command (int parameter_len, char *parameters);
+	void hci_vs_set_tx_power_command (int parameter_len, char *parameters);
+	void hci_vs_set_position_command (int parameter_len, char *parameters);
+	void hci_vs_set_clock_drift_command (int parameter_len, char *parameters);
+	void hci_vs_set_link_packet_loss_command (int parameter_len, char *parameters);
+	void hci_vs_set_btsnoop_capture_command (int parameter_len, char *parameters);
+	void hci_le_set_random_address_command (int parameter_len, char *parameters);
+	void hci_le_add_device_to_resolving_list_command (int parameter_len, char *parameters);
+	void hci_le_remove_device_from_resolving_list_command (int parameter_len, char *parameters);
+	void hci_le_clear_resolving_list_command (int parameter_len, char *parameters);
+	void hci_le_read_resolving_list_size_command (int parameter_len, char *parameters);
+	void hci_le_read_peer_resolvable_address_command (int parameter_len, char *parameters);
+	void hci_le_read_local_resolvable_address_command (int parameter_len, char *parameters);
+	void hci_le_set_address_resolution_enable_command (int parameter_len, char *parameters);
+	void hci_le_set_resolvable_private_address_timeout_command (int parameter_len, char *parameters);
+	void hci_le_set_advertising_set_random_address_command (int parameter_len, char *parameters);
+	void hci_le_encrypt_command (int parameter_len, char *parameters);
+	void hci_le_rand_command (int parameter_len, char *parameters);
+	void hci_le_start_encryption_command (int parameter_len, char *parameters);
+	void hci_le_long_term_key_request_reply_command (int parameter_len, char *parameters);
+	void hci_le_long_term_key_request_negative_reply_command (int parameter_len, char *parameters);
+	void hci_le_create_connection_command (int parameter_len, char *parameters);
+	void hci_le_create_connection_cancel_command (int parameter_len, char *parameters);
+	void hci_disconnect_command (int parameter_len, char *parameters);
 	void hci_unsupported_command (int opcode);
 	
 	void process_command (int opcode, int parameter_len, char *parameters);
 
+	// counters for the status page, false once index is past the last command
+	static bool hci_get_command_statistics (int index, int *opcode, uint64 *count, uint64 *total_time, uint64 *maximum_time);
+	void process_acl_data (int handle, int packet_boundary, int len, const char *data);
+
 	virtual void write_data (char *buffer, int len) = 0;
+	virtual void write_data (const char *header, int header_len, const char *data, int len) = 0;
+	virtual char *reserve_write (int len) = 0;
+	virtual void commit_write (int len) = 0;
+	virtual bool set_btsnoop_capture (bool enable) = 0;
+	char *reserve_event (int opcode, int parameter_len);
+	void commit_event (char *parameters);
 	void send_event (int opcode, int parameter_len, char *parameters);
 	void send_command_complete_event (int command_opcode, int parameter_len, char *parameters);
-
-	virtual void send_le_advertising_report_event (int rx_len, uint8 *rx_data);
+	void send_command_status_event (int command_opcode, int status);
+
+	virtual void send_le_advertising_report_event (int64 when, int event_type, int address_type, uint64 address, int rssi, int data_len, const uint8 *data);
+	virtual void send_le_extended_advertising_report_event (int64 when, int event_type, int address_type, uint64 address, int primary_phy, int secondary_phy, int sid, int rssi, int data_len, const uint8 *data);
+	virtual void send_le_advertising_set_terminated_event (int status, int handle, int number_of_events);
+	virtual void send_le_periodic_advertising_sync_established_event (int status, int handle, int sid, int address_type, uint64 address, int phy, int interval, int clock_accuracy);
+	virtual void send_le_periodic_advertising_report_event (int handle, int rssi, int data_status, int data_len, const uint8 *data);
+	virtual void send_le_periodic_advertising_sync_lost_event (int handle);
+	virtual void flush_le_advertising_reports (void);
+	virtual void send_le_connection_complete_event (int status, int handle, int role, int peer_address_type, uint64 peer_address, int interval, int latency, int supervision_timeout, int master_clock_accuracy);
+	virtual void send_disconnection_complete_event (int status, int handle, int reason);
+	virtual void send_encryption_change_event (int status, int handle, int enabled);
+	virtual void send_le_long_term_key_request_event (int handle, const uint8 *rand, const uint8 *ediv);
+	virtual void send_number_of_completed_packets_event (int64 when, int handle, int count);
+	virtual void send_data_buffer_overflow_event (void);
+	virtual void send_acl_data (int handle, int packet_boundary, int len, const uint8 *data);
+	void set_advertising_report_window (int64 window);
+	static void set_default_advertising_report_window (int64 window);
+	void flush_number_of_completed_packets (void);
+	void set_completed_packets_window (int64 window);
+	void set_completed_packets_threshold (int threshold);
+	static void set_default_completed_packets_window (int64 window);
+	static void set_default_completed_packets_threshold (int threshold);
+	static void set_default_num_hci_command_packets (int packets);
+
+	virtual void on_timer (int64 when);
 
 	uint8 hci_get_version (void);
 	uint16 hci_get_revision (void);
 	uint16 hci_get_manufacturer (void);
 
 private:
+	bool hci_event_wanted (int opcode);
+	void hci_update_le_event_mask (void);
+	char *reserve_advertising_report (int subevent, int report_len);
+	void commit_advertising_report (int64 when, int report_len);
+
+	// the command window advertised to the host in every Command Complete and
+	// Command Status
+	static int default_num_hci_command_packets;
 	int num_hci_command_packets;
 	uint64 hci_event_mask;
 	uint64 hci_le_event_mask;
 
 	uint8 hci_supported_commands[64];
 
+	// whether the host has used the legacy or the extended advertising
+	// commands since the last reset, either excludes the other
+	int hci_advertising_commands;
+
 	int hci_le_acl_data_packet_length;
 	int hci_total_num_le_acl_data_packets;
 
@@ -357,6 +1231,27 @@ private:
 	int hci_total_num_acl_data_packets;
 	int hci_total_num_synchronous_data_packets;
 
+	// advertising reports are coalesced into one LE Meta event for up to
+	// hci_advertising_report_window, the first two octets are the event header,
+	// legacy and extended reports never share an event
+	static int64 default_advertising_report_window;
+	int64 hci_advertising_report_window;
+	int64 hci_advertising_report_first;
+	int hci_advertising_report_count;
+	int hci_advertising_report_length;
+	char hci_advertising_report_buffer[maximum_hci_event_parameter_length];
+
+	// completed packets are counted per connection handle and reported in one
+	// Number Of Completed Packets event after hci_completed_packets_window or
+	// once hci_completed_packets_threshold packets have completed
+	static int64 default_completed_packets_window;
+	static int default_completed_packets_threshold;
+	int64 hci_completed_packets_window;
+	int hci_completed_packets_threshold;
+	int64 hci_completed_packets_first;
+	int hci_completed_packets_total;
+	int hci_completed_packets[maximum_number_of_connections];
+
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -364,6 +1259,7 @@ private:
 const uint8 HCI_COMMAND = 0x01;
 const uint8 HCI_DATA = 0x02;
 const uint8 HCI_EVENT = 0x04;
+const uint8 HCI_ISO_DATA = 0x05;
 
 class Controller : public ClientSocket, public LowerHCI
 {
@@ -374,10 +1270,75 @@ public:
 
 	virtual void on_readable (void);
 	virtual void write_data (char *buffer, int len);
+	virtual void write_data (const char *header, int header_len, const char *data, int len);
+	virtual char *reserve_write (int len);
+	virtual void commit_write (int len);
+	virtual bool set_btsnoop_capture (bool enable);
+
+	virtual void set_delete_ready (void);
+	virtual bool is_delete_pending (void);
+
+	virtual void flush_output (void);
+
+private:
+
+	int h4_header_length (int packet_type);
+	int h4_payload_length (const char *frame);
+	void h4_process_frame (const char *frame);
+
+	// the frame at the start of the read buffer, its length is known once
+	// the header is in and is zero until then
+	int h4_header_len;
+	int h4_frame_len;
+
+	// everything to and from the host, while capture is on
+	BtSnoop snoop;
+	char *reserved_write;
+
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+// a controller whose host is in the same process, see b1ee.h
+
+class EmbeddedController : public LowerHCI
+{
+public:
+
+	EmbeddedController (uint64 bd_addr, B1eeHostCallback callback, void *context);
+	virtual ~EmbeddedController ();
+
+	void send_packet (const uint8 *packet, int len);
+	void set_delete_pending (void);
+	void wait_until_delete_ready (void);
+
+	virtual void write_data (char *buffer, int len);
+	virtual void write_data (const char *header, int header_len, const char *data, int len);
+	virtual char *reserve_write (int len);
+	virtual void commit_write (int len);
+	virtual bool set_btsnoop_capture (bool enable);
 
 	virtual void set_delete_ready (void);
 	virtual bool is_delete_pending (void);
 
+private:
+
+	B1eeHostCallback host_callback;
+	void *host_context;
+
+	// held from reserve_write to commit_write, packets for the host are
+	// built here from both the host's thread and the simulation thread
+	pthread_mutex_t packet_mutex;
+	char *packet_buffer;
+	int packet_buffer_size;
+
+	pthread_mutex_t delete_mutex;
+	pthread_cond_t delete_cond;
+	std::atomic<bool> delete_pending; // looked at by the simulation thread on every packet
+	bool delete_ready;
+
+	BtSnoop snoop;
+
 };
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,311 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "controller.h"
+#include "log.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+static pthread_once_t b1ee_once = PTHREAD_ONCE_INIT;
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void b1ee_start (void)
+{
+	start_physical_layer_simulation ();
+	BtSnoop::start_writer ();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void b1ee_initialise (void)
+{
+	pthread_once (&b1ee_once, b1ee_start);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+EmbeddedController *b1ee_open (uint64 bd_addr, B1eeHostCallback callback, void *context)
+{
+	EmbeddedController *controller;
+
+
+	controller = new EmbeddedController (bd_addr, callback, context);
+	controller->mk_active ();
+
+	return controller;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void b1ee_send (EmbeddedController *controller, const uint8 *packet, int len)
+{
+	controller->send_packet (packet, len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void b1ee_close (EmbeddedController *controller)
+{
+	b1ee_close (&controller, 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void b1ee_close (EmbeddedController **controllers, int count)
+{
+	for (int index = 0; index < count; index ++)
+	{
+		controllers[index]->set_delete_pending ();
+	}
+
+	for (int index = 0; index < count; index ++)
+	{
+		controllers[index]->wait_until_delete_ready ();
+
+		delete controllers[index];
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+EmbeddedController::EmbeddedController (uint64 bd_addr, B1eeHostCallback callback, void *context)
+{
+	log (LOG_CONTROLLER, "EmbeddedController");
+
+	host_callback = callback;
+	host_context = context;
+
+	pthread_mutex_init (&packet_mutex, NULL);
+	packet_buffer = 0;
+	packet_buffer_size = 0;
+
+	pthread_mutex_init (&delete_mutex, NULL);
+	pthread_cond_init (&delete_cond, NULL);
+	delete_pending = false;
+	delete_ready = false;
+
+	ll_set_bd_addr (bd_addr & 0xFFFFFFFFFFFFUL);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+EmbeddedController::~EmbeddedController ()
+{
+	log (LOG_CONTROLLER, "~EmbeddedController");
+
+	free (packet_buffer);
+
+	pthread_mutex_destroy (&packet_mutex);
+	pthread_mutex_destroy (&delete_mutex);
+	pthread_cond_destroy (&delete_cond);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// one whole H4 frame, anything that is not is dropped, there is no stream to
+// lose framing on
+
+void EmbeddedController::send_packet (const uint8 *packet, int len)
+{
+	int parameter_len;
+
+
+	if (snoop.is_open ())
+	{
+		snoop.capture (false, (const char *) packet, len);
+	}
+
+	if ((len >= 4) && (packet[0] == HCI_COMMAND))
+	{
+		parameter_len = packet[3];
+
+		if (len == 4 + parameter_len)
+		{
+			process_command (packet[1] | (packet[2] << 8), parameter_len, (parameter_len == 0) ? 0 : (char *) &packet[4]);
+			return;
+		}
+	}
+	else if ((len >= 5) && (packet[0] == HCI_DATA))
+	{
+		parameter_len = packet[3] | (packet[4] << 8);
+
+		if (len == 5 + parameter_len)
+		{
+			process_acl_data (packet[1] | ((packet[2] & 0x0F) << 8), (packet[2] >> 4) & 0x03, parameter_len, (const char *) &packet[5]);
+			return;
+		}
+	}
+
+	log (LOG_ERROR, "EmbeddedController invalid packet %02X (%d)", (len > 0) ? packet[0] : 0, len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the simulation thread notices delete_pending the next time it asks this
+// controller for a packet, and says so through set_delete_ready
+
+void EmbeddedController::set_delete_pending (void)
+{
+	delete_pending = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void EmbeddedController::wait_until_delete_ready (void)
+{
+	pthread_mutex_lock (&delete_mutex);
+
+	while (!delete_ready)
+	{
+		pthread_cond_wait (&delete_cond, &delete_mutex);
+	}
+
+	pthread_mutex_unlock (&delete_mutex);
+
+	snoop.close ();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void EmbeddedController::set_delete_ready (void)
+{
+	pthread_mutex_lock (&delete_mutex);
+
+	if (!delete_ready)
+	{
+		delete_ready = true;
+		pthread_cond_signal (&delete_cond);
+	}
+
+	pthread_mutex_unlock (&delete_mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool EmbeddedController::is_delete_pending (void)
+{
+	return delete_pending.load (std::memory_order_relaxed);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void EmbeddedController::write_data (char *buffer, int len)
+{
+	write_data (buffer, len, 0, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void EmbeddedController::write_data (const char *header, int header_len, const char *data, int len)
+{
+	char *buffer;
+
+
+	buffer = reserve_write (header_len + len);
+
+	if (!buffer)
+	{
+		return;
+	}
+
+	memcpy (buffer, header, header_len);
+
+	if (len > 0)
+	{
+		memcpy (&buffer[header_len], data, len);
+	}
+
+	commit_write (header_len + len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// packets are handed over one at a time, so the buffer only ever holds the
+// one being built
+
+char *EmbeddedController::reserve_write (int len)
+{
+	char *buffer;
+
+
+	pthread_mutex_lock (&packet_mutex);
+
+	if (packet_buffer_size < len)
+	{
+		buffer = (char *) realloc (packet_buffer, len);
+
+		if (!buffer)
+		{
+			log (LOG_ERROR, "EmbeddedController::reserve_write no memory for %d", len);
+			pthread_mutex_unlock (&packet_mutex);
+			return 0;
+		}
+
+		packet_buffer = buffer;
+		packet_buffer_size = len;
+	}
+
+	return packet_buffer;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void EmbeddedController::commit_write (int len)
+{
+	if (snoop.is_open ())
+	{
+		snoop.capture (true, packet_buffer, len);
+	}
+
+	host_callback (host_context, (const uint8 *) packet_buffer, len);
+
+	pthread_mutex_unlock (&packet_mutex);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool EmbeddedController::set_btsnoop_capture (bool enable)
+{
+	if (!enable)
+	{
+		snoop.close ();
+		return true;
+	}
+
+	return snoop.open (ll_get_bd_addr ());
+}
+
+////////////////////////////////////////////////////////////////////////////////
@@ -32,6 +32,7 @@
 ////////////////////////////////////////////////////////////////////////////////
 // HCI Command Opcodes
 
+#define HCI_DISCONNECT_COMMAND                                 OGCF(0x01,0x0006)
 #define HCI_SET_EVENT_MASK_COMMAND                             OGCF(0x03,0x0001)
 #define HCI_RESET_COMMAND                                      OGCF(0x03,0x0003)
 #define HCI_WRITE_LE_HOST_SUPPORTED_COMMAND                    OGCF(0x03,0x006D)
@@ -41,9 +42,11 @@
 #define HCI_READ_LOCAL_EXTENDED_FEATURES_COMMAND               OGCF(0x04,0x0004)
 #define HCI_READ_BUFFER_SIZE_COMMAND                           OGCF(0X04,0X0005)
 #define HCI_READ_BD_ADDR_COMMAND                               OGCF(0x04,0x0009)
+#define HCI_READ_RSSI_COMMAND                                  OGCF(0x05,0x0005)
 #define HCI_LE_SET_EVENT_MASK_COMMAND                          OGCF(0x08,0x0001)
 #define HCI_LE_READ_BUFFER_SIZE_COMMAND                        OGCF(0x08,0x0002)
 #define HCI_LE_READ_LOCAL_SUPPORTED_FEATURES_COMMAND           OGCF(0x08,0x0003)
+#define HCI_LE_SET_RANDOM_ADDRESS_COMMAND                      OGCF(0x08,0x0005)
 #define HCI_LE_SET_ADVERTISING_PARAMETERS_COMMAND              OGCF(0x08,0x0006)
 #define HCI_LE_READ_ADVERTISING_CHANNEL_TX_POWER_COMMAND       OGCF(0x08,0x0007)
 #define HCI_LE_SET_ADVERTISING_DATA_COMMAND                    OGCF(0x08,0x0008)
@@ -51,15 +54,59 @@
 #define HCI_LE_SET_ADVERTISE_ENABLE_COMMAND                    OGCF(0x08,0x000A)
 #define HCI_LE_SET_SCAN_PARAMETERS_COMMAND                     OGCF(0x08,0x000B)
 #define HCI_LE_SET_SCAN_ENABLE_COMMAND                         OGCF(0x08,0x000C)
+#define HCI_LE_CREATE_CONNECTION_COMMAND                       OGCF(0x08,0x000D)
+#define HCI_LE_CREATE_CONNECTION_CANCEL_COMMAND                OGCF(0x08,0x000E)
 #define HCI_LE_READ_WHITE_LIST_SIZE_COMMAND                    OGCF(0x08,0x000F)
+#define HCI_LE_ENCRYPT_COMMAND                                 OGCF(0x08,0x0017)
+#define HCI_LE_RAND_COMMAND                                    OGCF(0x08,0x0018)
+#define HCI_LE_START_ENCRYPTION_COMMAND                        OGCF(0x08,0x0019)
+#define HCI_LE_LONG_TERM_KEY_REQUEST_REPLY_COMMAND             OGCF(0x08,0x001A)
+#define HCI_LE_LONG_TERM_KEY_REQUEST_NEGATIVE_REPLY_COMMAND    OGCF(0x08,0x001B)
 #define HCI_LE_READ_SUPPORTED_STATES_COMMAND                   OGCF(0x08,0x001C)
+#define HCI_LE_ADD_DEVICE_TO_RESOLVING_LIST_COMMAND            OGCF(0x08,0x0027)
+#define HCI_LE_REMOVE_DEVICE_FROM_RESOLVING_LIST_COMMAND       OGCF(0x08,0x0028)
+#define HCI_LE_CLEAR_RESOLVING_LIST_COMMAND                    OGCF(0x08,0x0029)
+#define HCI_LE_READ_RESOLVING_LIST_SIZE_COMMAND                OGCF(0x08,0x002A)
+#define HCI_LE_READ_PEER_RESOLVABLE_ADDRESS_COMMAND            OGCF(0x08,0x002B)
+#define HCI_LE_READ_LOCAL_RESOLVABLE_ADDRESS_COMMAND           OGCF(0x08,0x002C)
+#define HCI_LE_SET_ADDRESS_RESOLUTION_ENABLE_COMMAND           OGCF(0x08,0x002D)
+#define HCI_LE_SET_RESOLVABLE_PRIVATE_ADDRESS_TIMEOUT_COMMAND  OGCF(0x08,0x002E)
+#define HCI_LE_SET_DEFAULT_PHY_COMMAND                         OGCF(0x08,0x0031)
+#define HCI_LE_SET_ADVERTISING_SET_RANDOM_ADDRESS_COMMAND      OGCF(0x08,0x0035)
+#define HCI_LE_SET_EXTENDED_ADVERTISING_PARAMETERS_COMMAND     OGCF(0x08,0x0036)
+#define HCI_LE_SET_EXTENDED_ADVERTISING_DATA_COMMAND           OGCF(0x08,0x0037)
+#define HCI_LE_SET_EXTENDED_SCAN_RESPONSE_DATA_COMMAND         OGCF(0x08,0x0038)
+#define HCI_LE_SET_EXTENDED_ADVERTISING_ENABLE_COMMAND         OGCF(0x08,0x0039)
+#define HCI_LE_READ_MAXIMUM_ADVERTISING_DATA_LENGTH_COMMAND    OGCF(0x08,0x003A)
+#define HCI_LE_READ_NUMBER_OF_SUPPORTED_ADVERTISING_SETS_COMMAND OGCF(0x08,0x003B)
+#define HCI_LE_REMOVE_ADVERTISING_SET_COMMAND                  OGCF(0x08,0x003C)
+#define HCI_LE_CLEAR_ADVERTISING_SETS_COMMAND                  OGCF(0x08,0x003D)
+#define HCI_LE_SET_PERIODIC_ADVERTISING_PARAMETERS_COMMAND     OGCF(0x08,0x003E)
+#define HCI_LE_SET_PERIODIC_ADVERTISING_DATA_COMMAND           OGCF(0x08,0x003F)
+#define HCI_LE_SET_PERIODIC_ADVERTISING_ENABLE_COMMAND         OGCF(0x08,0x0040)
+#define HCI_LE_SET_EXTENDED_SCAN_PARAMETERS_COMMAND            OGCF(0x08,0x0041)
+#define HCI_LE_SET_EXTENDED_SCAN_ENABLE_COMMAND                OGCF(0x08,0x0042)
+#define HCI_LE_PERIODIC_ADVERTISING_CREATE_SYNC_COMMAND        OGCF(0x08,0x0044)
+#define HCI_LE_PERIODIC_ADVERTISING_CREATE_SYNC_CANCEL_COMMAND OGCF(0x08,0x0045)
+#define HCI_LE_PERIODIC_ADVERTISING_TERMINATE_SYNC_COMMAND     OGCF(0x08,0x0046)
+
+// Vendor specific commands, the radio model of the simulation
+
+#define HCI_VS_SET_TX_POWER_COMMAND                            OGCF(0x3F,0x0001)
+#define HCI_VS_SET_POSITION_COMMAND                            OGCF(0x3F,0x0002)
+#define HCI_VS_SET_CLOCK_DRIFT_COMMAND                         OGCF(0x3F,0x0003)
+#define HCI_VS_SET_LINK_PACKET_LOSS_COMMAND                    OGCF(0x3F,0x0004)
+#define HCI_VS_SET_BTSNOOP_CAPTURE_COMMAND                     OGCF(0x3F,0x0005)
 
 ////////////////////////////////////////////////////////////////////////////////
 // HCI Event Codes
 
+#define DISCONNECTION_COMPLETE_EVENT                                        0x05
+#define ENCRYPTION_CHANGE_EVENT                                             0x08
 #define COMMAND_COMPLETE_EVENT                                              0x0E
 #define COMMAND_STATUS_EVENT                                                0x0F
 #define NUMBER_OF_COMPLETED_PACKETS_EVENT                                   0x13
+#define DATA_BUFFER_OVERFLOW_EVENT                                          0x1A
 #define LE_META_EVENT                                                       0x3E
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -70,6 +117,11 @@
 #define LE_CONNECTION_UPDATE_COMPLETE_EVENT                                 0x03
 #define LE_READ_REMOTE_USED_FEATURES_COMPLETE_EVENT                         0x04
 #define LE_LONG_TERM_KEY_REQUEST_EVENT                                      0x05
+#define LE_EXTENDED_ADVERTISING_REPORT_EVENT                                0x0D
+#define LE_PERIODIC_ADVERTISING_SYNC_ESTABLISHED_EVENT                      0x0E
+#define LE_PERIODIC_ADVERTISING_REPORT_EVENT                                0x0F
+#define LE_PERIODIC_ADVERTISING_SYNC_LOST_EVENT                             0x10
+#define LE_ADVERTISING_SET_TERMINATED_EVENT                                 0x12
 
 ////////////////////////////////////////////////////////////////////////////////
 // HCI Error Codes
@@ -135,5 +187,10 @@
 #define EC_CONNECTION_TERTMINATED_DUE_TO_MIC_FAILURE                        0x3D
 #define EC_CONNECTION_FAILED_TO_BE_ESTABLISHED                              0x3E
 #define EC_MAC_CONNECTION_FAILED                                            0x3F
+#define EC_COARSE_CLOCK_ADJUSTMENT_REJECTED                                 0x40
+#define EC_TYPE0_SUBMAP_NOT_DEFINED                                         0x41
+#define EC_UNKNOWN_ADVERTISING_IDENTIFIER                                   0x42
+#define EC_LIMIT_REACHED                                                    0x43
+#define EC_OPERATION_CANCELLED_BY_HOST                                      0x44
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -33,16 +33,28 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include "controller.h"
+#include "hci.h"
 #include "log.h"
 
+uint64 LinkLayer::ll_total_missed_events = 0;
+
 ////////////////////////////////////////////////////////////////////////////////
 
 LinkLayer::LinkLayer ()
 {
 	log (LOG_LINKLAYER, "LinkLayer::LinkLayer");
 
+	static bool sample_data_checked = ll_check_encryption_sample_data ();
+
+	ll_encryption_supported = sample_data_checked;
+
 	ll_packet = new PhysicalPacket (this);
 
+	ll_bd_addr = 0x000000000000;
+	ll_advertising_pdu_index = 0;
+	ll_advertising_pdu_referenced = 0;
+	ll_host_le_event_mask = 0x000000000000001F;
+
 	reset ();
 }
 
@@ -67,7 +79,17 @@ void LinkLayer::reset (void)
 	lmp_features[0] = 0x00000000000000008000006000000000;
 
 	le_features = 0x00000000000000000000000000000000;
-	ll_supported_states = 0x00000000000000000000000000000037;
+	if (ll_encryption_supported)
+	{
+		le_features |= (1 << 0); // LE Encryption
+	}
+	le_features |= (1 << 6); // LL Privacy
+	le_features |= (1 << 8); // LE 2M PHY
+	le_features |= (1 << 11); // LE Coded PHY
+	le_features |= (1 << 12); // LE Extended Advertising
+	le_features |= (1 << 13); // LE Periodic Advertising
+	le_features |= (1 << 14); // Channel Selection Algorithm #2
+	ll_supported_states = 0x000000000000000000000000000000F7;
 
 	ll_advertising_interval_min = 0x0800;
 	ll_advertising_interval_max = 0x0800;
@@ -84,6 +106,13 @@ void LinkLayer::reset (void)
 	ll_scan_response_data_length = 0x00;
 	memset (ll_scan_response_data, 0, 31);
 
+	ll_advertising_enabled = 0;
+
+	for (int index = 0; index < maximum_number_of_advertising_sets; index ++)
+	{
+		ll_advertising_set[index].reset ();
+	}
+
 	ll_scan_type = 0;
 	ll_scan_interval = 0;
 	ll_scan_window = 0;
@@ -91,6 +120,42 @@ void LinkLayer::reset (void)
 	ll_scanning_filter_policy = 0;
 	ll_scanning_enabled = 0;
 	ll_scan_filter_duplicates = 0;
+
+	ll_scan_extended = false;
+	ll_scan_number_of_phys = 1;
+	ll_scan_phy_modulation[0] = GFSK_LE;
+	ll_scan_phy_interval[0] = 0;
+	ll_scan_phy_window[0] = 0;
+
+	ll_aux_data_length = 0;
+
+	ll_random_address = 0x000000000000;
+	ll_address_resolution_enabled = false;
+	ll_rpa_timeout = default_rpa_timeout;
+	ll_rpa_expiry = 0;
+	ll_resolving_list_size = 0;
+	ll_resolving_list_generation = 1;
+	memset (ll_resolved_address, 0, sizeof (ll_resolved_address));
+
+	ll_default_tx_phys = hci_phy_le_1m | hci_phy_le_2m | hci_phy_le_coded;
+	ll_default_rx_phys = hci_phy_le_1m | hci_phy_le_2m | hci_phy_le_coded;
+
+	ll_initiating = false;
+	ll_connect_ind_csa2 = false;
+
+	memset (ll_connection, 0, sizeof (ll_connection));
+
+	ll_sync_pending = false;
+	memset (ll_periodic_sync, 0, sizeof (ll_periodic_sync));
+
+	ll_acl_free_list = 0;
+
+	for (int index = total_num_le_acl_data_packets - 1; index >= 0; index --)
+	{
+		ll_free_acl_buffer (&ll_acl_buffer[index]);
+	}
+
+	ll_build_advertising_pdu ();
 	
 	for (int index = 0; index < maximum_number_of_link_layer_state_machines; index ++)
 	{
@@ -112,6 +177,18 @@ uint64 LinkLayer::ll_get_bd_addr (void)
 void LinkLayer::ll_set_bd_addr (uint64 bd_addr)
 {
 	ll_bd_addr = bd_addr;
+
+	set_radio_address (bd_addr);
+
+	ll_build_advertising_pdu ();
+
+	for (int index = 0; index < maximum_number_of_advertising_sets; index ++)
+	{
+		if (ll_advertising_set[index].in_use)
+		{
+			ll_build_advertising_set (&ll_advertising_set[index]);
+		}
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -186,6 +263,23 @@ void LinkLayer::ll_set_host_supports (int le_supported_host, int simultaneous_le
 
 ////////////////////////////////////////////////////////////////////////////////
 
+void LinkLayer::ll_set_host_le_event_mask (uint64 mask)
+{
+	bool was_scanning;
+
+
+	was_scanning = ll_scanning_wanted ();
+
+	ll_host_le_event_mask = mask;
+
+	if ((!was_scanning) && (ll_scanning_wanted ()))
+	{
+		ll_restart_scanning ();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 int LinkLayer::ll_get_maximum_number_of_white_list_entries (void)
 {
 	return maximum_number_of_white_list_entries;
@@ -210,6 +304,8 @@ void LinkLayer::ll_set_advertising_parameters (int advertising_interval_min, int
 	ll_direct_address = direct_address;
 	ll_advertising_channel_map = advertising_channel_map;
 	ll_advertising_filter_policy = advertising_filter_policy;
+
+	ll_build_advertising_pdu ();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -225,6 +321,8 @@ void LinkLayer::ll_set_advertising_data (int len, char *data)
 
 	memset (ll_advertising_data, 0, 31);
 	memcpy (ll_advertising_data, data, len);
+
+	ll_build_advertising_pdu ();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -265,7 +363,7 @@ bool LinkLayer::ll_set_advertising_enable (int enable)
 	{
 		for (index = 0; index < maximum_number_of_link_layer_state_machines; index ++)
 		{
-			if (machine[index].state == LLS_Advertising)
+			if ((machine[index].state == LLS_Advertising) && (machine[index].adv.ll_advertising_set < 0))
 			{
 				ll_advertising_enabled = enable;
 
@@ -288,6 +386,12 @@ void LinkLayer::ll_set_scan_parameters (int scan_type, int scan_interval, int sc
 	ll_scan_window = scan_window;
 	ll_scan_own_address_type = own_address_type;
 	ll_scanning_filter_policy = scanning_filter_policy;
+
+	ll_scan_extended = false;
+	ll_scan_number_of_phys = 1;
+	ll_scan_phy_modulation[0] = GFSK_LE;
+	ll_scan_phy_interval[0] = scan_interval;
+	ll_scan_phy_window[0] = scan_window;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -332,10 +436,94 @@ bool LinkLayer::ll_set_scan_enable (int enable, int filter_duplicates)
 
 ////////////////////////////////////////////////////////////////////////////////
 
-PhysicalPacket *LinkLayer::get_next_packet (int64 after)
+void LinkLayer::ll_build_advertising_pdu (void)
 {
-	uint8 buffer[maximum_pdu_length];
+	uint8 *buffer;
 	uint8 length;
+	int next_index;
+	uint64 adva;
+	bool adva_is_random;
+
+
+	adva = ll_own_address (ll_advertising_own_address_type, ll_direct_address_type, ll_direct_address, ll_random_address, &adva_is_random);
+
+	// build into the copy that is neither the latest nor referenced by the
+	// current packet, the caller holds the mutex so neither can move meanwhile
+
+	next_index = 0;
+	while ((next_index == ll_advertising_pdu_index) || (next_index == ll_advertising_pdu_referenced))
+	{
+		next_index ++;
+	}
+
+	buffer = ll_advertising_pdu[next_index];
+
+	buffer[0] = PDU_ADV_IND | PDU_CHSEL | (adva_is_random ? PDU_TXADD : 0);
+	buffer[1] = 6 + ll_advertising_data_length;
+	buffer[2] = (adva >> 0) & 0xFF;
+	buffer[3] = (adva >> 8) & 0xFF;
+	buffer[4] = (adva >> 16) & 0xFF;
+	buffer[5] = (adva >> 24) & 0xFF;
+	buffer[6] = (adva >> 32) & 0xFF;
+	buffer[7] = (adva >> 40) & 0xFF;
+	length = 8;
+	if (ll_advertising_data_length > 0)
+	{
+		memcpy (&buffer[length], ll_advertising_data, ll_advertising_data_length);
+		length = 8 + ll_advertising_data_length;
+	}
+
+	ll_advertising_pdu_length[next_index] = length;
+	ll_advertising_pdu_crc[next_index] = PhysicalPacket::calculate_crc (advertising_crc_init, length, buffer);
+
+	ll_advertising_pdu_index = next_index;
+
+	log (LOG_LINKLAYER, "LinkLayer::ll_build_advertising_pdu %d (%d)", next_index, length);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_set_default_phy (int all_phys, int tx_phys, int rx_phys)
+{
+	const int supported_phys = hci_phy_le_1m | hci_phy_le_2m | hci_phy_le_coded;
+
+
+	// ALL_PHYS bit 0 = no TX preference, bit 1 = no RX preference
+
+	if (all_phys & 0x01)
+	{
+		tx_phys = supported_phys;
+	}
+
+	if (all_phys & 0x02)
+	{
+		rx_phys = supported_phys;
+	}
+
+	// no PHY at all is a malformed command, a PHY that is not supported is
+	// a well formed one that cannot be met
+
+	if ((tx_phys == 0) || (rx_phys == 0))
+	{
+		return EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	if ((tx_phys & ~supported_phys) || (rx_phys & ~supported_phys))
+	{
+		return EC_UNSUPPORTED_FEATURE_OR_PARAMETER_VALUE;
+	}
+
+	ll_default_tx_phys = tx_phys;
+	ll_default_rx_phys = rx_phys;
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+PhysicalPacket *LinkLayer::get_next_packet (int64 after)
+{
+	PhysicalPacket *packet;
 	int index;
 	int count;
 
@@ -348,79 +536,245 @@ PhysicalPacket *LinkLayer::get_next_packet (int64 after)
 	{
 		last_clock = after;
 
-		index = (last_machine + 1) % maximum_number_of_link_layer_state_machines;
-		count = 0;
+		if (ll_rpa_expiry <= after)
+		{
+			ll_rotate_private_addresses (after);
+		}
 
-		while (count < maximum_number_of_link_layer_state_machines)
+		// packets that follow another one T_IFS later (within a connection
+		// event, CONNECT_IND after ADV_IND) cannot wait, so they go first
+
+		for (index = 0; index < maximum_number_of_link_layer_state_machines; index ++)
 		{
-			count = count + 1;
+			if
+			(
+				((machine[index].state == LLS_Master) || (machine[index].state == LLS_Slave)) &&
+				(ll_connection[machine[index].conn.ll_connection].event_in_progress)
+			)
+			{
+				packet = ll_next_connection_packet (index, after);
 
-			if (machine[index].state == LLS_Advertising)
+				if (packet)
+				{
+					return packet;
+				}
+			}
+			else if ((machine[index].state == LLS_Initiator) && (machine[index].scan.substate == SSS_Connect_Request))
+			{
+				return ll_next_initiator_packet (index, after);
+			}
+			else if ((machine[index].state == LLS_Advertising) && (machine[index].adv.substate == ASS_Advertise_Request))
 			{
-				if (machine[index].adv.ll_next_advertising_tx > after)
+				if (machine[index].adv.ll_request_window_end > after)
 				{
-					ll_packet->set_transmit (37 + machine[index].adv.ll_advertising_channel, GFSK_LE, machine[index].adv.ll_next_advertising_tx);
+					ll_packet->set_receive (machine[index].adv.ll_request_channel, GFSK_LE, after, machine[index].adv.ll_request_window_end);
 					ll_packet->set_access_address (advertising_access_address);
-					buffer[0] = 0x00;
-					buffer[1] = 8 + ll_advertising_data_length;
-					buffer[2] = (ll_bd_addr >> 0) & 0xFF;
-					buffer[3] = (ll_bd_addr >> 8) & 0xFF;
-					buffer[4] = (ll_bd_addr >> 16) & 0xFF;
-					buffer[5] = (ll_bd_addr >> 24) & 0xFF;
-					buffer[6] = (ll_bd_addr >> 32) & 0xFF;
-					buffer[7] = (ll_bd_addr >> 40) & 0xFF;
-					length = 8;
-					if (ll_advertising_data_length > 0)
-					{
-						memcpy (&buffer[length], ll_advertising_data, ll_advertising_data_length);
-						length = 8 + ll_advertising_data_length;
-					}
-					ll_packet->set_pdu (length, buffer);
 					ll_packet->set_llsm (index);
 
-					machine[index].adv.ll_advertising_channel = (machine[index].adv.ll_advertising_channel + 1) % 3;
+					return ll_packet;
+				}
 
-					if (machine[index].adv.ll_advertising_channel == 0)
-					{
-						machine[index].adv.ll_next_advertising_instant += ll_advertising_interval_min * 625;
-						machine[index].adv.ll_next_advertising_tx = machine[index].adv.ll_next_advertising_instant + (rand () % 16) * 625;
-					}
-					else
-					{
-						machine[index].adv.ll_next_advertising_tx += 8 + 32 + length * 8 + 24 + 150;
-					}
+				machine[index].adv.substate = ASS_Advertise;
+			}
+		}
 
-					last_machine = index;
+		// an extended advertising event or aux chain that has started has its
+		// timing fixed by the AuxPtr already on air, so it goes first
 
-					return ll_packet;
-				}
-				else if (machine[index].adv.ll_next_advertising_tx < after)
+		for (index = 0; index < maximum_number_of_link_layer_state_machines; index ++)
+		{
+			if
+			(
+				(machine[index].state == LLS_Advertising) &&
+				(machine[index].adv.ll_advertising_set >= 0) &&
+				(machine[index].adv.ll_advertising_channel > 0)
+			)
+			{
+				packet = ll_next_extended_advertising_packet (index, after);
+
+				if (packet)
 				{
-					machine[index].adv.ll_next_advertising_instant += ll_advertising_interval_min * 625;
-					machine[index].adv.ll_next_advertising_tx = machine[index].adv.ll_next_advertising_instant + (rand () % 16) * 625;
+					return packet;
 				}
 			}
-			else if (machine[index].state == LLS_Scanning)
+		}
+
+		// the arbiter picks which machine gets the radio next, a machine that
+		// turns out to have nothing to send (e.g. its set just terminated)
+		// goes back for another round
+
+		for (count = 0; count < maximum_number_of_link_layer_state_machines; count ++)
+		{
+			index = ll_arbitrate (after);
+
+			if (index < 0)
 			{
-				if (machine[index].scan.ll_next_scanning_instant > after)
-				{
-					ll_packet->set_receive (37 + machine[index].scan.ll_scanning_channel, GFSK_LE, machine[index].scan.ll_next_scanning_instant, machine[index].scan.ll_next_scanning_instant + ll_scan_window * 625 - 150);
-					ll_packet->set_access_address (advertising_access_address);
-					ll_packet->set_llsm (index);
+				break;
+			}
 
-					machine[index].scan.ll_scanning_channel = (machine[index].scan.ll_scanning_channel + 1) % 3;
+			packet = ll_next_machine_packet (index, after);
 
-					machine[index].scan.ll_next_scanning_instant += ll_scan_interval * 625;
+			if (packet)
+			{
+				last_machine = index;
 
-					return ll_packet;
-				}
-				else if (machine[index].scan.ll_next_scanning_instant < after)
-				{
-					machine[index].scan.ll_next_scanning_instant += ll_scan_interval * 625;
-				}
+				return packet;
 			}
+		}
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+PhysicalPacket *LinkLayer::ll_next_machine_packet (int index, int64 after)
+{
+	PhysicalPacket *packet;
+	uint8 length;
+	int pdu_index;
+	int phy;
+	int64 missed;
+
+
+	if ((machine[index].state == LLS_Advertising) && (machine[index].adv.ll_advertising_set >= 0))
+	{
+		packet = ll_next_extended_advertising_packet (index, after);
 
-			index = (index + 1) % maximum_number_of_link_layer_state_machines;
+		if (packet)
+		{
+			return packet;
+		}
+	}
+	else if (machine[index].state == LLS_Advertising)
+	{
+		if (machine[index].adv.ll_next_advertising_tx <= after)
+		{
+			// the radio was busy, so the rest of this event and any
+			// that followed it are skipped in one step
+
+			missed = (after - machine[index].adv.ll_next_advertising_instant) / (ll_advertising_interval_min * 625) + 1;
+
+			ll_count_missed_events (missed);
+
+			machine[index].adv.ll_advertising_channel = 0;
+			machine[index].adv.ll_next_advertising_instant += missed * ll_advertising_interval_min * 625;
+			machine[index].adv.ll_next_advertising_tx = machine[index].adv.ll_next_advertising_instant + (rand () % 16) * 625;
+		}
+
+		if (machine[index].adv.ll_next_advertising_tx > after)
+		{
+			pdu_index = ll_advertising_pdu_index;
+			length = ll_advertising_pdu_length[pdu_index];
+
+			ll_advertising_pdu_referenced = pdu_index;
+
+			ll_packet->set_transmit (37 + machine[index].adv.ll_advertising_channel, GFSK_LE, machine[index].adv.ll_next_advertising_tx);
+			ll_packet->set_access_address (advertising_access_address);
+			ll_packet->set_pdu_reference (length, ll_advertising_pdu[pdu_index], ll_advertising_pdu_crc[pdu_index]);
+			ll_packet->set_llsm (index);
+
+			machine[index].adv.ll_advertising_channel = (machine[index].adv.ll_advertising_channel + 1) % 3;
+
+			if (machine[index].adv.ll_advertising_channel == 0)
+			{
+				machine[index].adv.ll_next_advertising_instant += ll_advertising_interval_min * 625;
+				machine[index].adv.ll_next_advertising_tx = machine[index].adv.ll_next_advertising_instant + (rand () % 16) * 625;
+			}
+			else
+			{
+				machine[index].adv.ll_next_advertising_tx += phy_packet_airtime (GFSK_LE, length) + 150;
+			}
+
+			return ll_packet;
+		}
+	}
+	else if (machine[index].state == LLS_Initiator)
+	{
+		return ll_next_initiator_packet (index, after);
+	}
+	else if ((machine[index].state == LLS_Master) || (machine[index].state == LLS_Slave))
+	{
+		packet = ll_next_connection_packet (index, after);
+
+		if (packet)
+		{
+			return packet;
+		}
+	}
+	else if (machine[index].state == LLS_Periodic_Advertising)
+	{
+		return ll_next_periodic_advertising_packet (index, after);
+	}
+	else if (machine[index].state == LLS_Synchronized)
+	{
+		return ll_next_synchronized_packet (index, after);
+	}
+	else if (machine[index].state == LLS_Scanning)
+	{
+		if (machine[index].scan.substate == SSS_Scan_Aux)
+		{
+			if (machine[index].scan.ll_aux_start > after)
+			{
+				ll_packet->set_receive (machine[index].scan.ll_aux_channel, machine[index].scan.ll_aux_modulation, machine[index].scan.ll_aux_start, machine[index].scan.ll_aux_start + machine[index].scan.ll_aux_window);
+				ll_packet->set_access_address (advertising_access_address);
+				ll_packet->set_llsm (index);
+
+				return ll_packet;
+			}
+
+			// the radio was busy when the aux packet was sent
+
+			ll_end_of_aux_chain (index, after, REPORT_DATA_TRUNCATED);
+		}
+
+		if (machine[index].scan.ll_window_end > after + phy_sync_time (machine[index].scan.ll_window_modulation))
+		{
+			// carry on listening for the rest of a window after a packet was received
+
+			ll_packet->set_receive (machine[index].scan.ll_window_channel, machine[index].scan.ll_window_modulation, after, machine[index].scan.ll_window_end);
+			ll_packet->set_access_address (advertising_access_address);
+			ll_packet->set_llsm (index);
+
+			return ll_packet;
+		}
+
+		phy = machine[index].scan.ll_scanning_phy;
+
+		if (machine[index].scan.ll_next_scanning_instant <= after)
+		{
+			// skip the scan windows the radio was too busy for
+
+			missed = (after - machine[index].scan.ll_next_scanning_instant) / (ll_scan_phy_interval[phy] * 625) + 1;
+
+			ll_count_missed_events (missed);
+
+			machine[index].scan.ll_next_scanning_instant += missed * ll_scan_phy_interval[phy] * 625;
+			machine[index].scan.ll_scanning_channel = (machine[index].scan.ll_scanning_channel + missed) % 3;
+
+			phy = (phy + missed) % ll_scan_number_of_phys;
+			machine[index].scan.ll_scanning_phy = phy;
+		}
+
+		if (machine[index].scan.ll_next_scanning_instant > after)
+		{
+			ll_packet->set_receive (37 + machine[index].scan.ll_scanning_channel, ll_scan_phy_modulation[phy], machine[index].scan.ll_next_scanning_instant, machine[index].scan.ll_next_scanning_instant + ll_scan_phy_window[phy] * 625 - 150);
+			ll_packet->set_access_address (advertising_access_address);
+			ll_packet->set_llsm (index);
+
+			machine[index].scan.ll_window_end = machine[index].scan.ll_next_scanning_instant + ll_scan_phy_window[phy] * 625 - 150;
+			machine[index].scan.ll_window_channel = 37 + machine[index].scan.ll_scanning_channel;
+			machine[index].scan.ll_window_modulation = ll_scan_phy_modulation[phy];
+
+			machine[index].scan.ll_scanning_channel = (machine[index].scan.ll_scanning_channel + 1) % 3;
+
+			machine[index].scan.ll_next_scanning_instant += ll_scan_phy_interval[phy] * 625;
+
+			// scanning on both primary PHYs alternates between them each window
+
+			machine[index].scan.ll_scanning_phy = (phy + 1) % ll_scan_number_of_phys;
+
+			return ll_packet;
 		}
 	}
 
@@ -429,7 +783,28 @@ PhysicalPacket *LinkLayer::get_next_packet (int64 after)
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void LinkLayer::end_of_packet (PhysicalPacket *packet, int64 when, int rx_len, uint8 *rx_data)
+// an event that is already in the past when the radio comes to it is counted
+// here rather than just turning up as latency
+
+void LinkLayer::ll_count_missed_events (int64 count)
+{
+	log (LOG_LINKLAYER, "LinkLayer::ll_count_missed_events %lld", count);
+
+	ll_total_missed_events += count;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// called with the physical layer mutex held
+
+uint64 LinkLayer::ll_get_total_missed_events (void)
+{
+	return ll_total_missed_events;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::end_of_packet (PhysicalPacket *packet, int64 when, int rx_len, const uint8 *rx_data)
 {
 	int index;
 
@@ -438,6 +813,32 @@ void LinkLayer::end_of_packet (PhysicalPacket *packet, int64 when, int rx_len, u
 	packet->log ();
 	log_end ();
 
+	index = packet->get_llsm ();
+
+	if ((machine[index].state == LLS_Master) || (machine[index].state == LLS_Slave))
+	{
+		ll_connection_end_of_packet (index, packet, when, rx_len, rx_data);
+		return;
+	}
+
+	if (machine[index].state == LLS_Initiator)
+	{
+		ll_initiator_end_of_packet (index, packet, when, rx_len, rx_data);
+		return;
+	}
+
+	if (machine[index].state == LLS_Synchronized)
+	{
+		ll_synchronized_end_of_packet (index, packet, when, rx_len, rx_data);
+		return;
+	}
+
+	if ((machine[index].state == LLS_Advertising) && (machine[index].adv.ll_advertising_set < 0))
+	{
+		ll_advertiser_end_of_packet (index, packet, when, rx_len, rx_data);
+		return;
+	}
+
 	if (rx_len)
 	{
 		//for (int index = 0; index < rx_len; index ++)
@@ -452,11 +853,39 @@ void LinkLayer::end_of_packet (PhysicalPacket *packet, int64 when, int rx_len, u
 		{
 			if (machine[index].scan.substate == SSS_Scan)
 			{
-				log (LOG_LINKLAYER, "LE Advertising Report Event");
-				send_le_advertising_report_event (rx_len, rx_data);
+				if ((rx_data[0] & 0x0F) == PDU_ADV_EXT_IND)
+				{
+					if (ll_scan_extended)
+					{
+						ll_received_extended_pdu (index, packet, when, rx_len, rx_data);
+					}
+				}
+				else
+				{
+					ll_report_legacy_pdu (when, packet->get_rx_rssi (), rx_len, rx_data);
+				}
+			}
+			else if (machine[index].scan.substate == SSS_Scan_Aux)
+			{
+				ll_received_extended_pdu (index, packet, when, rx_len, rx_data);
 			}
 		}
 	}
+	else if (packet->is_receive ())
+	{
+		index = packet->get_llsm ();
+
+		if ((machine[index].state == LLS_Scanning) && (machine[index].scan.substate == SSS_Scan_Aux))
+		{
+			// nothing heard in the aux window, report what has been collected
+
+			ll_end_of_aux_chain (index, when, REPORT_DATA_TRUNCATED);
+		}
+
+		// end of a scan window, do not hold reports across the gap
+
+		flush_le_advertising_reports ();
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////
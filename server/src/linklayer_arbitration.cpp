@@ -0,0 +1,372 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include <stdlib.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "controller.h"
+#include "log.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+// arbitration between the state machines of one controller: when the next
+// events of two machines overlap the one with the higher priority gets the
+// radio, a machine gains priority for every event it loses in a row so that
+// scanning is not starved by advertising, and a connection close to its
+// supervision timeout (or still being established) goes ahead of everything
+
+static const int role_priority[number_of_link_layer_states] =
+{
+	0, // LLS_Idle
+	20, // LLS_Advertising
+	10, // LLS_Scanning
+	30, // LLS_Initiator
+	50, // LLS_Slave, has to catch the master's anchor
+	40, // LLS_Master
+	25, // LLS_Periodic_Advertising
+	45, // LLS_Synchronized, only listens when a packet is due
+};
+
+const int starvation_priority_step = 15;
+const int deadline_priority_boost = 100;
+
+uint64 LinkLayer::ll_total_preempted_events[number_of_link_layer_states] = { 0 };
+
+////////////////////////////////////////////////////////////////////////////////
+
+// when the next event of a machine starts and ends, without changing any of
+// its state, events that have already gone by are stepped over the same way
+// as the machine itself will when it is asked for the packet
+
+bool LinkLayer::ll_next_event_window (int index, int64 after, int64 *start, int64 *end)
+{
+	LinkLayerStateMachine *llsm;
+	AdvertisingSet *set;
+	AdvertisingEventPacket *entry;
+	AdvertisingEventPacket *last;
+	Connection *connection;
+	PeriodicSync *sync;
+	int schedule;
+	int length;
+	int phy;
+	int64 instant;
+	int64 missed;
+
+
+	llsm = &machine[index];
+
+	switch (llsm->state)
+	{
+		case LLS_Advertising:
+
+			if (llsm->adv.ll_advertising_set >= 0)
+			{
+				set = &ll_advertising_set[llsm->adv.ll_advertising_set];
+				schedule = (llsm->adv.ll_advertising_channel == 0) ? set->schedule_index : llsm->adv.ll_advertising_schedule;
+				entry = set->get_packet (schedule, llsm->adv.ll_advertising_channel);
+				last = set->get_packet (schedule, set->number_of_packets[schedule] - 1);
+
+				*start = llsm->adv.ll_advertising_event_start + entry->offset;
+				*end = llsm->adv.ll_advertising_event_start + last->offset + phy_packet_airtime (last->modulation, last->pdu_length);
+
+				if (*start <= after)
+				{
+					missed = (after - llsm->adv.ll_next_advertising_instant) / (set->interval * 625) + 1;
+					instant = llsm->adv.ll_next_advertising_instant + missed * set->interval * 625;
+
+					entry = set->get_packet (set->schedule_index, 0);
+					last = set->get_packet (set->schedule_index, set->number_of_packets[set->schedule_index] - 1);
+
+					*start = instant + entry->offset;
+					*end = instant + last->offset + phy_packet_airtime (last->modulation, last->pdu_length);
+				}
+			}
+			else
+			{
+				length = ll_advertising_pdu_length[ll_advertising_pdu_index];
+
+				*start = llsm->adv.ll_next_advertising_tx;
+				*end = *start + (3 - llsm->adv.ll_advertising_channel) * (phy_packet_airtime (GFSK_LE, length) + 150);
+
+				if (*start <= after)
+				{
+					missed = (after - llsm->adv.ll_next_advertising_instant) / (ll_advertising_interval_min * 625) + 1;
+
+					*start = llsm->adv.ll_next_advertising_instant + missed * ll_advertising_interval_min * 625;
+					*end = *start + 3 * (phy_packet_airtime (GFSK_LE, length) + 150);
+				}
+			}
+
+			return true;
+
+		case LLS_Scanning:
+
+			if (!ll_scanning_wanted ())
+			{
+				return false;
+			}
+
+			if ((llsm->scan.substate == SSS_Scan_Aux) && (llsm->scan.ll_aux_start > after))
+			{
+				*start = llsm->scan.ll_aux_start;
+				*end = llsm->scan.ll_aux_start + llsm->scan.ll_aux_window;
+
+				return true;
+			}
+
+			if (llsm->scan.ll_window_end > after + phy_sync_time (llsm->scan.ll_window_modulation))
+			{
+				*start = after;
+				*end = llsm->scan.ll_window_end;
+
+				return true;
+			}
+
+			phy = llsm->scan.ll_scanning_phy;
+			*start = llsm->scan.ll_next_scanning_instant;
+
+			if (*start <= after)
+			{
+				missed = (after - *start) / (ll_scan_phy_interval[phy] * 625) + 1;
+
+				*start += missed * ll_scan_phy_interval[phy] * 625;
+				phy = (phy + missed) % ll_scan_number_of_phys;
+			}
+
+			*end = *start + ll_scan_phy_window[phy] * 625 - 150;
+
+			return true;
+
+		case LLS_Initiator:
+
+			if (llsm->scan.ll_window_end > after + phy_sync_time (GFSK_LE))
+			{
+				*start = after;
+				*end = llsm->scan.ll_window_end;
+
+				return true;
+			}
+
+			*start = llsm->scan.ll_next_scanning_instant;
+
+			if (*start <= after)
+			{
+				*start += ((after - *start) / (ll_initiator_scan_interval * 625) + 1) * ll_initiator_scan_interval * 625;
+			}
+
+			*end = *start + ll_initiator_scan_window * 625 - 150;
+
+			return true;
+
+		case LLS_Master:
+		case LLS_Slave:
+
+			connection = &ll_connection[llsm->conn.ll_connection];
+
+			*start = connection->next_time;
+
+			if (*start < after)
+			{
+				*start += ((after - *start) / (connection->interval * 1250) + 1) * connection->interval * 1250;
+			}
+
+			// at least one exchange of the longest PDU, a slave also has to
+			// cover its receive window
+
+			*end = *start + 2 * phy_packet_airtime (GFSK_LE, maximum_data_pdu_length) + 150;
+
+			if (!connection->master)
+			{
+				*end += connection->window_end - connection->next_time;
+			}
+
+			return true;
+
+		case LLS_Periodic_Advertising:
+
+			set = &ll_advertising_set[llsm->per.ll_advertising_set];
+			length = set->periodic_pdu_length[set->periodic_pdu_index];
+
+			*start = llsm->per.ll_next_event;
+
+			if (*start <= after)
+			{
+				*start += ((after - *start) / (set->periodic_interval * 1250) + 1) * set->periodic_interval * 1250;
+			}
+
+			*end = *start + phy_packet_airtime (set->secondary_phy, length);
+
+			return true;
+
+		case LLS_Synchronized:
+
+			sync = &ll_periodic_sync[llsm->sync.ll_sync];
+
+			*start = sync->anchor - sync->window_widening;
+
+			if (*start + 2 * sync->window_widening <= after)
+			{
+				*start += ((after - *start - 2 * sync->window_widening) / (sync->interval * 1250) + 1) * sync->interval * 1250;
+			}
+
+			*end = *start + 2 * sync->window_widening + phy_packet_airtime (sync->modulation, maximum_periodic_advertising_data_length + 3);
+
+			return true;
+
+		default:
+
+			return false;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_event_priority (int index, int64 after)
+{
+	LinkLayerStateMachine *llsm;
+	Connection *connection;
+	int priority;
+
+
+	llsm = &machine[index];
+
+	priority = role_priority[llsm->state] + llsm->starvation * starvation_priority_step;
+
+	if ((llsm->state == LLS_Master) || (llsm->state == LLS_Slave))
+	{
+		connection = &ll_connection[llsm->conn.ll_connection];
+
+		if
+		(
+			(!connection->established) ||
+			(after - connection->last_received > connection->supervision_timeout * 10000LL / 2)
+		)
+		{
+			priority += deadline_priority_boost;
+		}
+	}
+
+	return priority;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// picks the machine to get the radio next, -1 when all of them are idle
+//
+// the candidate is the event that starts first, any event that overlaps it
+// and has a higher priority takes its place, and every event that overlaps
+// the winner is counted as pre-empted once, equal priorities go round robin
+
+int LinkLayer::ll_arbitrate (int64 after)
+{
+	bool candidate[maximum_number_of_link_layer_state_machines];
+	int64 start[maximum_number_of_link_layer_state_machines];
+	int64 end[maximum_number_of_link_layer_state_machines];
+	int priority[maximum_number_of_link_layer_state_machines];
+	int first;
+	int winner;
+	int index;
+	int count;
+	LinkLayerState role;
+
+
+	first = -1;
+	index = (last_machine + 1) % maximum_number_of_link_layer_state_machines;
+
+	for (count = 0; count < maximum_number_of_link_layer_state_machines; count ++)
+	{
+		candidate[index] = ll_next_event_window (index, after, &start[index], &end[index]);
+
+		if (candidate[index])
+		{
+			priority[index] = ll_event_priority (index, after);
+
+			if ((first < 0) || (start[index] < start[first]))
+			{
+				first = index;
+			}
+		}
+
+		index = (index + 1) % maximum_number_of_link_layer_state_machines;
+	}
+
+	if (first < 0)
+	{
+		return -1;
+	}
+
+	winner = first;
+
+	for (index = 0; index < maximum_number_of_link_layer_state_machines; index ++)
+	{
+		if ((candidate[index]) && (start[index] < end[first]) && (priority[index] > priority[winner]))
+		{
+			winner = index;
+		}
+	}
+
+	for (index = 0; index < maximum_number_of_link_layer_state_machines; index ++)
+	{
+		if
+		(
+			(candidate[index]) &&
+			(index != winner) &&
+			(start[index] < end[winner]) &&
+			(end[index] > start[winner]) &&
+			(machine[index].preempted_event_end != end[index])
+		)
+		{
+			role = machine[index].state;
+
+			log (LOG_LINKLAYER, "LinkLayer::ll_arbitrate machine %d (%d) pre-empted by %d (%d)", index, priority[index], winner, priority[winner]);
+
+			machine[index].preempted_event_end = end[index];
+			machine[index].starvation ++;
+
+			ll_total_preempted_events[role] ++;
+		}
+	}
+
+	machine[winner].starvation = 0;
+
+	return winner;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// called with the physical layer mutex held
+
+uint64 LinkLayer::ll_get_total_preempted_events (LinkLayerState role)
+{
+	return ll_total_preempted_events[role];
+}
+
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,1569 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include <stdlib.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "controller.h"
+#include "hci.h"
+#include "log.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+// receive windows are opened this much either side of when the peer is
+// expected to start transmitting
+
+const int receive_window_margin = 16;
+
+// the transmit window of the first connection event, in 1.25 ms units
+
+const int transmit_window_size = 2;
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool is_valid_access_address (uint32 aa)
+{
+	int run;
+	int transitions;
+	int top_transitions;
+	int bit;
+	int last_bit;
+
+
+	// the data channel access address must not look like the advertising
+	// one, must have enough transitions and no long runs of one value
+
+	if ((aa == advertising_access_address) || (__builtin_popcount (aa ^ advertising_access_address) == 1))
+	{
+		return false;
+	}
+
+	if ((((aa >> 24) & 0xFF) == (aa & 0xFF)) && (((aa >> 16) & 0xFF) == (aa & 0xFF)) && (((aa >> 8) & 0xFF) == (aa & 0xFF)))
+	{
+		return false;
+	}
+
+	run = 1;
+	transitions = 0;
+	top_transitions = 0;
+	last_bit = (aa >> 31) & 0x01;
+
+	for (int index = 30; index >= 0; index --)
+	{
+		bit = (aa >> index) & 0x01;
+
+		if (bit == last_bit)
+		{
+			run ++;
+
+			if (run > 6)
+			{
+				return false;
+			}
+		}
+		else
+		{
+			run = 1;
+			transitions ++;
+
+			if (index >= 26)
+			{
+				top_transitions ++;
+			}
+		}
+
+		last_bit = bit;
+	}
+
+	return (transitions <= 24) && (top_transitions >= 2);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the channel of the event the event counter has just moved on to, count is
+// how many events on from the last one that is
+
+static void select_data_channel (Connection *connection, int64 count)
+{
+	if (connection->csa2)
+	{
+		if ((uint16) (connection->event_counter - connection->lookahead_counter) >= connection->lookahead_length)
+		{
+			connection->lookahead_counter = connection->event_counter;
+			connection->lookahead_length = channel_lookahead_length;
+
+			csa2_select_channels (connection->channel_identifier, connection->lookahead_counter, connection->lookahead_length, connection->channel_map, connection->used_channel, connection->number_of_used_channels, connection->lookahead_channel);
+		}
+
+		connection->channel = connection->lookahead_channel[(uint16) (connection->event_counter - connection->lookahead_counter)];
+
+		return;
+	}
+
+	// Channel Selection Algorithm #1
+
+	connection->unmapped_channel = (connection->unmapped_channel + (count % 37) * connection->hop_increment) % 37;
+
+	if (connection->channel_map & (1ULL << connection->unmapped_channel))
+	{
+		connection->channel = connection->unmapped_channel;
+	}
+	else
+	{
+		connection->channel = connection->used_channel[connection->unmapped_channel % connection->number_of_used_channels];
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// queued ACL data is held back while the encryption is being started
+
+static bool data_waiting (Connection *connection)
+{
+	return (connection->tx_queue_head != 0) && (connection->encryption_substate == ESS_Idle);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// anything waiting to go after the PDU currently being sent
+
+static bool has_more_data (Connection *connection)
+{
+	if (connection->tx_pdu == connection->terminate_pdu)
+	{
+		return false;
+	}
+
+	if (connection->terminate_sent)
+	{
+		return true;
+	}
+
+	if ((connection->control_pending) && (connection->tx_pdu != connection->control_pdu))
+	{
+		return true;
+	}
+
+	if (connection->encryption_pdus_due)
+	{
+		return true;
+	}
+
+	if (!data_waiting (connection))
+	{
+		return false;
+	}
+
+	if (connection->tx_pdu != connection->tx_queue_head->pdu[connection->tx_fragment])
+	{
+		return true;
+	}
+
+	return (connection->tx_fragment + 1 < connection->tx_queue_head->number_of_fragments) || (connection->tx_queue_head->next != 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// is there time for another master / slave exchange before the next anchor
+
+static bool room_for_exchange (Connection *connection, int64 when)
+{
+	int64 next_anchor;
+
+
+	next_anchor = connection->anchor + connection->interval * 1250;
+
+	return when + 150 + 2 * phy_packet_airtime (GFSK_LE, maximum_data_pdu_length) + 150 + receive_window_margin <= next_anchor;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint64 get_pdu_address (const uint8 *p)
+{
+	uint64 address;
+
+
+	address = 0;
+
+	for (int index = 0; index < 6; index ++)
+	{
+		address |= ((uint64) p[index]) << (8 * index);
+	}
+
+	return address;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void put_pdu_address (uint8 *p, uint64 address)
+{
+	for (int index = 0; index < 6; index ++)
+	{
+		p[index] = (address >> (8 * index)) & 0xFF;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+AclBuffer *LinkLayer::ll_allocate_acl_buffer (void)
+{
+	AclBuffer *buffer;
+
+
+	buffer = ll_acl_free_list;
+
+	if (buffer)
+	{
+		ll_acl_free_list = buffer->next;
+		buffer->next = 0;
+		buffer->number_of_fragments = 0;
+	}
+
+	return buffer;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_free_acl_buffer (AclBuffer *buffer)
+{
+	buffer->next = ll_acl_free_list;
+	ll_acl_free_list = buffer;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_create_connection (int scan_interval, int scan_window, int filter_policy, int peer_address_type, uint64 peer_address, int own_address_type, int interval, int latency, int supervision_timeout)
+{
+	int index;
+	int connection;
+
+
+	if (ll_initiating)
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	if (filter_policy != 0x00)
+	{
+		// there is no white list to initiate from
+
+		return EC_UNSUPPORTED_FEATURE_OR_PARAMETER_VALUE;
+	}
+
+	if
+	(
+		(scan_interval < 0x0004) || (scan_interval > 0x4000) ||
+		(scan_window < 0x0004) || (scan_window > scan_interval) ||
+		(peer_address_type > 0x03) || (own_address_type > 0x03) ||
+		(interval < 0x0006) || (interval > 0x0C80) ||
+		(latency > 0x01F3) ||
+		(supervision_timeout < 0x000A) || (supervision_timeout > 0x0C80) ||
+		(supervision_timeout * 4 <= (1 + latency) * interval)
+	)
+	{
+		return EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	if (((own_address_type & 0x01) == 0x01) && (ll_random_address == 0))
+	{
+		return EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	for (connection = 0; connection < maximum_number_of_connections; connection ++)
+	{
+		if
+		(
+			(ll_connection[connection].in_use) &&
+			(ll_connection[connection].peer_address == peer_address) &&
+			((ll_connection[connection].peer_address_type & 0x01) == (peer_address_type & 0x01))
+		)
+		{
+			return EC_ACL_CONNECTION_ALREADY_EXISTS;
+		}
+	}
+
+	for (connection = 0; connection < maximum_number_of_connections; connection ++)
+	{
+		if (!ll_connection[connection].in_use)
+		{
+			break;
+		}
+	}
+
+	if (connection == maximum_number_of_connections)
+	{
+		return EC_CONNECTION_LIMIT_EXCEEDED;
+	}
+
+	for (index = 0; index < maximum_number_of_link_layer_state_machines; index ++)
+	{
+		if (machine[index].state == LLS_Idle)
+		{
+			ll_initiating = true;
+			ll_initiator_scan_interval = scan_interval;
+			ll_initiator_scan_window = scan_window;
+			ll_initiator_peer_address_type = peer_address_type;
+			ll_initiator_peer_address = peer_address;
+			ll_initiator_own_address_type = own_address_type;
+			ll_initiator_interval = interval;
+			ll_initiator_latency = latency;
+			ll_initiator_supervision_timeout = supervision_timeout;
+
+			machine[index].mk_initiator (last_clock);
+
+			return EC_SUCCESS;
+		}
+	}
+
+	return EC_MEMORY_CAPACITY_EXCEEDED;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_create_connection_cancel (void)
+{
+	if (!ll_initiating)
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	for (int index = 0; index < maximum_number_of_link_layer_state_machines; index ++)
+	{
+		if (machine[index].state == LLS_Initiator)
+		{
+			machine[index].mk_idle ();
+		}
+	}
+
+	ll_initiating = false;
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_disconnect (int handle, int reason)
+{
+	Connection *connection;
+
+
+	if ((handle < 0) || (handle >= maximum_number_of_connections) || (!ll_connection[handle].in_use))
+	{
+		return EC_UNKNOWN_CONNECTION_IDENTIFIER;
+	}
+
+	switch (reason)
+	{
+		case EC_AUTHENTICATION_FAILURE:
+		case EC_REMOTE_DEVICE_TERMINATED_CONNECTION:
+		case EC_REMOTE_DEVICE_TERMINATED_CONNECTION_DUE_TO_LOW_RESOURCES:
+		case EC_REMOTE_DEVICE_TERMINATED_CONNECTION_DUE_TO_POWER_OFF:
+		case EC_UNSUPPORTED_REMOTE_FEATURE_UNSUPPORTED_LMP_FEATURE:
+		case EC_PAIRING_WITH_UNIT_KEY_NOT_SUPPORTED:
+		case EC_UNACCEPTABLE_CONNECTION_INTERVAL:
+			break;
+
+		default:
+			return EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	connection = &ll_connection[handle];
+
+	if (connection->terminate_sent)
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	// the LL_TERMINATE_IND goes ahead of any data still queued, the
+	// connection is closed when the peer acknowledges it
+
+	connection->terminate_pdu[0] = LLID_CONTROL;
+	connection->terminate_pdu[1] = 2;
+	connection->terminate_pdu[2] = LL_TERMINATE_IND;
+	connection->terminate_pdu[3] = reason;
+	connection->terminate_sent = true;
+
+	log (LOG_LINKLAYER, "LinkLayer::ll_disconnect %d %02X", handle, reason);
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_read_rssi (int handle, int *rssi)
+{
+	if ((handle < 0) || (handle >= maximum_number_of_connections) || (!ll_connection[handle].in_use))
+	{
+		return EC_UNKNOWN_CONNECTION_IDENTIFIER;
+	}
+
+	*rssi = ll_connection[handle].rssi;
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the master starts the encryption, the encryption pause procedure is not
+// supported so a link is only encrypted once
+
+int LinkLayer::ll_start_encryption (int handle, const uint8 *rand, const uint8 *ediv, const uint8 *ltk)
+{
+	Connection *connection;
+	uint8 random[8];
+
+
+	if ((handle < 0) || (handle >= maximum_number_of_connections) || (!ll_connection[handle].in_use))
+	{
+		return EC_UNKNOWN_CONNECTION_IDENTIFIER;
+	}
+
+	if (!ll_encryption_supported)
+	{
+		return EC_UNSUPPORTED_FEATURE_OR_PARAMETER_VALUE;
+	}
+
+	connection = &ll_connection[handle];
+
+	if ((!connection->master) || (connection->encryption_substate != ESS_Idle) || (connection->encryption.tx_enabled) || (connection->terminate_sent))
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	memcpy (connection->encryption_rand, rand, 8);
+	memcpy (connection->encryption_ediv, ediv, 2);
+	memcpy (connection->encryption_ltk, ltk, 16);
+
+	// SKDm and IVm, the slave supplies the other halves in LL_ENC_RSP
+
+	ll_rand (&connection->encryption_skd[0]);
+	ll_rand (random);
+	memcpy (&connection->encryption_iv[0], random, 4);
+
+	connection->encryption_substate = ESS_Wait_Enc_Rsp;
+	connection->encryption_pdus_due |= 1 << LL_ENC_REQ;
+
+	log (LOG_LINKLAYER, "LinkLayer::ll_start_encryption %d", handle);
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_long_term_key_request_reply (int handle, const uint8 *ltk)
+{
+	Connection *connection;
+
+
+	if ((handle < 0) || (handle >= maximum_number_of_connections) || (!ll_connection[handle].in_use))
+	{
+		return EC_UNKNOWN_CONNECTION_IDENTIFIER;
+	}
+
+	connection = &ll_connection[handle];
+
+	if ((connection->master) || (connection->encryption_substate != ESS_Wait_Key))
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	ll_start_link_encryption (&connection->encryption, false, ltk, connection->encryption_skd, connection->encryption_iv);
+
+	connection->encryption_substate = ESS_Wait_Start_Enc_Rsp;
+	connection->encryption_pdus_due |= 1 << LL_START_ENC_REQ;
+
+	log (LOG_LINKLAYER, "LinkLayer::ll_long_term_key_request_reply %d", handle);
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_long_term_key_request_negative_reply (int handle)
+{
+	Connection *connection;
+
+
+	if ((handle < 0) || (handle >= maximum_number_of_connections) || (!ll_connection[handle].in_use))
+	{
+		return EC_UNKNOWN_CONNECTION_IDENTIFIER;
+	}
+
+	connection = &ll_connection[handle];
+
+	if ((connection->master) || (connection->encryption_substate != ESS_Wait_Key))
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	connection->encryption_substate = ESS_Idle;
+	connection->encryption_reject_reason = EC_PIN_OR_KEY_MISSING;
+	connection->encryption_pdus_due |= 1 << LL_REJECT_IND;
+
+	log (LOG_LINKLAYER, "LinkLayer::ll_long_term_key_request_negative_reply %d", handle);
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// called with the physical layer mutex held, the data is copied once into
+// the data channel PDUs that the radio transmits from
+
+bool LinkLayer::ll_queue_acl_data (int handle, int packet_boundary, int len, const uint8 *data)
+{
+	Connection *connection;
+	AclBuffer *buffer;
+	uint8 *pdu;
+	int offset;
+	int length;
+	int fragment;
+
+
+	if ((handle < 0) || (handle >= maximum_number_of_connections) || (!ll_connection[handle].in_use))
+	{
+		log (LOG_LINKLAYER, "LinkLayer::ll_queue_acl_data unknown handle %d", handle);
+		return false;
+	}
+
+	if (len > le_acl_data_packet_length)
+	{
+		return false;
+	}
+
+	buffer = ll_allocate_acl_buffer ();
+
+	if (buffer == 0)
+	{
+		log (LOG_LINKLAYER, "LinkLayer::ll_queue_acl_data no buffer for handle %d", handle);
+
+		// the pool holds as many packets as the host has credits for, so
+		// this one was sent without a credit
+
+		send_data_buffer_overflow_event ();
+		return false;
+	}
+
+	offset = 0;
+	fragment = 0;
+
+	do
+	{
+		length = len - offset;
+
+		if (length > maximum_data_pdu_payload_length)
+		{
+			length = maximum_data_pdu_payload_length;
+		}
+
+		pdu = buffer->pdu[fragment];
+
+		pdu[0] = ((fragment == 0) && (packet_boundary != 0x01) && (len > 0)) ? LLID_START : LLID_CONTINUATION;
+		pdu[1] = length;
+		memcpy (&pdu[2], &data[offset], length);
+
+		offset += length;
+		fragment ++;
+	}
+	while (offset < len);
+
+	buffer->number_of_fragments = fragment;
+
+	connection = &ll_connection[handle];
+
+	if (connection->tx_queue_head)
+	{
+		connection->tx_queue_tail->next = buffer;
+	}
+	else
+	{
+		connection->tx_queue_head = buffer;
+		connection->tx_fragment = 0;
+	}
+
+	connection->tx_queue_tail = buffer;
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+PhysicalPacket *LinkLayer::ll_next_initiator_packet (int index, int64 after)
+{
+	LinkLayerStateMachine *llsm;
+	int64 window_end;
+	int64 missed;
+
+
+	llsm = &machine[index];
+
+	if (llsm->scan.substate == SSS_Connect_Request)
+	{
+		if (ll_connect_ind_time > after)
+		{
+			ll_packet->set_transmit (ll_connect_ind_channel, GFSK_LE, ll_connect_ind_time);
+			ll_packet->set_access_address (advertising_access_address);
+			ll_packet->set_pdu_reference (2 + 34, ll_connect_ind, ll_connect_ind_crc);
+			ll_packet->set_llsm (index);
+
+			return ll_packet;
+		}
+
+		// the radio was busy, wait for the next advertising packet
+
+		llsm->scan.substate = SSS_Scan;
+	}
+
+	if (llsm->scan.ll_window_end > after + phy_sync_time (GFSK_LE))
+	{
+		ll_packet->set_receive (llsm->scan.ll_window_channel, GFSK_LE, after, llsm->scan.ll_window_end);
+		ll_packet->set_access_address (advertising_access_address);
+		ll_packet->set_llsm (index);
+
+		return ll_packet;
+	}
+
+	if (llsm->scan.ll_next_scanning_instant <= after)
+	{
+		missed = (after - llsm->scan.ll_next_scanning_instant) / (ll_initiator_scan_interval * 625) + 1;
+
+		ll_count_missed_events (missed);
+
+		llsm->scan.ll_next_scanning_instant += missed * ll_initiator_scan_interval * 625;
+		llsm->scan.ll_scanning_channel = (llsm->scan.ll_scanning_channel + missed) % 3;
+	}
+
+	window_end = llsm->scan.ll_next_scanning_instant + ll_initiator_scan_window * 625 - 150;
+
+	ll_packet->set_receive (37 + llsm->scan.ll_scanning_channel, GFSK_LE, llsm->scan.ll_next_scanning_instant, window_end);
+	ll_packet->set_access_address (advertising_access_address);
+	ll_packet->set_llsm (index);
+
+	llsm->scan.ll_window_end = window_end;
+	llsm->scan.ll_window_channel = 37 + llsm->scan.ll_scanning_channel;
+	llsm->scan.ll_scanning_channel = (llsm->scan.ll_scanning_channel + 1) % 3;
+	llsm->scan.ll_next_scanning_instant += ll_initiator_scan_interval * 625;
+
+	return ll_packet;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_initiator_end_of_packet (int index, PhysicalPacket *packet, int64 when, int rx_len, const uint8 *rx_data)
+{
+	LinkLayerStateMachine *llsm;
+	int pdu_type;
+	int address_type;
+	uint64 address;
+	uint64 own_address;
+	bool own_address_is_random;
+	uint32 aa;
+	uint32 crc_init;
+	int hop;
+
+
+	llsm = &machine[index];
+
+	if (packet->is_transmit ())
+	{
+		if (llsm->scan.substate == SSS_Connect_Request)
+		{
+			ll_initiating = false;
+
+			if (ll_open_connection (index, true, when, ll_connect_ind) < 0)
+			{
+				llsm->mk_idle ();
+				send_le_connection_complete_event (EC_CONNECTION_LIMIT_EXCEEDED, 0, 0x00, ll_initiator_peer_address_type & 0x01, ll_initiator_peer_address, 0, 0, 0, 0);
+			}
+		}
+
+		return;
+	}
+
+	if ((rx_len < 8) || (llsm->scan.substate != SSS_Scan))
+	{
+		return;
+	}
+
+	pdu_type = rx_data[0] & 0x0F;
+
+	if ((pdu_type != PDU_ADV_IND) && (pdu_type != PDU_ADV_DIRECT_IND))
+	{
+		return;
+	}
+
+	own_address = ll_own_address (ll_initiator_own_address_type, ll_initiator_peer_address_type & 0x01, ll_initiator_peer_address, ll_random_address, &own_address_is_random);
+
+	if (pdu_type == PDU_ADV_DIRECT_IND)
+	{
+		if ((rx_len < 14) || (get_pdu_address (&rx_data[8]) != own_address) || (((rx_data[0] & PDU_RXADD) != 0) != own_address_is_random))
+		{
+			return;
+		}
+	}
+
+	address_type = (rx_data[0] & PDU_TXADD) ? 0x01 : 0x00;
+	address = get_pdu_address (&rx_data[2]);
+
+	ll_resolve_peer_address (&address_type, &address);
+
+	if ((address != ll_initiator_peer_address) || ((address_type & 0x01) != (ll_initiator_peer_address_type & 0x01)))
+	{
+		return;
+	}
+
+	do
+	{
+		aa = ((uint32) (rand () & 0xFFFF) << 16) | (rand () & 0xFFFF);
+	}
+	while (!is_valid_access_address (aa));
+
+	crc_init = rand () & 0xFFFFFF;
+	hop = 5 + rand () % 12;
+
+	ll_connect_ind[0] = PDU_CONNECT_IND | PDU_CHSEL | (own_address_is_random ? PDU_TXADD : 0) | ((rx_data[0] & PDU_TXADD) ? PDU_RXADD : 0);
+	ll_connect_ind_csa2 = (rx_data[0] & PDU_CHSEL) != 0;
+	ll_connect_ind[1] = 34;
+	put_pdu_address (&ll_connect_ind[2], own_address);
+	memcpy (&ll_connect_ind[8], &rx_data[2], 6);
+	ll_connect_ind[14] = (aa >> 0) & 0xFF;
+	ll_connect_ind[15] = (aa >> 8) & 0xFF;
+	ll_connect_ind[16] = (aa >> 16) & 0xFF;
+	ll_connect_ind[17] = (aa >> 24) & 0xFF;
+	ll_connect_ind[18] = (crc_init >> 0) & 0xFF;
+	ll_connect_ind[19] = (crc_init >> 8) & 0xFF;
+	ll_connect_ind[20] = (crc_init >> 16) & 0xFF;
+	ll_connect_ind[21] = transmit_window_size;
+	ll_connect_ind[22] = 0x00; // WinOffset
+	ll_connect_ind[23] = 0x00;
+	ll_connect_ind[24] = (ll_initiator_interval >> 0) & 0xFF;
+	ll_connect_ind[25] = (ll_initiator_interval >> 8) & 0xFF;
+	ll_connect_ind[26] = (ll_initiator_latency >> 0) & 0xFF;
+	ll_connect_ind[27] = (ll_initiator_latency >> 8) & 0xFF;
+	ll_connect_ind[28] = (ll_initiator_supervision_timeout >> 0) & 0xFF;
+	ll_connect_ind[29] = (ll_initiator_supervision_timeout >> 8) & 0xFF;
+	ll_connect_ind[30] = 0xFF; // all 37 data channels
+	ll_connect_ind[31] = 0xFF;
+	ll_connect_ind[32] = 0xFF;
+	ll_connect_ind[33] = 0xFF;
+	ll_connect_ind[34] = 0x1F;
+	ll_connect_ind[35] = hop; // SCA 0, 251 to 500 ppm
+
+	ll_connect_ind_crc = PhysicalPacket::calculate_crc (advertising_crc_init, 2 + 34, ll_connect_ind);
+	ll_connect_ind_time = when + 150;
+	ll_connect_ind_channel = packet->get_channel ();
+
+	llsm->scan.substate = SSS_Connect_Request;
+
+	log (LOG_LINKLAYER, "LinkLayer::ll_initiator_end_of_packet CONNECT_IND %08lX", aa);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// legacy advertising only, after each connectable advertising packet the
+// advertiser listens for a CONNECT_IND
+
+void LinkLayer::ll_advertiser_end_of_packet (int index, PhysicalPacket *packet, int64 when, int rx_len, const uint8 *rx_data)
+{
+	LinkLayerStateMachine *llsm;
+	const uint8 *adv_pdu;
+
+
+	llsm = &machine[index];
+
+	if (packet->is_transmit ())
+	{
+		if ((ll_advertising_type == 0x02) || (ll_advertising_type == 0x03))
+		{
+			return;
+		}
+
+		llsm->adv.substate = ASS_Advertise_Request;
+		llsm->adv.ll_request_channel = packet->get_channel ();
+		llsm->adv.ll_request_window_end = when + 150 + phy_sync_time (GFSK_LE) + receive_window_margin;
+
+		if (llsm->adv.ll_advertising_channel != 0)
+		{
+			// the rest of this advertising event waits for the window
+
+			llsm->adv.ll_next_advertising_tx = llsm->adv.ll_request_window_end + 150;
+		}
+
+		return;
+	}
+
+	llsm->adv.substate = ASS_Advertise;
+
+	if (rx_len == 0)
+	{
+		return;
+	}
+
+	adv_pdu = ll_advertising_pdu[ll_advertising_pdu_index];
+
+	if
+	(
+		((rx_data[0] & 0x0F) != PDU_CONNECT_IND) ||
+		(rx_len < 2 + 34) ||
+		(memcmp (&rx_data[8], &adv_pdu[2], 6) != 0) ||
+		(((rx_data[0] & PDU_RXADD) != 0) != ((adv_pdu[0] & PDU_TXADD) != 0))
+	)
+	{
+		if ((llsm->adv.ll_advertising_channel != 0) && (llsm->adv.ll_next_advertising_tx < when + 150))
+		{
+			llsm->adv.ll_next_advertising_tx = when + 150;
+		}
+
+		return;
+	}
+
+	if (ll_open_connection (index, false, when, rx_data) >= 0)
+	{
+		ll_advertising_enabled = 0;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// when is the end of the CONNECT_IND, the first anchor point is the start of
+// the transmit window
+
+int LinkLayer::ll_open_connection (int index, bool master, int64 when, const uint8 *connect_ind)
+{
+	Connection *connection;
+	int handle;
+	int window_size;
+	int window_offset;
+	int master_clock_accuracy;
+
+
+	for (handle = 0; handle < maximum_number_of_connections; handle ++)
+	{
+		if (!ll_connection[handle].in_use)
+		{
+			break;
+		}
+	}
+
+	if (handle == maximum_number_of_connections)
+	{
+		return -1;
+	}
+
+	connection = &ll_connection[handle];
+
+	memset (connection, 0, sizeof (Connection));
+
+	connection->in_use = true;
+	connection->master = master;
+	connection->machine = index;
+
+	if (master)
+	{
+		connection->peer_address_type = (connect_ind[0] & PDU_RXADD) ? 0x01 : 0x00;
+		connection->peer_address = get_pdu_address (&connect_ind[8]);
+	}
+	else
+	{
+		connection->peer_address_type = (connect_ind[0] & PDU_TXADD) ? 0x01 : 0x00;
+		connection->peer_address = get_pdu_address (&connect_ind[2]);
+	}
+
+	ll_resolve_peer_address (&connection->peer_address_type, &connection->peer_address);
+
+	connection->access_address = connect_ind[14] | (connect_ind[15] << 8) | (connect_ind[16] << 16) | ((uint32) connect_ind[17] << 24);
+	connection->crc_init = connect_ind[18] | (connect_ind[19] << 8) | (connect_ind[20] << 16);
+	window_size = connect_ind[21];
+	window_offset = connect_ind[22] | (connect_ind[23] << 8);
+	connection->interval = connect_ind[24] | (connect_ind[25] << 8);
+	connection->latency = connect_ind[26] | (connect_ind[27] << 8);
+	connection->supervision_timeout = connect_ind[28] | (connect_ind[29] << 8);
+	connection->hop_increment = connect_ind[35] & 0x1F;
+	master_clock_accuracy = (connect_ind[35] >> 5) & 0x07;
+	connection->master_clock_accuracy = master_clock_accuracy;
+
+	connection->channel_map = 0;
+	connection->number_of_used_channels = 0;
+
+	for (int channel = 0; channel < 37; channel ++)
+	{
+		if (connect_ind[30 + channel / 8] & (1 << (channel % 8)))
+		{
+			connection->channel_map |= 1ULL << channel;
+			connection->used_channel[connection->number_of_used_channels ++] = channel;
+		}
+	}
+
+	if ((connection->number_of_used_channels < 2) || (connection->interval == 0))
+	{
+		connection->in_use = false;
+		return -1;
+	}
+
+	// CSA#2 when both the advertising PDU and the CONNECT_IND had ChSel set,
+	// the slave always sets it in its ADV_IND
+
+	connection->csa2 = (connect_ind[0] & PDU_CHSEL) && ((!master) || ll_connect_ind_csa2);
+	connection->channel_identifier = csa2_channel_identifier (connection->access_address);
+	connection->lookahead_length = 0;
+
+	connection->unmapped_channel = 0;
+	select_data_channel (connection, 1);
+
+	connection->anchor = when + 1250 + window_offset * 1250;
+	connection->next_time = connection->anchor;
+	connection->window_end = connection->anchor + window_size * 1250 + phy_sync_time (GFSK_LE);
+	connection->substate = master ? CSS_Transmit : CSS_Receive;
+	connection->last_received = when;
+	connection->rssi = 127; // not available until a packet is received
+
+	connection->empty_pdu[0] = LLID_CONTINUATION;
+	connection->empty_pdu[1] = 0;
+	connection->rx_packet_boundary = 0x01;
+
+	machine[index].mk_connection (handle, master);
+
+	log (LOG_LINKLAYER, "LinkLayer::ll_open_connection %d %s AA %08lX interval %d %s hop %d", handle, master ? "master" : "slave", connection->access_address, connection->interval, connection->csa2 ? "CSA#2" : "CSA#1", connection->hop_increment);
+
+	send_le_connection_complete_event
+	(
+		EC_SUCCESS,
+		handle,
+		master ? 0x00 : 0x01,
+		connection->peer_address_type,
+		connection->peer_address,
+		connection->interval,
+		connection->latency,
+		connection->supervision_timeout,
+		master_clock_accuracy
+	);
+
+	return handle;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_close_connection (Connection *connection, int reason)
+{
+	AclBuffer *buffer;
+	int handle;
+
+
+	handle = connection - ll_connection;
+
+	log (LOG_LINKLAYER, "LinkLayer::ll_close_connection %d %02X", handle, reason);
+
+	ll_flush_received_acl_data (connection);
+
+	// packets not yet acknowledged are dropped, the host gets its credits
+	// back from the Disconnection Complete event
+
+	while (connection->tx_queue_head)
+	{
+		buffer = connection->tx_queue_head;
+		connection->tx_queue_head = buffer->next;
+		ll_free_acl_buffer (buffer);
+	}
+
+	connection->tx_queue_tail = 0;
+	connection->tx_pdu = 0;
+	connection->in_use = false;
+
+	machine[connection->machine].mk_idle ();
+
+	send_disconnection_complete_event (EC_SUCCESS, handle, reason);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+PhysicalPacket *LinkLayer::ll_next_connection_packet (int index, int64 after)
+{
+	Connection *connection;
+	LinkEncryption *link;
+	uint8 *pdu;
+	uint32 crc;
+	int64 missed;
+
+
+	connection = &ll_connection[machine[index].conn.ll_connection];
+
+	if (!connection->event_in_progress)
+	{
+		// connection events that the radio was too busy for are skipped in
+		// one go
+
+		if (connection->next_time < after)
+		{
+			missed = (after - connection->next_time) / (connection->interval * 1250) + 1;
+
+			ll_count_missed_events (missed);
+			ll_end_of_connection_event (connection, after, missed);
+
+			if (!connection->in_use)
+			{
+				return 0;
+			}
+		}
+
+		connection->event_in_progress = true;
+		connection->event_packets_received = 0;
+	}
+
+	if (connection->substate == CSS_Transmit)
+	{
+		if (connection->next_time < after)
+		{
+			ll_end_of_connection_event (connection, after, 1);
+			return 0;
+		}
+
+		// a PDU is sent again until it is acknowledged, control procedures
+		// go ahead of data
+
+		if (connection->tx_pdu == 0)
+		{
+			if ((!connection->control_pending) && (connection->encryption_pdus_due))
+			{
+				ll_build_encryption_pdu (connection);
+			}
+
+			if (connection->control_pending)
+			{
+				connection->tx_pdu = connection->control_pdu;
+			}
+			else if (connection->terminate_sent)
+			{
+				connection->tx_pdu = connection->terminate_pdu;
+			}
+			else if (data_waiting (connection))
+			{
+				connection->tx_pdu = connection->tx_queue_head->pdu[connection->tx_fragment];
+			}
+			else
+			{
+				connection->tx_pdu = connection->empty_pdu;
+			}
+
+			// encrypted once as it is chosen, a retransmission sends the
+			// same octets and the header bits set below are not covered by
+			// the MIC
+
+			link = &connection->encryption;
+			ll_encrypt_data_pdus (&link, &connection->tx_pdu, 1);
+		}
+
+		pdu = connection->tx_pdu;
+
+		connection->more_data = has_more_data (connection);
+
+		pdu[0] = (pdu[0] & DATA_HEADER_LLID) |
+			(connection->nesn ? DATA_HEADER_NESN : 0) |
+			(connection->sn ? DATA_HEADER_SN : 0) |
+			(connection->more_data ? DATA_HEADER_MD : 0);
+
+		crc = PhysicalPacket::calculate_crc (connection->crc_init, 2 + pdu[1], pdu);
+
+		ll_packet->set_transmit (connection->channel, GFSK_LE, connection->next_time);
+		ll_packet->set_access_address (connection->access_address);
+		ll_packet->set_crc_init (connection->crc_init);
+		ll_packet->set_pdu_reference (2 + pdu[1], pdu, crc);
+		ll_packet->set_llsm (index);
+
+		return ll_packet;
+	}
+
+	if (connection->window_end <= after)
+	{
+		ll_end_of_connection_event (connection, after, 1);
+		return 0;
+	}
+
+	ll_packet->set_receive (connection->channel, GFSK_LE, (connection->next_time > after) ? connection->next_time : after, connection->window_end);
+	ll_packet->set_access_address (connection->access_address);
+	ll_packet->set_crc_init (connection->crc_init);
+	ll_packet->set_llsm (index);
+
+	return ll_packet;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_connection_end_of_packet (int index, PhysicalPacket *packet, int64 when, int rx_len, const uint8 *rx_data)
+{
+	Connection *connection;
+
+
+	connection = &ll_connection[machine[index].conn.ll_connection];
+
+	if (packet->is_transmit ())
+	{
+		if (connection->terminate_received)
+		{
+			// the LL_TERMINATE_IND has now been acknowledged
+
+			ll_close_connection (connection, connection->terminate_reason);
+		}
+		else if ((connection->master) || ((connection->more_data || connection->peer_more_data) && room_for_exchange (connection, when)))
+		{
+			connection->substate = CSS_Receive;
+			connection->next_time = when;
+			connection->window_end = when + 150 + phy_sync_time (GFSK_LE) + receive_window_margin;
+		}
+		else
+		{
+			ll_end_of_connection_event (connection, when, 1);
+		}
+
+		return;
+	}
+
+	if (rx_len < 2)
+	{
+		// nothing heard, the connection event is over
+
+		ll_end_of_connection_event (connection, when, 1);
+		return;
+	}
+
+	connection->rssi = packet->get_rx_rssi ();
+
+	if ((!connection->master) && (connection->event_packets_received == 0))
+	{
+		// the slave takes its timing from the first packet of each event
+
+		connection->anchor = packet->get_rx_start_time ();
+	}
+
+	ll_connection_received (connection, when, rx_data);
+
+	if (!connection->in_use)
+	{
+		return;
+	}
+
+	if
+	(
+		(!connection->master) ||
+		(connection->terminate_received) ||
+		(
+			(connection->peer_more_data || connection->control_pending || connection->encryption_pdus_due || connection->terminate_sent || data_waiting (connection)) &&
+			room_for_exchange (connection, when)
+		)
+	)
+	{
+		connection->substate = CSS_Transmit;
+		connection->next_time = when + 150;
+	}
+	else
+	{
+		ll_end_of_connection_event (connection, when, 1);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_connection_received (Connection *connection, int64 when, const uint8 *rx_data)
+{
+	AclBuffer *buffer;
+	int handle;
+	int llid;
+	int length;
+
+
+	handle = connection - ll_connection;
+
+	connection->last_received = when;
+	connection->established = true;
+	connection->event_packets_received ++;
+	connection->peer_more_data = (rx_data[0] & DATA_HEADER_MD) != 0;
+
+	// a NESN that differs from our SN acknowledges the last PDU sent
+
+	if (((rx_data[0] & DATA_HEADER_NESN) ? 1 : 0) != connection->sn)
+	{
+		connection->sn ^= 1;
+
+		if (connection->tx_pdu == connection->terminate_pdu)
+		{
+			ll_close_connection (connection, EC_CONNECTION_TERMINATED_BY_LOCAL_HOST);
+			return;
+		}
+		else if (connection->tx_pdu == connection->control_pdu)
+		{
+			connection->control_pending = false;
+		}
+		else if ((connection->tx_pdu != 0) && (connection->tx_pdu != connection->empty_pdu))
+		{
+			connection->tx_fragment ++;
+
+			if (connection->tx_fragment == connection->tx_queue_head->number_of_fragments)
+			{
+				buffer = connection->tx_queue_head;
+				connection->tx_queue_head = buffer->next;
+				connection->tx_fragment = 0;
+
+				ll_free_acl_buffer (buffer);
+
+				send_number_of_completed_packets_event (when, handle, 1);
+			}
+		}
+
+		connection->tx_pdu = 0;
+	}
+
+	// an SN equal to our NESN is a new PDU, anything else is a retransmission
+
+	if (((rx_data[0] & DATA_HEADER_SN) ? 1 : 0) != connection->nesn)
+	{
+		return;
+	}
+
+	// an encrypted PDU was decrypted into rx_pdu before it was delivered, one
+	// that fails authentication ends the connection straight away
+
+	if (connection->rx_pdu_decrypted)
+	{
+		connection->rx_pdu_decrypted = false;
+
+		if (!connection->rx_pdu_authenticated)
+		{
+			ll_close_connection (connection, EC_CONNECTION_TERTMINATED_DUE_TO_MIC_FAILURE);
+			return;
+		}
+
+		rx_data = connection->rx_pdu;
+	}
+
+	connection->nesn ^= 1;
+
+	llid = rx_data[0] & DATA_HEADER_LLID;
+	length = rx_data[1];
+
+	if (llid == LLID_CONTROL)
+	{
+		if (length < 1)
+		{
+			return;
+		}
+
+		switch (rx_data[2])
+		{
+			case LL_TERMINATE_IND:
+				connection->terminate_received = true;
+				connection->terminate_reason = (length >= 2) ? rx_data[3] : EC_UNSPECIFIED_ERROR;
+				break;
+
+			case LL_ENC_REQ:
+			case LL_ENC_RSP:
+			case LL_START_ENC_REQ:
+			case LL_START_ENC_RSP:
+			case LL_REJECT_IND:
+			case LL_UNKNOWN_RSP:
+				ll_encryption_received (connection, length, &rx_data[2]);
+				break;
+
+			default:
+				if ((!connection->control_pending) && (connection->tx_pdu != connection->control_pdu))
+				{
+					connection->control_pdu[0] = LLID_CONTROL;
+					connection->control_pdu[1] = 2;
+					connection->control_pdu[2] = LL_UNKNOWN_RSP;
+					connection->control_pdu[3] = rx_data[2];
+					connection->control_pending = true;
+				}
+				break;
+		}
+
+		return;
+	}
+
+	if (llid == LLID_START)
+	{
+		ll_flush_received_acl_data (connection);
+		connection->rx_packet_boundary = 0x02;
+	}
+	else if ((llid != LLID_CONTINUATION) || (length == 0))
+	{
+		return;
+	}
+
+	if (length > maximum_data_pdu_payload_length)
+	{
+		length = maximum_data_pdu_payload_length;
+	}
+
+	if (connection->rx_length + length > le_acl_data_packet_length)
+	{
+		ll_flush_received_acl_data (connection);
+	}
+
+	memcpy (&connection->rx_data[connection->rx_length], &rx_data[2], length);
+	connection->rx_length += length;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the LL control PDUs of the encryption start procedure, payload starts with
+// the opcode and length is the payload length. PDUs that arrive out of turn
+// are ignored.
+
+void LinkLayer::ll_encryption_received (Connection *connection, int length, const uint8 *payload)
+{
+	uint8 random[8];
+	int handle;
+
+
+	handle = connection - ll_connection;
+
+	log (LOG_LINKLAYER, "LinkLayer::ll_encryption_received %d %02X", handle, payload[0]);
+
+	switch (payload[0])
+	{
+		case LL_ENC_REQ:
+			if ((connection->master) || (length < 23))
+			{
+				break;
+			}
+
+			if (!ll_encryption_supported)
+			{
+				connection->encryption_reject_reason = EC_UNSUPPORTED_REMOTE_FEATURE_UNSUPPORTED_LMP_FEATURE;
+				connection->encryption_pdus_due |= 1 << LL_REJECT_IND;
+				break;
+			}
+
+			if ((connection->encryption_substate != ESS_Idle) || (connection->encryption.rx_enabled))
+			{
+				connection->encryption_reject_reason = EC_LMP_PDU_NOT_ALLOWED;
+				connection->encryption_pdus_due |= 1 << LL_REJECT_IND;
+				break;
+			}
+
+			memcpy (connection->encryption_rand, &payload[1], 8);
+			memcpy (connection->encryption_ediv, &payload[9], 2);
+			memcpy (&connection->encryption_skd[0], &payload[11], 8);
+			memcpy (&connection->encryption_iv[0], &payload[19], 4);
+
+			ll_rand (&connection->encryption_skd[8]);
+			ll_rand (random);
+			memcpy (&connection->encryption_iv[4], random, 4);
+
+			connection->encryption_substate = ESS_Wait_Key;
+			connection->encryption_pdus_due |= 1 << LL_ENC_RSP;
+
+			send_le_long_term_key_request_event (handle, connection->encryption_rand, connection->encryption_ediv);
+			break;
+
+		case LL_ENC_RSP:
+			if ((!connection->master) || (length < 13) || (connection->encryption_substate != ESS_Wait_Enc_Rsp))
+			{
+				break;
+			}
+
+			memcpy (&connection->encryption_skd[8], &payload[1], 8);
+			memcpy (&connection->encryption_iv[4], &payload[9], 4);
+
+			ll_start_link_encryption (&connection->encryption, true, connection->encryption_ltk, connection->encryption_skd, connection->encryption_iv);
+
+			connection->encryption_substate = ESS_Wait_Start_Enc_Req;
+			break;
+
+		case LL_START_ENC_REQ:
+			if ((!connection->master) || (connection->encryption_substate != ESS_Wait_Start_Enc_Req))
+			{
+				break;
+			}
+
+			// the master's LL_START_ENC_RSP is the first PDU sent encrypted
+
+			connection->encryption.tx_enabled = true;
+			connection->encryption.rx_enabled = true;
+
+			connection->encryption_substate = ESS_Wait_Start_Enc_Rsp;
+			connection->encryption_pdus_due |= 1 << LL_START_ENC_RSP;
+			break;
+
+		case LL_START_ENC_RSP:
+			if (connection->encryption_substate != ESS_Wait_Start_Enc_Rsp)
+			{
+				break;
+			}
+
+			if (!connection->master)
+			{
+				connection->encryption.tx_enabled = true;
+				connection->encryption_pdus_due |= 1 << LL_START_ENC_RSP;
+			}
+
+			connection->encryption_substate = ESS_Idle;
+
+			send_encryption_change_event (EC_SUCCESS, handle, 0x01);
+			break;
+
+		case LL_REJECT_IND:
+		case LL_UNKNOWN_RSP:
+			if ((!connection->master) || (length < 2))
+			{
+				break;
+			}
+
+			if ((connection->encryption_substate != ESS_Wait_Enc_Rsp) && (connection->encryption_substate != ESS_Wait_Start_Enc_Req))
+			{
+				break;
+			}
+
+			if ((payload[0] == LL_UNKNOWN_RSP) && (payload[1] != LL_ENC_REQ))
+			{
+				break;
+			}
+
+			connection->encryption_substate = ESS_Idle;
+
+			send_encryption_change_event ((payload[0] == LL_REJECT_IND) ? payload[1] : EC_UNSUPPORTED_REMOTE_FEATURE_UNSUPPORTED_LMP_FEATURE, handle, 0x00);
+			break;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the next LL control PDU owed by the encryption start procedure, in opcode
+// order, goes into control_pdu
+
+void LinkLayer::ll_build_encryption_pdu (Connection *connection)
+{
+	uint8 *pdu;
+	uint8 opcode;
+
+
+	opcode = 0;
+
+	while (!(connection->encryption_pdus_due & (1 << opcode)))
+	{
+		opcode ++;
+	}
+
+	connection->encryption_pdus_due &= ~(1 << opcode);
+
+	pdu = connection->control_pdu;
+
+	pdu[0] = LLID_CONTROL;
+	pdu[1] = 1;
+	pdu[2] = opcode;
+
+	switch (opcode)
+	{
+		case LL_ENC_REQ:
+			memcpy (&pdu[3], connection->encryption_rand, 8);
+			memcpy (&pdu[11], connection->encryption_ediv, 2);
+			memcpy (&pdu[13], &connection->encryption_skd[0], 8);
+			memcpy (&pdu[21], &connection->encryption_iv[0], 4);
+			pdu[1] = 23;
+			break;
+
+		case LL_ENC_RSP:
+			memcpy (&pdu[3], &connection->encryption_skd[8], 8);
+			memcpy (&pdu[11], &connection->encryption_iv[4], 4);
+			pdu[1] = 13;
+			break;
+
+		case LL_START_ENC_REQ:
+			// sent in the clear, the master answers encrypted
+
+			connection->encryption.rx_enabled = true;
+			break;
+
+		case LL_REJECT_IND:
+			pdu[3] = connection->encryption_reject_reason;
+			pdu[1] = 2;
+			break;
+	}
+
+	connection->control_pending = true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the fragments received so far go to the host as one ACL data packet, what
+// follows is a continuation
+
+void LinkLayer::ll_flush_received_acl_data (Connection *connection)
+{
+	if (connection->rx_length > 0)
+	{
+		send_acl_data (connection - ll_connection, connection->rx_packet_boundary, connection->rx_length, connection->rx_data);
+
+		connection->rx_length = 0;
+		connection->rx_packet_boundary = 0x01;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// count is the number of events ended, more than one when events were
+// skipped
+
+void LinkLayer::ll_end_of_connection_event (Connection *connection, int64 when, int64 count)
+{
+	ll_flush_received_acl_data (connection);
+
+	connection->event_in_progress = false;
+
+	if ((connection->established) && (when - connection->last_received > connection->supervision_timeout * 10000LL))
+	{
+		ll_close_connection (connection, EC_CONNECTION_TIMEOUT);
+		return;
+	}
+
+	if ((!connection->established) && (connection->event_counter + count > 5))
+	{
+		ll_close_connection (connection, EC_CONNECTION_FAILED_TO_BE_ESTABLISHED);
+		return;
+	}
+
+	connection->event_counter += count;
+	connection->anchor += count * connection->interval * 1250;
+
+	select_data_channel (connection, count);
+
+	if (connection->master)
+	{
+		connection->substate = CSS_Transmit;
+		connection->next_time = connection->anchor;
+	}
+	else
+	{
+		connection->substate = CSS_Receive;
+		connection->next_time = connection->anchor - receive_window_margin;
+		connection->window_end = connection->anchor + phy_sync_time (GFSK_LE) + receive_window_margin;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
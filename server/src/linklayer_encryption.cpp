@@ -0,0 +1,407 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include <stdlib.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "controller.h"
+#include "log.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the largest number of data PDUs en/decrypted in one call, larger batches
+// are split
+
+const int maximum_encryption_batch = 16;
+
+////////////////////////////////////////////////////////////////////////////////
+
+// HCI and the LL carry keys and values least significant octet first, the
+// security functions want the most significant octet first
+
+static void reverse_octets (const uint8 *in, uint8 *out, int len)
+{
+	for (int index = 0; index < len; index ++)
+	{
+		out[index] = in[len - 1 - index];
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_encrypt (const uint8 *key, const uint8 *plaintext, uint8 *encrypted)
+{
+	AesKey expanded;
+	uint8 k[16];
+	uint8 in[16];
+	uint8 out[16];
+
+
+	reverse_octets (key, k, 16);
+	reverse_octets (plaintext, in, 16);
+
+	aes_expand_key (k, &expanded);
+	aes_encrypt (&expanded, in, out);
+
+	reverse_octets (out, encrypted, 16);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_rand (uint8 *random)
+{
+	for (int index = 0; index < 8; index ++)
+	{
+		random[index] = rand () & 0xFF;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// skd is SKDm || SKDs and iv is IVm || IVs as carried in LL_ENC_REQ and
+// LL_ENC_RSP, SK = e (LTK, SKD). Neither direction is encrypted until the
+// procedure turns it on.
+
+void LinkLayer::ll_start_link_encryption (LinkEncryption *link, bool master, const uint8 *ltk, const uint8 *skd, const uint8 *iv)
+{
+	AesKey expanded;
+	uint8 k[16];
+	uint8 in[16];
+	uint8 sk[16];
+
+
+	reverse_octets (ltk, k, 16);
+	reverse_octets (skd, in, 16);
+
+	aes_expand_key (k, &expanded);
+	aes_encrypt (&expanded, in, sk);
+
+	aes_expand_key (sk, &link->session_key);
+	memcpy (link->iv, iv, 8);
+
+	link->master = master;
+	link->tx_packet_counter = 0;
+	link->rx_packet_counter = 0;
+	link->tx_enabled = false;
+	link->rx_enabled = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// nonce = packetCounter (39 bits) || directionBit || IV, the direction bit
+// is set for packets from the master
+
+static void build_nonce (uint8 *nonce, uint64 counter, bool from_master, const uint8 *iv)
+{
+	nonce[0] = (counter >> 0) & 0xFF;
+	nonce[1] = (counter >> 8) & 0xFF;
+	nonce[2] = (counter >> 16) & 0xFF;
+	nonce[3] = (counter >> 24) & 0xFF;
+	nonce[4] = ((counter >> 32) & 0x7F) | (from_master ? 0x80 : 0x00);
+	memcpy (&nonce[5], iv, 8);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// pdu points at the data channel PDU header, the payload is encrypted in
+// place, the MIC appended and the length updated. Empty PDUs are sent in the
+// clear and do not use a packet counter.
+
+void LinkLayer::ll_encrypt_data_pdus (LinkEncryption *const *link, uint8 *const *pdu, int count)
+{
+	CcmPacket packet[maximum_encryption_batch];
+	uint8 nonce[maximum_encryption_batch][13];
+	int batch;
+
+
+	for (int first = 0; first < count; first += maximum_encryption_batch)
+	{
+		batch = 0;
+
+		for (int index = first; (index < count) && (index < first + maximum_encryption_batch); index ++)
+		{
+			if (!link[index]->tx_enabled || (pdu[index][1] == 0))
+			{
+				continue;
+			}
+
+			build_nonce (nonce[batch], link[index]->tx_packet_counter ++, link[index]->master, link[index]->iv);
+
+			packet[batch].key = &link[index]->session_key;
+			packet[batch].nonce = nonce[batch];
+			packet[batch].header = pdu[index][0];
+			packet[batch].length = pdu[index][1];
+			packet[batch].payload = &pdu[index][2];
+			packet[batch].mic = &pdu[index][2 + pdu[index][1]];
+
+			pdu[index][1] += ccm_mic_length;
+			batch ++;
+		}
+
+		aes_ccm_encrypt (packet, batch);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the reverse of the above, the MIC is removed from the length and the
+// number of packets that failed authentication returned
+
+int LinkLayer::ll_decrypt_data_pdus (LinkEncryption *const *link, uint8 *const *pdu, int count, bool *authenticated)
+{
+	CcmPacket packet[maximum_encryption_batch];
+	uint8 nonce[maximum_encryption_batch][13];
+	int position[maximum_encryption_batch];
+	int failures;
+	int batch;
+
+
+	failures = 0;
+
+	for (int first = 0; first < count; first += maximum_encryption_batch)
+	{
+		batch = 0;
+
+		for (int index = first; (index < count) && (index < first + maximum_encryption_batch); index ++)
+		{
+			authenticated[index] = true;
+
+			if (!link[index]->rx_enabled || (pdu[index][1] == 0))
+			{
+				continue;
+			}
+
+			if (pdu[index][1] < ccm_mic_length)
+			{
+				authenticated[index] = false;
+				failures ++;
+				continue;
+			}
+
+			build_nonce (nonce[batch], link[index]->rx_packet_counter ++, !link[index]->master, link[index]->iv);
+
+			pdu[index][1] -= ccm_mic_length;
+
+			packet[batch].key = &link[index]->session_key;
+			packet[batch].nonce = nonce[batch];
+			packet[batch].header = pdu[index][0];
+			packet[batch].length = pdu[index][1];
+			packet[batch].payload = &pdu[index][2];
+			packet[batch].mic = &pdu[index][2 + pdu[index][1]];
+
+			position[batch] = index;
+			batch ++;
+		}
+
+		aes_ccm_decrypt (packet, batch);
+
+		for (int index = 0; index < batch; index ++)
+		{
+			if (!packet[index].authenticated)
+			{
+				authenticated[position[index]] = false;
+				failures ++;
+			}
+		}
+	}
+
+	return failures;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the encrypted PDUs received in one step of the simulation, see
+// PhysicalLayer::physical_layer_simulation_thread
+
+static int received_batch_length = 0;
+static Connection *received_connection[maximum_encryption_batch];
+static LinkEncryption *received_link[maximum_encryption_batch];
+static uint8 *received_pdu[maximum_encryption_batch];
+
+////////////////////////////////////////////////////////////////////////////////
+
+// called for each packet the physical layer is about to deliver, a new
+// non-empty PDU on an encrypted connection is copied and queued to be
+// decrypted, retransmissions were decrypted the first time they were heard
+
+void LinkLayer::ll_prepare_received_pdu (PhysicalPacket *packet, int rx_len, const uint8 *rx_data)
+{
+	Connection *connection;
+	int index;
+
+
+	index = packet->get_llsm ();
+
+	if ((machine[index].state != LLS_Master) && (machine[index].state != LLS_Slave))
+	{
+		return;
+	}
+
+	connection = &ll_connection[machine[index].conn.ll_connection];
+
+	if ((!connection->encryption.rx_enabled) || (rx_len < 2) || (rx_data[1] == 0))
+	{
+		return;
+	}
+
+	if (((rx_data[0] & DATA_HEADER_SN) ? 1 : 0) != connection->nesn)
+	{
+		return;
+	}
+
+	connection->rx_pdu_decrypted = true;
+	connection->rx_pdu_authenticated = false;
+
+	if (2 + rx_data[1] > maximum_data_pdu_length)
+	{
+		// too long to carry a MIC after the largest payload
+
+		return;
+	}
+
+	memcpy (connection->rx_pdu, rx_data, 2 + rx_data[1]);
+
+	if (received_batch_length == maximum_encryption_batch)
+	{
+		ll_decrypt_received_pdus ();
+	}
+
+	received_connection[received_batch_length] = connection;
+	received_link[received_batch_length] = &connection->encryption;
+	received_pdu[received_batch_length] = connection->rx_pdu;
+	received_batch_length ++;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_decrypt_received_pdus (void)
+{
+	bool authenticated[maximum_encryption_batch];
+
+
+	if (received_batch_length == 0)
+	{
+		return;
+	}
+
+	ll_decrypt_data_pdus (received_link, received_pdu, received_batch_length, authenticated);
+
+	for (int index = 0; index < received_batch_length; index ++)
+	{
+		received_connection[index]->rx_pdu_authenticated = authenticated[index];
+	}
+
+	received_batch_length = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the sample data of the Core Specification (Vol 6 Part C, 1), checked once
+// as the first controller is created, LE Encryption is not offered by any
+// controller if it fails. LTK, SKD, IV and SK are least
+// significant octet first, the PDUs are LL_START_ENC_RSP with packet
+// counter 0 in each direction.
+
+bool LinkLayer::ll_check_encryption_sample_data (void)
+{
+	static const uint8 ltk[16] = { 0xBF, 0x01, 0xFB, 0x9D, 0x4E, 0xF3, 0xBC, 0x36, 0xD8, 0x74, 0xF5, 0x39, 0x41, 0x38, 0x68, 0x4C };
+	static const uint8 skd[16] = { 0x13, 0x02, 0xF1, 0xE0, 0xDF, 0xCE, 0xBD, 0xAC, 0x79, 0x68, 0x57, 0x46, 0x35, 0x24, 0x13, 0x02 };
+	static const uint8 iv[8] = { 0x24, 0xAB, 0xDC, 0xBA, 0xBE, 0xBA, 0xAF, 0xDE };
+	static const uint8 sk[16] = { 0x66, 0xC6, 0xC2, 0x27, 0x8E, 0x3B, 0x8E, 0x05, 0x3E, 0x7E, 0xA3, 0x26, 0x52, 0x1B, 0xAD, 0x99 };
+	static const uint8 encrypted[2][7] =
+	{
+		{ 0x0F, 0x05, 0x9F, 0xCD, 0xA7, 0xF4, 0x48 }, // master to slave
+		{ 0x07, 0x05, 0xA3, 0x4C, 0x13, 0xA4, 0x15 }, // slave to master
+	};
+	LinkEncryption master;
+	LinkEncryption slave;
+	LinkEncryption *link[2];
+	uint8 pdu[2][7];
+	uint8 *pdus[2];
+	bool authenticated[2];
+	uint8 out[16];
+	AesKey expanded;
+	uint8 k[16];
+	uint8 in[16];
+
+
+	reverse_octets (ltk, k, 16);
+	reverse_octets (skd, in, 16);
+	aes_expand_key (k, &expanded);
+	aes_encrypt (&expanded, in, out);
+	reverse_octets (out, k, 16);
+
+	if (memcmp (k, sk, 16) != 0)
+	{
+		log (LOG_ERROR, "LinkLayer: the session key does not match the sample data");
+		return false;
+	}
+
+	ll_start_link_encryption (&master, true, ltk, skd, iv);
+	ll_start_link_encryption (&slave, false, ltk, skd, iv);
+
+	master.tx_enabled = master.rx_enabled = true;
+	slave.tx_enabled = slave.rx_enabled = true;
+
+	pdu[0][0] = 0x0F;
+	pdu[1][0] = 0x07;
+
+	for (int index = 0; index < 2; index ++)
+	{
+		pdu[index][1] = 1;
+		pdu[index][2] = LL_START_ENC_RSP;
+		pdus[index] = pdu[index];
+	}
+
+	link[0] = &master;
+	link[1] = &slave;
+
+	ll_encrypt_data_pdus (link, pdus, 2);
+
+	if (memcmp (pdu, encrypted, sizeof (pdu)) != 0)
+	{
+		log (LOG_ERROR, "LinkLayer: the encrypted PDUs do not match the sample data");
+		return false;
+	}
+
+	link[0] = &slave;
+	link[1] = &master;
+
+	if ((ll_decrypt_data_pdus (link, pdus, 2, authenticated) != 0) || (pdu[0][2] != LL_START_ENC_RSP) || (pdu[1][2] != LL_START_ENC_RSP))
+	{
+		log (LOG_ERROR, "LinkLayer: the sample data does not decrypt");
+		return false;
+	}
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
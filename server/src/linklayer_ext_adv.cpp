@@ -0,0 +1,805 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include <stdlib.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "controller.h"
+#include "hci.h"
+#include "log.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+struct ExtendedHeader
+{
+	int adv_mode;
+	uint8 flags;
+	uint64 adva;
+	uint16 adi;
+	const uint8 *aux_ptr;
+	const uint8 *sync_info;
+	const uint8 *data;
+	int data_len;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+static bool parse_extended_header (int rx_len, const uint8 *rx_data, ExtendedHeader *header)
+{
+	int length;
+	int ext_len;
+	int p;
+
+
+	if (rx_len < 3)
+	{
+		return false;
+	}
+
+	length = rx_data[1];
+	ext_len = rx_data[2] & 0x3F;
+
+	if ((length + 2 > rx_len) || (1 + ext_len > length))
+	{
+		return false;
+	}
+
+	header->adv_mode = rx_data[2] >> 6;
+	header->flags = 0;
+	header->adva = 0;
+	header->adi = 0;
+	header->aux_ptr = 0;
+	header->sync_info = 0;
+
+	p = 3;
+
+	if (ext_len > 0)
+	{
+		header->flags = rx_data[p++];
+	}
+
+	if (header->flags & EXT_HEADER_ADVA)
+	{
+		for (int index = 0; index < 6; index ++)
+		{
+			header->adva |= ((uint64) rx_data[p++]) << (8 * index);
+		}
+	}
+
+	if (header->flags & EXT_HEADER_TARGETA)
+	{
+		p += 6;
+	}
+
+	if (header->flags & EXT_HEADER_CTEINFO)
+	{
+		p += 1;
+	}
+
+	if (header->flags & EXT_HEADER_ADI)
+	{
+		header->adi = rx_data[p] | (rx_data[p + 1] << 8);
+		p += 2;
+	}
+
+	if (header->flags & EXT_HEADER_AUXPTR)
+	{
+		header->aux_ptr = &rx_data[p];
+		p += 3;
+	}
+
+	if (header->flags & EXT_HEADER_SYNCINFO)
+	{
+		header->sync_info = &rx_data[p];
+		p += 18;
+	}
+
+	if (header->flags & EXT_HEADER_TXPOWER)
+	{
+		p += 1;
+	}
+
+	if (p > 3 + ext_len)
+	{
+		return false;
+	}
+
+	header->data = &rx_data[3 + ext_len];
+	header->data_len = length - 1 - ext_len;
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static bool hci_phy_to_modulation (int hci_phy, PhyModulation *mod)
+{
+	switch (hci_phy)
+	{
+		case 0x01: *mod = GFSK_LE; return true;
+		case 0x02: *mod = GFSK_LE_2M; return true;
+		case 0x03: *mod = GFSK_LE_CODED_S8; return true;
+	}
+
+	return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+AdvertisingSet *LinkLayer::ll_find_advertising_set (int handle)
+{
+	for (int index = 0; index < maximum_number_of_advertising_sets; index ++)
+	{
+		if ((ll_advertising_set[index].in_use) && (ll_advertising_set[index].handle == handle))
+		{
+			return &ll_advertising_set[index];
+		}
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_set_extended_advertising_parameters (int handle, int properties, int interval, int channel_map, int own_address_type, int peer_address_type, uint64 peer_address, int primary_phy, int secondary_phy, int sid)
+{
+	AdvertisingSet *set;
+	PhyModulation primary;
+	PhyModulation secondary;
+
+
+	if ((handle > 0xEF) || (sid > 0x0F))
+	{
+		return EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	if ((primary_phy == 0x02) || !hci_phy_to_modulation (primary_phy, &primary) || !hci_phy_to_modulation (secondary_phy, &secondary))
+	{
+		return EC_UNSUPPORTED_FEATURE_OR_PARAMETER_VALUE;
+	}
+
+	if (properties & (ADV_PROP_DIRECTED | ADV_PROP_HIGH_DUTY_DIRECTED))
+	{
+		return EC_UNSUPPORTED_FEATURE_OR_PARAMETER_VALUE;
+	}
+
+	set = ll_find_advertising_set (handle);
+
+	if (set == 0)
+	{
+		for (int index = 0; index < maximum_number_of_advertising_sets; index ++)
+		{
+			if (!ll_advertising_set[index].in_use)
+			{
+				set = &ll_advertising_set[index];
+				set->reset ();
+				set->in_use = true;
+				set->handle = handle;
+				break;
+			}
+		}
+
+		if (set == 0)
+		{
+			return EC_MEMORY_CAPACITY_EXCEEDED;
+		}
+	}
+	else if (set->enabled)
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	if (!set->set_parameters (properties, interval, channel_map, own_address_type, peer_address_type, peer_address, primary, secondary, sid))
+	{
+		return EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	ll_build_advertising_set (set);
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_set_extended_advertising_data (int handle, int operation, int len, const uint8 *data)
+{
+	AdvertisingSet *set;
+
+
+	set = ll_find_advertising_set (handle);
+
+	if (set == 0)
+	{
+		return EC_UNKNOWN_ADVERTISING_IDENTIFIER;
+	}
+
+	// while advertising only complete data can be supplied, so an event never
+	// goes out with half of the new data
+
+	if ((set->enabled) && (operation != 0x03) && (operation != 0x04))
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	if (!set->set_data (operation, len, data))
+	{
+		return EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	if ((operation == 0x02) || (operation == 0x03) || (operation == 0x04))
+	{
+		ll_build_advertising_set (set);
+	}
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_set_extended_advertising_enable (int enable, int handle, int duration, int max_events)
+{
+	AdvertisingSet *set;
+	int set_index;
+	int index;
+
+
+	if ((!enable) && (handle < 0))
+	{
+		// disable all sets
+
+		for (set_index = 0; set_index < maximum_number_of_advertising_sets; set_index ++)
+		{
+			if (ll_advertising_set[set_index].enabled)
+			{
+				ll_set_extended_advertising_enable (0, ll_advertising_set[set_index].handle, 0, 0);
+			}
+		}
+
+		return EC_SUCCESS;
+	}
+
+	set = ll_find_advertising_set (handle);
+
+	if (set == 0)
+	{
+		return EC_UNKNOWN_ADVERTISING_IDENTIFIER;
+	}
+
+	set_index = set - ll_advertising_set;
+
+	if (enable)
+	{
+		set->duration = duration;
+		set->max_events = max_events;
+		set->number_of_events = 0;
+		set->end_of_duration = last_clock + duration;
+
+		if (set->enabled)
+		{
+			return EC_SUCCESS;
+		}
+
+		for (index = 0; index < maximum_number_of_link_layer_state_machines; index ++)
+		{
+			if (machine[index].state == LLS_Idle)
+			{
+				set->enabled = true;
+				machine[index].mk_extended_advertiser (last_clock, set_index);
+
+				return EC_SUCCESS;
+			}
+		}
+
+		return EC_MEMORY_CAPACITY_EXCEEDED;
+	}
+
+	if (set->enabled)
+	{
+		for (index = 0; index < maximum_number_of_link_layer_state_machines; index ++)
+		{
+			if ((machine[index].state == LLS_Advertising) && (machine[index].adv.ll_advertising_set == set_index))
+			{
+				machine[index].mk_idle ();
+			}
+		}
+
+		set->enabled = false;
+	}
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_remove_advertising_set (int handle)
+{
+	AdvertisingSet *set;
+
+
+	set = ll_find_advertising_set (handle);
+
+	if (set == 0)
+	{
+		return EC_UNKNOWN_ADVERTISING_IDENTIFIER;
+	}
+
+	if ((set->enabled) || (set->periodic_enabled))
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	set->reset ();
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_clear_advertising_sets (void)
+{
+	for (int index = 0; index < maximum_number_of_advertising_sets; index ++)
+	{
+		if ((ll_advertising_set[index].enabled) || (ll_advertising_set[index].periodic_enabled))
+		{
+			return EC_COMMAND_DISALLOWED;
+		}
+	}
+
+	for (int index = 0; index < maximum_number_of_advertising_sets; index ++)
+	{
+		ll_advertising_set[index].reset ();
+	}
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_get_number_of_advertising_sets (void)
+{
+	return maximum_number_of_advertising_sets;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_set_extended_scan_parameters (int own_address_type, int scanning_filter_policy, int scanning_phys, int number_of_phys, const int *scan_type, const int *scan_interval, const int *scan_window)
+{
+	int phy;
+
+
+	if (ll_scanning_enabled)
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	if (scanning_phys & ~(hci_phy_le_1m | hci_phy_le_coded))
+	{
+		return EC_UNSUPPORTED_FEATURE_OR_PARAMETER_VALUE;
+	}
+
+	if ((number_of_phys < 1) || (number_of_phys > 2))
+	{
+		return EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	for (phy = 0; phy < number_of_phys; phy ++)
+	{
+		if ((scan_interval[phy] == 0) || (scan_window[phy] > scan_interval[phy]))
+		{
+			return EC_INVALID_HCI_COMMAND_PARAMETERS;
+		}
+	}
+
+	phy = 0;
+
+	if (scanning_phys & hci_phy_le_1m)
+	{
+		ll_scan_phy_modulation[phy++] = GFSK_LE;
+	}
+
+	if (scanning_phys & hci_phy_le_coded)
+	{
+		ll_scan_phy_modulation[phy++] = GFSK_LE_CODED_S8; // receives either coding
+	}
+
+	for (phy = 0; phy < number_of_phys; phy ++)
+	{
+		ll_scan_phy_interval[phy] = scan_interval[phy];
+		ll_scan_phy_window[phy] = scan_window[phy];
+	}
+
+	ll_scan_number_of_phys = number_of_phys;
+	ll_scan_type = scan_type[0];
+	ll_scan_interval = scan_interval[0];
+	ll_scan_window = scan_window[0];
+	ll_scan_own_address_type = own_address_type;
+	ll_scanning_filter_policy = scanning_filter_policy;
+	ll_scan_extended = true;
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool LinkLayer::ll_set_extended_scan_enable (int enable, int filter_duplicates)
+{
+	if ((enable) && (ll_scanning_enabled == false))
+	{
+		ll_scan_extended = true;
+	}
+
+	return ll_set_scan_enable (enable, filter_duplicates);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+PhysicalPacket *LinkLayer::ll_next_extended_advertising_packet (int index, int64 after)
+{
+	LinkLayerStateMachine *llsm;
+	AdvertisingSet *set;
+	AdvertisingEventPacket *entry;
+	int64 tx;
+	int64 missed;
+
+
+	llsm = &machine[index];
+	set = &ll_advertising_set[llsm->adv.ll_advertising_set];
+
+	if (llsm->adv.ll_advertising_event_start + set->get_packet (llsm->adv.ll_advertising_schedule, llsm->adv.ll_advertising_channel)->offset <= after)
+	{
+		// too late for the rest of this event, the aux packets would be
+		// out of step with the AuxPtr already sent, so it and any events
+		// after it that have also gone by are ended in one step
+
+		missed = (after - llsm->adv.ll_next_advertising_instant) / (set->interval * 625) + 1;
+
+		ll_count_missed_events (missed);
+		ll_end_of_extended_advertising_event (index, missed);
+
+		if (!set->enabled)
+		{
+			return 0;
+		}
+	}
+
+	if (llsm->adv.ll_advertising_channel == 0)
+	{
+		// first packet of an event, pick up the latest build
+
+		llsm->adv.ll_advertising_schedule = set->schedule_index;
+		set->schedule_referenced = set->schedule_index;
+	}
+
+	entry = set->get_packet (llsm->adv.ll_advertising_schedule, llsm->adv.ll_advertising_channel);
+	tx = llsm->adv.ll_advertising_event_start + entry->offset;
+
+	if (entry->sync_info)
+	{
+		ll_update_sync_info (set, entry, tx);
+	}
+
+	ll_packet->set_transmit (entry->channel, entry->modulation, tx);
+	ll_packet->set_access_address (advertising_access_address);
+	ll_packet->set_pdu_reference (entry->pdu_length, entry->pdu, entry->crc);
+	ll_packet->set_llsm (index);
+
+	llsm->adv.ll_next_advertising_tx = tx;
+	llsm->adv.ll_advertising_channel ++;
+
+	if (llsm->adv.ll_advertising_channel >= set->number_of_packets[llsm->adv.ll_advertising_schedule])
+	{
+		ll_end_of_extended_advertising_event (index, 1);
+	}
+
+	return ll_packet;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// count is more than one when events that the radio was too busy for are
+// ended along with this one
+
+void LinkLayer::ll_end_of_extended_advertising_event (int index, int64 count)
+{
+	LinkLayerStateMachine *llsm;
+	AdvertisingSet *set;
+	int status;
+
+
+	llsm = &machine[index];
+	set = &ll_advertising_set[llsm->adv.ll_advertising_set];
+
+	set->number_of_events += count;
+
+	llsm->adv.ll_advertising_channel = 0;
+	llsm->adv.ll_next_advertising_instant += count * set->interval * 625;
+	llsm->adv.ll_advertising_event_start = llsm->adv.ll_next_advertising_instant + (rand () % 16) * 625;
+	llsm->adv.ll_next_advertising_tx = llsm->adv.ll_advertising_event_start;
+
+	if ((set->max_events > 0) && (set->number_of_events >= set->max_events))
+	{
+		status = EC_LIMIT_REACHED;
+	}
+	else if ((set->duration > 0) && (llsm->adv.ll_advertising_event_start >= set->end_of_duration))
+	{
+		status = EC_DIRECTED_ADVERTISING_TIMEOUT;
+	}
+	else
+	{
+		return;
+	}
+
+	log (LOG_LINKLAYER, "LinkLayer::ll_end_of_extended_advertising_event %02X terminated %02X after %d", set->handle, status, set->number_of_events);
+
+	set->enabled = false;
+	llsm->mk_idle ();
+
+	send_le_advertising_set_terminated_event (status, set->handle, set->number_of_events);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// a scanner only listens when what it hears can go somewhere, either to the
+// host as reports or to a pending LE Periodic Advertising Create Sync
+
+bool LinkLayer::ll_scanning_wanted (void)
+{
+	if (ll_sync_pending)
+	{
+		return true;
+	}
+
+	return ll_host_wants_le_event (ll_scan_extended ? LE_EXTENDED_ADVERTISING_REPORT_EVENT : LE_ADVERTISING_REPORT_EVENT);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// scan windows that went by while nobody wanted what was in them were not
+// missed, scanning picks up again from now
+
+void LinkLayer::ll_restart_scanning (void)
+{
+	for (int index = 0; index < maximum_number_of_link_layer_state_machines; index ++)
+	{
+		if (machine[index].state == LLS_Scanning)
+		{
+			machine[index].mk_scanner (last_clock);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_report_legacy_pdu (int64 when, int rssi, int rx_len, const uint8 *rx_data)
+{
+	int event_type;
+	int legacy_event_type;
+	int address_type;
+	uint64 address;
+	int data_len;
+
+
+	if ((rx_len < 8) || (!ll_host_wants_le_event (ll_scan_extended ? LE_EXTENDED_ADVERTISING_REPORT_EVENT : LE_ADVERTISING_REPORT_EVENT)))
+	{
+		return;
+	}
+
+	switch (rx_data[0] & 0x0F)
+	{
+		case PDU_ADV_IND:
+			event_type = ADV_PROP_LEGACY | ADV_PROP_SCANNABLE | ADV_PROP_CONNECTABLE;
+			legacy_event_type = 0x00;
+			break;
+
+		case PDU_ADV_DIRECT_IND:
+			event_type = ADV_PROP_LEGACY | ADV_PROP_DIRECTED | ADV_PROP_CONNECTABLE;
+			legacy_event_type = 0x01;
+			break;
+
+		case PDU_ADV_SCAN_IND:
+			event_type = ADV_PROP_LEGACY | ADV_PROP_SCANNABLE;
+			legacy_event_type = 0x02;
+			break;
+
+		case PDU_ADV_NONCONN_IND:
+			event_type = ADV_PROP_LEGACY;
+			legacy_event_type = 0x03;
+			break;
+
+		default:
+			return;
+	}
+
+	address_type = (rx_data[0] & PDU_TXADD) ? 0x01 : 0x00;
+	address = ((uint64) rx_data[2]) | ((uint64) rx_data[3] << 8) | ((uint64) rx_data[4] << 16) | ((uint64) rx_data[5] << 24) | ((uint64) rx_data[6] << 32) | ((uint64) rx_data[7] << 40);
+	data_len = ((rx_data[0] & 0x0F) == PDU_ADV_DIRECT_IND) ? 0 : rx_len - 8;
+
+	ll_resolve_peer_address (&address_type, &address);
+
+	if (!ll_scan_extended)
+	{
+		log (LOG_LINKLAYER, "LE Advertising Report Event");
+		send_le_advertising_report_event (when, legacy_event_type, address_type, address, rssi, data_len, &rx_data[8]);
+		return;
+	}
+
+	log (LOG_LINKLAYER, "LE Extended Advertising Report Event (legacy)");
+	send_le_extended_advertising_report_event
+	(
+		when,
+		event_type,
+		address_type,
+		address,
+		hci_phy_value (GFSK_LE),
+		0x00,
+		0xFF,
+		rssi,
+		data_len,
+		&rx_data[8]
+	);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_received_extended_pdu (int index, PhysicalPacket *packet, int64 when, int rx_len, const uint8 *rx_data)
+{
+	LinkLayerStateMachine *llsm;
+	ExtendedHeader header;
+	int len;
+	int unit;
+	int units;
+	int aux_phy;
+
+
+	llsm = &machine[index];
+
+	if (((rx_data[0] & 0x0F) != PDU_ADV_EXT_IND) || !parse_extended_header (rx_len, rx_data, &header))
+	{
+		if (llsm->scan.substate == SSS_Scan_Aux)
+		{
+			ll_end_of_aux_chain (index, when, REPORT_DATA_TRUNCATED);
+		}
+
+		return;
+	}
+
+	if (llsm->scan.substate == SSS_Scan)
+	{
+		// ADV_EXT_IND on a primary channel, only the AuxPtr is of interest
+
+		if (header.aux_ptr == 0)
+		{
+			return;
+		}
+
+		ll_aux_adi = header.adi;
+		ll_aux_event_type = header.adv_mode & (ADV_PROP_CONNECTABLE | ADV_PROP_SCANNABLE);
+		ll_aux_primary_phy = packet->get_rx_modulation ();
+		ll_aux_have_address = false;
+		ll_aux_address_type = 0xFF;
+		ll_aux_address = 0;
+		ll_aux_data_length = 0;
+		ll_aux_rssi = packet->get_rx_rssi ();
+	}
+	else if ((header.flags & EXT_HEADER_ADI) && (header.adi != ll_aux_adi))
+	{
+		// some other advertiser on the aux channel
+
+		ll_end_of_aux_chain (index, when, REPORT_DATA_TRUNCATED);
+
+		return;
+	}
+	else
+	{
+		ll_aux_rssi = packet->get_rx_rssi ();
+
+		len = header.data_len;
+
+		if (ll_aux_data_length + len > maximum_extended_advertising_data_length)
+		{
+			len = maximum_extended_advertising_data_length - ll_aux_data_length;
+		}
+
+		memcpy (&ll_aux_data[ll_aux_data_length], header.data, len);
+		ll_aux_data_length += len;
+
+		if (len < header.data_len)
+		{
+			ll_end_of_aux_chain (index, when, REPORT_DATA_TRUNCATED);
+
+			return;
+		}
+	}
+
+	if (header.flags & EXT_HEADER_ADVA)
+	{
+		ll_aux_have_address = true;
+		ll_aux_address_type = (rx_data[0] & PDU_TXADD) ? 0x01 : 0x00;
+		ll_aux_address = header.adva;
+
+		ll_resolve_peer_address (&ll_aux_address_type, &ll_aux_address);
+	}
+
+	// the SyncInfo of the train the host asked to synchronise to
+
+	if ((ll_sync_pending) && (header.sync_info) && (ll_aux_have_address) && ((ll_aux_adi >> 12) == ll_sync_sid) && ((ll_aux_address_type & 0x01) == ll_sync_address_type) && (ll_aux_address == ll_sync_address))
+	{
+		ll_create_periodic_sync (packet->get_rx_start_time (), header.sync_info, ll_sync_sid, ll_aux_address_type, ll_aux_address, packet->get_rx_modulation ());
+	}
+
+	if (header.aux_ptr)
+	{
+		unit = (header.aux_ptr[0] & 0x80) ? 300 : 30;
+		units = header.aux_ptr[1] | ((header.aux_ptr[2] & 0x1F) << 8);
+		aux_phy = header.aux_ptr[2] >> 5;
+
+		llsm->scan.ll_aux_channel = header.aux_ptr[0] & 0x3F;
+		llsm->scan.ll_aux_modulation = (aux_phy == 1) ? GFSK_LE_2M : (aux_phy == 2) ? GFSK_LE_CODED_S8 : GFSK_LE;
+		llsm->scan.ll_aux_start = packet->get_rx_start_time () + units * unit;
+		llsm->scan.ll_aux_window = unit + phy_sync_time (llsm->scan.ll_aux_modulation);
+		llsm->scan.substate = SSS_Scan_Aux;
+	}
+	else
+	{
+		ll_end_of_aux_chain (index, when, REPORT_DATA_COMPLETE);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_end_of_aux_chain (int index, int64 when, int data_status)
+{
+	// a chain can be followed only for the SyncInfo in it, in which case
+	// there is nobody to report it to
+
+	if (ll_host_wants_le_event (LE_EXTENDED_ADVERTISING_REPORT_EVENT))
+	{
+		log (LOG_LINKLAYER, "LE Extended Advertising Report Event %d octets %02X", ll_aux_data_length, data_status);
+
+		send_le_extended_advertising_report_event
+		(
+			when,
+			ll_aux_event_type | data_status,
+			ll_aux_address_type,
+			ll_aux_address,
+			hci_phy_value (ll_aux_primary_phy),
+			hci_phy_value (machine[index].scan.ll_aux_modulation),
+			ll_aux_adi >> 12,
+			ll_aux_rssi,
+			ll_aux_data_length,
+			ll_aux_data
+		);
+	}
+
+	machine[index].scan.substate = SSS_Scan;
+}
+
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,681 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include <stdlib.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "controller.h"
+#include "hci.h"
+#include "log.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the receiver opens its window this much either side of where it expects the
+// AUX_SYNC_IND once it has heard the train, drift is not modelled
+
+const int sync_window_margin = 16;
+
+// a sync that has not heard the train after this many events has failed
+
+const int sync_establishment_events = 6;
+
+// SyncInfo offsets beyond what 13 bits of 300 us units can hold carry the
+// Offset Adjust bit instead
+
+const int sync_offset_adjust = 2457600;
+
+// clock accuracy advertised in the SyncInfo, 0 to 20 ppm
+
+const int periodic_sleep_clock_accuracy = 7;
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_set_periodic_advertising_parameters (int handle, int interval_min, int interval_max, int properties)
+{
+	AdvertisingSet *set;
+
+
+	set = ll_find_advertising_set (handle);
+
+	if (set == 0)
+	{
+		return EC_UNKNOWN_ADVERTISING_IDENTIFIER;
+	}
+
+	if (set->properties & (ADV_PROP_LEGACY | ADV_PROP_CONNECTABLE | ADV_PROP_SCANNABLE | ADV_PROP_ANONYMOUS))
+	{
+		return EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	if (set->periodic_enabled)
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	if ((interval_min > interval_max) || !set->set_periodic_parameters (interval_min, properties))
+	{
+		return EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_set_periodic_advertising_data (int handle, int operation, int len, const uint8 *data)
+{
+	AdvertisingSet *set;
+
+
+	set = ll_find_advertising_set (handle);
+
+	if (set == 0)
+	{
+		return EC_UNKNOWN_ADVERTISING_IDENTIFIER;
+	}
+
+	if ((set->periodic_enabled) && (operation != 0x03))
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	if (!set->set_periodic_data (operation, len, data))
+	{
+		return EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	if ((set->periodic_enabled) && (operation == 0x03))
+	{
+		set->build_periodic ();
+	}
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_set_periodic_advertising_enable (int enable, int handle)
+{
+	AdvertisingSet *set;
+	int set_index;
+	int index;
+	uint32 aa;
+
+
+	set = ll_find_advertising_set (handle);
+
+	if (set == 0)
+	{
+		return EC_UNKNOWN_ADVERTISING_IDENTIFIER;
+	}
+
+	set_index = set - ll_advertising_set;
+
+	if (enable)
+	{
+		if (!set->periodic_configured)
+		{
+			return EC_COMMAND_DISALLOWED;
+		}
+
+		if (set->periodic_enabled)
+		{
+			return EC_SUCCESS;
+		}
+
+		for (index = 0; index < maximum_number_of_link_layer_state_machines; index ++)
+		{
+			if (machine[index].state == LLS_Idle)
+			{
+				break;
+			}
+		}
+
+		if (index == maximum_number_of_link_layer_state_machines)
+		{
+			return EC_MEMORY_CAPACITY_EXCEEDED;
+		}
+
+		do
+		{
+			aa = ((uint32) (rand () & 0xFFFF) << 16) | (rand () & 0xFFFF);
+		}
+		while (!is_valid_access_address (aa));
+
+		set->periodic_access_address = aa;
+		set->periodic_crc_init = rand () & 0xFFFFFF;
+		set->periodic_channel_identifier = csa2_channel_identifier (aa);
+		set->periodic_channel_map = 0;
+		set->periodic_number_of_used_channels = 0;
+
+		for (int channel = 0; channel < 37; channel ++)
+		{
+			set->periodic_channel_map |= 1ULL << channel;
+			set->periodic_used_channel[set->periodic_number_of_used_channels ++] = channel;
+		}
+
+		set->periodic_enabled = true;
+		set->build_periodic ();
+
+		// the AUX_ADV_IND now has to carry the SyncInfo
+
+		ll_build_advertising_set (set);
+
+		machine[index].mk_periodic_advertiser (last_clock, set_index);
+
+		return EC_SUCCESS;
+	}
+
+	if (set->periodic_enabled)
+	{
+		for (index = 0; index < maximum_number_of_link_layer_state_machines; index ++)
+		{
+			if ((machine[index].state == LLS_Periodic_Advertising) && (machine[index].per.ll_advertising_set == set_index))
+			{
+				machine[index].mk_idle ();
+			}
+		}
+
+		set->periodic_enabled = false;
+
+		ll_build_advertising_set (set);
+	}
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+PhysicalPacket *LinkLayer::ll_next_periodic_advertising_packet (int index, int64 after)
+{
+	LinkLayerStateMachine *llsm;
+	AdvertisingSet *set;
+	int pdu_index;
+	int channel;
+	int64 interval;
+	int64 missed;
+
+
+	llsm = &machine[index];
+	set = &ll_advertising_set[llsm->per.ll_advertising_set];
+	interval = set->periodic_interval * 1250;
+
+	if (llsm->per.ll_next_event <= after)
+	{
+		// the radio was busy, the train carries on from the next event
+		// still to come and the counter keeps in step with it
+
+		missed = (after - llsm->per.ll_next_event) / interval + 1;
+
+		ll_count_missed_events (missed);
+
+		llsm->per.ll_next_event += missed * interval;
+		llsm->per.ll_event_counter += missed;
+	}
+
+	pdu_index = set->periodic_pdu_index;
+	set->periodic_pdu_referenced = pdu_index;
+	channel = csa2_select_channel (set->periodic_channel_identifier, llsm->per.ll_event_counter, set->periodic_channel_map, set->periodic_used_channel, set->periodic_number_of_used_channels);
+
+	ll_packet->set_transmit (channel, set->secondary_phy, llsm->per.ll_next_event);
+	ll_packet->set_access_address (set->periodic_access_address);
+	ll_packet->set_crc_init (set->periodic_crc_init);
+	ll_packet->set_pdu_reference (set->periodic_pdu_length[pdu_index], set->periodic_pdu[pdu_index], set->periodic_pdu_crc[pdu_index]);
+	ll_packet->set_llsm (index);
+
+	llsm->per.ll_next_event += interval;
+	llsm->per.ll_event_counter ++;
+
+	return ll_packet;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_update_sync_info (AdvertisingSet *set, AdvertisingEventPacket *entry, int64 tx)
+{
+	LinkLayerStateMachine *llsm;
+	uint8 *p;
+	int64 interval;
+	int64 earliest;
+	int64 next;
+	int64 offset;
+	int64 count;
+	uint16 counter;
+	int units;
+	int adjust;
+	int value;
+	int index;
+
+
+	llsm = 0;
+
+	for (index = 0; index < maximum_number_of_link_layer_state_machines; index ++)
+	{
+		if ((machine[index].state == LLS_Periodic_Advertising) && (&ll_advertising_set[machine[index].per.ll_advertising_set] == set))
+		{
+			llsm = &machine[index];
+			break;
+		}
+	}
+
+	if (llsm == 0)
+	{
+		return;
+	}
+
+	// point at the first AUX_SYNC_IND a scanner could still get to after
+	// receiving this AUX_ADV_IND
+
+	interval = set->periodic_interval * 1250;
+	earliest = tx + phy_packet_airtime (entry->modulation, entry->pdu_length) + 300;
+	next = llsm->per.ll_next_event;
+	counter = llsm->per.ll_event_counter;
+
+	if (next < earliest)
+	{
+		count = (earliest - next + interval - 1) / interval;
+		next += count * interval;
+		counter += count;
+	}
+
+	offset = next - tx;
+	adjust = 0;
+
+	if (offset >= sync_offset_adjust)
+	{
+		adjust = 1;
+		offset -= sync_offset_adjust;
+	}
+
+	if ((adjust == 0) && (offset < 8192 * 30))
+	{
+		units = 0;
+		value = offset / 30;
+	}
+	else
+	{
+		units = 1;
+		value = offset / 300;
+	}
+
+	p = &entry->pdu[entry->sync_info];
+
+	p[0] = value & 0xFF;
+	p[1] = ((value >> 8) & 0x1F) | (units << 5) | (adjust << 6);
+	p[2] = set->periodic_interval & 0xFF;
+	p[3] = set->periodic_interval >> 8;
+
+	for (index = 0; index < 5; index ++)
+	{
+		p[4 + index] = (set->periodic_channel_map >> (8 * index)) & 0xFF;
+	}
+
+	p[8] = (p[8] & 0x1F) | (periodic_sleep_clock_accuracy << 5);
+
+	for (index = 0; index < 4; index ++)
+	{
+		p[9 + index] = (set->periodic_access_address >> (8 * index)) & 0xFF;
+	}
+
+	for (index = 0; index < 3; index ++)
+	{
+		p[13 + index] = (set->periodic_crc_init >> (8 * index)) & 0xFF;
+	}
+
+	p[16] = counter & 0xFF;
+	p[17] = counter >> 8;
+
+	entry->crc = PhysicalPacket::calculate_crc (advertising_crc_init, entry->pdu_length, entry->pdu);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_periodic_advertising_create_sync (int options, int sid, int address_type, uint64 address, int skip, int sync_timeout)
+{
+	bool was_scanning;
+
+
+	if (ll_sync_pending)
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	if (options & 0x01)
+	{
+		// the periodic advertiser list is not supported
+
+		return EC_UNSUPPORTED_FEATURE_OR_PARAMETER_VALUE;
+	}
+
+	if ((sid > 0x0F) || (address_type > 0x01) || (skip > 0x01F3) || (sync_timeout < 0x000A) || (sync_timeout > 0x4000))
+	{
+		return EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	for (int handle = 0; handle < maximum_number_of_periodic_syncs; handle ++)
+	{
+		if ((ll_periodic_sync[handle].in_use) && (ll_periodic_sync[handle].sid == sid) && ((ll_periodic_sync[handle].address_type & 0x01) == address_type) && (ll_periodic_sync[handle].address == address))
+		{
+			return EC_ACL_CONNECTION_ALREADY_EXISTS;
+		}
+	}
+
+	was_scanning = ll_scanning_wanted ();
+
+	ll_sync_pending = true;
+	ll_sync_options = options;
+	ll_sync_sid = sid;
+	ll_sync_address_type = address_type;
+	ll_sync_address = address;
+	ll_sync_skip = skip;
+	ll_sync_timeout = sync_timeout;
+
+	if (!was_scanning)
+	{
+		ll_restart_scanning ();
+	}
+
+	log (LOG_LINKLAYER, "LinkLayer::ll_periodic_advertising_create_sync sid %d %012llX", sid, address);
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_periodic_advertising_create_sync_cancel (void)
+{
+	if (!ll_sync_pending)
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	ll_sync_pending = false;
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_periodic_advertising_terminate_sync (int handle)
+{
+	PeriodicSync *sync;
+
+
+	if ((handle < 0) || (handle >= maximum_number_of_periodic_syncs) || !ll_periodic_sync[handle].in_use)
+	{
+		return EC_UNKNOWN_ADVERTISING_IDENTIFIER;
+	}
+
+	sync = &ll_periodic_sync[handle];
+
+	if (!sync->established)
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	ll_close_periodic_sync (sync);
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_create_periodic_sync (int64 when, const uint8 *sync_info, int sid, int address_type, uint64 address, PhyModulation modulation)
+{
+	PeriodicSync *sync;
+	int handle;
+	int index;
+	int unit;
+
+
+	for (handle = 0; handle < maximum_number_of_periodic_syncs; handle ++)
+	{
+		if (!ll_periodic_sync[handle].in_use)
+		{
+			break;
+		}
+	}
+
+	for (index = 0; index < maximum_number_of_link_layer_state_machines; index ++)
+	{
+		if (machine[index].state == LLS_Idle)
+		{
+			break;
+		}
+	}
+
+	ll_sync_pending = false;
+
+	if ((handle == maximum_number_of_periodic_syncs) || (index == maximum_number_of_link_layer_state_machines))
+	{
+		send_le_periodic_advertising_sync_established_event (EC_CONNECTION_REJECTED_DUE_TO_LIMITED_RESOURCES, 0, sid, address_type, address, hci_phy_value (modulation), 0, 0);
+		return;
+	}
+
+	sync = &ll_periodic_sync[handle];
+	memset (sync, 0, sizeof (PeriodicSync));
+
+	sync->machine = index;
+	sync->sid = sid;
+	sync->address_type = address_type;
+	sync->address = address;
+	sync->modulation = modulation;
+	sync->interval = sync_info[2] | (sync_info[3] << 8);
+	sync->skip = ll_sync_skip;
+	sync->sync_timeout = ll_sync_timeout;
+	sync->reports_enabled = (ll_sync_options & 0x02) == 0;
+	sync->clock_accuracy = sync_info[8] >> 5;
+
+	for (int channel = 0; channel < 37; channel ++)
+	{
+		if (sync_info[4 + channel / 8] & (1 << (channel % 8)))
+		{
+			sync->channel_map |= 1ULL << channel;
+			sync->used_channel[sync->number_of_used_channels ++] = channel;
+		}
+	}
+
+	if ((sync->number_of_used_channels < 2) || (sync->interval < 6))
+	{
+		send_le_periodic_advertising_sync_established_event (EC_UNSUPPORTED_REMOTE_FEATURE_UNSUPPORTED_LMP_FEATURE, 0, sid, address_type, address, hci_phy_value (modulation), 0, 0);
+		return;
+	}
+
+	for (int octet = 0; octet < 4; octet ++)
+	{
+		sync->access_address |= ((uint32) sync_info[9 + octet]) << (8 * octet);
+	}
+
+	sync->crc_init = sync_info[13] | (sync_info[14] << 8) | (sync_info[15] << 16);
+	sync->channel_identifier = csa2_channel_identifier (sync->access_address);
+	sync->event_counter = sync_info[16] | (sync_info[17] << 8);
+
+	// the offset is rounded down to its unit, so the first window has to
+	// cover a whole unit after the anchor as well
+
+	unit = (sync_info[1] & 0x20) ? 300 : 30;
+
+	sync->anchor = when + (sync_info[0] | ((sync_info[1] & 0x1F) << 8)) * unit;
+
+	if (sync_info[1] & 0x40)
+	{
+		sync->anchor += sync_offset_adjust;
+	}
+
+	sync->window_widening = unit + sync_window_margin;
+	sync->in_use = true;
+
+	machine[index].mk_synchronized (handle);
+
+	log (LOG_LINKLAYER, "LinkLayer::ll_create_periodic_sync %d aa %08lX interval %d counter %d", handle, sync->access_address, sync->interval, sync->event_counter);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_close_periodic_sync (PeriodicSync *sync)
+{
+	machine[sync->machine].mk_idle ();
+
+	sync->in_use = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+PhysicalPacket *LinkLayer::ll_next_synchronized_packet (int index, int64 after)
+{
+	PeriodicSync *sync;
+	int64 interval;
+	int64 start;
+	int64 missed;
+	int channel;
+	int handle;
+
+
+	handle = machine[index].sync.ll_sync;
+	sync = &ll_periodic_sync[handle];
+	interval = sync->interval * 1250;
+
+	if (sync->anchor + sync->window_widening <= after)
+	{
+		// the radio was busy for the windows that have gone by
+
+		missed = (after - sync->anchor - sync->window_widening) / interval + 1;
+
+		ll_count_missed_events (missed);
+		ll_end_of_sync_event (sync, after, missed);
+
+		if (!ll_periodic_sync[handle].in_use)
+		{
+			return 0;
+		}
+	}
+
+	// only listen around the AUX_SYNC_IND, the radio is free the rest of
+	// the interval
+
+	start = sync->anchor - sync->window_widening;
+	channel = csa2_select_channel (sync->channel_identifier, sync->event_counter, sync->channel_map, sync->used_channel, sync->number_of_used_channels);
+
+	ll_packet->set_receive (channel, sync->modulation, (start > after) ? start : after, sync->anchor + sync->window_widening + phy_sync_time (sync->modulation));
+	ll_packet->set_access_address (sync->access_address);
+	ll_packet->set_crc_init (sync->crc_init);
+	ll_packet->set_llsm (index);
+
+	return ll_packet;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_synchronized_end_of_packet (int index, PhysicalPacket *packet, int64 when, int rx_len, const uint8 *rx_data)
+{
+	PeriodicSync *sync;
+	int handle;
+	int ext_len;
+	int data_status;
+	int data_len;
+
+
+	handle = machine[index].sync.ll_sync;
+	sync = &ll_periodic_sync[handle];
+
+	if ((rx_len < 3) || ((rx_data[0] & 0x0F) != PDU_ADV_EXT_IND))
+	{
+		// nothing heard in the window
+
+		ll_end_of_sync_event (sync, when, 1);
+		return;
+	}
+
+	ext_len = rx_data[2] & 0x3F;
+
+	if (1 + ext_len > rx_data[1])
+	{
+		ll_end_of_sync_event (sync, when, 1);
+		return;
+	}
+
+	// chains are not followed, data that continues in an AUX_CHAIN_IND is
+	// reported as truncated (Data_Status 0x02)
+
+	data_status = ((ext_len > 0) && (rx_data[3] & EXT_HEADER_AUXPTR)) ? 0x02 : 0x00;
+	data_len = rx_data[1] - 1 - ext_len;
+
+	sync->anchor = packet->get_rx_start_time ();
+	sync->window_widening = sync_window_margin;
+	sync->last_received = when;
+
+	if (!sync->established)
+	{
+		sync->established = true;
+
+		log (LOG_LINKLAYER, "LE Periodic Advertising Sync Established %d", handle);
+
+		send_le_periodic_advertising_sync_established_event (EC_SUCCESS, handle, sync->sid, sync->address_type, sync->address, hci_phy_value (sync->modulation), sync->interval, sync->clock_accuracy);
+	}
+
+	if ((sync->reports_enabled) && (ll_host_wants_le_event (LE_PERIODIC_ADVERTISING_REPORT_EVENT)))
+	{
+		send_le_periodic_advertising_report_event (handle, packet->get_rx_rssi (), data_status, data_len, &rx_data[3 + ext_len]);
+	}
+
+	ll_end_of_sync_event (sync, when, sync->skip + 1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_end_of_sync_event (PeriodicSync *sync, int64 when, int64 count)
+{
+	sync->anchor += count * sync->interval * 1250;
+	sync->event_counter += count;
+
+	if (sync->established)
+	{
+		if (when - sync->last_received > sync->sync_timeout * 10000LL)
+		{
+			log (LOG_LINKLAYER, "LE Periodic Advertising Sync Lost %d", (int) (sync - ll_periodic_sync));
+
+			send_le_periodic_advertising_sync_lost_event (sync - ll_periodic_sync);
+			ll_close_periodic_sync (sync);
+		}
+
+		return;
+	}
+
+	sync->events_waited += count;
+
+	if (sync->events_waited >= sync_establishment_events)
+	{
+		send_le_periodic_advertising_sync_established_event (EC_CONNECTION_FAILED_TO_BE_ESTABLISHED, sync - ll_periodic_sync, sync->sid, sync->address_type, sync->address, hci_phy_value (sync->modulation), sync->interval, sync->clock_accuracy);
+		ll_close_periodic_sync (sync);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
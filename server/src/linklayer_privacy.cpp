@@ -0,0 +1,510 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <string.h>
+#include <stdlib.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "controller.h"
+#include "hci.h"
+#include "log.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+// HCI carries keys least significant octet first, AES wants them the other way
+
+static void expand_hci_key (const uint8 *hci_key, AesKey *key, bool *non_zero)
+{
+	uint8 k[16];
+
+
+	*non_zero = false;
+
+	for (int index = 0; index < 16; index ++)
+	{
+		k[index] = hci_key[15 - index];
+		if (k[index])
+		{
+			*non_zero = true;
+		}
+	}
+
+	aes_expand_key (k, key);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint64 generate_resolvable_private_address (const AesKey *irk)
+{
+	uint32 prand;
+
+
+	prand = (rand () & 0x3FFFFF) | 0x400000; // top two bits 01
+
+	return ((uint64) prand << 24) | bt_ah (irk, prand);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline bool is_resolvable_private_address (uint64 address)
+{
+	return ((address >> 46) & 0x03) == 0x01;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_find_resolving_list_entry (int peer_identity_address_type, uint64 peer_identity_address)
+{
+	for (int index = 0; index < ll_resolving_list_size; index ++)
+	{
+		if
+		(
+			(ll_resolving_list[index].peer_identity_address_type == peer_identity_address_type) &&
+			(ll_resolving_list[index].peer_identity_address == peer_identity_address)
+		)
+		{
+			return index;
+		}
+	}
+
+	return -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the list may not change under an advertiser, scanner or initiator that is
+// resolving
+
+bool LinkLayer::ll_resolving_list_in_use (void)
+{
+	if (!ll_address_resolution_enabled)
+	{
+		return false;
+	}
+
+	if (ll_advertising_enabled || ll_scanning_enabled || ll_initiating)
+	{
+		return true;
+	}
+
+	for (int index = 0; index < maximum_number_of_advertising_sets; index ++)
+	{
+		if (ll_advertising_set[index].enabled)
+		{
+			return true;
+		}
+	}
+
+	return false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+uint64 LinkLayer::ll_own_address (int own_address_type, int peer_address_type, uint64 peer_address, uint64 random_address, bool *is_random)
+{
+	int entry;
+
+
+	if (own_address_type >= 0x02)
+	{
+		// resolvable private address from the local IRK for the peer, or
+		// fall back to the public / random address
+
+		entry = ll_find_resolving_list_entry (peer_address_type, peer_address);
+
+		if ((entry >= 0) && (ll_resolving_list[entry].has_local_irk))
+		{
+			*is_random = true;
+			return ll_resolving_list[entry].local_rpa;
+		}
+
+		own_address_type -= 0x02;
+	}
+
+	if (own_address_type == 0x01)
+	{
+		*is_random = true;
+		return random_address;
+	}
+
+	*is_random = false;
+	return ll_bd_addr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_build_advertising_set (AdvertisingSet *set)
+{
+	uint64 adva;
+	bool adva_is_random;
+
+
+	adva = ll_own_address (set->own_address_type, set->peer_address_type, set->peer_address, set->random_address, &adva_is_random);
+
+	set->build (adva, adva_is_random);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_rotate_private_addresses (int64 now)
+{
+	for (int index = 0; index < ll_resolving_list_size; index ++)
+	{
+		if (ll_resolving_list[index].has_local_irk)
+		{
+			ll_resolving_list[index].local_rpa = generate_resolvable_private_address (&ll_resolving_list[index].local_irk);
+		}
+	}
+
+	if (ll_advertising_own_address_type >= 0x02)
+	{
+		ll_build_advertising_pdu ();
+	}
+
+	for (int index = 0; index < maximum_number_of_advertising_sets; index ++)
+	{
+		if ((ll_advertising_set[index].in_use) && (ll_advertising_set[index].own_address_type >= 0x02))
+		{
+			ll_build_advertising_set (&ll_advertising_set[index]);
+		}
+	}
+
+	ll_rpa_expiry = now + ll_rpa_timeout;
+
+	log (LOG_LINKLAYER, "LinkLayer::ll_rotate_private_addresses next at %lld", ll_rpa_expiry);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_resolve_address (uint64 address)
+{
+	ResolvedAddress *cached;
+	uint32 hash[maximum_resolving_list_size];
+	uint32 prand;
+	int entry;
+
+
+	if (!is_resolvable_private_address (address))
+	{
+		return -1;
+	}
+
+	// the same advertiser is heard over and over, so the answer (including
+	// "no IRK resolves this") is remembered until the list changes
+
+	cached = &ll_resolved_address[((address * 0x9E3779B97F4A7C15ULL) >> 58) & (resolved_address_cache_size - 1)];
+
+	if ((cached->generation == ll_resolving_list_generation) && (cached->address == address))
+	{
+		return cached->entry;
+	}
+
+	prand = (address >> 24) & 0xFFFFFF;
+
+	bt_ah_many (ll_resolving_peer_irk, ll_resolving_list_size, prand, hash);
+
+	entry = -1;
+
+	for (int index = 0; index < ll_resolving_list_size; index ++)
+	{
+		if ((ll_resolving_list[index].has_peer_irk) && (hash[index] == (address & 0xFFFFFF)))
+		{
+			entry = index;
+			ll_resolving_list[index].peer_rpa = address;
+			break;
+		}
+	}
+
+	cached->address = address;
+	cached->entry = entry;
+	cached->generation = ll_resolving_list_generation;
+
+	return entry;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayer::ll_resolve_peer_address (int *address_type, uint64 *address)
+{
+	int entry;
+
+
+	if ((ll_address_resolution_enabled) && (*address_type == 0x01) && (ll_resolving_list_size > 0))
+	{
+		entry = ll_resolve_address (*address);
+
+		if (entry >= 0)
+		{
+			// 0x02 public identity address, 0x03 random (static) identity address
+
+			*address_type = 0x02 + ll_resolving_list[entry].peer_identity_address_type;
+			*address = ll_resolving_list[entry].peer_identity_address;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_set_random_address (uint64 address)
+{
+	if (ll_advertising_enabled || ll_scanning_enabled)
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	ll_random_address = address;
+
+	ll_build_advertising_pdu ();
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_set_advertising_set_random_address (int handle, uint64 address)
+{
+	AdvertisingSet *set;
+
+
+	set = ll_find_advertising_set (handle);
+
+	if (set == 0)
+	{
+		return EC_UNKNOWN_ADVERTISING_IDENTIFIER;
+	}
+
+	if (set->enabled)
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	set->random_address = address;
+
+	ll_build_advertising_set (set);
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_add_device_to_resolving_list (int peer_identity_address_type, uint64 peer_identity_address, const uint8 *peer_irk, const uint8 *local_irk)
+{
+	ResolvingListEntry *entry;
+	int index;
+
+
+	if (ll_resolving_list_in_use ())
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	if (peer_identity_address_type > 0x01)
+	{
+		return EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	index = ll_find_resolving_list_entry (peer_identity_address_type, peer_identity_address);
+
+	if (index < 0)
+	{
+		if (ll_resolving_list_size >= maximum_resolving_list_size)
+		{
+			return EC_MEMORY_CAPACITY_EXCEEDED;
+		}
+
+		index = ll_resolving_list_size ++;
+	}
+
+	entry = &ll_resolving_list[index];
+
+	entry->peer_identity_address_type = peer_identity_address_type;
+	entry->peer_identity_address = peer_identity_address;
+	entry->peer_rpa = 0;
+
+	expand_hci_key (peer_irk, &ll_resolving_peer_irk[index], &entry->has_peer_irk);
+	expand_hci_key (local_irk, &entry->local_irk, &entry->has_local_irk);
+
+	entry->local_rpa = 0;
+	if (entry->has_local_irk)
+	{
+		entry->local_rpa = generate_resolvable_private_address (&entry->local_irk);
+	}
+
+	ll_resolving_list_generation ++;
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_remove_device_from_resolving_list (int peer_identity_address_type, uint64 peer_identity_address)
+{
+	int index;
+	int last;
+
+
+	if (ll_resolving_list_in_use ())
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	index = ll_find_resolving_list_entry (peer_identity_address_type, peer_identity_address);
+
+	if (index < 0)
+	{
+		return EC_UNKNOWN_CONNECTION_IDENTIFIER;
+	}
+
+	// keep the list dense, the last entry moves into the hole
+
+	last = ll_resolving_list_size - 1;
+
+	if (index != last)
+	{
+		ll_resolving_list[index] = ll_resolving_list[last];
+		ll_resolving_peer_irk[index] = ll_resolving_peer_irk[last];
+	}
+
+	ll_resolving_list_size --;
+	ll_resolving_list_generation ++;
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_clear_resolving_list (void)
+{
+	if (ll_resolving_list_in_use ())
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	ll_resolving_list_size = 0;
+	ll_resolving_list_generation ++;
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_get_resolving_list_size (void)
+{
+	return maximum_resolving_list_size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_read_peer_resolvable_address (int peer_identity_address_type, uint64 peer_identity_address, uint64 *address)
+{
+	int index;
+
+
+	index = ll_find_resolving_list_entry (peer_identity_address_type, peer_identity_address);
+
+	if (index < 0)
+	{
+		return EC_UNKNOWN_CONNECTION_IDENTIFIER;
+	}
+
+	*address = ll_resolving_list[index].peer_rpa;
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_read_local_resolvable_address (int peer_identity_address_type, uint64 peer_identity_address, uint64 *address)
+{
+	int index;
+
+
+	index = ll_find_resolving_list_entry (peer_identity_address_type, peer_identity_address);
+
+	if (index < 0)
+	{
+		return EC_UNKNOWN_CONNECTION_IDENTIFIER;
+	}
+
+	*address = ll_resolving_list[index].local_rpa;
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_set_address_resolution_enable (int enable)
+{
+	bool in_use;
+
+
+	in_use = ll_advertising_enabled || ll_scanning_enabled;
+
+	for (int index = 0; index < maximum_number_of_advertising_sets; index ++)
+	{
+		if (ll_advertising_set[index].enabled)
+		{
+			in_use = true;
+		}
+	}
+
+	if (in_use)
+	{
+		return EC_COMMAND_DISALLOWED;
+	}
+
+	if (enable > 0x01)
+	{
+		return EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	ll_address_resolution_enabled = (enable == 0x01);
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int LinkLayer::ll_set_resolvable_private_address_timeout (int seconds)
+{
+	if ((seconds < 0x0001) || (seconds > 0xA1B8))
+	{
+		return EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	// restart the timer, new addresses are generated on the next event
+
+	ll_rpa_timeout = (int64) seconds * 1000000;
+	ll_rpa_expiry = 0;
+
+	return EC_SUCCESS;
+}
+
+////////////////////////////////////////////////////////////////////////////////
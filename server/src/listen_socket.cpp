@@ -33,8 +33,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -45,6 +47,8 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 int ListenSocket::pipefd[2] = { 0, 0 };
+int ListenSocket::reserve_fd = -1;
+unsigned int ListenSocket::unix_connections = 0;
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -56,6 +60,7 @@ ListenSocket::ListenSocket (int listen_port)
 
 	port = listen_port;
 	addr = INADDR_ANY;
+	path = 0;
 
 	sockfd = socket (AF_INET, SOCK_STREAM, 0);
 	
@@ -84,36 +89,102 @@ ListenSocket::ListenSocket (int listen_port)
 	
 	listen (sockfd, 50);
 
-	if (pipe (pipefd) < 0)
-	{
-		log (LOG_ERROR, "pipe (%d : %s)", errno, strerror (errno));
-		return;		
-	}
+	create_pipe ();
+	open_reserve_fd ();
 
-	log (LOG_LISTENSOCKET, "Pipe = %d,%d", pipefd[0], pipefd[1]);
+	watch ();
 
 	log (LOG_LISTENSOCKET, "ListenSocket %p", this);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-ListenSocket::~ListenSocket ()
+// a unix domain socket, for hosts on the same machine, anything left at the
+// path by an earlier run is removed first
+
+ListenSocket::ListenSocket (const char *listen_path)
 {
-	log (LOG_LISTENSOCKET, "~ListenSocket %p", this);
+	struct sockaddr_un sock_addr;
+
+
+	port = 0;
+	addr = 0;
+	path = strdup (listen_path);
+
+	sockfd = socket (AF_UNIX, SOCK_STREAM, 0);
+
+	if (sockfd < 0)
+	{
+		log (LOG_ERROR, "opening socket (%d : %s)", errno, strerror (errno));
+		return;
+	}
+
+	bzero ((char *) &sock_addr, sizeof (sock_addr));
+
+	sock_addr.sun_family = AF_UNIX;
+
+	if (strlen (path) >= sizeof (sock_addr.sun_path))
+	{
+		log (LOG_ERROR, "Listen socket %s path too long", path);
+		exit (1);
+	}
+
+	strcpy (sock_addr.sun_path, path);
+
+	unlink (path);
+
+	if (bind (sockfd, (struct sockaddr *) &sock_addr, sizeof (sock_addr)) < 0)
+	{
+		log (LOG_ERROR, "Listen socket %s on binding (%d : %s)", path, errno, strerror (errno));
+		exit (1);
+	}
+
+	callback_func = 0;
+
+	listen (sockfd, 50);
+
+	create_pipe ();
+	open_reserve_fd ();
+
+	watch ();
+
+	log (LOG_LISTENSOCKET, "ListenSocket %p %s", this, path);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-bool ListenSocket::is_readable (void)
+ListenSocket::~ListenSocket ()
 {
-	return true;
+	log (LOG_LISTENSOCKET, "~ListenSocket %p", this);
+
+	if (path)
+	{
+		unlink (path);
+		free (path);
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-bool ListenSocket::is_writable (void)
+// the one pipe that wakes the poll loop is shared by every listener, neither
+// end blocks, a full pipe is already a wakeup
+
+void ListenSocket::create_pipe (void)
 {
-	return false;
+	if (pipefd[1] != 0)
+	{
+		return;
+	}
+
+	if (pipe2 (pipefd, O_NONBLOCK) < 0)
+	{
+		log (LOG_ERROR, "pipe (%d : %s)", errno, strerror (errno));
+		return;		
+	}
+
+	watch_descriptor (pipefd[0], 0);
+
+	log (LOG_LISTENSOCKET, "Pipe = %d,%d", pipefd[0], pipefd[1]);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -122,23 +193,97 @@ void ListenSocket::on_readable (void)
 {
 	int new_sockfd;
 	socklen_t new_addrlen;
-	struct sockaddr_in new_addr;
-	Socket *new_socket;
-	char buffer[100];
+	struct sockaddr_storage new_addr;
+	struct sockaddr_in *inet_addr;
 
 
 	log (LOG_LISTENSOCKET, "ListenSocket::on_readable");
 
-	new_addrlen = sizeof (new_addr);
-	new_sockfd = accept (sockfd, (struct sockaddr *) &new_addr, &new_addrlen);
+	// every connection waiting is taken, the edge is not seen again
+
+	while (true)
+	{
+		new_addrlen = sizeof (new_addr);
+		new_sockfd = accept (sockfd, (struct sockaddr *) &new_addr, &new_addrlen);
+
+		if (new_sockfd == -1)
+		{
+			if ((errno == EINTR) || (errno == ECONNABORTED))
+			{
+				continue;
+			}
+
+			if (((errno == EMFILE) || (errno == ENFILE)) && (reserve_fd >= 0))
+			{
+				// the connections queued would otherwise wait for an edge
+				// that may never come, each is refused instead
+
+				log (LOG_ERROR, "accept (%d : %s), connection dropped", errno, strerror (errno));
+
+				drop_connection ();
+				continue;
+			}
+
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+			{
+				log (LOG_ERROR, "accept (%d : %s)", errno, strerror (errno));
+			}
+			return;
+		}
+
+		if (new_addr.ss_family == AF_INET)
+		{
+			inet_addr = (struct sockaddr_in *) &new_addr;
+
+			callback_func (new_sockfd, ntohl (inet_addr->sin_addr.s_addr), ntohs (inet_addr->sin_port));
+		}
+		else
+		{
+			unix_connections = (unix_connections + 1) & 0xFFFF;
+
+			callback_func (new_sockfd, 0, unix_connections);
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
 
-	if (new_sockfd == -1)
+void ListenSocket::open_reserve_fd (void)
+{
+	if (reserve_fd >= 0)
 	{
-		log (LOG_ERROR, "accept (%d : %s)", errno, strerror (errno));
 		return;
 	}
 
-	callback_func (new_sockfd, ntohl (new_addr.sin_addr.s_addr), ntohs (new_addr.sin_port));
+	reserve_fd = open ("/dev/null", O_RDONLY | O_CLOEXEC);
+
+	if (reserve_fd < 0)
+	{
+		log (LOG_ERROR, "reserve descriptor (%d : %s)", errno, strerror (errno));
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// out of descriptors, the reserve is given up for long enough to accept the
+// connection at the head of the queue and close it
+
+void ListenSocket::drop_connection (void)
+{
+	int new_sockfd;
+
+
+	close (reserve_fd);
+	reserve_fd = -1;
+
+	new_sockfd = accept (sockfd, 0, 0);
+
+	if (new_sockfd >= 0)
+	{
+		close (new_sockfd);
+	}
+
+	open_reserve_fd ();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -155,7 +300,15 @@ char *ListenSocket::get_name (void)
 	static char buffer[100];
 
 
-	sprintf (buffer, "ListenSocket{%04X}", port);
+	if (path)
+	{
+		snprintf (buffer, sizeof (buffer), "ListenSocket{%s}", path);
+	}
+	else
+	{
+		sprintf (buffer, "ListenSocket{%04X}", port);
+	}
+
 	return buffer;
 }
 
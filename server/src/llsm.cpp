@@ -61,6 +61,9 @@ void LinkLayerStateMachine::mk_idle (void)
 {
 	state = LLS_Idle;
 
+	starvation = 0;
+	preempted_event_end = -1;
+
 	log (LOG_LLSM, "mk_idle %p", this);
 }
 
@@ -45,8 +45,40 @@ void LinkLayerStateMachine::mk_advertiser (int64 after)
 	adv.ll_next_advertising_instant = (after / 1250) * 1250 + 1250;
 	adv.ll_next_advertising_tx = adv.ll_next_advertising_instant + (rand () % 16) * 625;
 	adv.ll_advertising_channel = 0;
+	adv.ll_advertising_set = -1;
+	adv.ll_request_window_end = 0;
 
 	log (LOG_LLSM, "mk_advertiser %p", this);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayerStateMachine::mk_extended_advertiser (int64 after, int set)
+{
+	state = LLS_Advertising;
+
+	adv.substate = ASS_Advertise;
+	adv.ll_next_advertising_instant = (after / 1250) * 1250 + 1250;
+	adv.ll_advertising_event_start = adv.ll_next_advertising_instant + (rand () % 16) * 625;
+	adv.ll_next_advertising_tx = adv.ll_advertising_event_start;
+	adv.ll_advertising_channel = 0; // index into the prebuilt event
+	adv.ll_advertising_set = set;
+	adv.ll_advertising_schedule = 0;
+
+	log (LOG_LLSM, "mk_extended_advertiser %p set %d", this, set);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayerStateMachine::mk_periodic_advertiser (int64 after, int set)
+{
+	state = LLS_Periodic_Advertising;
+
+	per.ll_advertising_set = set;
+	per.ll_next_event = (after / 1250) * 1250 + 1250;
+	per.ll_event_counter = 0;
+
+	log (LOG_LLSM, "mk_periodic_advertiser %p set %d", this, set);
+}
+
+////////////////////////////////////////////////////////////////////////////////
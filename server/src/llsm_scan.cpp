@@ -44,8 +44,36 @@ void LinkLayerStateMachine::mk_scanner (int64 after)
 	scan.substate = SSS_Scan;
 	scan.ll_next_scanning_instant = after + 1250;
 	scan.ll_scanning_channel = 0;
+	scan.ll_scanning_phy = 0;
+	scan.ll_window_end = 0;
 
 	log (LOG_LLSM, "mk_scanner %p", this);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayerStateMachine::mk_initiator (int64 after)
+{
+	state = LLS_Initiator;
+
+	scan.substate = SSS_Scan;
+	scan.ll_next_scanning_instant = after + 1250;
+	scan.ll_scanning_channel = 0;
+	scan.ll_scanning_phy = 0;
+	scan.ll_window_end = 0;
+
+	log (LOG_LLSM, "mk_initiator %p", this);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LinkLayerStateMachine::mk_synchronized (int sync)
+{
+	state = LLS_Synchronized;
+
+	this->sync.ll_sync = sync;
+
+	log (LOG_LLSM, "mk_synchronized %p sync %d", this, sync);
+}
+
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,893 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+// b1ee_load, a load generator for the server. Thousands of hosts are run from
+// one epoll loop, each connects, works through a script of HCI commands that
+// sets it up as an advertiser or a scanner, then sends a probe command at a
+// fixed interval. Command round trip latencies and per host event rates are
+// reported at the end.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <algorithm>
+#include <vector>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "types.h"
+#include "hci.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+const uint8 H4_COMMAND = 0x01;
+const uint8 H4_EVENT = 0x04;
+
+const int maximum_script_length = 16;
+const int maximum_step_parameters = 32;
+const int host_read_buffer_size = 4096;
+const int host_write_buffer_size = 1024;
+const int maximum_epoll_events = 256;
+
+enum HostState
+{
+	HOST_IDLE,
+	HOST_CONNECTING,
+	HOST_SCRIPT,
+	HOST_RUNNING,
+	HOST_CLOSED,
+};
+
+enum HostRole
+{
+	ROLE_IDLE,
+	ROLE_ADVERTISER,
+	ROLE_SCANNER,
+};
+
+struct ScriptStep
+{
+	int opcode;
+	int parameter_len;
+	uint8 parameters[maximum_step_parameters];
+};
+
+struct Script
+{
+	int length;
+	ScriptStep step[maximum_script_length];
+};
+
+struct LoadHost
+{
+	int fd;
+	HostState state;
+	HostRole role;
+	const Script *script;
+	int step;
+
+	// the one command a host has outstanding, Num_HCI_Command_Packets is 1
+	bool command_pending;
+	bool command_is_probe;
+	int command_opcode;
+	int64 command_sent;
+	int64 next_probe;
+
+	int64 running_since;
+	uint64 events;
+	uint64 reports;
+
+	int read_len;
+	char read_buffer[host_read_buffer_size];
+	int write_len;
+	char write_buffer[host_write_buffer_size];
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+static Script idle_script;
+static Script advertise_script;
+static Script scan_script;
+
+static std::vector<uint32> script_latency; // microseconds
+static std::vector<uint32> probe_latency;
+
+static uint64 connect_failures = 0;
+static uint64 unexpected_closes = 0;
+static uint64 command_failures = 0;
+
+////////////////////////////////////////////////////////////////////////////////
+
+static int64 now_ns (void)
+{
+	struct timespec now;
+
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+
+	return (int64) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void add_step (Script *script, int opcode, int parameter_len, const uint8 *parameters)
+{
+	ScriptStep *step;
+
+
+	step = &script->step[script->length ++];
+
+	step->opcode = opcode;
+	step->parameter_len = parameter_len;
+
+	if (parameter_len > 0)
+	{
+		memcpy (step->parameters, parameters, parameter_len);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// what every host does first, the same as a host stack bringing a controller
+// up
+
+static void add_init_steps (Script *script)
+{
+	static const uint8 event_mask[8] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x3F };
+	static const uint8 le_event_mask[8] = { 0xFF, 0xFF, 0x0F, 0x00, 0x00, 0x00, 0x00, 0x00 };
+
+
+	add_step (script, HCI_RESET_COMMAND, 0, 0);
+	add_step (script, HCI_SET_EVENT_MASK_COMMAND, 8, event_mask);
+	add_step (script, HCI_LE_SET_EVENT_MASK_COMMAND, 8, le_event_mask);
+	add_step (script, HCI_READ_LOCAL_VERSION_INFORMATION_COMMAND, 0, 0);
+	add_step (script, HCI_READ_LOCAL_SUPPORTED_COMMANDS_COMMAND, 0, 0);
+	add_step (script, HCI_READ_BD_ADDR_COMMAND, 0, 0);
+	add_step (script, HCI_LE_READ_BUFFER_SIZE_COMMAND, 0, 0);
+	add_step (script, HCI_LE_READ_LOCAL_SUPPORTED_FEATURES_COMMAND, 0, 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// intervals are in 0.625 ms slots
+
+static void build_scripts (int advertising_interval, int scan_interval)
+{
+	uint8 parameters[maximum_step_parameters];
+
+
+	add_init_steps (&idle_script);
+
+	add_init_steps (&advertise_script);
+
+	memset (parameters, 0, sizeof (parameters));
+	parameters[0] = advertising_interval & 0xFF;
+	parameters[1] = (advertising_interval >> 8) & 0xFF;
+	parameters[2] = advertising_interval & 0xFF;
+	parameters[3] = (advertising_interval >> 8) & 0xFF;
+	parameters[13] = 0x07; // all three advertising channels
+	add_step (&advertise_script, HCI_LE_SET_ADVERTISING_PARAMETERS_COMMAND, 15, parameters);
+
+	memset (parameters, 0, sizeof (parameters));
+	parameters[0] = 9;
+	memcpy (&parameters[1], "\x08\x09" "b1ee_ld", 9);
+	add_step (&advertise_script, HCI_LE_SET_ADVERTISING_DATA_COMMAND, 32, parameters);
+
+	parameters[0] = 1;
+	add_step (&advertise_script, HCI_LE_SET_ADVERTISE_ENABLE_COMMAND, 1, parameters);
+
+	add_init_steps (&scan_script);
+
+	memset (parameters, 0, sizeof (parameters));
+	parameters[1] = scan_interval & 0xFF;
+	parameters[2] = (scan_interval >> 8) & 0xFF;
+	parameters[3] = scan_interval & 0xFF;
+	parameters[4] = (scan_interval >> 8) & 0xFF;
+	add_step (&scan_script, HCI_LE_SET_SCAN_PARAMETERS_COMMAND, 7, parameters);
+
+	parameters[0] = 1; // enabled
+	parameters[1] = 0; // every report, not just the first from each device
+	add_step (&scan_script, HCI_LE_SET_SCAN_ENABLE_COMMAND, 2, parameters);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void close_host (LoadHost *host, int epfd)
+{
+	epoll_ctl (epfd, EPOLL_CTL_DEL, host->fd, 0);
+	close (host->fd);
+
+	host->fd = -1;
+	host->state = HOST_CLOSED;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void update_interest (LoadHost *host, int epfd)
+{
+	struct epoll_event ev;
+
+
+	ev.events = EPOLLIN | ((host->write_len > 0) ? EPOLLOUT : 0);
+	ev.data.ptr = host;
+
+	epoll_ctl (epfd, EPOLL_CTL_MOD, host->fd, &ev);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// whatever the socket will not take now waits for EPOLLOUT
+
+static bool flush_host (LoadHost *host, int epfd)
+{
+	int err;
+	bool was_blocked;
+
+
+	was_blocked = (host->write_len > 0);
+
+	while (host->write_len > 0)
+	{
+		err = send (host->fd, host->write_buffer, host->write_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if (err < 0)
+		{
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				break;
+			}
+
+			return false;
+		}
+
+		memmove (host->write_buffer, &host->write_buffer[err], host->write_len - err);
+		host->write_len -= err;
+	}
+
+	if (was_blocked != (host->write_len > 0))
+	{
+		update_interest (host, epfd);
+	}
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static bool send_command (LoadHost *host, int epfd, int opcode, int parameter_len, const uint8 *parameters, bool probe)
+{
+	char *packet;
+
+
+	if (host->write_len + 4 + parameter_len > host_write_buffer_size)
+	{
+		return false;
+	}
+
+	packet = &host->write_buffer[host->write_len];
+
+	packet[0] = H4_COMMAND;
+	packet[1] = opcode & 0xFF;
+	packet[2] = (opcode >> 8) & 0xFF;
+	packet[3] = parameter_len;
+
+	if (parameter_len > 0)
+	{
+		memcpy (&packet[4], parameters, parameter_len);
+	}
+
+	host->write_len += 4 + parameter_len;
+
+	host->command_pending = true;
+	host->command_is_probe = probe;
+	host->command_opcode = opcode;
+	host->command_sent = now_ns ();
+
+	return flush_host (host, epfd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static bool send_next_step (LoadHost *host, int epfd)
+{
+	const ScriptStep *step;
+
+
+	step = &host->script->step[host->step];
+
+	return send_command (host, epfd, step->opcode, step->parameter_len, step->parameters, false);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// Command Complete or Command Status for the outstanding command, the script
+// moves on or the host starts probing once the script is done
+
+static bool on_command_done (LoadHost *host, int epfd, int opcode, int status, int64 now, int64 probe_interval)
+{
+	uint32 latency;
+
+
+	if ((!host->command_pending) || (opcode != host->command_opcode))
+	{
+		return true;
+	}
+
+	host->command_pending = false;
+
+	latency = (now - host->command_sent) / 1000;
+
+	if (host->command_is_probe)
+	{
+		probe_latency.push_back (latency);
+		return true;
+	}
+
+	script_latency.push_back (latency);
+
+	if (status != 0)
+	{
+		command_failures ++;
+	}
+
+	host->step ++;
+
+	if (host->step < host->script->length)
+	{
+		return send_next_step (host, epfd);
+	}
+
+	host->state = HOST_RUNNING;
+	host->running_since = now;
+	host->events = 0;
+	host->reports = 0;
+
+	// probes are spread out rather than all landing in the same tick
+
+	host->next_probe = now + (probe_interval > 0 ? rand () % probe_interval : 0);
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void process_event (LoadHost *host, int epfd, const uint8 *event, int64 now, int64 probe_interval)
+{
+	int len;
+
+
+	len = event[1];
+
+	if (host->state == HOST_RUNNING)
+	{
+		host->events ++;
+	}
+
+	switch (event[0])
+	{
+		case COMMAND_COMPLETE_EVENT:
+
+			if (len >= 3)
+			{
+				if (!on_command_done (host, epfd, event[3] | (event[4] << 8), (len > 3) ? event[5] : 0, now, probe_interval))
+				{
+					close_host (host, epfd);
+				}
+			}
+			break;
+
+		case COMMAND_STATUS_EVENT:
+
+			if (len >= 4)
+			{
+				if (!on_command_done (host, epfd, event[4] | (event[5] << 8), event[2], now, probe_interval))
+				{
+					close_host (host, epfd);
+				}
+			}
+			break;
+
+		case LE_META_EVENT:
+
+			if ((len >= 2) && (event[2] == LE_ADVERTISING_REPORT_EVENT) && (host->state == HOST_RUNNING))
+			{
+				host->reports += event[3];
+			}
+			break;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void on_host_readable (LoadHost *host, int epfd, int64 now, int64 probe_interval)
+{
+	int err;
+	int offset;
+	int frame_len;
+	uint8 *frame;
+
+
+	err = recv (host->fd, &host->read_buffer[host->read_len], host_read_buffer_size - host->read_len, MSG_DONTWAIT);
+
+	if (err <= 0)
+	{
+		if ((err < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+		{
+			return;
+		}
+
+		unexpected_closes ++;
+		close_host (host, epfd);
+		return;
+	}
+
+	host->read_len += err;
+	offset = 0;
+
+	while ((host->state != HOST_CLOSED) && (host->read_len - offset >= 3))
+	{
+		frame = (uint8 *) &host->read_buffer[offset];
+
+		if (frame[0] != H4_EVENT)
+		{
+			// no connections are made so nothing but events should come
+
+			fprintf (stderr, "unexpected packet type %02X\n", frame[0]);
+			unexpected_closes ++;
+			close_host (host, epfd);
+			return;
+		}
+
+		frame_len = 3 + frame[2];
+
+		if (host->read_len - offset < frame_len)
+		{
+			break;
+		}
+
+		process_event (host, epfd, &frame[1], now, probe_interval);
+
+		offset += frame_len;
+	}
+
+	if (host->state != HOST_CLOSED)
+	{
+		memmove (host->read_buffer, &host->read_buffer[offset], host->read_len - offset);
+		host->read_len -= offset;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static bool start_connect (LoadHost *host, int epfd, const struct sockaddr_in *server)
+{
+	struct epoll_event ev;
+	int one;
+
+
+	host->fd = socket (AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+
+	if (host->fd < 0)
+	{
+		fprintf (stderr, "socket (%d : %s)\n", errno, strerror (errno));
+		return false;
+	}
+
+	one = 1;
+	setsockopt (host->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof (one));
+
+	if ((connect (host->fd, (const struct sockaddr *) server, sizeof (*server)) < 0) && (errno != EINPROGRESS))
+	{
+		close (host->fd);
+		host->fd = -1;
+		return false;
+	}
+
+	host->state = HOST_CONNECTING;
+
+	ev.events = EPOLLOUT;
+	ev.data.ptr = host;
+
+	epoll_ctl (epfd, EPOLL_CTL_ADD, host->fd, &ev);
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static bool on_connected (LoadHost *host, int epfd)
+{
+	int err;
+	socklen_t len;
+
+
+	len = sizeof (err);
+
+	if ((getsockopt (host->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0) || (err != 0))
+	{
+		return false;
+	}
+
+	host->state = HOST_SCRIPT;
+	host->step = 0;
+
+	update_interest (host, epfd);
+
+	return send_next_step (host, epfd);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint32 percentile (const std::vector<uint32> &sorted, double fraction)
+{
+	size_t index;
+
+
+	if (sorted.empty ())
+	{
+		return 0;
+	}
+
+	index = (size_t) (fraction * (sorted.size () - 1) + 0.5);
+
+	return sorted[index];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void print_latency (const char *name, std::vector<uint32> &latency)
+{
+	std::sort (latency.begin (), latency.end ());
+
+	printf ("%-8s %10zu commands, latency us p50 %lu p90 %lu p99 %lu p99.9 %lu max %lu\n", name, latency.size (),
+		percentile (latency, 0.5), percentile (latency, 0.9), percentile (latency, 0.99), percentile (latency, 0.999),
+		latency.empty () ? 0 : latency.back ());
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// per second rates of the hosts of one role that got as far as running
+
+static void print_rates (const char *name, LoadHost *hosts, int number_of_hosts, HostRole role, int64 now, bool reports)
+{
+	double rate;
+	double total;
+	double minimum;
+	double maximum;
+	int count;
+
+
+	total = 0;
+	minimum = 0;
+	maximum = 0;
+	count = 0;
+
+	for (int index = 0; index < number_of_hosts; index ++)
+	{
+		LoadHost *host = &hosts[index];
+
+		if ((host->role != role) || (host->running_since == 0) || (now <= host->running_since))
+		{
+			continue;
+		}
+
+		rate = (reports ? host->reports : host->events) * 1e9 / (now - host->running_since);
+
+		minimum = (count == 0) ? rate : std::min (minimum, rate);
+		maximum = (count == 0) ? rate : std::max (maximum, rate);
+		total += rate;
+		count ++;
+	}
+
+	if (count > 0)
+	{
+		printf ("%-12s %6d hosts, per host per second mean %.1f min %.1f max %.1f, total %.0f/s\n", name, count, total / count, minimum, maximum, total);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void usage (const char *program_name)
+{
+	fprintf (stderr, "usage: %s [-H host] [-p port] [-n hosts] [-m idle|advertise|scan|mixed] [-d seconds] [-i probe_interval_ms] [-a advertising_interval_ms] [-s scan_interval_ms] [-c concurrent_connects]\n", program_name);
+	exit (1);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int main (int argc, char **argv)
+{
+	struct epoll_event events[maximum_epoll_events];
+	struct sockaddr_in server;
+	struct rlimit limit;
+	struct hostent *he;
+	const char *server_name;
+	const char *mode;
+	LoadHost *hosts;
+	LoadHost *host;
+	int number_of_hosts;
+	int port;
+	int duration;
+	int64 probe_interval;
+	int advertising_interval;
+	int scan_interval;
+	int concurrent_connects;
+	int connecting;
+	int next_host;
+	int running;
+	int epfd;
+	int count;
+	int opt;
+	int64 start;
+	int64 end;
+	int64 now;
+	int64 next_progress;
+
+
+	server_name = "127.0.0.1";
+	port = 0xb1ee;
+	number_of_hosts = 100;
+	mode = "mixed";
+	duration = 10;
+	probe_interval = 100;
+	advertising_interval = 100;
+	scan_interval = 10;
+	concurrent_connects = 32;
+
+	while ((opt = getopt (argc, argv, "H:p:n:m:d:i:a:s:c:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'H': server_name = optarg; break;
+			case 'p': port = atoi (optarg); break;
+			case 'n': number_of_hosts = atoi (optarg); break;
+			case 'm': mode = optarg; break;
+			case 'd': duration = atoi (optarg); break;
+			case 'i': probe_interval = atoi (optarg); break;
+			case 'a': advertising_interval = atoi (optarg); break;
+			case 's': scan_interval = atoi (optarg); break;
+			case 'c': concurrent_connects = atoi (optarg); break;
+			default: usage (argv[0]);
+		}
+	}
+
+	if ((number_of_hosts <= 0) || (concurrent_connects <= 0) ||
+		(strcmp (mode, "idle") && strcmp (mode, "advertise") && strcmp (mode, "scan") && strcmp (mode, "mixed")))
+	{
+		usage (argv[0]);
+	}
+
+	he = gethostbyname (server_name);
+
+	if (!he)
+	{
+		fprintf (stderr, "unknown host %s\n", server_name);
+		exit (1);
+	}
+
+	memset (&server, 0, sizeof (server));
+	server.sin_family = AF_INET;
+	server.sin_port = htons (port);
+	memcpy (&server.sin_addr, he->h_addr_list[0], sizeof (server.sin_addr));
+
+	// one descriptor per host, plus a few for everything else
+
+	if (getrlimit (RLIMIT_NOFILE, &limit) == 0)
+	{
+		if (limit.rlim_cur < (rlim_t) number_of_hosts + 16)
+		{
+			limit.rlim_cur = std::min ((rlim_t) number_of_hosts + 16, limit.rlim_max);
+			setrlimit (RLIMIT_NOFILE, &limit);
+		}
+	}
+
+	// the server wants milliseconds as 0.625 ms slots
+
+	build_scripts (advertising_interval * 8 / 5, scan_interval * 8 / 5);
+
+	probe_interval *= 1000000;
+
+	hosts = (LoadHost *) calloc (number_of_hosts, sizeof (LoadHost));
+
+	for (int index = 0; index < number_of_hosts; index ++)
+	{
+		host = &hosts[index];
+
+		host->fd = -1;
+		host->state = HOST_IDLE;
+
+		if (!strcmp (mode, "advertise") || (!strcmp (mode, "mixed") && (index % 2 == 0)))
+		{
+			host->role = ROLE_ADVERTISER;
+			host->script = &advertise_script;
+		}
+		else if (!strcmp (mode, "scan") || !strcmp (mode, "mixed"))
+		{
+			host->role = ROLE_SCANNER;
+			host->script = &scan_script;
+		}
+		else
+		{
+			host->role = ROLE_IDLE;
+			host->script = &idle_script;
+		}
+	}
+
+	epfd = epoll_create1 (0);
+
+	start = now_ns ();
+	end = start + (int64) duration * 1000000000;
+	next_progress = start + 1000000000;
+	next_host = 0;
+	connecting = 0;
+
+	while ((now = now_ns ()) < end)
+	{
+		// connections are opened a few at a time, the server's listen
+		// backlog is short
+
+		while ((next_host < number_of_hosts) && (connecting < concurrent_connects))
+		{
+			if (start_connect (&hosts[next_host], epfd, &server))
+			{
+				connecting ++;
+			}
+			else
+			{
+				connect_failures ++;
+				hosts[next_host].state = HOST_CLOSED;
+			}
+
+			next_host ++;
+		}
+
+		count = epoll_wait (epfd, events, maximum_epoll_events, 1);
+		now = now_ns ();
+
+		for (int index = 0; index < count; index ++)
+		{
+			host = (LoadHost *) events[index].data.ptr;
+
+			if (host->state == HOST_CLOSED)
+			{
+				continue;
+			}
+
+			if (host->state == HOST_CONNECTING)
+			{
+				connecting --;
+
+				if (!on_connected (host, epfd))
+				{
+					connect_failures ++;
+					close_host (host, epfd);
+				}
+
+				continue;
+			}
+
+			if (events[index].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
+			{
+				on_host_readable (host, epfd, now, probe_interval);
+			}
+
+			if ((host->state != HOST_CLOSED) && (events[index].events & EPOLLOUT))
+			{
+				if (!flush_host (host, epfd))
+				{
+					unexpected_closes ++;
+					close_host (host, epfd);
+				}
+			}
+		}
+
+		// probes, the hosts are swept at most once a millisecond
+
+		running = 0;
+
+		for (int index = 0; index < next_host; index ++)
+		{
+			host = &hosts[index];
+
+			if (host->state != HOST_RUNNING)
+			{
+				continue;
+			}
+
+			running ++;
+
+			if ((probe_interval > 0) && (!host->command_pending) && (now >= host->next_probe))
+			{
+				host->next_probe += probe_interval;
+
+				if (!send_command (host, epfd, HCI_READ_BD_ADDR_COMMAND, 0, 0, true))
+				{
+					unexpected_closes ++;
+					close_host (host, epfd);
+				}
+			}
+		}
+
+		if (now >= next_progress)
+		{
+			fprintf (stderr, "%3lds %d running, %zu script commands, %zu probes\n",
+				(long) ((now - start) / 1000000000), running, script_latency.size (), probe_latency.size ());
+			next_progress += 1000000000;
+		}
+	}
+
+	now = now_ns ();
+
+	running = 0;
+
+	for (int index = 0; index < number_of_hosts; index ++)
+	{
+		if (hosts[index].state == HOST_RUNNING)
+		{
+			running ++;
+		}
+	}
+
+	printf ("%d hosts, %d running, %llu connect failures, %llu closed by the server, %llu commands failed\n",
+		number_of_hosts, running, connect_failures, unexpected_closes, command_failures);
+
+	print_latency ("script", script_latency);
+	print_latency ("probe", probe_latency);
+
+	print_rates ("advertisers", hosts, number_of_hosts, ROLE_ADVERTISER, now, false);
+	print_rates ("scanners", hosts, number_of_hosts, ROLE_SCANNER, now, false);
+	print_rates ("adv reports", hosts, number_of_hosts, ROLE_SCANNER, now, true);
+
+	for (int index = 0; index < number_of_hosts; index ++)
+	{
+		if (hosts[index].fd >= 0)
+		{
+			close (hosts[index].fd);
+		}
+	}
+
+	close (epfd);
+	free (hosts);
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
@@ -97,6 +97,16 @@ void disable_logging_of (DebugLog val)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// lets a caller skip building a multi part log line, without the lock as a
+// stale answer only costs one line
+
+bool is_logging_enabled (DebugLog val)
+{
+	return ((1 << val) & log_enabled) != 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 const char *log_type_string (DebugLog val)
 {
 	const char *log_type;
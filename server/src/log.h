@@ -47,6 +47,7 @@ enum DebugLog
 
 extern void enable_logging_of (DebugLog val);
 extern void disable_logging_of (DebugLog val);
+extern bool is_logging_enabled (DebugLog val);
 
 ////////////////////////////////////////////////////////////////////////////////
 
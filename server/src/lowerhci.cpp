@@ -28,6 +28,8 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include <string.h>
+#include <time.h>
+#include <atomic>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -37,10 +39,221 @@
 
 ////////////////////////////////////////////////////////////////////////////////
 
+int64 LowerHCI::default_advertising_report_window = 10000; // 10ms
+int64 LowerHCI::default_completed_packets_window = 5000; // 5ms
+int LowerHCI::default_completed_packets_threshold = total_num_le_acl_data_packets / 2;
+int LowerHCI::default_num_hci_command_packets = 1;
+
+////////////////////////////////////////////////////////////////////////////////
+
+static uint64 get_bd_addr (const char *p)
+{
+	uint64 bd_addr;
+
+
+	bd_addr = 0;
+
+	for (int index = 0; index < 6; index ++)
+	{
+		bd_addr |= ((uint64) (p[index] & 0xFF)) << (8 * index);
+	}
+
+	return bd_addr;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// every command the controller handles, the dispatcher checks fixed
+// parameter lengths (-1 when the handler parses a variable length) and
+// answers a bad one itself, octet 0xFF is a command without a bit in the
+// supported commands mask
+
+// the legacy and extended advertising commands may not be mixed, the first
+// of either used after a reset decides which the host has until the next
+
+const int ADV_ANY = 0;
+const int ADV_LEGACY = 1;
+const int ADV_EXTENDED = 2;
+
+struct HciCommand
+{
+	int opcode;
+	void (LowerHCI::*handler) (int parameter_len, char *parameters);
+	int parameter_len;
+	bool status_event; // answered with Command Status rather than Command Complete
+	uint8 supported_octet;
+	uint8 supported_bit;
+	uint8 advertising_commands; // ADV_LEGACY or ADV_EXTENDED for the command sets that exclude each other
+};
+
+static const HciCommand hci_command_table[] =
+{
+	{ HCI_DISCONNECT_COMMAND, &LowerHCI::hci_disconnect_command, 3, true, 0, 5, ADV_ANY },
+	{ HCI_SET_EVENT_MASK_COMMAND, &LowerHCI::hci_set_event_mask_command, 8, false, 5, 6, ADV_ANY },
+	{ HCI_RESET_COMMAND, &LowerHCI::hci_reset_command, 0, false, 5, 7, ADV_ANY },
+	{ HCI_WRITE_LE_HOST_SUPPORTED_COMMAND, &LowerHCI::hci_write_le_host_supported_command, 2, false, 24, 6, ADV_ANY },
+	{ HCI_READ_LOCAL_VERSION_INFORMATION_COMMAND, &LowerHCI::hci_read_local_version_information_command, 0, false, 14, 3, ADV_ANY },
+	{ HCI_READ_LOCAL_SUPPORTED_COMMANDS_COMMAND, &LowerHCI::hci_read_local_supported_commands_command, 0, false, 0xFF, 0, ADV_ANY },
+	{ HCI_READ_LOCAL_SUPPORTED_FEATURES_COMMAND, &LowerHCI::hci_read_local_supported_features_command, 0, false, 14, 5, ADV_ANY },
+	{ HCI_READ_LOCAL_EXTENDED_FEATURES_COMMAND, &LowerHCI::hci_read_local_extended_features_command, 1, false, 14, 6, ADV_ANY },
+	{ HCI_READ_BUFFER_SIZE_COMMAND, &LowerHCI::hci_read_buffer_size_command, 0, false, 14, 7, ADV_ANY },
+	{ HCI_READ_BD_ADDR_COMMAND, &LowerHCI::hci_read_bd_addr_command, 0, false, 15, 1, ADV_ANY },
+	{ HCI_READ_RSSI_COMMAND, &LowerHCI::hci_read_rssi_command, 2, false, 15, 5, ADV_ANY },
+	{ HCI_LE_SET_EVENT_MASK_COMMAND, &LowerHCI::hci_le_set_event_mask_command, 8, false, 25, 0, ADV_ANY },
+	{ HCI_LE_READ_BUFFER_SIZE_COMMAND, &LowerHCI::hci_le_read_buffer_size_command, 0, false, 25, 1, ADV_ANY },
+	{ HCI_LE_READ_LOCAL_SUPPORTED_FEATURES_COMMAND, &LowerHCI::hci_le_read_local_supported_features_command, 0, false, 25, 2, ADV_ANY },
+	{ HCI_LE_SET_RANDOM_ADDRESS_COMMAND, &LowerHCI::hci_le_set_random_address_command, 6, false, 25, 4, ADV_ANY },
+	{ HCI_LE_SET_ADVERTISING_PARAMETERS_COMMAND, &LowerHCI::hci_le_set_advertising_parameters_command, 15, false, 25, 5, ADV_LEGACY },
+	{ HCI_LE_READ_ADVERTISING_CHANNEL_TX_POWER_COMMAND, &LowerHCI::hci_le_read_advertising_channel_tx_power_command, 0, false, 25, 6, ADV_LEGACY },
+	{ HCI_LE_SET_ADVERTISING_DATA_COMMAND, &LowerHCI::hci_le_set_advertising_data_command, 32, false, 25, 7, ADV_LEGACY },
+	{ HCI_LE_SET_SCAN_RESPONSE_DATA_COMMAND, &LowerHCI::hci_le_set_scan_response_data_command, 32, false, 26, 0, ADV_LEGACY },
+	{ HCI_LE_SET_ADVERTISE_ENABLE_COMMAND, &LowerHCI::hci_le_set_advertise_enable_command, 1, false, 26, 1, ADV_LEGACY },
+	{ HCI_LE_SET_SCAN_PARAMETERS_COMMAND, &LowerHCI::hci_le_set_scan_parameters_command, 7, false, 26, 2, ADV_LEGACY },
+	{ HCI_LE_SET_SCAN_ENABLE_COMMAND, &LowerHCI::hci_le_set_scan_enable_command, 2, false, 26, 3, ADV_LEGACY },
+	{ HCI_LE_CREATE_CONNECTION_COMMAND, &LowerHCI::hci_le_create_connection_command, 25, true, 26, 4, ADV_LEGACY },
+	{ HCI_LE_CREATE_CONNECTION_CANCEL_COMMAND, &LowerHCI::hci_le_create_connection_cancel_command, 0, false, 26, 5, ADV_ANY },
+	{ HCI_LE_READ_WHITE_LIST_SIZE_COMMAND, &LowerHCI::hci_le_read_white_list_size_command, 0, false, 26, 6, ADV_ANY },
+	{ HCI_LE_ENCRYPT_COMMAND, &LowerHCI::hci_le_encrypt_command, 32, false, 27, 6, ADV_ANY },
+	{ HCI_LE_RAND_COMMAND, &LowerHCI::hci_le_rand_command, 0, false, 27, 7, ADV_ANY },
+	{ HCI_LE_START_ENCRYPTION_COMMAND, &LowerHCI::hci_le_start_encryption_command, 28, true, 28, 0, ADV_ANY },
+	{ HCI_LE_LONG_TERM_KEY_REQUEST_REPLY_COMMAND, &LowerHCI::hci_le_long_term_key_request_reply_command, 18, false, 28, 1, ADV_ANY },
+	{ HCI_LE_LONG_TERM_KEY_REQUEST_NEGATIVE_REPLY_COMMAND, &LowerHCI::hci_le_long_term_key_request_negative_reply_command, 2, false, 28, 2, ADV_ANY },
+	{ HCI_LE_READ_SUPPORTED_STATES_COMMAND, &LowerHCI::hci_le_read_supported_states_command, 0, false, 28, 3, ADV_ANY },
+	{ HCI_LE_ADD_DEVICE_TO_RESOLVING_LIST_COMMAND, &LowerHCI::hci_le_add_device_to_resolving_list_command, 39, false, 34, 3, ADV_ANY },
+	{ HCI_LE_REMOVE_DEVICE_FROM_RESOLVING_LIST_COMMAND, &LowerHCI::hci_le_remove_device_from_resolving_list_command, 7, false, 34, 4, ADV_ANY },
+	{ HCI_LE_CLEAR_RESOLVING_LIST_COMMAND, &LowerHCI::hci_le_clear_resolving_list_command, 0, false, 34, 5, ADV_ANY },
+	{ HCI_LE_READ_RESOLVING_LIST_SIZE_COMMAND, &LowerHCI::hci_le_read_resolving_list_size_command, 0, false, 34, 6, ADV_ANY },
+	{ HCI_LE_READ_PEER_RESOLVABLE_ADDRESS_COMMAND, &LowerHCI::hci_le_read_peer_resolvable_address_command, 7, false, 34, 7, ADV_ANY },
+	{ HCI_LE_READ_LOCAL_RESOLVABLE_ADDRESS_COMMAND, &LowerHCI::hci_le_read_local_resolvable_address_command, 7, false, 35, 0, ADV_ANY },
+	{ HCI_LE_SET_ADDRESS_RESOLUTION_ENABLE_COMMAND, &LowerHCI::hci_le_set_address_resolution_enable_command, 1, false, 35, 1, ADV_ANY },
+	{ HCI_LE_SET_RESOLVABLE_PRIVATE_ADDRESS_TIMEOUT_COMMAND, &LowerHCI::hci_le_set_resolvable_private_address_timeout_command, 2, false, 35, 2, ADV_ANY },
+	{ HCI_LE_SET_DEFAULT_PHY_COMMAND, &LowerHCI::hci_le_set_default_phy_command, 3, false, 35, 5, ADV_ANY },
+	{ HCI_LE_SET_ADVERTISING_SET_RANDOM_ADDRESS_COMMAND, &LowerHCI::hci_le_set_advertising_set_random_address_command, 7, false, 36, 1, ADV_EXTENDED },
+	{ HCI_LE_SET_EXTENDED_ADVERTISING_PARAMETERS_COMMAND, &LowerHCI::hci_le_set_extended_advertising_parameters_command, 25, false, 36, 2, ADV_EXTENDED },
+	{ HCI_LE_SET_EXTENDED_ADVERTISING_DATA_COMMAND, &LowerHCI::hci_le_set_extended_advertising_data_command, -1, false, 36, 3, ADV_EXTENDED },
+	{ HCI_LE_SET_EXTENDED_SCAN_RESPONSE_DATA_COMMAND, &LowerHCI::hci_le_set_extended_scan_response_data_command, -1, false, 36, 4, ADV_EXTENDED },
+	{ HCI_LE_SET_EXTENDED_ADVERTISING_ENABLE_COMMAND, &LowerHCI::hci_le_set_extended_advertising_enable_command, -1, false, 36, 5, ADV_EXTENDED },
+	{ HCI_LE_READ_MAXIMUM_ADVERTISING_DATA_LENGTH_COMMAND, &LowerHCI::hci_le_read_maximum_advertising_data_length_command, 0, false, 36, 6, ADV_EXTENDED },
+	{ HCI_LE_READ_NUMBER_OF_SUPPORTED_ADVERTISING_SETS_COMMAND, &LowerHCI::hci_le_read_number_of_supported_advertising_sets_command, 0, false, 36, 7, ADV_EXTENDED },
+	{ HCI_LE_REMOVE_ADVERTISING_SET_COMMAND, &LowerHCI::hci_le_remove_advertising_set_command, 1, false, 37, 0, ADV_EXTENDED },
+	{ HCI_LE_CLEAR_ADVERTISING_SETS_COMMAND, &LowerHCI::hci_le_clear_advertising_sets_command, 0, false, 37, 1, ADV_EXTENDED },
+	{ HCI_LE_SET_PERIODIC_ADVERTISING_PARAMETERS_COMMAND, &LowerHCI::hci_le_set_periodic_advertising_parameters_command, 7, false, 37, 2, ADV_EXTENDED },
+	{ HCI_LE_SET_PERIODIC_ADVERTISING_DATA_COMMAND, &LowerHCI::hci_le_set_periodic_advertising_data_command, -1, false, 37, 3, ADV_EXTENDED },
+	{ HCI_LE_SET_PERIODIC_ADVERTISING_ENABLE_COMMAND, &LowerHCI::hci_le_set_periodic_advertising_enable_command, 2, false, 37, 4, ADV_EXTENDED },
+	{ HCI_LE_SET_EXTENDED_SCAN_PARAMETERS_COMMAND, &LowerHCI::hci_le_set_extended_scan_parameters_command, -1, false, 37, 5, ADV_EXTENDED },
+	{ HCI_LE_SET_EXTENDED_SCAN_ENABLE_COMMAND, &LowerHCI::hci_le_set_extended_scan_enable_command, 6, false, 37, 6, ADV_EXTENDED },
+	{ HCI_LE_PERIODIC_ADVERTISING_CREATE_SYNC_COMMAND, &LowerHCI::hci_le_periodic_advertising_create_sync_command, 14, true, 38, 0, ADV_EXTENDED },
+	{ HCI_LE_PERIODIC_ADVERTISING_CREATE_SYNC_CANCEL_COMMAND, &LowerHCI::hci_le_periodic_advertising_create_sync_cancel_command, 0, false, 38, 1, ADV_EXTENDED },
+	{ HCI_LE_PERIODIC_ADVERTISING_TERMINATE_SYNC_COMMAND, &LowerHCI::hci_le_periodic_advertising_terminate_sync_command, 2, false, 38, 2, ADV_EXTENDED },
+	{ HCI_VS_SET_TX_POWER_COMMAND, &LowerHCI::hci_vs_set_tx_power_command, 1, false, 0xFF, 0, ADV_ANY },
+	{ HCI_VS_SET_POSITION_COMMAND, &LowerHCI::hci_vs_set_position_command, 12, false, 0xFF, 0, ADV_ANY },
+	{ HCI_VS_SET_CLOCK_DRIFT_COMMAND, &LowerHCI::hci_vs_set_clock_drift_command, 2, false, 0xFF, 0, ADV_ANY },
+	{ HCI_VS_SET_LINK_PACKET_LOSS_COMMAND, &LowerHCI::hci_vs_set_link_packet_loss_command, 7, false, 0xFF, 0, ADV_ANY },
+	{ HCI_VS_SET_BTSNOOP_CAPTURE_COMMAND, &LowerHCI::hci_vs_set_btsnoop_capture_command, 1, false, 0xFF, 0, ADV_ANY },
+};
+
+const int number_of_hci_commands = sizeof (hci_command_table) / sizeof (hci_command_table[0]);
+
+////////////////////////////////////////////////////////////////////////////////
+
+// opcodes are looked up through a perfect hash, a multiplier is searched for
+// once at start up that puts every opcode in the table in a slot of its own
+
+const int hci_command_hash_bits = 8;
+const int hci_command_hash_size = 1 << hci_command_hash_bits;
+
+static_assert (number_of_hci_commands < 0xFF, "slots hold a table index + 1 in a uint8");
+
+static unsigned int hci_command_hash_multiplier;
+static uint8 hci_command_hash[hci_command_hash_size]; // table index + 1, 0 for an empty slot
+
+////////////////////////////////////////////////////////////////////////////////
+
+static inline int hci_command_hash_slot (int opcode, unsigned int multiplier)
+{
+	return ((unsigned int) opcode * multiplier) >> (32 - hci_command_hash_bits);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static bool build_hci_command_hash (void)
+{
+	int slot;
+	int index;
+
+
+	for (unsigned int multiplier = 0x9E3779B1; ; multiplier += 2)
+	{
+		memset (hci_command_hash, 0, sizeof (hci_command_hash));
+
+		for (index = 0; index < number_of_hci_commands; index ++)
+		{
+			slot = hci_command_hash_slot (hci_command_table[index].opcode, multiplier);
+
+			if (hci_command_hash[slot])
+			{
+				break;
+			}
+
+			hci_command_hash[slot] = index + 1;
+		}
+
+		if (index == number_of_hci_commands)
+		{
+			hci_command_hash_multiplier = multiplier;
+
+			log (LOG_LOWERHCI, "HCI command hash multiplier %08X", multiplier);
+
+			return true;
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static const HciCommand *find_hci_command (int opcode)
+{
+	int index;
+
+
+	index = hci_command_hash[hci_command_hash_slot (opcode, hci_command_hash_multiplier)];
+
+	if ((index == 0) || (hci_command_table[index - 1].opcode != opcode))
+	{
+		return 0;
+	}
+
+	return &hci_command_table[index - 1];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// how often each command was processed and how long it took, shared by
+// every controller and updated without a lock
+
+struct HciCommandStatistics
+{
+	std::atomic<uint64> count;
+	std::atomic<uint64> total_time; // nanoseconds
+	std::atomic<uint64> maximum_time;
+};
+
+static HciCommandStatistics hci_command_statistics[number_of_hci_commands];
+
+////////////////////////////////////////////////////////////////////////////////
+
 LowerHCI::LowerHCI ()
 {
 	log (LOG_LOWERHCI, "LowerHCI");
 
+	static bool hash_built = build_hci_command_hash ();
+
+	(void) hash_built;
+
+	hci_advertising_report_window = default_advertising_report_window;
+	hci_completed_packets_window = default_completed_packets_window;
+	hci_completed_packets_threshold = default_completed_packets_threshold;
+
 	reset ();
 }
 
@@ -57,12 +270,13 @@ void LowerHCI::reset (void)
 {
 	log (LOG_LOWERHCI, "LowerHCI::reset");
 
-	num_hci_command_packets = 1;
+	num_hci_command_packets = default_num_hci_command_packets;
 	hci_event_mask = 0x00001FFFFFFFFFFF;
 	hci_le_event_mask = 0x000000000000001F;
+	hci_update_le_event_mask ();
 
-	hci_le_acl_data_packet_length = 27;
-	hci_total_num_le_acl_data_packets = 4;
+	hci_le_acl_data_packet_length = le_acl_data_packet_length;
+	hci_total_num_le_acl_data_packets = total_num_le_acl_data_packets;
 
 	hci_acl_data_packet_length = 0;
 	hci_acl_data_packet_length = 0;
@@ -72,30 +286,32 @@ void LowerHCI::reset (void)
 	hci_total_num_synchronous_data_packets = 0;
 	hci_total_num_synchronous_data_packets = 0;
 
+	hci_advertising_report_first = 0;
+	hci_advertising_report_count = 0;
+	hci_advertising_report_length = 2;
+
+	hci_completed_packets_first = 0;
+	hci_completed_packets_total = 0;
+	memset (hci_completed_packets, 0, sizeof (hci_completed_packets));
+
+	hci_advertising_commands = ADV_ANY;
+
 	memset (hci_supported_commands, 0, sizeof (hci_supported_commands));
 
-	hci_supported_commands[5] |= (1 << 6); // Set Event Mask
-	hci_supported_commands[5] |= (1 << 7); // Reset
-	hci_supported_commands[14] |= (1 << 3); // Read Local Version Information
-	hci_supported_commands[14] |= (1 << 5); // Read Local Supported Features
-	hci_supported_commands[14] |= (1 << 6); // Read Local Extended Features
-	hci_supported_commands[14] |= (1 << 7); // Read Buffer Size
-	hci_supported_commands[15] |= (1 << 1); // Read BD_ADDR
-	hci_supported_commands[24] |= (1 << 5); // Read LE Host Supported
-	hci_supported_commands[24] |= (1 << 6); // Write LE Host Supported
-	hci_supported_commands[25] |= (1 << 0); // LE Set Event Mask
-	hci_supported_commands[25] |= (1 << 1); // LE Read Buffer Size
-	hci_supported_commands[25] |= (1 << 2); // LE Read Local Supported Features
-	hci_supported_commands[25] |= (1 << 4); // LE Set Random Address
-	hci_supported_commands[25] |= (1 << 5); // LE Set Advertising Parameters
-	hci_supported_commands[25] |= (1 << 6); // LE Read Advertising Channel Tx Power
-	hci_supported_commands[25] |= (1 << 7); // LE Set Advertising Data
-	hci_supported_commands[26] |= (1 << 0); // LE Set Scan Response Data
-	hci_supported_commands[26] |= (1 << 1); // LE Set Advertising Enable
-	hci_supported_commands[26] |= (1 << 2); // LE Set Scan Parameters
-	hci_supported_commands[26] |= (1 << 3); // LE Set Scan Enable
-	hci_supported_commands[26] |= (1 << 4); // LE Create Connection
-	hci_supported_commands[26] |= (1 << 5); // LE Create Connection Cancel
+	for (int index = 0; index < number_of_hci_commands; index ++)
+	{
+		if (hci_command_table[index].supported_octet != 0xFF)
+		{
+			hci_supported_commands[hci_command_table[index].supported_octet] |= (1 << hci_command_table[index].supported_bit);
+		}
+	}
+
+	// the encryption commands go with the LE Encryption feature
+
+	if (!(ll_get_le_features () & (1 << 0)))
+	{
+		hci_supported_commands[28] &= ~0x07;
+	}
 
 };
 
@@ -122,6 +338,8 @@ void LowerHCI::hci_set_event_mask_command (int parameter_len, char *parameters)
 		hci_event_mask |= (1 << (COMMAND_STATUS_EVENT - 1));
 		hci_event_mask |= (1 << (NUMBER_OF_COMPLETED_PACKETS_EVENT - 1));
 
+		hci_update_le_event_mask ();
+
 		buffer[0] = EC_SUCCESS;
 	}
 	else
@@ -142,7 +360,11 @@ void LowerHCI::hci_reset_command (int parameter_len, char *parameters)
 	log (LOG_LOWERHCI, "HCI Reset Command");
 
 	PhysicalLayer::reset ();
+
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
 	LinkLayer::reset ();
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+
 	LowerHCI::reset ();
 
 	buffer[0] = EC_SUCCESS;
@@ -331,10 +553,36 @@ void LowerHCI::hci_read_bd_addr_command (int parameter_len, char *parameters)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+void LowerHCI::hci_read_rssi_command (int parameter_len, char *parameters)
+{
+	char buffer[4];
+	uint8 *p;
+	int handle;
+	int rssi;
+
+
+	log (LOG_LOWERHCI, "HCI Read RSSI Command");
+
+	p = (uint8 *) parameters;
+	handle = p[0] | ((p[1] & 0x0F) << 8);
+	rssi = 127;
+
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+	buffer[0] = ll_read_rssi (handle, &rssi);
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+
+	buffer[1] = (handle) & 0xFF;
+	buffer[2] = (handle >> 8) & 0xFF;
+	buffer[3] = (char) rssi;
+
+	send_command_complete_event (HCI_READ_RSSI_COMMAND, 4, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 void LowerHCI::hci_le_set_event_mask_command (int parameter_len, char *parameters)
 {
 	char buffer[1];
-	uint64 hci_le_event_mask;
 
 
 	log (LOG_LOWERHCI, "HCI LE Set Event Mask Command");
@@ -350,6 +598,8 @@ void LowerHCI::hci_le_set_event_mask_command (int parameter_len, char *parameter
 		hci_le_event_mask |= (((uint64) parameters[6]) & 0xFF) << 48;
 		hci_le_event_mask |= (((uint64) parameters[7]) & 0xFF) << 56;
 
+		hci_update_le_event_mask ();
+
 		buffer[0] = EC_SUCCESS;
 	}
 	else
@@ -402,6 +652,29 @@ void LowerHCI::hci_le_read_local_supported_features_command (int parameter_len,
 
 ////////////////////////////////////////////////////////////////////////////////
 
+void LowerHCI::hci_le_set_random_address_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+
+
+	log (LOG_LOWERHCI, "HCI LE Set Random Address Command");
+
+	if (parameter_len == 6)
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = ll_set_random_address (get_bd_addr (parameters));
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	send_command_complete_event (HCI_LE_SET_RANDOM_ADDRESS_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 void LowerHCI::hci_le_set_advertising_parameters_command (int parameter_len, char *parameters)
 {
 	char buffer[1];
@@ -433,7 +706,9 @@ void LowerHCI::hci_le_set_advertising_parameters_command (int parameter_len, cha
 		advertising_channel_map = parameters[13];
 		advertising_filter_policy = parameters[14];
 
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
 		ll_set_advertising_parameters (advertising_interval_min, advertising_interval_max, advertising_type, own_address_type, direct_address_type, direct_address, advertising_channel_map, advertising_filter_policy);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
 
 		buffer[0] = EC_SUCCESS;
 	}
@@ -471,12 +746,21 @@ void LowerHCI::hci_le_set_advertising_data_command (int parameter_len, char *par
 
 	log (LOG_LOWERHCI, "HCI LE Set Advertising Data Command");
 
-	advertising_data_length = parameters[0];
+	advertising_data_length = parameters[0] & 0xFF;
 	advertising_data = &parameters[1];
 
-	ll_set_advertising_data (advertising_data_length, advertising_data);
+	if (advertising_data_length > 31)
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+	else
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		ll_set_advertising_data (advertising_data_length, advertising_data);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
 
-	buffer[0] = EC_SUCCESS;
+		buffer[0] = EC_SUCCESS;
+	}
 
 	send_command_complete_event (HCI_LE_SET_ADVERTISING_DATA_COMMAND, 1, buffer);
 }
@@ -492,12 +776,21 @@ void LowerHCI::hci_le_set_scan_response_data_command (int parameter_len, char *p
 
 	log (LOG_LOWERHCI, "HCI LE Set Advertising Data Command");
 
-	scan_response_data_length = parameters[0];
+	scan_response_data_length = parameters[0] & 0xFF;
 	scan_response_data = &parameters[1];
 
-	ll_set_scan_response_data (scan_response_data_length, scan_response_data);
+	if (scan_response_data_length > 31)
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+	else
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		ll_set_scan_response_data (scan_response_data_length, scan_response_data);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
 
-	buffer[0] = EC_SUCCESS;
+		buffer[0] = EC_SUCCESS;
+	}
 
 	send_command_complete_event (HCI_LE_SET_SCAN_RESPONSE_DATA_COMMAND, 1, buffer);
 }
@@ -511,14 +804,9 @@ void LowerHCI::hci_le_set_advertise_enable_command (int parameter_len, char *par
 
 	log (LOG_LOWERHCI, "HCI LE Set Advertise Enable Command");
 
-	if (ll_set_advertising_enable (parameters[0]))
-	{
-		buffer[0] = EC_SUCCESS;
-	}
-	else
-	{
-		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
-	}
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+	buffer[0] = ll_set_advertising_enable (parameters[0]) ? EC_SUCCESS : EC_INVALID_HCI_COMMAND_PARAMETERS;
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
 
 	send_command_complete_event (HCI_LE_SET_ADVERTISE_ENABLE_COMMAND, 1, buffer);
 }
@@ -545,7 +833,9 @@ void LowerHCI::hci_le_set_scan_parameters_command (int parameter_len, char *para
 		own_address_type = parameters[5] & 0xFF;
 		scanning_filter_policy = parameters[6] & 0xFF;
 
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
 		ll_set_scan_parameters (scan_type, scan_interval, scan_window, own_address_type, scanning_filter_policy);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
 
 		buffer[0] = EC_SUCCESS;
 	}
@@ -566,8 +856,17 @@ void LowerHCI::hci_le_set_scan_enable_command (int parameter_len, char *paramete
 
 	log (LOG_LOWERHCI, "HCI LE Set Scan Enable Command");
 
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+
 	if (ll_set_scan_enable (parameters[0], parameters[1]))
 	{
+		if (!parameters[0])
+		{
+			// any reports still being coalesced go out before the command complete
+
+			flush_le_advertising_reports ();
+		}
+
 		buffer[0] = EC_SUCCESS;
 	}
 	else
@@ -575,6 +874,8 @@ void LowerHCI::hci_le_set_scan_enable_command (int parameter_len, char *paramete
 		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
 	}
 
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+
 	send_command_complete_event (HCI_LE_SET_SCAN_ENABLE_COMMAND, 1, buffer);
 }
 
@@ -595,201 +896,1996 @@ void LowerHCI::hci_le_read_white_list_size_command (int parameter_len, char *par
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void LowerHCI::hci_le_read_supported_states_command (int parameter_len, char *parameters)
+void LowerHCI::hci_le_encrypt_command (int parameter_len, char *parameters)
 {
-	char buffer[9];
-	uint64 states;
+	char buffer[17];
 
 
-	log (LOG_LOWERHCI, "HCI LE Read Supported States Command");
+	log (LOG_LOWERHCI, "HCI LE Encrypt Command");
 
-	states = ll_get_supported_states ();
+	memset (buffer, 0, sizeof (buffer));
 
-	buffer[0] = EC_SUCCESS;
-	buffer[1] = (states);
-	buffer[2] = (states >> 8);
-	buffer[3] = (states >> 16);
-	buffer[4] = (states >> 24);
-	buffer[5] = (states >> 32);
-	buffer[6] = (states >> 40);
-	buffer[7] = (states >> 48);
-	buffer[8] = (states >> 56);
+	if (parameter_len == 32)
+	{
+		ll_encrypt ((const uint8 *) &parameters[0], (const uint8 *) &parameters[16], (uint8 *) &buffer[1]);
 
-	send_command_complete_event (HCI_LE_READ_SUPPORTED_STATES_COMMAND, 9, buffer);
+		buffer[0] = EC_SUCCESS;
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	send_command_complete_event (HCI_LE_ENCRYPT_COMMAND, 17, buffer);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void LowerHCI::hci_unsupported_command (int opcode)
+void LowerHCI::hci_le_rand_command (int parameter_len, char *parameters)
 {
-	char buffer[4];
+	char buffer[9];
 
-	log (LOG_LOWERHCI, "LowerHCI::unsupported_command %04X", opcode);
 
-	buffer[0] = EC_UNKNOWN_HCI_COMMAND;
-	buffer[1] = (unsigned char) num_hci_command_packets;
-	buffer[2] = (opcode) & 0xFF;
-	buffer[3] = (opcode >> 8) & 0xFF;
+	log (LOG_LOWERHCI, "HCI LE Rand Command");
+
+	buffer[0] = EC_SUCCESS;
+	ll_rand ((uint8 *) &buffer[1]);
 
-	send_event (COMMAND_STATUS_EVENT, 4, buffer);
+	send_command_complete_event (HCI_LE_RAND_COMMAND, 9, buffer);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void LowerHCI::process_command (int opcode, int parameter_len, char *parameters)
+void LowerHCI::hci_le_start_encryption_command (int parameter_len, char *parameters)
 {
-	log_start (LOG_LOWERHCI, "HCI Command %04X (%d) ", opcode, parameter_len);
-	for (int index = 0; index < parameter_len; index ++)
-	{
-		log_continuation ("%02X", parameters[index] & 0xFF);
-	}
-	log_end ();
+	const uint8 *p;
+	int status;
 
-	switch (opcode)
-	{
-		case HCI_SET_EVENT_MASK_COMMAND:
-			hci_set_event_mask_command (parameter_len, parameters); break;
 
-		case HCI_RESET_COMMAND:
-			hci_reset_command (parameter_len, parameters); break;
+	log (LOG_LOWERHCI, "HCI LE Start Encryption Command");
+
+	p = (const uint8 *) parameters;
 
-		case HCI_WRITE_LE_HOST_SUPPORTED_COMMAND:
-			hci_write_le_host_supported_command (parameter_len, parameters); break;
+	// Connection_Handle, Random_Number, Encrypted_Diversifier, Long_Term_Key
 
-		case HCI_READ_LOCAL_VERSION_INFORMATION_COMMAND:
-			hci_read_local_version_information_command (parameter_len, parameters); break;
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+	status = ll_start_encryption (p[0] | ((p[1] & 0x0F) << 8), &p[2], &p[10], &p[12]);
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
 
-		case HCI_READ_LOCAL_SUPPORTED_COMMANDS_COMMAND:
-			hci_read_local_supported_commands_command (parameter_len, parameters); break;
+	send_command_status_event (HCI_LE_START_ENCRYPTION_COMMAND, status);
+}
 
-		case HCI_READ_LOCAL_SUPPORTED_FEATURES_COMMAND:
-			hci_read_local_supported_features_command (parameter_len, parameters); break;
+////////////////////////////////////////////////////////////////////////////////
 
-		case HCI_READ_LOCAL_EXTENDED_FEATURES_COMMAND:
-			hci_read_local_extended_features_command (parameter_len, parameters); break;
+void LowerHCI::hci_le_long_term_key_request_reply_command (int parameter_len, char *parameters)
+{
+	char buffer[3];
+	const uint8 *p;
+	int handle;
 
-		case HCI_READ_BUFFER_SIZE_COMMAND:
-			hci_read_buffer_size_command (parameter_len, parameters); break;
 
-		case HCI_READ_BD_ADDR_COMMAND:
-			hci_read_bd_addr_command (parameter_len, parameters); break;
+	log (LOG_LOWERHCI, "HCI LE Long Term Key Request Reply Command");
 
-		case HCI_LE_SET_EVENT_MASK_COMMAND:
-			hci_le_set_event_mask_command (parameter_len, parameters); break;
+	p = (const uint8 *) parameters;
+	handle = p[0] | ((p[1] & 0x0F) << 8);
 
-		case HCI_LE_READ_BUFFER_SIZE_COMMAND:
-			hci_le_read_buffer_size_command (parameter_len, parameters); break;
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+	buffer[0] = ll_long_term_key_request_reply (handle, &p[2]);
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
 
-		case HCI_LE_READ_LOCAL_SUPPORTED_FEATURES_COMMAND:
-			hci_le_read_local_supported_features_command (parameter_len, parameters); break;
+	buffer[1] = handle & 0xFF;
+	buffer[2] = (handle >> 8) & 0xFF;
 
-		case HCI_LE_SET_ADVERTISING_PARAMETERS_COMMAND:
-			hci_le_set_advertising_parameters_command (parameter_len, parameters); break;
+	send_command_complete_event (HCI_LE_LONG_TERM_KEY_REQUEST_REPLY_COMMAND, 3, buffer);
+}
 
-		case HCI_LE_READ_ADVERTISING_CHANNEL_TX_POWER_COMMAND:
-			hci_le_read_advertising_channel_tx_power_command (parameter_len, parameters); break;
+////////////////////////////////////////////////////////////////////////////////
 
-		case HCI_LE_SET_ADVERTISING_DATA_COMMAND:
-			hci_le_set_advertising_data_command (parameter_len, parameters); break;
+void LowerHCI::hci_le_long_term_key_request_negative_reply_command (int parameter_len, char *parameters)
+{
+	char buffer[3];
+	const uint8 *p;
+	int handle;
 
-		case HCI_LE_SET_SCAN_RESPONSE_DATA_COMMAND:
-			hci_le_set_scan_response_data_command (parameter_len, parameters); break;
 
-		case HCI_LE_SET_ADVERTISE_ENABLE_COMMAND:
-			hci_le_set_advertise_enable_command (parameter_len, parameters); break;
+	log (LOG_LOWERHCI, "HCI LE Long Term Key Request Negative Reply Command");
 
-		case HCI_LE_SET_SCAN_PARAMETERS_COMMAND:
-			hci_le_set_scan_parameters_command (parameter_len, parameters); break;
+	p = (const uint8 *) parameters;
+	handle = p[0] | ((p[1] & 0x0F) << 8);
 
-		case HCI_LE_SET_SCAN_ENABLE_COMMAND:
-			hci_le_set_scan_enable_command (parameter_len, parameters); break;
-			
-		case HCI_LE_READ_WHITE_LIST_SIZE_COMMAND:
-			hci_le_read_white_list_size_command (parameter_len, parameters); break;
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+	buffer[0] = ll_long_term_key_request_negative_reply (handle);
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
 
-		case HCI_LE_READ_SUPPORTED_STATES_COMMAND:
-			hci_le_read_supported_states_command (parameter_len, parameters); break;
+	buffer[1] = handle & 0xFF;
+	buffer[2] = (handle >> 8) & 0xFF;
 
-		default:
-			hci_unsupported_command (opcode); break;
-			break;
-	}
+	send_command_complete_event (HCI_LE_LONG_TERM_KEY_REQUEST_NEGATIVE_REPLY_COMMAND, 3, buffer);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void LowerHCI::send_event (int opcode, int parameter_len, char *parameters)
+void LowerHCI::hci_le_create_connection_command (int parameter_len, char *parameters)
 {
-	char header[3];
+	const uint8 *p;
+	int status;
 
 
-	if ((1LL << (opcode - 1)) & hci_event_mask)
-	{
-		log_start (LOG_LOWERHCI, "HCI Event %02X (%d) ", opcode, parameter_len);
-		for (int index = 0; index < parameter_len; index ++)
-		{
-			log_continuation ("%02X", parameters[index] & 0xFF);
-		}
-		log_end ();
+	log (LOG_LOWERHCI, "HCI LE Create Connection Command");
 
-		header[0] = HCI_EVENT;
-		header[1] = opcode;
-		header[2] = parameter_len;
+	p = (const uint8 *) parameters;
+
+	if (parameter_len != 25)
+	{
+		status = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+	else if ((p[13] | (p[14] << 8)) > (p[15] | (p[16] << 8)))
+	{
+		// Conn_Interval_Min greater than Conn_Interval_Max
 
-		write_data (header, 3);
-		write_data (parameters, parameter_len);
+		status = EC_INVALID_HCI_COMMAND_PARAMETERS;
 	}
 	else
 	{
-		log (LOG_LOWERHCI, "Filtered HCI Event %02X : %016llX", opcode, hci_event_mask);
+		// the minimum connection interval is used, the CE lengths are ignored
+
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		status = ll_create_connection
+		(
+			p[0] | (p[1] << 8),
+			p[2] | (p[3] << 8),
+			p[4],
+			p[5],
+			get_bd_addr (&parameters[6]),
+			p[12],
+			p[13] | (p[14] << 8),
+			p[17] | (p[18] << 8),
+			p[19] | (p[20] << 8)
+		);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
 	}
+
+	send_command_status_event (HCI_LE_CREATE_CONNECTION_COMMAND, status);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void LowerHCI::send_command_complete_event (int command_opcode, int parameter_len, char *parameters)
+void LowerHCI::hci_le_create_connection_cancel_command (int parameter_len, char *parameters)
 {
-	char buffer[255];
+	char buffer[1];
 
 
-	log (LOG_LOWERHCI, "LowerHCI::send_command_complete_event %04X", command_opcode);
+	log (LOG_LOWERHCI, "HCI LE Create Connection Cancel Command");
 
-	buffer[0] = (unsigned char) num_hci_command_packets;
-	buffer[1] = (command_opcode) & 0xFF;
-	buffer[2] = (command_opcode >> 8) & 0xFF;
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+	buffer[0] = ll_create_connection_cancel ();
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
 
-	if (parameter_len > 0)
+	send_command_complete_event (HCI_LE_CREATE_CONNECTION_CANCEL_COMMAND, 1, buffer);
+
+	if (buffer[0] == EC_SUCCESS)
 	{
-		memcpy (&buffer[3], parameters, parameter_len);
+		send_le_connection_complete_event (EC_UNKNOWN_CONNECTION_IDENTIFIER, 0, 0x00, 0x00, 0, 0, 0, 0, 0);
 	}
-	
-	send_event (COMMAND_COMPLETE_EVENT, 3 + parameter_len, buffer);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void LowerHCI::send_le_advertising_report_event (int len, uint8 *data)
+void LowerHCI::hci_disconnect_command (int parameter_len, char *parameters)
 {
-	char buffer[255];
+	int status;
 
 
-	log (LOG_LOWERHCI, "LowerHCI::send_le_advertising_report_event");
+	log (LOG_LOWERHCI, "HCI Disconnect Command");
+
+	if (parameter_len != 3)
+	{
+		status = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+	else
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		status = ll_disconnect ((parameters[0] & 0xFF) | ((parameters[1] & 0x0F) << 8), parameters[2] & 0xFF);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+
+	send_command_status_event (HCI_DISCONNECT_COMMAND, status);
+}
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_read_supported_states_command (int parameter_len, char *parameters)
+{
+	char buffer[9];
+	uint64 states;
+
+
+	log (LOG_LOWERHCI, "HCI LE Read Supported States Command");
+
+	states = ll_get_supported_states ();
+
+	buffer[0] = EC_SUCCESS;
+	buffer[1] = (states);
+	buffer[2] = (states >> 8);
+	buffer[3] = (states >> 16);
+	buffer[4] = (states >> 24);
+	buffer[5] = (states >> 32);
+	buffer[6] = (states >> 40);
+	buffer[7] = (states >> 48);
+	buffer[8] = (states >> 56);
+
+	send_command_complete_event (HCI_LE_READ_SUPPORTED_STATES_COMMAND, 9, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_add_device_to_resolving_list_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
 
-	buffer[0] = LE_ADVERTISING_REPORT_EVENT;
-	buffer[1] = 1;
-	buffer[2] = 0x00;
-	buffer[3] = 0;
-	buffer[4] = data[2];
-	buffer[5] = data[3];
-	buffer[6] = data[4];
-	buffer[7] = data[5];
-	buffer[8] = data[6];
-	buffer[9] = data[7];
-	buffer[10] = len - 8;
-	memcpy (&buffer[11], &data[8], len - 8);
-	buffer[11 + len - 8] = -60;
-
-	send_event (LE_META_EVENT, 12 + len - 8, buffer);
+
+	log (LOG_LOWERHCI, "HCI LE Add Device To Resolving List Command");
+
+	if (parameter_len == 39)
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = ll_add_device_to_resolving_list (parameters[0] & 0xFF, get_bd_addr (&parameters[1]), (const uint8 *) &parameters[7], (const uint8 *) &parameters[23]);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	send_command_complete_event (HCI_LE_ADD_DEVICE_TO_RESOLVING_LIST_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_remove_device_from_resolving_list_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+
+
+	log (LOG_LOWERHCI, "HCI LE Remove Device From Resolving List Command");
+
+	if (parameter_len == 7)
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = ll_remove_device_from_resolving_list (parameters[0] & 0xFF, get_bd_addr (&parameters[1]));
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	send_command_complete_event (HCI_LE_REMOVE_DEVICE_FROM_RESOLVING_LIST_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_clear_resolving_list_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+
+
+	log (LOG_LOWERHCI, "HCI LE Clear Resolving List Command");
+
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+	buffer[0] = ll_clear_resolving_list ();
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+
+	send_command_complete_event (HCI_LE_CLEAR_RESOLVING_LIST_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_read_resolving_list_size_command (int parameter_len, char *parameters)
+{
+	char buffer[2];
+
+
+	log (LOG_LOWERHCI, "HCI LE Read Resolving List Size Command");
+
+	buffer[0] = EC_SUCCESS;
+	buffer[1] = ll_get_resolving_list_size ();
+
+	send_command_complete_event (HCI_LE_READ_RESOLVING_LIST_SIZE_COMMAND, 2, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_read_peer_resolvable_address_command (int parameter_len, char *parameters)
+{
+	char buffer[7];
+	uint64 address;
+
+
+	log (LOG_LOWERHCI, "HCI LE Read Peer Resolvable Address Command");
+
+	address = 0;
+
+	if (parameter_len == 7)
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = ll_read_peer_resolvable_address (parameters[0] & 0xFF, get_bd_addr (&parameters[1]), &address);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	for (int index = 0; index < 6; index ++)
+	{
+		buffer[1 + index] = (address >> (8 * index)) & 0xFF;
+	}
+
+	send_command_complete_event (HCI_LE_READ_PEER_RESOLVABLE_ADDRESS_COMMAND, 7, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_read_local_resolvable_address_command (int parameter_len, char *parameters)
+{
+	char buffer[7];
+	uint64 address;
+
+
+	log (LOG_LOWERHCI, "HCI LE Read Local Resolvable Address Command");
+
+	address = 0;
+
+	if (parameter_len == 7)
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = ll_read_local_resolvable_address (parameters[0] & 0xFF, get_bd_addr (&parameters[1]), &address);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	for (int index = 0; index < 6; index ++)
+	{
+		buffer[1 + index] = (address >> (8 * index)) & 0xFF;
+	}
+
+	send_command_complete_event (HCI_LE_READ_LOCAL_RESOLVABLE_ADDRESS_COMMAND, 7, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_set_address_resolution_enable_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+
+
+	log (LOG_LOWERHCI, "HCI LE Set Address Resolution Enable Command");
+
+	if (parameter_len == 1)
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = ll_set_address_resolution_enable (parameters[0] & 0xFF);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	send_command_complete_event (HCI_LE_SET_ADDRESS_RESOLUTION_ENABLE_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_set_resolvable_private_address_timeout_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+
+
+	log (LOG_LOWERHCI, "HCI LE Set Resolvable Private Address Timeout Command");
+
+	if (parameter_len == 2)
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = ll_set_resolvable_private_address_timeout ((parameters[0] & 0xFF) | ((parameters[1] & 0xFF) << 8));
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	send_command_complete_event (HCI_LE_SET_RESOLVABLE_PRIVATE_ADDRESS_TIMEOUT_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_set_default_phy_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+
+
+	log (LOG_LOWERHCI, "HCI LE Set Default PHY Command");
+
+	if (parameter_len == 3)
+	{
+		buffer[0] = ll_set_default_phy (parameters[0] & 0xFF, parameters[1] & 0xFF, parameters[2] & 0xFF);
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	send_command_complete_event (HCI_LE_SET_DEFAULT_PHY_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_set_advertising_set_random_address_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+
+
+	log (LOG_LOWERHCI, "HCI LE Set Advertising Set Random Address Command");
+
+	if (parameter_len == 7)
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = ll_set_advertising_set_random_address (parameters[0] & 0xFF, get_bd_addr (&parameters[1]));
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	send_command_complete_event (HCI_LE_SET_ADVERTISING_SET_RANDOM_ADDRESS_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_set_extended_advertising_parameters_command (int parameter_len, char *parameters)
+{
+	char buffer[2];
+	uint8 *p;
+	int properties;
+	int interval;
+	uint64 peer_address;
+
+
+	log (LOG_LOWERHCI, "HCI LE Set Extended Advertising Parameters Command");
+
+	p = (uint8 *) parameters;
+
+	if (parameter_len == 25)
+	{
+		properties = p[1] | (p[2] << 8);
+		interval = p[3] | (p[4] << 8) | (p[5] << 16); // minimum, the maximum is not used
+		peer_address = 0;
+		for (int index = 0; index < 6; index ++)
+		{
+			peer_address |= ((uint64) p[12 + index]) << (8 * index);
+		}
+
+		// 9 channel map, 10 own address type, 11 peer address type, 18 filter policy,
+		// 19 tx power, 20 primary PHY, 21 secondary max skip, 22 secondary PHY, 23 SID
+
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = ll_set_extended_advertising_parameters (p[0], properties, interval, p[9], p[10], p[11], peer_address, p[20], p[22], p[23]);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	buffer[1] = 0; // selected tx power, dBm
+
+	send_command_complete_event (HCI_LE_SET_EXTENDED_ADVERTISING_PARAMETERS_COMMAND, 2, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_set_extended_advertising_data_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+	uint8 *p;
+
+
+	log (LOG_LOWERHCI, "HCI LE Set Extended Advertising Data Command");
+
+	p = (uint8 *) parameters;
+
+	if ((parameter_len >= 4) && (parameter_len == 4 + p[3]))
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = ll_set_extended_advertising_data (p[0], p[1], p[3], &p[4]);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	send_command_complete_event (HCI_LE_SET_EXTENDED_ADVERTISING_DATA_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_set_extended_scan_response_data_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+	uint8 *p;
+
+
+	log (LOG_LOWERHCI, "HCI LE Set Extended Scan Response Data Command");
+
+	p = (uint8 *) parameters;
+
+	// there is no active scanning, so the data is checked but not kept
+
+	if ((parameter_len < 4) || (parameter_len != 4 + p[3]))
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+	else
+	{
+		buffer[0] = EC_SUCCESS;
+	}
+
+	send_command_complete_event (HCI_LE_SET_EXTENDED_SCAN_RESPONSE_DATA_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_set_extended_advertising_enable_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+	uint8 *p;
+	int number_of_sets;
+	int duration;
+
+
+	log (LOG_LOWERHCI, "HCI LE Set Extended Advertising Enable Command");
+
+	p = (uint8 *) parameters;
+	number_of_sets = (parameter_len >= 2) ? p[1] : 0;
+
+	if ((parameter_len < 2) || (parameter_len != 2 + 4 * number_of_sets) || ((p[0]) && (number_of_sets == 0)))
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+	else if (number_of_sets == 0)
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = ll_set_extended_advertising_enable (0, -1, 0, 0);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+	else
+	{
+		buffer[0] = EC_SUCCESS;
+
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+
+		for (int index = 0; (index < number_of_sets) && (buffer[0] == EC_SUCCESS); index ++)
+		{
+			duration = (p[2 + 4 * index + 1] | (p[2 + 4 * index + 2] << 8)) * 10000; // 10 ms units
+
+			buffer[0] = ll_set_extended_advertising_enable (p[0], p[2 + 4 * index], duration, p[2 + 4 * index + 3]);
+		}
+
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+
+	send_command_complete_event (HCI_LE_SET_EXTENDED_ADVERTISING_ENABLE_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_read_maximum_advertising_data_length_command (int parameter_len, char *parameters)
+{
+	char buffer[3];
+
+
+	log (LOG_LOWERHCI, "HCI LE Read Maximum Advertising Data Length Command");
+
+	buffer[0] = EC_SUCCESS;
+	buffer[1] = maximum_extended_advertising_data_length & 0xFF;
+	buffer[2] = (maximum_extended_advertising_data_length >> 8) & 0xFF;
+
+	send_command_complete_event (HCI_LE_READ_MAXIMUM_ADVERTISING_DATA_LENGTH_COMMAND, 3, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_read_number_of_supported_advertising_sets_command (int parameter_len, char *parameters)
+{
+	char buffer[2];
+
+
+	log (LOG_LOWERHCI, "HCI LE Read Number of Supported Advertising Sets Command");
+
+	buffer[0] = EC_SUCCESS;
+	buffer[1] = ll_get_number_of_advertising_sets ();
+
+	send_command_complete_event (HCI_LE_READ_NUMBER_OF_SUPPORTED_ADVERTISING_SETS_COMMAND, 2, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_remove_advertising_set_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+
+
+	log (LOG_LOWERHCI, "HCI LE Remove Advertising Set Command");
+
+	if (parameter_len == 1)
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = ll_remove_advertising_set (parameters[0] & 0xFF);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	send_command_complete_event (HCI_LE_REMOVE_ADVERTISING_SET_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_clear_advertising_sets_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+
+
+	log (LOG_LOWERHCI, "HCI LE Clear Advertising Sets Command");
+
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+	buffer[0] = ll_clear_advertising_sets ();
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+
+	send_command_complete_event (HCI_LE_CLEAR_ADVERTISING_SETS_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_set_periodic_advertising_parameters_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+	uint8 *p;
+
+
+	log (LOG_LOWERHCI, "HCI LE Set Periodic Advertising Parameters Command");
+
+	p = (uint8 *) parameters;
+
+	if (parameter_len == 7)
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = ll_set_periodic_advertising_parameters (p[0], p[1] | (p[2] << 8), p[3] | (p[4] << 8), p[5] | (p[6] << 8));
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	send_command_complete_event (HCI_LE_SET_PERIODIC_ADVERTISING_PARAMETERS_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_set_periodic_advertising_data_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+	uint8 *p;
+
+
+	log (LOG_LOWERHCI, "HCI LE Set Periodic Advertising Data Command");
+
+	p = (uint8 *) parameters;
+
+	if ((parameter_len >= 3) && (parameter_len == 3 + p[2]))
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = ll_set_periodic_advertising_data (p[0], p[1], p[2], &p[3]);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	send_command_complete_event (HCI_LE_SET_PERIODIC_ADVERTISING_DATA_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_set_periodic_advertising_enable_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+	uint8 *p;
+
+
+	log (LOG_LOWERHCI, "HCI LE Set Periodic Advertising Enable Command");
+
+	p = (uint8 *) parameters;
+
+	if ((parameter_len == 2) && (p[0] <= 0x01))
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = ll_set_periodic_advertising_enable (p[0], p[1]);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	send_command_complete_event (HCI_LE_SET_PERIODIC_ADVERTISING_ENABLE_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_periodic_advertising_create_sync_command (int parameter_len, char *parameters)
+{
+	int status;
+	uint8 *p;
+
+
+	log (LOG_LOWERHCI, "HCI LE Periodic Advertising Create Sync Command");
+
+	p = (uint8 *) parameters;
+
+	// 13 sync CTE type, constant tone extensions are not supported so any
+	// train is accepted
+
+	if (parameter_len != 14)
+	{
+		status = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+	else
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		status = ll_periodic_advertising_create_sync
+		(
+			p[0],
+			p[1],
+			p[2],
+			get_bd_addr (&parameters[3]),
+			p[9] | (p[10] << 8),
+			p[11] | (p[12] << 8)
+		);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+
+	send_command_status_event (HCI_LE_PERIODIC_ADVERTISING_CREATE_SYNC_COMMAND, status);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_periodic_advertising_create_sync_cancel_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+
+
+	log (LOG_LOWERHCI, "HCI LE Periodic Advertising Create Sync Cancel Command");
+
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+	buffer[0] = ll_periodic_advertising_create_sync_cancel ();
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+
+	send_command_complete_event (HCI_LE_PERIODIC_ADVERTISING_CREATE_SYNC_CANCEL_COMMAND, 1, buffer);
+
+	if (buffer[0] == EC_SUCCESS)
+	{
+		send_le_periodic_advertising_sync_established_event (EC_OPERATION_CANCELLED_BY_HOST, 0, 0, 0, 0, 0, 0, 0);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_periodic_advertising_terminate_sync_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+	uint8 *p;
+
+
+	log (LOG_LOWERHCI, "HCI LE Periodic Advertising Terminate Sync Command");
+
+	p = (uint8 *) parameters;
+
+	if (parameter_len == 2)
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = ll_periodic_advertising_terminate_sync (p[0] | ((p[1] & 0x0F) << 8));
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	send_command_complete_event (HCI_LE_PERIODIC_ADVERTISING_TERMINATE_SYNC_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_set_extended_scan_parameters_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+	uint8 *p;
+	int number_of_phys;
+	int scan_type[2];
+	int scan_interval[2];
+	int scan_window[2];
+
+
+	log (LOG_LOWERHCI, "HCI LE Set Extended Scan Parameters Command");
+
+	p = (uint8 *) parameters;
+	number_of_phys = 0;
+
+	if (parameter_len >= 3)
+	{
+		for (int bit = 0; bit < 8; bit ++)
+		{
+			if (p[2] & (1 << bit))
+			{
+				number_of_phys ++;
+			}
+		}
+	}
+
+	if ((parameter_len < 3) || (number_of_phys == 0) || (number_of_phys > 2) || (parameter_len != 3 + 5 * number_of_phys))
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+	else
+	{
+		for (int phy = 0; phy < number_of_phys; phy ++)
+		{
+			scan_type[phy] = p[3 + 5 * phy];
+			scan_interval[phy] = p[3 + 5 * phy + 1] | (p[3 + 5 * phy + 2] << 8);
+			scan_window[phy] = p[3 + 5 * phy + 3] | (p[3 + 5 * phy + 4] << 8);
+		}
+
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = ll_set_extended_scan_parameters (p[0], p[1], p[2], number_of_phys, scan_type, scan_interval, scan_window);
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+
+	send_command_complete_event (HCI_LE_SET_EXTENDED_SCAN_PARAMETERS_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_le_set_extended_scan_enable_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+
+
+	log (LOG_LOWERHCI, "HCI LE Set Extended Scan Enable Command");
+
+	// duration and period are not supported, scanning continues until disabled
+
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+
+	if ((parameter_len == 6) && (ll_set_extended_scan_enable (parameters[0], parameters[1])))
+	{
+		if (!parameters[0])
+		{
+			flush_le_advertising_reports ();
+		}
+
+		buffer[0] = EC_SUCCESS;
+	}
+	else
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+
+	send_command_complete_event (HCI_LE_SET_EXTENDED_SCAN_ENABLE_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::hci_unsupported_command (int opcode)
+{
+	char *buffer;
+
+	log (LOG_LOWERHCI, "LowerHCI::unsupported_command %04X", opcode);
+
+	buffer = reserve_event (COMMAND_STATUS_EVENT, 4);
+
+	if (!buffer)
+	{
+		return;
+	}
+
+	buffer[0] = EC_UNKNOWN_HCI_COMMAND;
+	buffer[1] = (unsigned char) num_hci_command_packets;
+	buffer[2] = (opcode) & 0xFF;
+	buffer[3] = (opcode >> 8) & 0xFF;
+
+	commit_event (buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// vendor specific commands that drive the radio model, they change state the
+// simulation thread reads so each one is applied under the mutex
+
+void LowerHCI::hci_vs_set_tx_power_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+
+
+	log (LOG_LOWERHCI, "HCI VS Set TX Power Command");
+
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+	buffer[0] = set_tx_power ((int8) parameters[0]) ? EC_SUCCESS : EC_INVALID_HCI_COMMAND_PARAMETERS;
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+
+	send_command_complete_event (HCI_VS_SET_TX_POWER_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// three signed 32 bit coordinates in millimetres
+
+void LowerHCI::hci_vs_set_position_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+	uint8 *p;
+	int coordinate[3];
+	int i;
+
+
+	log (LOG_LOWERHCI, "HCI VS Set Position Command");
+
+	p = (uint8 *) parameters;
+
+	for (i = 0; i < 3; i ++)
+	{
+		coordinate[i] = (int) (p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int) p[3] << 24));
+		p += 4;
+	}
+
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+	set_position (coordinate[0], coordinate[1], coordinate[2]);
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+
+	buffer[0] = EC_SUCCESS;
+
+	send_command_complete_event (HCI_VS_SET_POSITION_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// signed 16 bit parts per million
+
+void LowerHCI::hci_vs_set_clock_drift_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+	uint8 *p;
+
+
+	log (LOG_LOWERHCI, "HCI VS Set Clock Drift Command");
+
+	p = (uint8 *) parameters;
+
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+	buffer[0] = set_clock_drift ((int16) (p[0] | (p[1] << 8))) ? EC_SUCCESS : EC_INVALID_HCI_COMMAND_PARAMETERS;
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+
+	send_command_complete_event (HCI_VS_SET_CLOCK_DRIFT_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the peer's public address and the percentage of packets between the two
+// devices that are lost, zero removes the peer again
+
+void LowerHCI::hci_vs_set_link_packet_loss_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+	uint8 *p;
+	uint64 address;
+	int percent;
+	int i;
+
+
+	log (LOG_LOWERHCI, "HCI VS Set Link Packet Loss Command");
+
+	p = (uint8 *) parameters;
+
+	address = 0;
+
+	for (i = 5; i >= 0; i --)
+	{
+		address = (address << 8) | p[i];
+	}
+
+	percent = p[6];
+
+	if (percent > 100)
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+	else
+	{
+		PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+		buffer[0] = set_link_loss (address, percent) ? EC_SUCCESS : EC_MEMORY_CAPACITY_EXCEEDED;
+		PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+	}
+
+	send_command_complete_event (HCI_VS_SET_LINK_PACKET_LOSS_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// starts or stops a btsnoop capture of this connection
+
+void LowerHCI::hci_vs_set_btsnoop_capture_command (int parameter_len, char *parameters)
+{
+	char buffer[1];
+
+
+	log (LOG_LOWERHCI, "HCI VS Set Btsnoop Capture Command");
+
+	if ((parameters[0] & 0xFF) > 1)
+	{
+		buffer[0] = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+	else
+	{
+		buffer[0] = set_btsnoop_capture (parameters[0] == 1) ? EC_SUCCESS : EC_UNSPECIFIED_ERROR;
+	}
+
+	send_command_complete_event (HCI_VS_SET_BTSNOOP_CAPTURE_COMMAND, 1, buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::process_command (int opcode, int parameter_len, char *parameters)
+{
+	const HciCommand *command;
+	HciCommandStatistics *statistics;
+	struct timespec start;
+	struct timespec end;
+	uint64 elapsed;
+	uint64 maximum;
+	int status;
+	char buffer[1];
+
+
+	// the parameter dump is only built when it is going to be printed, so a
+	// command does not take the logger lock otherwise
+
+	if (is_logging_enabled (LOG_LOWERHCI))
+	{
+		log_start (LOG_LOWERHCI, "HCI Command %04X (%d) ", opcode, parameter_len);
+		for (int index = 0; index < parameter_len; index ++)
+		{
+			log_continuation ("%02X", parameters[index] & 0xFF);
+		}
+		log_end ();
+	}
+
+	command = find_hci_command (opcode);
+
+	if (command == 0)
+	{
+		hci_unsupported_command (opcode);
+		return;
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &start);
+
+	status = EC_SUCCESS;
+
+	if ((command->parameter_len >= 0) && (parameter_len != command->parameter_len))
+	{
+		log (LOG_LOWERHCI, "HCI Command %04X expects %d octets", opcode, command->parameter_len);
+
+		status = EC_INVALID_HCI_COMMAND_PARAMETERS;
+	}
+	else if ((command->advertising_commands != ADV_ANY) && (hci_advertising_commands != ADV_ANY) && (command->advertising_commands != hci_advertising_commands))
+	{
+		log (LOG_LOWERHCI, "HCI Command %04X mixes legacy and extended advertising", opcode);
+
+		status = EC_COMMAND_DISALLOWED;
+	}
+
+	if (status != EC_SUCCESS)
+	{
+		if (command->status_event)
+		{
+			send_command_status_event (opcode, status);
+		}
+		else
+		{
+			buffer[0] = status;
+			send_command_complete_event (opcode, 1, buffer);
+		}
+	}
+	else
+	{
+		if (command->advertising_commands != ADV_ANY)
+		{
+			hci_advertising_commands = command->advertising_commands;
+		}
+
+		(this->*command->handler) (parameter_len, parameters);
+	}
+
+	clock_gettime (CLOCK_MONOTONIC, &end);
+
+	elapsed = (end.tv_sec - start.tv_sec) * 1000000000LL + (end.tv_nsec - start.tv_nsec);
+	statistics = &hci_command_statistics[command - hci_command_table];
+
+	statistics->count.fetch_add (1, std::memory_order_relaxed);
+	statistics->total_time.fetch_add (elapsed, std::memory_order_relaxed);
+
+	maximum = statistics->maximum_time.load (std::memory_order_relaxed);
+
+	while ((elapsed > maximum) && !statistics->maximum_time.compare_exchange_weak (maximum, elapsed, std::memory_order_relaxed))
+	{
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool LowerHCI::hci_get_command_statistics (int index, int *opcode, uint64 *count, uint64 *total_time, uint64 *maximum_time)
+{
+	if ((index < 0) || (index >= number_of_hci_commands))
+	{
+		return false;
+	}
+
+	*opcode = hci_command_table[index].opcode;
+	*count = hci_command_statistics[index].count.load (std::memory_order_relaxed);
+	*total_time = hci_command_statistics[index].total_time.load (std::memory_order_relaxed);
+	*maximum_time = hci_command_statistics[index].maximum_time.load (std::memory_order_relaxed);
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// whether the host has the event unmasked, event builders ask before they
+// format anything
+
+bool LowerHCI::hci_event_wanted (int opcode)
+{
+	return (hci_event_mask >> (opcode - 1)) & 1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the link layer keeps the LE subevents that get through both masks, the LE
+// mask on its own means nothing while LE Meta is masked
+
+void LowerHCI::hci_update_le_event_mask (void)
+{
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+	ll_set_host_le_event_mask (hci_event_wanted (LE_META_EVENT) ? hci_le_event_mask : 0);
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// events are built straight into the socket's write buffer, reserve_event
+// writes the header and returns where the parameters go and commit_event
+// hands the event over; the host's masks are for the caller to check first.
+// It returns 0 if there is no room to be had, and the event is dropped
+
+char *LowerHCI::reserve_event (int opcode, int parameter_len)
+{
+	char *event;
+
+
+	event = reserve_write (3 + parameter_len);
+
+	if (!event)
+	{
+		return 0;
+	}
+
+	event[0] = HCI_EVENT;
+	event[1] = opcode;
+	event[2] = parameter_len;
+
+	return &event[3];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::commit_event (char *parameters)
+{
+	int parameter_len;
+
+
+	parameter_len = parameters[-1] & 0xFF;
+
+	if (is_logging_enabled (LOG_LOWERHCI))
+	{
+		log_start (LOG_LOWERHCI, "HCI Event %02X (%d) ", parameters[-2] & 0xFF, parameter_len);
+		for (int index = 0; index < parameter_len; index ++)
+		{
+			log_continuation ("%02X", parameters[index] & 0xFF);
+		}
+		log_end ();
+	}
+
+	commit_write (3 + parameter_len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::send_event (int opcode, int parameter_len, char *parameters)
+{
+	char *event;
+
+
+	if ((hci_event_wanted (opcode)) && ((opcode != LE_META_EVENT) || (ll_host_wants_le_event (parameters[0]))))
+	{
+		event = reserve_event (opcode, parameter_len);
+
+		if (!event)
+		{
+			return;
+		}
+
+		memcpy (event, parameters, parameter_len);
+
+		commit_event (event);
+	}
+	else
+	{
+		log (LOG_LOWERHCI, "Filtered HCI Event %02X : %016llX", opcode, hci_event_mask);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::send_command_complete_event (int command_opcode, int parameter_len, char *parameters)
+{
+	char *buffer;
+
+
+	log (LOG_LOWERHCI, "LowerHCI::send_command_complete_event %04X", command_opcode);
+
+	buffer = reserve_event (COMMAND_COMPLETE_EVENT, 3 + parameter_len);
+
+	if (!buffer)
+	{
+		return;
+	}
+
+	buffer[0] = (unsigned char) num_hci_command_packets;
+	buffer[1] = (command_opcode) & 0xFF;
+	buffer[2] = (command_opcode >> 8) & 0xFF;
+
+	if (parameter_len > 0)
+	{
+		memcpy (&buffer[3], parameters, parameter_len);
+	}
+
+	commit_event (buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::send_command_status_event (int command_opcode, int status)
+{
+	char *buffer;
+
+
+	log (LOG_LOWERHCI, "LowerHCI::send_command_status_event %04X %02X", command_opcode, status);
+
+	buffer = reserve_event (COMMAND_STATUS_EVENT, 4);
+
+	if (!buffer)
+	{
+		return;
+	}
+
+	buffer[0] = status;
+	buffer[1] = (unsigned char) num_hci_command_packets;
+	buffer[2] = (command_opcode) & 0xFF;
+	buffer[3] = (command_opcode >> 8) & 0xFF;
+
+	commit_event (buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::process_acl_data (int handle, int packet_boundary, int len, const char *data)
+{
+	bool queued;
+
+
+	log (LOG_LOWERHCI, "HCI ACL Data %03X %d (%d)", handle, packet_boundary, len);
+
+	if (len > hci_le_acl_data_packet_length)
+	{
+		log (LOG_ERROR, "HCI ACL Data too long %d", len);
+		return;
+	}
+
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+	queued = ll_queue_acl_data (handle, packet_boundary, len, (const uint8 *) data);
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+
+	if (!queued)
+	{
+		log (LOG_ERROR, "HCI ACL Data dropped %03X", handle);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::send_data_buffer_overflow_event (void)
+{
+	char *buffer;
+
+
+	log (LOG_LOWERHCI, "LowerHCI::send_data_buffer_overflow_event");
+
+	if (!hci_event_wanted (DATA_BUFFER_OVERFLOW_EVENT))
+	{
+		return;
+	}
+
+	buffer = reserve_event (DATA_BUFFER_OVERFLOW_EVENT, 1);
+
+	if (!buffer)
+	{
+		return;
+	}
+
+	buffer[0] = 0x01; // ACL link type
+
+	commit_event (buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::send_acl_data (int handle, int packet_boundary, int len, const uint8 *data)
+{
+	char *packet;
+
+
+	log (LOG_LOWERHCI, "LowerHCI::send_acl_data %03X %d (%d)", handle, packet_boundary, len);
+
+	packet = reserve_write (5 + len);
+
+	if (!packet)
+	{
+		return;
+	}
+
+	packet[0] = HCI_DATA;
+	packet[1] = handle & 0xFF;
+	packet[2] = ((handle >> 8) & 0x0F) | (packet_boundary << 4);
+	packet[3] = len & 0xFF;
+	packet[4] = (len >> 8) & 0xFF;
+	memcpy (&packet[5], data, len);
+
+	commit_write (5 + len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::send_le_connection_complete_event (int status, int handle, int role, int peer_address_type, uint64 peer_address, int interval, int latency, int supervision_timeout, int master_clock_accuracy)
+{
+	char *buffer;
+
+
+	log (LOG_LOWERHCI, "LowerHCI::send_le_connection_complete_event %02X %03X", status, handle);
+
+	if (!ll_host_wants_le_event (LE_CONNECTION_COMPLETE_EVENT))
+	{
+		return;
+	}
+
+	// the legacy event has no identity address types, a resolved peer is
+	// reported with its identity address
+
+	buffer = reserve_event (LE_META_EVENT, 19);
+
+	if (!buffer)
+	{
+		return;
+	}
+
+	buffer[0] = LE_CONNECTION_COMPLETE_EVENT;
+	buffer[1] = status;
+	buffer[2] = handle & 0xFF;
+	buffer[3] = (handle >> 8) & 0x0F;
+	buffer[4] = role;
+	buffer[5] = peer_address_type & 0x01;
+	for (int index = 0; index < 6; index ++)
+	{
+		buffer[6 + index] = (peer_address >> (8 * index)) & 0xFF;
+	}
+	buffer[12] = interval & 0xFF;
+	buffer[13] = (interval >> 8) & 0xFF;
+	buffer[14] = latency & 0xFF;
+	buffer[15] = (latency >> 8) & 0xFF;
+	buffer[16] = supervision_timeout & 0xFF;
+	buffer[17] = (supervision_timeout >> 8) & 0xFF;
+	buffer[18] = master_clock_accuracy;
+
+	commit_event (buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::send_disconnection_complete_event (int status, int handle, int reason)
+{
+	char *buffer;
+
+
+	log (LOG_LOWERHCI, "LowerHCI::send_disconnection_complete_event %03X %02X", handle, reason);
+
+	// credits for packets that did complete go first, the host treats any
+	// others as flushed once it sees the disconnection
+
+	flush_number_of_completed_packets ();
+
+	if (!hci_event_wanted (DISCONNECTION_COMPLETE_EVENT))
+	{
+		return;
+	}
+
+	buffer = reserve_event (DISCONNECTION_COMPLETE_EVENT, 4);
+
+	if (!buffer)
+	{
+		return;
+	}
+
+	buffer[0] = status;
+	buffer[1] = handle & 0xFF;
+	buffer[2] = (handle >> 8) & 0x0F;
+	buffer[3] = reason;
+
+	commit_event (buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::send_encryption_change_event (int status, int handle, int enabled)
+{
+	char *buffer;
+
+
+	log (LOG_LOWERHCI, "LowerHCI::send_encryption_change_event %02X %03X %d", status, handle, enabled);
+
+	if (!hci_event_wanted (ENCRYPTION_CHANGE_EVENT))
+	{
+		return;
+	}
+
+	buffer = reserve_event (ENCRYPTION_CHANGE_EVENT, 4);
+
+	if (!buffer)
+	{
+		return;
+	}
+
+	buffer[0] = status;
+	buffer[1] = handle & 0xFF;
+	buffer[2] = (handle >> 8) & 0x0F;
+	buffer[3] = enabled;
+
+	commit_event (buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::send_le_long_term_key_request_event (int handle, const uint8 *rand, const uint8 *ediv)
+{
+	char *buffer;
+
+
+	log (LOG_LOWERHCI, "LowerHCI::send_le_long_term_key_request_event %03X", handle);
+
+	if (!ll_host_wants_le_event (LE_LONG_TERM_KEY_REQUEST_EVENT))
+	{
+		return;
+	}
+
+	buffer = reserve_event (LE_META_EVENT, 13);
+
+	if (!buffer)
+	{
+		return;
+	}
+
+	buffer[0] = LE_LONG_TERM_KEY_REQUEST_EVENT;
+	buffer[1] = handle & 0xFF;
+	buffer[2] = (handle >> 8) & 0x0F;
+	memcpy (&buffer[3], rand, 8);
+	memcpy (&buffer[11], ediv, 2);
+
+	commit_event (buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::send_number_of_completed_packets_event (int64 when, int handle, int count)
+{
+	log (LOG_LOWERHCI, "LowerHCI::send_number_of_completed_packets_event %03X %d", handle, count);
+
+	if (hci_completed_packets_total == 0)
+	{
+		hci_completed_packets_first = when;
+	}
+
+	hci_completed_packets[handle] += count;
+	hci_completed_packets_total += count;
+
+	if
+	(
+		(hci_completed_packets_total >= hci_completed_packets_threshold) ||
+		(when - hci_completed_packets_first >= hci_completed_packets_window)
+	)
+	{
+		flush_number_of_completed_packets ();
+	}
+	else
+	{
+		set_timer (hci_completed_packets_first + hci_completed_packets_window);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::flush_number_of_completed_packets (void)
+{
+	char *buffer;
+	int number_of_handles;
+
+
+	if (hci_completed_packets_total > 0)
+	{
+		log (LOG_LOWERHCI, "LowerHCI::flush_number_of_completed_packets %d", hci_completed_packets_total);
+
+		number_of_handles = 0;
+
+		for (int handle = 0; handle < maximum_number_of_connections; handle ++)
+		{
+			if (hci_completed_packets[handle] > 0)
+			{
+				number_of_handles += 1;
+			}
+		}
+
+		buffer = reserve_event (NUMBER_OF_COMPLETED_PACKETS_EVENT, 1 + 4 * number_of_handles);
+
+		if (buffer)
+		{
+			buffer[0] = number_of_handles;
+
+			number_of_handles = 0;
+
+			for (int handle = 0; handle < maximum_number_of_connections; handle ++)
+			{
+				if (hci_completed_packets[handle] > 0)
+				{
+					buffer[1 + 4 * number_of_handles] = handle & 0xFF;
+					buffer[2 + 4 * number_of_handles] = (handle >> 8) & 0x0F;
+					buffer[3 + 4 * number_of_handles] = hci_completed_packets[handle] & 0xFF;
+					buffer[4 + 4 * number_of_handles] = (hci_completed_packets[handle] >> 8) & 0xFF;
+
+					number_of_handles += 1;
+				}
+			}
+
+			commit_event (buffer);
+		}
+	}
+
+	hci_completed_packets_total = 0;
+	memset (hci_completed_packets, 0, sizeof (hci_completed_packets));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::send_le_advertising_report_event (int64 when, int event_type, int address_type, uint64 address, int rssi, int data_len, const uint8 *data)
+{
+	char *report;
+	int report_len;
+
+
+	log (LOG_LOWERHCI, "LowerHCI::send_le_advertising_report_event");
+
+	if (!ll_host_wants_le_event (LE_ADVERTISING_REPORT_EVENT))
+	{
+		return;
+	}
+
+	report_len = 1 + 1 + 6 + 1 + data_len + 1;
+
+	report = reserve_advertising_report (LE_ADVERTISING_REPORT_EVENT, report_len);
+
+	report[0] = event_type;
+	report[1] = address_type;
+	for (int index = 0; index < 6; index ++)
+	{
+		report[2 + index] = (address >> (8 * index)) & 0xFF;
+	}
+	report[8] = data_len;
+	memcpy (&report[9], data, data_len);
+	report[9 + data_len] = rssi;
+
+	commit_advertising_report (when, report_len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::send_le_extended_advertising_report_event (int64 when, int event_type, int address_type, uint64 address, int primary_phy, int secondary_phy, int sid, int rssi, int data_len, const uint8 *data)
+{
+	char *report;
+	int offset;
+	int fragment;
+	int data_status;
+
+
+	log (LOG_LOWERHCI, "LowerHCI::send_le_extended_advertising_report_event %d", data_len);
+
+	if (!ll_host_wants_le_event (LE_EXTENDED_ADVERTISING_REPORT_EVENT))
+	{
+		return;
+	}
+
+	// data that does not fit in one report is split over several, all but
+	// the last are marked incomplete
+
+	offset = 0;
+
+	do
+	{
+		fragment = data_len - offset;
+		data_status = event_type & (REPORT_DATA_INCOMPLETE | REPORT_DATA_TRUNCATED);
+
+		if (fragment > maximum_extended_report_data_length)
+		{
+			fragment = maximum_extended_report_data_length;
+			data_status = REPORT_DATA_INCOMPLETE;
+		}
+
+		report = reserve_advertising_report (LE_EXTENDED_ADVERTISING_REPORT_EVENT, 24 + fragment);
+
+		report[0] = ((event_type & ~(REPORT_DATA_INCOMPLETE | REPORT_DATA_TRUNCATED)) | data_status) & 0xFF;
+		report[1] = 0x00;
+		report[2] = address_type;
+		for (int index = 0; index < 6; index ++)
+		{
+			report[3 + index] = (address >> (8 * index)) & 0xFF;
+		}
+		report[9] = primary_phy;
+		report[10] = secondary_phy;
+		report[11] = sid;
+		report[12] = 0x7F; // tx power not available
+		report[13] = rssi;
+		report[14] = 0x00; // periodic advertising interval
+		report[15] = 0x00;
+		report[16] = 0x00; // direct address type
+		memset (&report[17], 0, 6);
+		report[23] = fragment;
+		memcpy (&report[24], &data[offset], fragment);
+
+		commit_advertising_report (when, 24 + fragment);
+
+		offset += fragment;
+	}
+	while (offset < data_len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::send_le_advertising_set_terminated_event (int status, int handle, int number_of_events)
+{
+	char *buffer;
+
+
+	log (LOG_LOWERHCI, "LowerHCI::send_le_advertising_set_terminated_event %02X %02X", status, handle);
+
+	if (!ll_host_wants_le_event (LE_ADVERTISING_SET_TERMINATED_EVENT))
+	{
+		return;
+	}
+
+	buffer = reserve_event (LE_META_EVENT, 6);
+
+	if (!buffer)
+	{
+		return;
+	}
+
+	buffer[0] = LE_ADVERTISING_SET_TERMINATED_EVENT;
+	buffer[1] = status;
+	buffer[2] = handle;
+	buffer[3] = 0x00; // connection handle, only valid when a connection was created
+	buffer[4] = 0x00;
+	buffer[5] = (number_of_events > 0xFF) ? 0xFF : number_of_events;
+
+	commit_event (buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::send_le_periodic_advertising_sync_established_event (int status, int handle, int sid, int address_type, uint64 address, int phy, int interval, int clock_accuracy)
+{
+	char *buffer;
+
+
+	log (LOG_LOWERHCI, "LowerHCI::send_le_periodic_advertising_sync_established_event %02X %03X", status, handle);
+
+	if (!ll_host_wants_le_event (LE_PERIODIC_ADVERTISING_SYNC_ESTABLISHED_EVENT))
+	{
+		return;
+	}
+
+	buffer = reserve_event (LE_META_EVENT, 16);
+
+	if (!buffer)
+	{
+		return;
+	}
+
+	buffer[0] = LE_PERIODIC_ADVERTISING_SYNC_ESTABLISHED_EVENT;
+	buffer[1] = status;
+	buffer[2] = handle & 0xFF;
+	buffer[3] = (handle >> 8) & 0x0F;
+	buffer[4] = sid;
+	buffer[5] = address_type;
+	for (int index = 0; index < 6; index ++)
+	{
+		buffer[6 + index] = (address >> (8 * index)) & 0xFF;
+	}
+	buffer[12] = phy;
+	buffer[13] = interval & 0xFF;
+	buffer[14] = (interval >> 8) & 0xFF;
+	buffer[15] = clock_accuracy;
+
+	commit_event (buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::send_le_periodic_advertising_report_event (int handle, int rssi, int data_status, int data_len, const uint8 *data)
+{
+	char *buffer;
+	int offset;
+	int fragment;
+	int fragment_status;
+
+
+	log (LOG_LOWERHCI, "LowerHCI::send_le_periodic_advertising_report_event %03X %d", handle, data_len);
+
+	if (!ll_host_wants_le_event (LE_PERIODIC_ADVERTISING_REPORT_EVENT))
+	{
+		return;
+	}
+
+	// as with extended reports, data that does not fit in one event is
+	// split and all but the last are marked incomplete
+
+	offset = 0;
+
+	do
+	{
+		fragment = data_len - offset;
+		fragment_status = data_status;
+
+		if (fragment > maximum_hci_event_parameter_length - 8)
+		{
+			fragment = maximum_hci_event_parameter_length - 8;
+			fragment_status = 0x01;
+		}
+
+		buffer = reserve_event (LE_META_EVENT, 8 + fragment);
+
+		if (!buffer)
+		{
+			return;
+		}
+
+		buffer[0] = LE_PERIODIC_ADVERTISING_REPORT_EVENT;
+		buffer[1] = handle & 0xFF;
+		buffer[2] = (handle >> 8) & 0x0F;
+		buffer[3] = 0x7F; // tx power not available
+		buffer[4] = rssi;
+		buffer[5] = 0xFF; // no constant tone extension
+		buffer[6] = fragment_status;
+		buffer[7] = fragment;
+		memcpy (&buffer[8], &data[offset], fragment);
+
+		commit_event (buffer);
+
+		offset += fragment;
+	}
+	while (offset < data_len);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::send_le_periodic_advertising_sync_lost_event (int handle)
+{
+	char *buffer;
+
+
+	log (LOG_LOWERHCI, "LowerHCI::send_le_periodic_advertising_sync_lost_event %03X", handle);
+
+	if (!ll_host_wants_le_event (LE_PERIODIC_ADVERTISING_SYNC_LOST_EVENT))
+	{
+		return;
+	}
+
+	buffer = reserve_event (LE_META_EVENT, 3);
+
+	if (!buffer)
+	{
+		return;
+	}
+
+	buffer[0] = LE_PERIODIC_ADVERTISING_SYNC_LOST_EVENT;
+	buffer[1] = handle & 0xFF;
+	buffer[2] = (handle >> 8) & 0x0F;
+
+	commit_event (buffer);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+char *LowerHCI::reserve_advertising_report (int subevent, int report_len)
+{
+	if
+	(
+		(hci_advertising_report_count > 0) &&
+		(
+			(hci_advertising_report_buffer[0] != subevent) ||
+			(hci_advertising_report_length + report_len > maximum_hci_event_parameter_length)
+		)
+	)
+	{
+		flush_le_advertising_reports ();
+	}
+
+	hci_advertising_report_buffer[0] = subevent;
+
+	return &hci_advertising_report_buffer[hci_advertising_report_length];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::commit_advertising_report (int64 when, int report_len)
+{
+	if (hci_advertising_report_count == 0)
+	{
+		hci_advertising_report_first = when;
+	}
+
+	hci_advertising_report_count += 1;
+	hci_advertising_report_length += report_len;
+
+	if (when - hci_advertising_report_first >= hci_advertising_report_window)
+	{
+		flush_le_advertising_reports ();
+	}
+	else
+	{
+		set_timer (hci_advertising_report_first + hci_advertising_report_window);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::flush_le_advertising_reports (void)
+{
+	if (hci_advertising_report_count > 0)
+	{
+		log (LOG_LOWERHCI, "LowerHCI::flush_le_advertising_reports %d", hci_advertising_report_count);
+
+		hci_advertising_report_buffer[1] = hci_advertising_report_count;
+
+		send_event (LE_META_EVENT, hci_advertising_report_length, hci_advertising_report_buffer);
+	}
+
+	hci_advertising_report_count = 0;
+	hci_advertising_report_length = 2;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::set_advertising_report_window (int64 window)
+{
+	hci_advertising_report_window = window;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::set_default_advertising_report_window (int64 window)
+{
+	default_advertising_report_window = window;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::set_completed_packets_window (int64 window)
+{
+	hci_completed_packets_window = window;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::set_completed_packets_threshold (int threshold)
+{
+	hci_completed_packets_threshold = threshold;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::set_default_completed_packets_window (int64 window)
+{
+	default_completed_packets_window = window;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::set_default_completed_packets_threshold (int threshold)
+{
+	default_completed_packets_threshold = threshold;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::set_default_num_hci_command_packets (int packets)
+{
+	default_num_hci_command_packets = (packets < 1) ? 1 : (packets > 255) ? 255 : packets;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void LowerHCI::on_timer (int64 when)
+{
+	if (hci_advertising_report_count > 0)
+	{
+		if (when - hci_advertising_report_first >= hci_advertising_report_window)
+		{
+			flush_le_advertising_reports ();
+		}
+		else
+		{
+			set_timer (hci_advertising_report_first + hci_advertising_report_window);
+		}
+	}
+
+	if (hci_completed_packets_total > 0)
+	{
+		if (when - hci_completed_packets_first >= hci_completed_packets_window)
+		{
+			flush_number_of_completed_packets ();
+		}
+		else
+		{
+			set_timer (hci_completed_packets_first + hci_completed_packets_window);
+		}
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -43,10 +43,6 @@
 
 ////////////////////////////////////////////////////////////////////////////////
 
-static time_t program_start_time;
-
-////////////////////////////////////////////////////////////////////////////////
-
 void *background_monitor_thread (void *arg)
 {
 	struct stat st;
@@ -112,6 +108,32 @@ void on_hci_connection (int sockfd, unsigned long addr, unsigned int port)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// the H4 stream goes through a pair of rings in shared memory, the socket
+// that asked for them only hands them over and then says when the host is
+// gone
+
+void on_shm_connection (int sockfd, unsigned long addr, unsigned int port)
+{
+	SharedMemoryTransport *transport;
+	Controller *controller;
+
+
+	transport = new SharedMemoryTransport ();
+
+	if ((!transport->create ()) || (!transport->send_descriptors (sockfd)))
+	{
+		delete transport;
+		close (sockfd);
+		return;
+	}
+
+	controller = new Controller (sockfd, addr, port);
+	controller->use_shared_memory (transport);
+	controller->mk_active ();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 void on_web_connection (int sockfd, unsigned long addr, unsigned int port)
 {
 	WebSocket *web;
@@ -129,7 +151,7 @@ bool server_uptime (WebRequest *req)
 	
 
 	time (&now);
-	uptime = now - program_start_time;
+	uptime = now - get_program_start_time ();
 
 	req->add_response_part ("page_right", "Uptime = ${uptime}");
 	req->add_response_part ("page_left", "");
@@ -156,7 +178,7 @@ const char *part_uptime (WebRequest *req)
 	
 
 	time (&now);
-	uptime = now - program_start_time;
+	uptime = now - get_program_start_time ();
 
 	seconds = uptime % 60;
 	uptime = (uptime - seconds) / 60;
@@ -186,9 +208,93 @@ const char *part_hit_count (WebRequest *req)
 
 ////////////////////////////////////////////////////////////////////////////////
 
-long get_program_start_time (void)
+bool server_status (WebRequest *req)
+{
+	char buffer[100];
+	
+
+	req->add_response_part ("page_right", "Missed events = ${missed_events}<br>Pre-empted events = ${preempted_events}<br>HCI commands<br>${hci_commands}");
+	req->add_response_part ("page_left", "");
+
+	sprintf (buffer, "${page_layout}");
+
+	req->set_response_code (200);
+	req->add_template_response (buffer, strlen (buffer));
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// radio events that started too late and were skipped, a rising count means
+// the simulation is not keeping up
+
+const char *part_missed_events (WebRequest *req)
+{
+	static char buffer[30];
+	uint64 missed;
+
+
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+	missed = LinkLayer::ll_get_total_missed_events ();
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+
+	sprintf (buffer, "%llu", missed);
+
+	return buffer;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// events that lost the radio to another role on the same controller
+
+const char *part_preempted_events (WebRequest *req)
 {
-	return program_start_time;
+	static char buffer[300];
+
+
+	PhysicalLayer::enter_mutex (__FILE__, __LINE__);
+
+	sprintf (buffer, "advertising %llu, scanning %llu, initiating %llu, slave %llu, master %llu, periodic advertising %llu, synchronized %llu",
+		LinkLayer::ll_get_total_preempted_events (LLS_Advertising),
+		LinkLayer::ll_get_total_preempted_events (LLS_Scanning),
+		LinkLayer::ll_get_total_preempted_events (LLS_Initiator),
+		LinkLayer::ll_get_total_preempted_events (LLS_Slave),
+		LinkLayer::ll_get_total_preempted_events (LLS_Master),
+		LinkLayer::ll_get_total_preempted_events (LLS_Periodic_Advertising),
+		LinkLayer::ll_get_total_preempted_events (LLS_Synchronized));
+
+	PhysicalLayer::leave_mutex (__FILE__, __LINE__);
+
+	return buffer;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// each HCI command that has been used, with how long processing it took
+
+const char *part_hci_commands (WebRequest *req)
+{
+	static char buffer[8000];
+	int length;
+	int opcode;
+	uint64 count;
+	uint64 total_time;
+	uint64 maximum_time;
+
+
+	length = 0;
+	buffer[0] = 0;
+
+	for (int index = 0; LowerHCI::hci_get_command_statistics (index, &opcode, &count, &total_time, &maximum_time); index ++)
+	{
+		if ((count > 0) && (length < (int) sizeof (buffer) - 100))
+		{
+			length += sprintf (&buffer[length], "%04X count %llu mean %llu ns max %llu ns<br>", opcode, count, total_time / count, maximum_time);
+		}
+	}
+
+	return buffer;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -196,9 +302,19 @@ long get_program_start_time (void)
 int main (int argc, char **argv)
 {
 	ListenSocket *hci_listen;
+	ListenSocket *unix_listen;
+	ListenSocket *shm_listen;
 	ListenSocket *web_listen;
+	const char *unix_path;
+	const char *shm_path;
 	struct tm *timeinfo;
+	time_t program_start_time;
 	char *timestr;
+	int opt;
+
+
+	unix_path = 0;
+	shm_path = 0;
 
 	enable_logging_of (LOG_INFO);
 	enable_logging_of (LOG_WARNING);
@@ -213,7 +329,47 @@ int main (int argc, char **argv)
 //	enable_logging_of (LOG_LLSM);
 //	enable_logging_of (LOG_PHYSICALLAYER);
 
-	time (&program_start_time);
+	while ((opt = getopt (argc, argv, "r:c:C:n:s:u:U:")) != -1)
+	{
+		switch (opt)
+		{
+			case 'r': // advertising report coalescing window in microseconds, 0 = off
+				LowerHCI::set_default_advertising_report_window (atoll (optarg));
+				break;
+
+			case 'c': // number of completed packets coalescing window in microseconds, 0 = off
+				LowerHCI::set_default_completed_packets_window (atoll (optarg));
+				break;
+
+			case 'C': // number of completed packets reported as soon as this many are pending
+				LowerHCI::set_default_completed_packets_threshold (atoi (optarg));
+				break;
+
+			case 'n': // Num_HCI_Command_Packets, how many commands a host may have outstanding
+				LowerHCI::set_default_num_hci_command_packets (atoi (optarg));
+				break;
+
+			case 's': // capture every connection to a btsnoop file in this directory
+				BtSnoop::set_capture_directory (optarg);
+				break;
+
+			case 'u': // also accept hosts on a unix domain socket at this path
+				unix_path = optarg;
+				break;
+
+			case 'U': // also accept hosts using shared memory, set up through a unix domain socket at this path
+				shm_path = optarg;
+				break;
+
+			default:
+				fprintf (stderr, "usage: %s [-r report_window_us] [-c completed_window_us] [-C completed_threshold] [-n num_hci_command_packets] [-s btsnoop_directory] [-u unix_socket_path] [-U shared_memory_socket_path]\n", argv[0]);
+				exit (1);
+		}
+	}
+
+	start_physical_layer_simulation ();
+
+	program_start_time = get_program_start_time ();
 	srand (program_start_time);
 	timeinfo = localtime (&program_start_time);
 	timestr = asctime (timeinfo);
@@ -224,15 +380,31 @@ int main (int argc, char **argv)
 	log (LOG_INFO, "-----------------------------------------------------------------------------");
 
 	WebRequest::register_page ("/server/uptime", server_uptime);
+	WebRequest::register_page ("/server/status", server_status);
 	WebRequest::register_part ("hit_count", part_hit_count);
 	WebRequest::register_part ("uptime", part_uptime);
+	WebRequest::register_part ("missed_events", part_missed_events);
+	WebRequest::register_part ("preempted_events", part_preempted_events);
+	WebRequest::register_part ("hci_commands", part_hci_commands);
 
 	start_background_monitor ((void *) argv[0]);
-	start_physical_layer_simulation ();
+	BtSnoop::start_writer ();
 
 	hci_listen = new ListenSocket (0xb1ee);
 	hci_listen->set_callback (on_hci_connection);
 
+	if (unix_path)
+	{
+		unix_listen = new ListenSocket (unix_path);
+		unix_listen->set_callback (on_hci_connection);
+	}
+
+	if (shm_path)
+	{
+		shm_listen = new ListenSocket (shm_path);
+		shm_listen->set_callback (on_shm_connection);
+	}
+
 	web_listen = new ListenSocket (0xb1ed);
 	web_listen->set_callback (on_web_connection);
 	
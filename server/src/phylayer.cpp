@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -41,15 +42,23 @@
 
 int64 physical_clock = 0;	// nanoseconds
 
+static time_t program_start_time;
+
 pthread_mutex_t physical_layer_mutex;
 
 PhysicalLayer *PhysicalLayer::all_radios = 0;
 
+pthread_t PhysicalLayer::simulation_thread;
+PhysicalLayer *PhysicalLayer::deferred_output = 0;
+
 PhysicalPacket *PhysicalLayer::ordered_transmitters = 0;
 PhysicalPacket *PhysicalLayer::ordered_receivers = 0;
 
-int PhysicalLayer::transmitting[40] = { 0 };
-bool PhysicalLayer::bad_transmission[40] = { false };
+PhysicalPacket *PhysicalLayer::transmitters_on_channel[maximum_radio_channels] = { 0 };
+PhysicalPacket *PhysicalLayer::receivers_on_channel[maximum_radio_channels] = { 0 };
+
+int PhysicalLayer::transmitting[maximum_radio_channels] = { 0 };
+bool PhysicalLayer::bad_transmission[maximum_radio_channels] = { false };
 
 ////////////////////////////////////////////////////////////////////////////////
 
@@ -60,8 +69,16 @@ PhysicalPacket::PhysicalPacket (PhysicalLayer *phy)
 	modulation = GFSK_LE;
 	start_time = 0;
 	end_time = 0;
+	rx_start_time = 0;
+	rx_modulation = GFSK_LE;
+	rx_rssi = 0;
+	access_address = advertising_access_address;
+	crc_init = advertising_crc_init;
 	pdu_length = 0;
+	pdu_data = pdu_buffer;
+	crc = 0x000000;
 	physical_layer = phy;
+	rx_transmitter = 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -78,7 +95,7 @@ void PhysicalPacket::set_transmit (uint8 chan, PhyModulation mod, int64 when)
 	channel = chan;
 	modulation = mod;
 	start_time = when;
-	end_time = start_time + (8 + 32) * 8; // preamble + access address
+	end_time = start_time + phy_sync_time (modulation); // preamble + access address
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -107,10 +124,17 @@ void PhysicalPacket::set_access_address (uint32 aa)
 	}
 }
 
+////////////////////////////////////////////////////////////////////////////////
+
+void PhysicalPacket::set_crc_init (uint32 init)
+{
+	crc_init = init & 0xFFFFFF;
+}
+
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void PhysicalPacket::set_pdu (uint8 len, uint8 *pdu)
+void PhysicalPacket::set_pdu (int len, uint8 *pdu)
 {
 	if (len > maximum_pdu_length)
 	{
@@ -118,9 +142,61 @@ void PhysicalPacket::set_pdu (uint8 len, uint8 *pdu)
 	}
 
 	pdu_length = len;
-	memcpy (pdu_data, pdu, pdu_length);
-	crc = 0x000000;
-	end_time = start_time + (8 + 32 + 24 + 8 * pdu_length); // preamble, access address, crc
+	memcpy (pdu_buffer, pdu, pdu_length);
+	pdu_data = pdu_buffer;
+	crc = calculate_crc (crc_init, pdu_length, pdu_data);
+	end_time = start_time + phy_packet_airtime (modulation, pdu_length); // preamble, access address, crc
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void PhysicalPacket::set_pdu_reference (int len, const uint8 *pdu, uint32 pdu_crc)
+{
+	// the caller owns the buffer and must keep it unchanged until end_of_packet
+
+	if (len > maximum_pdu_length)
+	{
+		len = maximum_pdu_length;
+	}
+
+	pdu_length = len;
+	pdu_data = pdu;
+	crc = pdu_crc;
+	end_time = start_time + phy_packet_airtime (modulation, pdu_length); // preamble, access address, crc
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+uint32 PhysicalPacket::calculate_crc (uint32 init, int len, const uint8 *pdu)
+{
+	uint32 state;
+	uint32 feedback;
+	uint8 byte;
+
+
+	// 24 bit LFSR, polynomial x^24 + x^10 + x^9 + x^6 + x^4 + x^3 + x + 1,
+	// data is clocked in least significant bit first
+
+	state = init & 0xFFFFFF;
+
+	for (int index = 0; index < len; index ++)
+	{
+		byte = pdu[index];
+
+		for (int bit = 0; bit < 8; bit ++)
+		{
+			feedback = ((state >> 23) ^ byte) & 0x01;
+			byte >>= 1;
+			state = (state << 1) & 0xFFFFFF;
+
+			if (feedback)
+			{
+				state ^= 0x00065B;
+			}
+		}
+	}
+
+	return state;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -136,13 +212,16 @@ void PhysicalPacket::log (void)
 {
 	log_continuation ("PHY{");
 	
-	if (modulation == GFSK_LE)
+	switch (modulation)
 	{
-		log_continuation ("LE:");
-	}
-	else
-	{
-		log_continuation ("??:");
+		case GFSK_LE:          log_continuation ("LE:"); break;
+		case GFSK_LE_2M:       log_continuation ("2M:"); break;
+		case GFSK_LE_CODED_S2: log_continuation ("S2:"); break;
+		case GFSK_LE_CODED_S8: log_continuation ("S8:"); break;
+
+		default:
+			log_continuation ("??:");
+			break;
 	}
 
 	log_continuation ("[%d]", llsm_index);
@@ -154,7 +233,7 @@ void PhysicalPacket::log (void)
 		{
 			log_continuation ("%02X", pdu_data[index]);
 		}
-		log_continuation ("}");
+		log_continuation (":%06lX}", crc);
 	}
 	else
 	{
@@ -165,18 +244,23 @@ void PhysicalPacket::log (void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void PhysicalPacket::end_of_packet (int64 when, int rx_len, uint8 *rx_data)
+void PhysicalPacket::end_of_packet (int64 when, int rx_len, const uint8 *rx_data)
 {
 	physical_layer->end_of_packet (this, when, rx_len, rx_data);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// the version information reported to hosts is made from when the simulation
+// started
+
 void start_physical_layer_simulation (void)
 {
 	pthread_t t2;
 
 
+	time (&program_start_time);
+
 	pthread_mutex_init (&physical_layer_mutex, NULL);
 
 	pthread_create (&t2, NULL, &PhysicalLayer::physical_layer_simulation_thread, 0);
@@ -184,6 +268,13 @@ void start_physical_layer_simulation (void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+long get_program_start_time (void)
+{
+	return program_start_time;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 PhysicalLayer::PhysicalLayer ()
 {
 	log (LOG_PHYSICALLAYER, "PhysicalLayer");
@@ -200,6 +291,19 @@ PhysicalLayer::PhysicalLayer ()
 
 	physical_layer_is_active = false;
 	current_packet = 0;
+	timer_is_set = false;
+	timer_instant = 0;
+
+	output_deferred = false;
+	next_deferred = 0;
+
+	// the radio model is not controller state, HCI Reset leaves it alone
+
+	radio_address = 0;
+	tx_power = default_tx_power;
+	memset (position, 0, sizeof (position));
+	clock_drift = 0;
+	number_of_lossy_links = 0;
 
 	reset ();
 
@@ -228,6 +332,10 @@ PhysicalLayer::~PhysicalLayer ()
 		succ->pred = pred;
 	}
 
+	// nothing is sent by now, it only comes off the list
+
+	send_deferred_output ();
+
 	leave_mutex (__FILE__, __LINE__);
 }
 
@@ -247,6 +355,26 @@ void PhysicalLayer::mk_active (void)
 
 ////////////////////////////////////////////////////////////////////////////////
 
+void PhysicalLayer::set_timer (int64 when)
+{
+	// only one timer per radio, an earlier request wins
+
+	if ((!timer_is_set) || (when < timer_instant))
+	{
+		timer_instant = when;
+		timer_is_set = true;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void PhysicalLayer::clear_timer (void)
+{
+	timer_is_set = false;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 void *PhysicalLayer::physical_layer_simulation_thread (void *arg)
 {
 	PhysicalLayer *phy;
@@ -256,8 +384,12 @@ void *PhysicalLayer::physical_layer_simulation_thread (void *arg)
 	PhysicalPacket *receiver;
 	PhysicalPacket *next_receiver;
 	int64 time_until_next_event;
+	int64 next_timer_instant;
 	int64 end_time;
+	int rssi;
+
 
+	simulation_thread = pthread_self ();
 
 	while (true)
 	{
@@ -266,6 +398,11 @@ void *PhysicalLayer::physical_layer_simulation_thread (void *arg)
 		ordered_transmitters = 0;
 		ordered_receivers = 0;
 
+		memset (transmitters_on_channel, 0, sizeof (transmitters_on_channel));
+		memset (receivers_on_channel, 0, sizeof (receivers_on_channel));
+
+		next_timer_instant = physical_clock + 12500;
+
 		phy = all_radios;
 		while (phy)
 		{
@@ -273,6 +410,20 @@ void *PhysicalLayer::physical_layer_simulation_thread (void *arg)
 
 			if (phy->is_active ())
 			{
+				if (phy->timer_is_set)
+				{
+					if (phy->timer_instant <= physical_clock)
+					{
+						phy->timer_is_set = false;
+						phy->on_timer (physical_clock);
+					}
+
+					if ((phy->timer_is_set) && (phy->timer_instant < next_timer_instant))
+					{
+						next_timer_instant = phy->timer_instant;
+					}
+				}
+
 				if (phy->current_packet)
 				{
 					packet = phy->current_packet;
@@ -283,6 +434,7 @@ void *PhysicalLayer::physical_layer_simulation_thread (void *arg)
 
 					if (packet)
 					{
+						phy->apply_clock_drift (packet, physical_clock);
 						phy->current_packet = packet;
 					}
 				}
@@ -292,10 +444,17 @@ void *PhysicalLayer::physical_layer_simulation_thread (void *arg)
 					if (packet->is_transmit ())
 					{
 						insert_into (&ordered_transmitters, packet);
+
+						packet->channel_succ = transmitters_on_channel[packet->channel];
+						transmitters_on_channel[packet->channel] = packet;
 					}
 					else if (packet->is_receive ())
 					{
 						insert_into (&ordered_receivers, packet);
+
+						packet->channel_succ = receivers_on_channel[packet->channel];
+						packet->rx_transmitter = 0;
+						receivers_on_channel[packet->channel] = packet;
 					}
 				}
 			}
@@ -305,9 +464,61 @@ void *PhysicalLayer::physical_layer_simulation_thread (void *arg)
 
 		time_until_next_event = 12500;
 
+		if (next_timer_instant <= physical_clock)
+		{
+			time_until_next_event = 1;
+		}
+		else if (next_timer_instant - physical_clock < time_until_next_event)
+		{
+			time_until_next_event = next_timer_instant - physical_clock;
+		}
+
 		if (ordered_transmitters)
 		{
-			time_until_next_event = 1250;
+			// the receivers of the transmissions that complete in this step
+			// are worked out first, so that the link layers can decrypt all
+			// of the packets together before any is delivered
+
+			packet = ordered_transmitters;
+			while (packet)
+			{
+				if ((packet->end_time == physical_clock) && (!PhysicalLayer::bad_transmission[packet->get_channel ()]))
+				{
+					receiver = receivers_on_channel[packet->get_channel ()];
+					while (receiver)
+					{
+						if
+						(
+							(receiver->physical_layer->current_packet == receiver) &&
+							(receiver->rx_transmitter == 0) &&
+							(receiver->start_time <= packet->start_time) &&
+							(receiver->end_time >= packet->start_time + phy_sync_time (packet->modulation)) &&
+							(receiver->access_address == packet->access_address) &&
+							(phy_can_receive (receiver->modulation, packet->modulation)) &&
+							((rssi = received_power (receiver->physical_layer, packet->physical_layer)) >= receiver_sensitivity) &&
+							(rand () % 100 >= link_loss (receiver->physical_layer, packet->physical_layer))
+						)
+						{
+							receiver->rx_transmitter = packet;
+							receiver->rx_start_time = packet->start_time;
+							receiver->rx_modulation = packet->modulation;
+							receiver->rx_rssi = rssi;
+							receiver->physical_layer->prepare_packet (receiver, packet->pdu_length, packet->pdu_data);
+						}
+
+						receiver = receiver->channel_succ;
+					}
+				}
+
+				packet = packet->succ;
+			}
+
+			LinkLayer::ll_decrypt_received_pdus ();
+
+			if (1250 < time_until_next_event)
+			{
+				time_until_next_event = 1250;
+			}
 			packet = ordered_transmitters;
 			while (packet)
 			{
@@ -321,18 +532,14 @@ void *PhysicalLayer::physical_layer_simulation_thread (void *arg)
 						packet->log ();
 						log_end ();
 
-						receiver = ordered_receivers;
+						receiver = receivers_on_channel[packet->get_channel ()];
 						while (receiver)
 						{
-							next_receiver = receiver->succ;
-
-							if
-							(
-								(receiver->start_time <= packet->start_time) &&
-								(receiver->end_time >= packet->start_time + (8 + 32)) &&
-								(receiver->get_channel () == packet->get_channel ())
-							)
+							next_receiver = receiver->channel_succ;
+
+							if (receiver->rx_transmitter == packet)
 							{
+								receiver->rx_transmitter = 0;
 								receiver->end_of_packet (physical_clock, packet->pdu_length, packet->pdu_data);
 							}
 
@@ -400,7 +607,22 @@ void *PhysicalLayer::physical_layer_simulation_thread (void *arg)
 			{
 				next_packet = packet->succ;
 
-				if (packet->end_time == physical_clock)
+				if (packet->physical_layer->current_packet != packet)
+				{
+					// the receive window was closed by a packet received earlier in this step
+				}
+				else if ((packet->end_time == physical_clock) && (receiver = synchronised_transmitter (packet)))
+				{
+					// a packet was synchronised to inside the window, keep receiving until it ends
+
+					packet->end_time = receiver->end_time;
+
+					if (packet->end_time - physical_clock < time_until_next_event)
+					{
+						time_until_next_event = packet->end_time - physical_clock;
+					}
+				}
+				else if (packet->end_time == physical_clock)
 				{
 					log (LOG_PHYSICALLAYER, "  Rx End %lld %p", physical_clock, packet);
 
@@ -441,6 +663,8 @@ void *PhysicalLayer::physical_layer_simulation_thread (void *arg)
 
 		physical_clock += time_until_next_event;
 
+		send_all_deferred_output ();
+
 		leave_mutex (__FILE__, __LINE__);
 
 		usleep (time_until_next_event + 1000 + 10);
@@ -450,7 +674,72 @@ void *PhysicalLayer::physical_layer_simulation_thread (void *arg)
 
 ////////////////////////////////////////////////////////////////////////////////
 
-void PhysicalLayer::end_of_packet (PhysicalPacket *packet, int64 when, int rx_len, uint8 *rx_data)
+bool PhysicalLayer::is_simulation_thread (void)
+{
+	return pthread_equal (pthread_self (), simulation_thread);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// called from the simulation thread with the mutex held, on the first output
+// of a step; the caller holds its output back until flush_output is called
+
+void PhysicalLayer::defer_output (void)
+{
+	if (!output_deferred)
+	{
+		output_deferred = true;
+
+		next_deferred = deferred_output;
+		deferred_output = this;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// now rather than at the end of the step, for a controller that is going away
+
+void PhysicalLayer::send_deferred_output (void)
+{
+	PhysicalLayer **link;
+
+
+	if (!output_deferred)
+	{
+		return;
+	}
+
+	link = &deferred_output;
+	while (*link != this)
+	{
+		link = &(*link)->next_deferred;
+	}
+	*link = next_deferred;
+
+	output_deferred = false;
+	flush_output ();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void PhysicalLayer::send_all_deferred_output (void)
+{
+	PhysicalLayer *phy;
+
+
+	while (deferred_output)
+	{
+		phy = deferred_output;
+		deferred_output = phy->next_deferred;
+
+		phy->output_deferred = false;
+		phy->flush_output ();
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void PhysicalLayer::end_of_packet (PhysicalPacket *packet, int64 when, int rx_len, const uint8 *rx_data)
 {
 	current_packet = 0;
 	((LinkLayer *) this)->end_of_packet (packet, when, rx_len, rx_data);
@@ -458,6 +747,16 @@ void PhysicalLayer::end_of_packet (PhysicalPacket *packet, int64 when, int rx_le
 
 ////////////////////////////////////////////////////////////////////////////////
 
+// a packet that will be delivered later in this step, see
+// physical_layer_simulation_thread
+
+void PhysicalLayer::prepare_packet (PhysicalPacket *packet, int rx_len, const uint8 *rx_data)
+{
+	((LinkLayer *) this)->ll_prepare_received_pdu (packet, rx_len, rx_data);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
 void PhysicalLayer::enter_mutex (const char *file, int line)
 {
 	pthread_mutex_lock (&physical_layer_mutex);	
@@ -513,3 +812,34 @@ void PhysicalLayer::insert_into (PhysicalPacket **list, PhysicalPacket *packet)
 }
 
 ////////////////////////////////////////////////////////////////////////////////
+
+// a transmission that the receiver synchronised to before its window closed
+
+PhysicalPacket *PhysicalLayer::synchronised_transmitter (PhysicalPacket *receiver)
+{
+	PhysicalPacket *packet;
+
+
+	packet = transmitters_on_channel[receiver->get_channel ()];
+	while (packet)
+	{
+		if
+		(
+			(packet->end_time > physical_clock) &&
+			(receiver->start_time <= packet->start_time) &&
+			(receiver->end_time >= packet->start_time + phy_sync_time (packet->modulation)) &&
+			(receiver->access_address == packet->access_address) &&
+			(phy_can_receive (receiver->modulation, packet->modulation)) &&
+			(received_power (receiver->physical_layer, packet->physical_layer) >= receiver_sensitivity)
+		)
+		{
+			return packet;
+		}
+
+		packet = packet->channel_succ;
+	}
+
+	return 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
@@ -0,0 +1,217 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <math.h>
+#include <string.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "controller.h"
+#include "log.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the controller's public address, which is how other hosts name it when
+// they set a lossy link
+
+void PhysicalLayer::set_radio_address (uint64 address)
+{
+	radio_address = address;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool PhysicalLayer::set_tx_power (int dbm)
+{
+	if ((dbm < minimum_tx_power) || (dbm > maximum_tx_power))
+	{
+		return false;
+	}
+
+	log (LOG_PHYSICALLAYER, "PhysicalLayer::set_tx_power %d dBm", dbm);
+
+	tx_power = dbm;
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void PhysicalLayer::set_position (int x, int y, int z)
+{
+	log (LOG_PHYSICALLAYER, "PhysicalLayer::set_position %d,%d,%d mm", x, y, z);
+
+	position[0] = x;
+	position[1] = y;
+	position[2] = z;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool PhysicalLayer::set_clock_drift (int ppm)
+{
+	if ((ppm < -maximum_clock_drift) || (ppm > maximum_clock_drift))
+	{
+		return false;
+	}
+
+	log (LOG_PHYSICALLAYER, "PhysicalLayer::set_clock_drift %d ppm", ppm);
+
+	clock_drift = ppm;
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// a loss of zero takes the link out of the table, false when the table is full
+
+bool PhysicalLayer::set_link_loss (uint64 address, int percent)
+{
+	int index;
+
+
+	log (LOG_PHYSICALLAYER, "PhysicalLayer::set_link_loss %012llX %d%%", address, percent);
+
+	for (index = 0; index < number_of_lossy_links; index ++)
+	{
+		if (lossy_link[index].address == address)
+		{
+			break;
+		}
+	}
+
+	if (percent == 0)
+	{
+		if (index < number_of_lossy_links)
+		{
+			number_of_lossy_links -= 1;
+			lossy_link[index] = lossy_link[number_of_lossy_links];
+		}
+
+		return true;
+	}
+
+	if (index == number_of_lossy_links)
+	{
+		if (number_of_lossy_links == maximum_number_of_lossy_links)
+		{
+			return false;
+		}
+
+		number_of_lossy_links += 1;
+		lossy_link[index].address = address;
+	}
+
+	lossy_link[index].percent = percent;
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// dBm at the receiver, the transmit power less the free space path loss over
+// the distance between the two
+
+int PhysicalLayer::received_power (const PhysicalLayer *receiver, const PhysicalLayer *transmitter)
+{
+	double dx;
+	double dy;
+	double dz;
+	double metres;
+
+
+	dx = (double) receiver->position[0] - transmitter->position[0];
+	dy = (double) receiver->position[1] - transmitter->position[1];
+	dz = (double) receiver->position[2] - transmitter->position[2];
+
+	metres = sqrt (dx * dx + dy * dy + dz * dz) / 1000.0;
+
+	if (metres <= 1.0)
+	{
+		return transmitter->tx_power - reference_path_loss;
+	}
+
+	return transmitter->tx_power - reference_path_loss - (int) lround (20.0 * log10 (metres));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the percentage of packets dropped between the two, either end may have set
+// it and the higher one counts
+
+int PhysicalLayer::link_loss (const PhysicalLayer *receiver, const PhysicalLayer *transmitter)
+{
+	int percent;
+
+
+	percent = 0;
+
+	for (int index = 0; index < receiver->number_of_lossy_links; index ++)
+	{
+		if ((receiver->lossy_link[index].address == transmitter->radio_address) && (receiver->lossy_link[index].percent > percent))
+		{
+			percent = receiver->lossy_link[index].percent;
+		}
+	}
+
+	for (int index = 0; index < transmitter->number_of_lossy_links; index ++)
+	{
+		if ((transmitter->lossy_link[index].address == receiver->radio_address) && (transmitter->lossy_link[index].percent > percent))
+		{
+			percent = transmitter->lossy_link[index].percent;
+		}
+	}
+
+	return percent;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the link layer schedules against its own clock, a packet planned for some
+// time ahead is off by the drift over that time; packets sent straight after
+// another (T_IFS) are too close for it to show
+
+void PhysicalLayer::apply_clock_drift (PhysicalPacket *packet, int64 now)
+{
+	int64 offset;
+
+
+	if ((clock_drift == 0) || ((int64) packet->start_time <= now))
+	{
+		return;
+	}
+
+	offset = -(((int64) packet->start_time - now) * clock_drift) / 1000000;
+
+	packet->start_time += offset;
+	packet->end_time += offset;
+}
+
+////////////////////////////////////////////////////////////////////////////////
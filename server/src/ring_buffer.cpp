@@ -0,0 +1,226 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "log.h"
+#include "socket.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+RingBuffer::RingBuffer (int new_capacity)
+{
+	base = 0;
+	capacity = new_capacity;
+	head = 0;
+	tail = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+RingBuffer::~RingBuffer ()
+{
+	if (base)
+	{
+		munmap (base, 2 * capacity);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the pages of one memfd, mapped into both halves of an address range taken
+// for the pair; the descriptor is not needed once they are mapped. Returns 0
+// if any of it fails, with nothing left behind
+
+char *RingBuffer::map (unsigned int size)
+{
+	int fd;
+	char *mapping;
+
+
+	fd = memfd_create ("b1ee_ring", MFD_CLOEXEC);
+
+	if (fd < 0)
+	{
+		log (LOG_ERROR, "RingBuffer memfd_create (%d : %s)", errno, strerror (errno));
+		return 0;
+	}
+
+	if (ftruncate (fd, size) < 0)
+	{
+		log (LOG_ERROR, "RingBuffer ftruncate (%d : %s)", errno, strerror (errno));
+		close (fd);
+		return 0;
+	}
+
+	mapping = (char *) mmap (0, 2 * size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (mapping == MAP_FAILED)
+	{
+		log (LOG_ERROR, "RingBuffer mmap (%d : %s)", errno, strerror (errno));
+		close (fd);
+		return 0;
+	}
+
+	if
+	(
+		(mmap (mapping, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) ||
+		(mmap (&mapping[size], size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+	)
+	{
+		log (LOG_ERROR, "RingBuffer mmap (%d : %s)", errno, strerror (errno));
+		munmap (mapping, 2 * size);
+		close (fd);
+		return 0;
+	}
+
+	close (fd);
+
+	return mapping;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// room for len more bytes, the data moves to the start of the new ring; if
+// the new ring cannot be mapped the old one is left as it was
+
+bool RingBuffer::grow (int len)
+{
+	char *new_base;
+	unsigned int new_capacity;
+	unsigned int length;
+
+
+	length = head - tail;
+	new_capacity = capacity;
+
+	while (new_capacity - length < (unsigned int) len)
+	{
+		new_capacity = 2 * new_capacity;
+	}
+
+	new_base = map (new_capacity);
+
+	if (!new_base)
+	{
+		return false;
+	}
+
+	if (base)
+	{
+		log (LOG_SOCKET, "RingBuffer grow %u to %u", capacity, new_capacity);
+
+		memcpy (new_base, &base[tail], length);
+		munmap (base, 2 * capacity);
+	}
+
+	base = new_base;
+	capacity = new_capacity;
+	head = length;
+	tail = 0;
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+char *RingBuffer::peek (int *len)
+{
+	*len = head - tail;
+	return base ? &base[tail] : 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void RingBuffer::consume (int len)
+{
+	tail += len;
+
+	if (tail == head)
+	{
+		tail = 0;
+		head = 0;
+	}
+	else if (tail >= capacity)
+	{
+		tail -= capacity;
+		head -= capacity;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// all of the room there is, which may be none; 0 if the ring could not be
+// mapped
+
+char *RingBuffer::get_space (int *len)
+{
+	if ((!base) && (!grow (0)))
+	{
+		*len = 0;
+		return 0;
+	}
+
+	*len = capacity - (head - tail);
+	return &base[head];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// room for len bytes, for the caller to fill in and commit; 0 if the ring
+// could not be grown to take them
+
+char *RingBuffer::reserve (int len)
+{
+	if ((!base) || (capacity - (head - tail) < (unsigned int) len))
+	{
+		if (!grow (len))
+		{
+			return 0;
+		}
+	}
+
+	return &base[head];
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void RingBuffer::commit (int len)
+{
+	head += len;
+}
+
+////////////////////////////////////////////////////////////////////////////////
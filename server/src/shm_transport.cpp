@@ -0,0 +1,345 @@
+////////////////////////////////////////////////////////////////////////////////
+//
+// Copyright (c) 2013, Robin Heydon
+// All rights reserved.
+// 
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are met:
+// 
+// Redistributions of source code must retain the above copyright notice, this
+// list of conditions and the following disclaimer.
+// 
+// Redistributions in binary form must reproduce the above copyright notice, 
+// this list of conditions and the following disclaimer in the documentation
+// and/or other materials provided with the distribution.
+// 
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+// AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO,
+// THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+// PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+// CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+// EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+// PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+// OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+// WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+// OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+// ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+//
+////////////////////////////////////////////////////////////////////////////////
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+
+////////////////////////////////////////////////////////////////////////////////
+
+#include "log.h"
+#include "socket.h"
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the other process writes these, so every access is atomic. Stores are
+// sequentially consistent, and a producer that sets waiting reads tail again
+// with a sequentially consistent load (has_space), so either it sees the
+// room a consumer made or that consumer sees waiting and rings its doorbell.
+
+static unsigned int load_index (unsigned int *index)
+{
+	return __atomic_load_n (index, __ATOMIC_ACQUIRE);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void store_index (unsigned int *index, unsigned int value)
+{
+	__atomic_store_n (index, value, __ATOMIC_SEQ_CST);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void ring_doorbell (int fd)
+{
+	uint64_t one;
+	ssize_t err;
+
+
+	one = 1;
+	err = write (fd, &one, sizeof (one));
+
+	if (err < 0)
+	{
+		log (LOG_ERROR, "doorbell write (%d : %s)", errno, strerror (errno));
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+SharedMemoryTransport::SharedMemoryTransport ()
+{
+	rings = 0;
+	memfd = -1;
+	doorbell_fd = -1;
+	host_doorbell_fd = -1;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+SharedMemoryTransport::~SharedMemoryTransport ()
+{
+	if (rings)
+	{
+		munmap (rings, sizeof (ShmRingPair));
+	}
+
+	if (memfd >= 0)
+	{
+		close (memfd);
+	}
+
+	if (doorbell_fd >= 0)
+	{
+		close (doorbell_fd);
+	}
+
+	if (host_doorbell_fd >= 0)
+	{
+		close (host_doorbell_fd);
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool SharedMemoryTransport::create (void)
+{
+	memfd = memfd_create ("b1ee", MFD_CLOEXEC);
+
+	if (memfd < 0)
+	{
+		log (LOG_ERROR, "memfd_create (%d : %s)", errno, strerror (errno));
+		return false;
+	}
+
+	if (ftruncate (memfd, sizeof (ShmRingPair)) < 0)
+	{
+		log (LOG_ERROR, "ftruncate (%d : %s)", errno, strerror (errno));
+		return false;
+	}
+
+	rings = (ShmRingPair *) mmap (0, sizeof (ShmRingPair), PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+
+	if (rings == MAP_FAILED)
+	{
+		log (LOG_ERROR, "mmap (%d : %s)", errno, strerror (errno));
+		rings = 0;
+		return false;
+	}
+
+	doorbell_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+	host_doorbell_fd = eventfd (0, EFD_CLOEXEC);
+
+	if ((doorbell_fd < 0) || (host_doorbell_fd < 0))
+	{
+		log (LOG_ERROR, "eventfd (%d : %s)", errno, strerror (errno));
+		return false;
+	}
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+// the host gets its own copies of the descriptors, the memfd is only needed
+// until then
+
+bool SharedMemoryTransport::send_descriptors (int sockfd)
+{
+	struct msghdr msg;
+	struct iovec iov;
+	struct cmsghdr *cmsg;
+	char control[CMSG_SPACE (3 * sizeof (int))];
+	unsigned char size[4];
+	int fds[3];
+
+
+	size[0] = (shm_ring_size) & 0xFF;
+	size[1] = (shm_ring_size >> 8) & 0xFF;
+	size[2] = (shm_ring_size >> 16) & 0xFF;
+	size[3] = (shm_ring_size >> 24) & 0xFF;
+
+	iov.iov_base = size;
+	iov.iov_len = sizeof (size);
+
+	memset (&msg, 0, sizeof (msg));
+	memset (control, 0, sizeof (control));
+
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof (control);
+
+	fds[0] = memfd;
+	fds[1] = doorbell_fd;
+	fds[2] = host_doorbell_fd;
+
+	cmsg = CMSG_FIRSTHDR (&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN (sizeof (fds));
+	memcpy (CMSG_DATA (cmsg), fds, sizeof (fds));
+
+	if (sendmsg (sockfd, &msg, MSG_NOSIGNAL) != sizeof (size))
+	{
+		log (LOG_ERROR, "sendmsg (%d : %s)", errno, strerror (errno));
+		return false;
+	}
+
+	close (memfd);
+	memfd = -1;
+
+	return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+void SharedMemoryTransport::clear_doorbell (void)
+{
+	uint64_t count;
+	ssize_t err;
+
+
+	err = read (doorbell_fd, &count, sizeof (count));
+	(void) err;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int SharedMemoryTransport::receive (char *buffer, int len)
+{
+	ShmRing *ring;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int offset;
+	int available;
+	int first;
+
+
+	ring = &rings->to_controller;
+
+	head = load_index (&ring->head);
+	tail = ring->tail;
+
+	available = head - tail;
+
+	if ((available < 0) || (available > shm_ring_size))
+	{
+		log (LOG_ERROR, "SharedMemoryTransport ring corrupt %u %u", head, tail);
+		return 0;
+	}
+
+	if (available > len)
+	{
+		available = len;
+	}
+
+	offset = tail % shm_ring_size;
+	first = shm_ring_size - offset;
+
+	if (first > available)
+	{
+		first = available;
+	}
+
+	memcpy (buffer, &ring->data[offset], first);
+	memcpy (&buffer[first], ring->data, available - first);
+
+	store_index (&ring->tail, tail + available);
+
+	if ((available > 0) && (__atomic_load_n (&ring->waiting, __ATOMIC_SEQ_CST)))
+	{
+		store_index (&ring->waiting, 0);
+		ring_doorbell (host_doorbell_fd);
+	}
+
+	return available;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+int SharedMemoryTransport::send (const char *buffer, int len)
+{
+	ShmRing *ring;
+	unsigned int head;
+	unsigned int tail;
+	unsigned int offset;
+	int space;
+	int first;
+
+
+	ring = &rings->to_host;
+
+	head = ring->head;
+	tail = load_index (&ring->tail);
+
+	space = shm_ring_size - (int) (head - tail);
+
+	if (space < len)
+	{
+		// the host may have drained the ring since tail was read and then
+		// found waiting clear, so look again now that it is set
+
+		store_index (&ring->waiting, 1);
+
+		if (has_space ())
+		{
+			tail = load_index (&ring->tail);
+			space = shm_ring_size - (int) (head - tail);
+		}
+	}
+
+	if (space > len)
+	{
+		space = len;
+	}
+
+	if (space <= 0)
+	{
+		return 0;
+	}
+
+	offset = head % shm_ring_size;
+	first = shm_ring_size - offset;
+
+	if (first > space)
+	{
+		first = space;
+	}
+
+	memcpy (&ring->data[offset], buffer, first);
+	memcpy (ring->data, &buffer[first], space - first);
+
+	store_index (&ring->head, head + space);
+
+	ring_doorbell (host_doorbell_fd);
+
+	return space;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool SharedMemoryTransport::has_space (void)
+{
+	ShmRing *ring;
+
+
+	ring = &rings->to_host;
+
+	return (ring->head - __atomic_load_n (&ring->tail, __ATOMIC_SEQ_CST)) < (unsigned int) shm_ring_size;
+}
+
+////////////////////////////////////////////////////////////////////////////////
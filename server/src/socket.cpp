@@ -33,8 +33,10 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
 #include <netinet/in.h>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -43,18 +45,18 @@
 #include "socket.h"
 
 #define BUFFER_SIZE (64*1024)
+#define MAX_EVENTS 256
 
 ////////////////////////////////////////////////////////////////////////////////
 
 Socket *Socket::all_sockets = 0;
+Socket *Socket::deleting_sockets = 0;
+int Socket::epoll_fd = -1;
 
 ////////////////////////////////////////////////////////////////////////////////
 
 Socket::Socket ()
 {
-	Socket *sl;
-
-
 	sockfd = 0;
 	port = 0;
 	addr = 0;
@@ -71,6 +73,8 @@ Socket::Socket ()
 
 	delete_pending = false;
 	delete_ready = false;
+	write_interest = false;
+	next_deleting = 0;
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -79,6 +83,7 @@ Socket::~Socket ()
 {
 	log (LOG_SOCKET, "Socket::~Socket");
 
+	unwatch_descriptor (sockfd);
 	close (sockfd);
 
 	if (pred)
@@ -98,122 +103,185 @@ Socket::~Socket ()
 
 ////////////////////////////////////////////////////////////////////////////////
 
-bool Socket::poll (void)
+// called by each kind of socket once sockfd is set, the socket is made non
+// blocking as every handler reads or writes until it would block
+
+void Socket::watch (void)
 {
-	Socket *sl;
-	Socket *next_sl;
+	int flags;
 
-	fd_set read_set;
-	fd_set write_set;
-	fd_set error_set;
 
-	int len;
-	int err;
-	int max_fd;
+	flags = fcntl (sockfd, F_GETFL, 0);
+	fcntl (sockfd, F_SETFL, flags | O_NONBLOCK);
 
-	struct timeval tv;
+	watch_descriptor (sockfd, this);
+}
 
-	char buffer[1];
+////////////////////////////////////////////////////////////////////////////////
 
+// an fd that is readable calls on_readable for the socket, a null socket is
+// the wakeup pipe
 
-	FD_ZERO(&read_set);
-	FD_ZERO(&write_set);
-	FD_ZERO(&error_set);
+void Socket::watch_descriptor (int fd, Socket *socket)
+{
+	struct epoll_event event;
 
-	max_fd = 0;
 
-	sl = all_sockets;
-	while (sl)
+	if (epoll_fd < 0)
 	{
-		next_sl = sl->succ;
+		epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
 
-		if (sl->is_active ())
+		if (epoll_fd < 0)
 		{
-			log (LOG_SOCKET, " >> %p : %d : %s", sl, sl->sockfd, sl->get_name ());
+			log (LOG_ERROR, "epoll_create1 (%d : %s)", errno, strerror (errno));
+			exit (1);
+		}
+	}
 
-			if (sl->is_readable ())
-			{
-				FD_SET (sl->sockfd, &read_set);
-				FD_SET (sl->sockfd, &error_set);
+	event.events = EPOLLIN | EPOLLET;
+	event.data.ptr = socket;
 
-				if (sl->sockfd > max_fd)
-				{
-					max_fd = sl->sockfd;
-				}
-			}
+	if (epoll_ctl (epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+	{
+		log (LOG_ERROR, "epoll_ctl add %d (%d : %s)", fd, errno, strerror (errno));
+	}
+}
 
-			if (sl->is_writable ())
-			{
-				FD_SET (sl->sockfd, &write_set);
-				FD_SET (sl->sockfd, &error_set);
+////////////////////////////////////////////////////////////////////////////////
 
-				if (sl->sockfd > max_fd)
-				{
-					max_fd = sl->sockfd;
-				}
-			}
-		}
+// closing an fd only drops it from the epoll set when nothing else holds the
+// file open, and a doorbell is also held by the host, so it is done by hand
 
-		sl = next_sl;
+void Socket::unwatch_descriptor (int fd)
+{
+	if (epoll_fd >= 0)
+	{
+		epoll_ctl (epoll_fd, EPOLL_CTL_DEL, fd, 0);
 	}
+}
 
-	FD_SET (ListenSocket::get_read_pipefd (), &read_set);
+////////////////////////////////////////////////////////////////////////////////
 
-	tv.tv_sec = 60;
-	tv.tv_usec = 0;
+// only called as the output goes from empty to waiting and back again. It may
+// be called from the simulation thread, the epoll set takes care of waking
+// the poll loop, and a socket with room already is reported straight away
 
-	err = select (max_fd + 1, &read_set, &write_set, &error_set, &tv);
+void Socket::set_write_interest (bool enable)
+{
+	struct epoll_event event;
 
-	log (LOG_SOCKET, "select = %d", err);
 
-	if (err < 0)
+	if (enable == write_interest)
 	{
-		log (LOG_ERROR, "select (%d : %s)", err, strerror (err));
-		return false;
+		return;
 	}
 
-	if (err == 0)
+	write_interest = enable;
+
+	event.events = EPOLLIN | EPOLLET | (enable ? EPOLLOUT : 0);
+	event.data.ptr = this;
+
+	if (epoll_ctl (epoll_fd, EPOLL_CTL_MOD, sockfd, &event) < 0)
 	{
-		return true;
+		log (LOG_ERROR, "epoll_ctl mod %d (%d : %s)", sockfd, errno, strerror (errno));
 	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
 
-	sl = all_sockets;
-	while (sl)
+// the socket goes on the list the poll loop looks through for sockets to
+// delete, so that it never has to look at the rest
+
+void Socket::set_delete_pending (void)
+{
+	if (!delete_pending)
 	{
-		next_sl = sl->succ;
+		delete_pending = true;
 
-		if (FD_ISSET (sl->sockfd, &read_set))
+		next_deleting = deleting_sockets;
+		deleting_sockets = this;
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+bool Socket::poll (void)
+{
+	Socket *sl;
+	Socket **link;
+
+	struct epoll_event events[MAX_EVENTS];
+
+	int index;
+	int count;
+
+	char buffer[64];
+
+
+	count = epoll_wait (epoll_fd, events, MAX_EVENTS, 60 * 1000);
+
+	log (LOG_SOCKET, "epoll_wait = %d", count);
+
+	if (count < 0)
+	{
+		if (errno == EINTR)
 		{
-			sl->on_readable ();
+			return true;
+		}
+
+		log (LOG_ERROR, "epoll_wait (%d : %s)", errno, strerror (errno));
+		return false;
+	}
+
+	for (index = 0; index < count; index ++)
+	{
+		sl = (Socket *) events[index].data.ptr;
+
+		if (!sl)
+		{
+			while (read (ListenSocket::get_read_pipefd (), buffer, sizeof (buffer)) > 0)
+			{
+			}
+
+			continue;
 		}
 
-		if (FD_ISSET (sl->sockfd, &write_set))
+		// a socket going away may still have events in this batch
+
+		if (!sl->is_active ())
 		{
-			sl->on_writable ();
+			continue;
 		}
 
-		if (FD_ISSET (sl->sockfd, &error_set))
+		log (LOG_SOCKET, " >> %p : %d : %s : %X", sl, sl->sockfd, sl->get_name (), events[index].events);
+
+		// an error or hang up is found by the read
+
+		if (events[index].events & (EPOLLIN | EPOLLERR | EPOLLHUP))
 		{
-			sl->set_delete_pending ();
+			sl->on_readable ();
 		}
 
-		sl = next_sl;
+		if ((events[index].events & EPOLLOUT) && (sl->is_active ()))
+		{
+			sl->on_writable ();
+		}
 	}
 
-	if (FD_ISSET (ListenSocket::get_read_pipefd (), &read_set))
+	link = &deleting_sockets;
+	while (*link)
 	{
-		err = read (ListenSocket::get_read_pipefd (), buffer, 1);
-	}
+		sl = *link;
 
-	sl = all_sockets;
-	while (sl)
-	{
-		next_sl = sl->succ;
-		if (sl->is_delete_ready ())
+		if (sl->delete_ready)
 		{
+			*link = sl->next_deleting;
 			delete sl;
 		}
-		sl = next_sl;
+		else
+		{
+			link = &sl->next_deleting;
+		}
 	}
 
 	return true;
@@ -33,6 +33,7 @@
 ////////////////////////////////////////////////////////////////////////////////
 
 #include <stdio.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -46,15 +47,15 @@ public:
 
 	static bool poll (void);
 
-	virtual bool is_readable (void) = 0;
-	virtual bool is_writable (void) = 0;
+	// called on an edge, so each must carry on until the descriptor would
+	// block or there will be no second call for what is left
 
 	virtual void on_readable (void) = 0;
 	virtual void on_writable (void) = 0;
 
 	virtual char *get_name (void) = 0;
 
-	void set_delete_pending (void) { delete_pending = true; };
+	void set_delete_pending (void);
 	void set_delete_ready (void) { delete_ready = true; };
 
 	bool is_active (void) { return !delete_pending; };
@@ -67,14 +68,123 @@ protected:
 	unsigned int port;
 	unsigned long addr;
 
+	void watch (void);
+	void set_write_interest (bool enable);
+
+	static void watch_descriptor (int fd, Socket *socket);
+	static void unwatch_descriptor (int fd);
+
 private:
 	static Socket *all_sockets;
+	static Socket *deleting_sockets;
+
+	// every descriptor is registered once, edge triggered, for input; output
+	// is only asked for while there is something waiting to go out
+	static int epoll_fd;
 
 	bool delete_pending;
 	bool delete_ready;
+	bool write_interest;
 	
 	Socket *pred;
 	Socket *succ;
+	Socket *next_deleting;
+
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// A ring of bytes mapped twice, back to back, so that whatever is in it and
+// whatever room is left are each one run of memory however they wrap. Nothing
+// is mapped until it is first used, head and tail go back to the start each
+// time it empties, so a quiet socket only ever touches its first pages. The
+// capacity is a whole number of pages; reserve doubles it when asked for more
+// room than there is, which a read ring never is.
+
+const int read_ring_size = 128 * 1024;	// two whole H4 frames of the largest kind
+const int write_ring_size = 64 * 1024;
+
+class RingBuffer
+{
+public:
+
+	RingBuffer (int capacity);
+	~RingBuffer ();
+
+	char *peek (int *len);
+	void consume (int len);
+
+	char *get_space (int *len);
+	char *reserve (int len);
+	void commit (int len);
+
+	int get_length (void) { return head - tail; };
+	bool is_full (void) { return (base) && (head - tail == capacity); };
+
+private:
+
+	static char *map (unsigned int size);
+	bool grow (int len);
+
+	char *base;
+	unsigned int capacity;
+	unsigned int head;		// offset of the end of the data, may be in the mirror
+	unsigned int tail;		// offset of the start of the data, never in the mirror
+
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Shared memory transport for hosts on the same machine. A host connects to
+// the shared memory listener and is sent, in one SCM_RIGHTS message whose data
+// is the ring size as a little endian uint32, three descriptors: a memfd
+// holding a ShmRingPair, the eventfd that is the controller's doorbell, and the
+// eventfd that is the host's. The rings carry the same H4 byte stream as a
+// socket. head and tail count bytes and are free running; the producer moves
+// head and rings the other side's doorbell, the consumer moves tail. A producer
+// that finds its ring full sets waiting, and a consumer that finds waiting set
+// after moving tail clears it and rings the producer's doorbell. The socket is
+// kept open by the host for as long as the controller is wanted.
+
+const int shm_ring_size = 64 * 1024;
+
+struct ShmRing
+{
+	unsigned int head;
+	unsigned int waiting;
+	char pad0[56];
+	unsigned int tail;
+	char pad1[60];
+	char data[shm_ring_size];
+};
+
+struct ShmRingPair
+{
+	ShmRing to_controller;
+	ShmRing to_host;
+};
+
+class SharedMemoryTransport
+{
+public:
+
+	SharedMemoryTransport ();
+	~SharedMemoryTransport ();
+
+	bool create (void);
+	bool send_descriptors (int sockfd);
+
+	int get_doorbell_fd (void) { return doorbell_fd; };
+	void clear_doorbell (void);
+
+	int receive (char *buffer, int len);
+	int send (const char *buffer, int len);
+	bool has_space (void);
+
+private:
+
+	ShmRingPair *rings;
+	int memfd;
+	int doorbell_fd;		// rung by the host
+	int host_doorbell_fd;	// rung for the host
 
 };
 
@@ -87,28 +197,46 @@ public:
 	ClientSocket (int client_sockfd, unsigned long addr, unsigned int port);
 	virtual ~ClientSocket ();
 
-	bool is_readable (void);
-	bool is_writable (void);
-
 	virtual void on_readable (void);
 	virtual void on_writable (void);
 
+	bool fill_read_buffer (void);
 	char *peek_read_buffer (int *len);
 	void consume_read_buffer (int len);
 
 	void write_data (char *buffer, int len);
+	void write_data (const char *header, int header_len, const char *data, int len);
+
+	char *reserve_write (int len);
+	void commit_write (int len);
+
+	void begin_write_batch (void);
+	void end_write_batch (void);
+
+	void use_shared_memory (SharedMemoryTransport *transport);
 
 	virtual char *get_name (void);
 
 private:
 
-	int read_buffer_len;	// length of the valid data in the read_buffer
-	int read_buffer_size;	// how big is the read_buffer
-	char *read_buffer;		// the read_buffer itself
+	int transport_send (const char *buffer, int len, int flags);
+
+	RingBuffer read_ring;
+
+	// written from both the socket and the simulation threads
+	pthread_mutex_t write_mutex;
+	RingBuffer write_ring;
+
+	// while the socket thread works through a batch of packets, or the
+	// simulation thread through a step, responses are only queued and are
+	// sent in one go at the end; this counts the batches open
+	int write_batch;
 
-	int write_buffer_len;
-	int write_buffer_size;
-	char *write_buffer;
+	// the write ring could not be grown, the socket is deleted
+	bool write_failed;
+
+	// the H4 stream goes through shared memory rather than the socket
+	SharedMemoryTransport *shm;
 
 };
 
@@ -121,9 +249,6 @@ public:
 	WebSocket (int client_sockfd, unsigned long addr, unsigned int port);
 	virtual ~WebSocket ();
 
-	bool is_readable (void);
-	bool is_writable (void);
-
 	virtual void on_readable (void);
 	virtual void on_writable (void);
 
@@ -140,13 +265,8 @@ private:
 
 	void process_request (char *request);
 
-	int read_buffer_len;	// length of the valid data in the read_buffer
-	int read_buffer_size;	// how big is the read_buffer
-	char *read_buffer;		// the read_buffer itself
-
-	int write_buffer_len;
-	int write_buffer_size;
-	char *write_buffer;
+	RingBuffer read_ring;
+	RingBuffer write_ring;
 
 	bool close_pending;
 
@@ -288,11 +408,9 @@ class ListenSocket : public Socket
 public:
 
 	ListenSocket (int port);
+	ListenSocket (const char *path);
 	virtual ~ListenSocket ();
 
-	bool is_readable (void);
-	bool is_writable (void);
-
 	virtual void on_readable (void);
 	virtual void on_writable (void) {};
 
@@ -307,6 +425,19 @@ private:
 
 	static int pipefd[2];
 
+	// held open so that a listener out of descriptors can still take a
+	// connection off its queue, shared by every listener
+	static int reserve_fd;
+
+	// hosts on a unix domain socket are numbered in place of an address
+	static unsigned int unix_connections;
+
+	void create_pipe (void);
+	static void open_reserve_fd (void);
+	void drop_connection (void);
+
+	char *path;
+
 	void (*callback_func)(int, unsigned long, unsigned int);
 
 };
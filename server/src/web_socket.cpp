@@ -44,26 +44,20 @@
 #include "log.h"
 #include "socket.h"
 
-#define BUFFER_SIZE (64*1024)
-
 ////////////////////////////////////////////////////////////////////////////////
 
-WebSocket::WebSocket (int new_sockfd, unsigned long new_addr, unsigned int new_port)
+WebSocket::WebSocket (int new_sockfd, unsigned long new_addr, unsigned int new_port) :
+	read_ring (read_ring_size),
+	write_ring (write_ring_size)
 {
 	sockfd = new_sockfd;
 	addr = new_addr;
 	port = new_port;
 
-	read_buffer_len = 0;
-	read_buffer_size = 0;
-	read_buffer = 0;
-
-	write_buffer_len = 0;
-	write_buffer_size = 0;
-	write_buffer = 0;
-
 	close_pending = false;
 
+	watch ();
+
 	log (LOG_WEBSOCKET, "WebSocket %s", get_name ());
 }
 
@@ -71,93 +65,110 @@ WebSocket::WebSocket (int new_sockfd, unsigned long new_addr, unsigned int new_p
 
 WebSocket::~WebSocket ()
 {
-	if (read_buffer)
-	{
-		free (read_buffer);
-	}
-
-	if (write_buffer)
-	{
-		free (write_buffer);
-	}
-
 	log (LOG_WEBSOCKET, "~WebSocket %s", get_name ());
 }
 
 ////////////////////////////////////////////////////////////////////////////////
 
-bool WebSocket::is_readable (void)
-{
-	return true;
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
-bool WebSocket::is_writable (void)
-{
-	if ((write_buffer) && (write_buffer_len > 0))
-	{
-		log (LOG_WEBSOCKET, "WebSocket is_writable %p %d", write_buffer, write_buffer_len);
-		return true;
-	}
-	else
-	{
-		log (LOG_WEBSOCKET, "WebSocket !is_writable %p %d", write_buffer, write_buffer_len);
-		return false;
-	}
-}
-
-////////////////////////////////////////////////////////////////////////////////
-
 void WebSocket::on_readable (void)
 {
 	int err;
+	int len;
 	int index;
+	int start;
+	char *space;
+	char *buffer;
+	bool read_full;
 	WebRequest *request;
 
 
-	if (read_buffer_size - read_buffer_len < BUFFER_SIZE)
+	do
 	{
-		read_buffer_size += BUFFER_SIZE;
-		read_buffer = (char *) realloc (read_buffer, read_buffer_size);
-	}
+		read_full = false;
 
-	err = recv (sockfd, &read_buffer[read_buffer_len], read_buffer_size - read_buffer_len, 0);
+		while (true)
+		{
+			space = read_ring.get_space (&len);
 
-	log (LOG_WEBSOCKET, "WebSocket::on_readable (%d)", err);
+			if (!space)
+			{
+				this->set_delete_pending ();
+				this->set_delete_ready ();
+				return;
+			}
 
-	if (err < 0)
-	{
-		log (LOG_ERROR, "recv (%d : %s)", errno, strerror (errno));
-		return;
-	}
+			if (len == 0)
+			{
+				read_full = true;
+				break;
+			}
 
-	if (err == 0)
-	{
-		this->set_delete_pending ();
-		this->set_delete_ready ();
-		return;
-	}
+			err = recv (sockfd, space, len, 0);
 
-	read_buffer_len += err; // err is actually the length of data read
+			log (LOG_WEBSOCKET, "WebSocket::on_readable (%d)", err);
 
-	for (index = 3; index < read_buffer_len; index ++)
-	{
-		if
-		(
-			(read_buffer[index - 3] == 0x0D) &&
-			(read_buffer[index - 2] == 0x0A) &&
-			(read_buffer[index - 1] == 0x0D) &&
-			(read_buffer[index - 0] == 0x0A)
-		)
+			if (err < 0)
+			{
+				if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+				{
+					break;
+				}
+
+				if (errno == EINTR)
+				{
+					continue;
+				}
+
+				log (LOG_ERROR, "recv (%d : %s)", errno, strerror (errno));
+			}
+
+			if (err <= 0)
+			{
+				this->set_delete_pending ();
+				this->set_delete_ready ();
+				return;
+			}
+
+			read_ring.commit (err); // err is actually the length of data read
+		}
+
+		// each request ends with a blank line, and is consumed once it has
+		// been handled
+
+		buffer = read_ring.peek (&len);
+		start = 0;
+
+		for (index = 3; index < len; index ++)
 		{
-			read_buffer[index - 3] = 0;
+			if
+			(
+				(buffer[index - 3] == 0x0D) &&
+				(buffer[index - 2] == 0x0A) &&
+				(buffer[index - 1] == 0x0D) &&
+				(buffer[index - 0] == 0x0A)
+			)
+			{
+				buffer[index - 3] = 0;
+
+				request = new WebRequest (this, &buffer[start]);
+				request->process ();
+				delete request;
+
+				start = index + 1;
+			}
+		}
 
-			request = new WebRequest (this, read_buffer);
-			request->process ();
-			delete request;
+		if ((read_full) && (start == 0))
+		{
+			log (LOG_ERROR, "WebSocket request longer than %d", len);
+			this->set_delete_pending ();
+			this->set_delete_ready ();
+			return;
 		}
+
+		read_ring.consume (start);
 	}
+	while (read_full);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -166,29 +177,33 @@ void WebSocket::on_writable (void)
 {
 	int err;
 	int len;
+	char *buffer;
 
 
-	log (LOG_WEBSOCKET, "WebSocket::on_writable (%d)", write_buffer_len);
+	buffer = write_ring.peek (&len);
 
-	len = write_buffer_len;
+	log (LOG_WEBSOCKET, "WebSocket::on_writable (%d)", len);
 
-	if (len > BUFFER_SIZE)
+	while (len > 0)
 	{
-		len = BUFFER_SIZE;
-	}
+		err = send (sockfd, buffer, len, 0);
 
-	err = send (sockfd, write_buffer, len, 0);
-	
-	if (err < 0)
-	{
-		log (LOG_ERROR, "ERROR send (%d : %s)", errno, strerror (errno));
-		return;
+		if (err < 0)
+		{
+			if ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR))
+			{
+				log (LOG_ERROR, "ERROR send (%d : %s)", errno, strerror (errno));
+			}
+			break;
+		}
+
+		write_ring.consume (err);
+		buffer = write_ring.peek (&len);
 	}
 
-	memcpy (write_buffer, &write_buffer[err], write_buffer_size - err);
-	write_buffer_len -= err;
+	set_write_interest (len > 0);
 
-	if ((close_pending) && (write_buffer_len == 0))
+	if ((close_pending) && (len == 0))
 	{
 		log (LOG_WEBSOCKET, "Deleting WebSocket");
 		set_delete_ready ();
@@ -200,8 +215,7 @@ void WebSocket::on_writable (void)
 
 char *WebSocket::peek_read_buffer (int *len)
 {
-	*len = read_buffer_len;
-	return read_buffer;
+	return read_ring.peek (len);
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -210,10 +224,9 @@ void WebSocket::consume_read_buffer (int len)
 {
 	log (LOG_WEBSOCKET, "WebSocket::consume_read_buffer (%d)", len);
 
-	if ((len > 0) && (len <= read_buffer_len))
+	if ((len > 0) && (len <= read_ring.get_length ()))
 	{
-		memmove (read_buffer, &read_buffer[len], read_buffer_size - len);
-		read_buffer_len -= len;
+		read_ring.consume (len);
 	}
 }
 
@@ -221,6 +234,9 @@ void WebSocket::consume_read_buffer (int len)
 
 void WebSocket::write_data (const char *buffer, int len)
 {
+	char *space;
+
+
 //	log_start (LOG_WEBSOCKET, "WebSocket::write_data (%d : %p) ", len, buffer);
 //	for (int index = 0; index < len; index ++)
 //	{
@@ -228,16 +244,19 @@ void WebSocket::write_data (const char *buffer, int len)
 //	}
 //	log_end ();
 
-	if (write_buffer_size - write_buffer_len < len)
+	space = write_ring.reserve (len);
+
+	if (!space)
 	{
-		write_buffer_size = write_buffer_len + len;
-		write_buffer = (char *) realloc (write_buffer, write_buffer_size);
+		this->set_delete_pending ();
+		this->set_delete_ready ();
+		return;
 	}
 
-	memcpy (&write_buffer[write_buffer_len], buffer, len);
-	write_buffer_len += len;
+	memcpy (space, buffer, len);
+	write_ring.commit (len);
 
-	write (ListenSocket::get_write_pipefd (), " ", 1);
+	set_write_interest (true);
 }
 
 void WebSocket::write_string (const char *buffer)